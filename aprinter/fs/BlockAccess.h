@@ -29,6 +29,8 @@
 #include <stddef.h>
 
 #include <aprinter/meta/WrapFunction.h>
+#include <aprinter/meta/BitsInInt.h>
+#include <aprinter/meta/MinMax.h>
 #include <aprinter/meta/ServiceUtils.h>
 #include <aprinter/base/Object.h>
 #include <aprinter/base/DebugObject.h>
@@ -56,10 +58,64 @@ private:
     struct SdInitHandler;
     struct SdCommandHandler;
     APRINTER_MAKE_INSTANCE(TheSd, (Params::SdService::template SdCard<Context, Object, SdInitHandler, SdCommandHandler>))
+    using TimeType = typename Context::Clock::TimeType;
     
     enum {STATE_INACTIVE, STATE_ACTIVATING, STATE_READY, STATE_BUSY};
     
+    // The first latency bucket ends at about 32 us.
+    static int const LatencyBucketShift = MaxValue(0, BitsInInt<(uintmax_t)(32e-6 * Context::Clock::time_freq)>::Value - 1);
+    static TimeType const RateWindowTicks = 1.0 * Context::Clock::time_freq;
+    
 public:
+    /**
+     * Requests are started in order of priority, and in order of submission
+     * within the same priority. A request which has been started always
+     * runs to completion. The intended use is HIGH for reads which someone
+     * is waiting for, NORMAL for speculative reads (readahead) and LOW for
+     * writing back data.
+     */
+    enum class Priority : uint8_t {HIGH, NORMAL, LOW};
+    static int const NumPriorities = 3;
+    
+    /**
+     * Latency of completed requests of one priority, from submission to
+     * completion, in clock ticks.
+     */
+    struct LatencyStats {
+        uint32_t num_requests;
+        TimeType max_latency;
+        uint64_t total_latency;
+    };
+    
+    /**
+     * Each completed command is split into the time it waited in the queue,
+     * the time the card was busy (waiting for data to become available or
+     * for programming to finish, as reported by the SD card driver) and the
+     * remaining time, which is taken to be the transfer. Each of these is
+     * counted in a log2 histogram. Bucket 0 counts times below
+     * getLatencyBucketLimit(0), bucket i counts times from
+     * getLatencyBucketLimit(i-1) up to getLatencyBucketLimit(i), and the
+     * last bucket counts all longer times.
+     */
+    enum class TimingKind : uint8_t {QUEUE_WAIT, CARD_BUSY, TRANSFER};
+    static int const NumTimingKinds = 3;
+    static int const NumLatencyBuckets = 15;
+    
+    struct LatencyHistogram {
+        uint32_t counts[NumLatencyBuckets];
+    };
+    
+    /**
+     * Blocks transferred since the last reset, and the transfer rates in
+     * bytes per second measured over the last second or so of activity.
+     */
+    struct IoCounters {
+        uint32_t read_blocks;
+        uint32_t write_blocks;
+        uint32_t read_rate;
+        uint32_t write_rate;
+    };
+    
     using BlockIndexType = typename TheSd::BlockIndexType;
     static size_t const BlockSize = TheSd::BlockSize;
     using DataWordType = typename TheSd::DataWordType;
@@ -73,6 +129,7 @@ public:
         
         TheSd::init(c);
         o->state = STATE_INACTIVE;
+        resetLatencyStats(c);
         
         TheDebugObject::init(c);
     }
@@ -125,6 +182,60 @@ public:
         return TheSd::isWritable(c);
     }
     
+    static LatencyStats getLatencyStats (Context c, Priority priority)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        return o->latency_stats[(int)priority];
+    }
+    
+    static LatencyHistogram getLatencyHistogram (Context c, TimingKind kind)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        return o->histograms[(int)kind];
+    }
+    
+    static TimeType getLatencyBucketLimit (int bucket)
+    {
+        AMBRO_ASSERT(bucket >= 0 && bucket < NumLatencyBuckets - 1)
+        
+        return (TimeType)1 << (LatencyBucketShift + bucket);
+    }
+    
+    static IoCounters getIoCounters (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        IoCounters counters = o->io_counters;
+        // Nothing completed for a while, the rates are out of date.
+        TimeType elapsed = Context::Clock::getTime(c) - o->rate_window_start;
+        if (elapsed >= 2 * RateWindowTicks) {
+            counters.read_rate = 0;
+            counters.write_rate = 0;
+        }
+        return counters;
+    }
+    
+    static void resetLatencyStats (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        for (auto &stats : o->latency_stats) {
+            stats = LatencyStats{};
+        }
+        for (auto &histogram : o->histograms) {
+            histogram = LatencyHistogram{};
+        }
+        o->io_counters = IoCounters{};
+        o->rate_window_start = Context::Clock::getTime(c);
+        o->rate_window_read_blocks = 0;
+        o->rate_window_write_blocks = 0;
+    }
+    
     using GetSd = TheSd;
     
     class User {
@@ -149,7 +260,7 @@ public:
         {
         }
         
-        void startReadOrWrite (Context c, bool is_write, BlockIndexType block_idx, size_t num_blocks, TransferVector<DataWordType> data_vector)
+        void startReadOrWrite (Context c, bool is_write, BlockIndexType block_idx, size_t num_blocks, TransferVector<DataWordType> data_vector, Priority priority=Priority::HIGH)
         {
             auto *o = Object::self(c);
             TheDebugObject::access(c);
@@ -160,6 +271,8 @@ public:
             m_block_idx = block_idx;
             m_num_blocks = num_blocks;
             m_data_vector = data_vector;
+            m_priority = (uint8_t)priority;
+            m_submit_time = Context::Clock::getTime(c);
             
             add_request(c, this);
         }
@@ -178,6 +291,8 @@ public:
         HandlerType m_handler;
         uint8_t m_state : 3;
         bool m_is_full : 1;
+        uint8_t m_priority : 2;
+        TimeType m_submit_time;
         BlockIndexType m_block_idx;
         size_t m_num_blocks;
         TransferVector<DataWordType> m_data_vector;
@@ -217,7 +332,10 @@ private:
             o->state = STATE_INACTIVE;
         } else {
             o->state = STATE_READY;
-            o->queue.init();
+            for (auto &queue : o->queues) {
+                queue.init();
+            }
+            o->active_user = nullptr;
         }
         return ActivateHandler::call(c, error_code);
     }
@@ -228,16 +346,18 @@ private:
         auto *o = Object::self(c);
         TheDebugObject::access(c);
         AMBRO_ASSERT(o->state == STATE_BUSY)
-        AMBRO_ASSERT(!o->queue.isEmpty())
+        AMBRO_ASSERT(o->active_user)
         
-        User *user = o->queue.first();
+        User *user = o->active_user;
         AMBRO_ASSERT(user->m_state == User::USER_STATE_READING || user->m_state == User::USER_STATE_WRITING)
         
         if (user->m_state == User::USER_STATE_WRITING) {
             user->maybe_call_locker(c, false);
         }
         
-        o->queue.removeFirst();
+        account_completion(c, user);
+        
+        o->active_user = nullptr;
         user->m_state = User::USER_STATE_IDLE;
         o->state = STATE_READY;
         
@@ -252,7 +372,7 @@ private:
         auto *o = Object::self(c);
         AMBRO_ASSERT(o->state == STATE_READY || o->state == STATE_BUSY)
         
-        o->queue.append(user);
+        o->queues[user->m_priority].append(user);
         if (o->state == STATE_READY) {
             continue_queue(c);
         }
@@ -263,16 +383,80 @@ private:
         auto *o = Object::self(c);
         AMBRO_ASSERT(o->state == STATE_READY)
         
-        User *user = o->queue.first();
-        if (user) {
+        for (auto &queue : o->queues) {
+            User *user = queue.first();
+            if (!user) {
+                continue;
+            }
             AMBRO_ASSERT(user->m_state == User::USER_STATE_READING || user->m_state == User::USER_STATE_WRITING)
+            
+            queue.removeFirst();
+            o->active_user = user;
+            o->start_time = Context::Clock::getTime(c);
+            
             bool is_write = (user->m_state == User::USER_STATE_WRITING);
             if (is_write) {
                 user->maybe_call_locker(c, true);
             }
             TheSd::startReadOrWrite(c, is_write, user->m_block_idx, user->m_num_blocks, user->m_data_vector);
             o->state = STATE_BUSY;
+            break;
+        }
+    }
+    
+    static void account_completion (Context c, User *user)
+    {
+        auto *o = Object::self(c);
+        
+        TimeType now = Context::Clock::getTime(c);
+        TimeType latency = (TimeType)(now - user->m_submit_time);
+        LatencyStats *stats = &o->latency_stats[user->m_priority];
+        stats->num_requests++;
+        stats->total_latency += latency;
+        if (latency > stats->max_latency) {
+            stats->max_latency = latency;
         }
+        
+        TimeType service_time = (TimeType)(now - o->start_time);
+        TimeType busy_time = MinValue(TheSd::getBusyTime(c), service_time);
+        account_histogram(c, TimingKind::QUEUE_WAIT, (TimeType)(o->start_time - user->m_submit_time));
+        account_histogram(c, TimingKind::CARD_BUSY, busy_time);
+        account_histogram(c, TimingKind::TRANSFER, (TimeType)(service_time - busy_time));
+        
+        if (user->m_state == User::USER_STATE_WRITING) {
+            o->io_counters.write_blocks += user->m_num_blocks;
+            o->rate_window_write_blocks += user->m_num_blocks;
+        } else {
+            o->io_counters.read_blocks += user->m_num_blocks;
+            o->rate_window_read_blocks += user->m_num_blocks;
+        }
+        
+        TimeType window_time = (TimeType)(now - o->rate_window_start);
+        if (window_time >= RateWindowTicks) {
+            o->io_counters.read_rate = bytes_per_second(o->rate_window_read_blocks, window_time);
+            o->io_counters.write_rate = bytes_per_second(o->rate_window_write_blocks, window_time);
+            o->rate_window_start = now;
+            o->rate_window_read_blocks = 0;
+            o->rate_window_write_blocks = 0;
+        }
+    }
+    
+    static void account_histogram (Context c, TimingKind kind, TimeType time)
+    {
+        auto *o = Object::self(c);
+        
+        TimeType x = time >> LatencyBucketShift;
+        int bucket = 0;
+        while (x > 0 && bucket < NumLatencyBuckets - 1) {
+            x >>= 1;
+            bucket++;
+        }
+        o->histograms[(int)kind].counts[bucket]++;
+    }
+    
+    static uint32_t bytes_per_second (uint32_t blocks, TimeType time)
+    {
+        return (uint64_t)blocks * BlockSize * (uint32_t)Context::Clock::time_freq / time;
     }
     
 public:
@@ -281,7 +465,15 @@ public:
         TheSd
     >> {
         uint8_t state;
-        DoubleEndedList<User, &User::m_list_node> queue;
+        DoubleEndedList<User, &User::m_list_node> queues[NumPriorities];
+        User *active_user;
+        TimeType start_time;
+        LatencyStats latency_stats[NumPriorities];
+        LatencyHistogram histograms[NumTimingKinds];
+        IoCounters io_counters;
+        TimeType rate_window_start;
+        uint32_t rate_window_read_blocks;
+        uint32_t rate_window_write_blocks;
     };
 };
 
@@ -30,7 +30,10 @@
 #include <string.h>
 #include <inttypes.h>
 
+#include <aprinter/meta/MinMax.h>
 #include <aprinter/meta/ChooseInt.h>
+#include <aprinter/meta/BitsInInt.h>
+#include <aprinter/meta/PowerOfTwo.h>
 #include <aprinter/meta/StructIf.h>
 #include <aprinter/meta/FunctionIf.h>
 #include <aprinter/meta/BasicMetaUtils.h>
@@ -41,6 +44,7 @@
 #include <aprinter/base/DebugObject.h>
 #include <aprinter/base/TransferVector.h>
 #include <aprinter/base/LoopUtils.h>
+#include <aprinter/misc/ClockUtils.h>
 #include <aprinter/structure/DoubleEndedList.h>
 
 #include <aprinter/BeginNamespace.h>
@@ -70,7 +74,6 @@ public:
     
 private:
     static_assert(NumCacheEntries > 0, "");
-    static_assert(NumCacheEntries <= 64, "");
     static_assert(NumIoUnits > 0 && NumIoUnits <= NumCacheEntries, "");
     static_assert(MaxIoBlocks > 0 && MaxIoBlocks <= NumCacheEntries, "");
     static_assert(MaxIoBlocks <= TheBlockAccess::MaxIoBlocks, "");
@@ -93,16 +96,51 @@ private:
     using IoUnitIndexType = ChooseIntForMax<NumIoUnits, true>;
     using IoBlockIndexType = ChooseIntForMax<MaxIoBlocks, true>;
     
-    static int const NumBuffers = NumCacheEntries + (Writable ? TheBlockAccess::MaxBufferLocks : 0);
+    // Pinned references (CacheRef::pinFrom) may keep at most this many entries
+    // busy, leaving the rest of the cache for normal requests.
+    static int const MaxPinnedRefs = NumCacheEntries / 2;
+    
+    // Besides its active buffer, an entry may hold one buffer being written out
+    // and one kept for its pinned references, so that the block can be written
+    // to meanwhile (see CacheEntry::getDataForWriting).
+    static int const NumBuffers = NumCacheEntries + (Writable ? TheBlockAccess::MaxBufferLocks + MaxPinnedRefs : 0);
     using BufferIndexType = ChooseIntForMax<NumBuffers, true>;
     
     using NumRefsType = uint8_t;
     static NumRefsType const MaxNumRefs = (NumRefsType)-1;
     
+    // The block index is an open-addressed hash table from block numbers to
+    // assigned entries, kept at most half full so that probe sequences are short.
+    static int const IndexBits = BitsInInt<NumCacheEntries - 1>::Value + 1;
+    static size_t const IndexSize = PowerOfTwo<size_t, IndexBits>::Value;
+    
+    // Lists of entries which are candidates for (re)assignment, see CacheEntry::get_evict_class.
+    enum class DirtState : uint8_t {CLEAN, DIRTY, WRITING};
+    enum class EvictClass : uint8_t {NONE, FREE, CLEAN, CLEAN_WEAK, PENDING_READ, RELEASING};
+    static int const NumEvictLists = 5;
+    
+    using TheClockUtils = ClockUtils<Context>;
+    using TimeType = typename TheClockUtils::TimeType;
+    
+    // With a write-back delay, dirty blocks are written in the background once
+    // the delay has passed since the first of them became dirty. Without one,
+    // they are only written by flush requests and when evicted.
+    static bool const EnableWriteBack = Writable && (Arg::WriteBackDelay::value() > 0.0);
+    static TimeType const WriteBackDelayTicks = Arg::WriteBackDelay::value() * TheClockUtils::time_freq;
+    static_assert(Arg::WriteBackDelay::value() <= TheClockUtils::WorkingTimeSpan, "WriteBackDelay is too large");
+    
+    static int const HintReserveEntries = 2;
+    static int const MaxReadaheadWindow = MaxValue(0, NumCacheEntries - HintReserveEntries - 1);
+    static int const InitialReadaheadWindow = 2;
+    
+    using IoPriority = typename TheBlockAccess::Priority;
+    
 public:
     using BlockIndexType = typename TheBlockAccess::BlockIndexType;
     static size_t const BlockSize = TheBlockAccess::BlockSize;
     
+    class Readahead;
+    
     static void init (Context c)
     {
         auto *o = Object::self(c);
@@ -110,6 +148,18 @@ public:
         o->io_queue.init();
         o->io_queue_event.init(c, APRINTER_CB_STATFUNC_T(&BlockCache::io_queue_event_handler));
         writable_init(c);
+        o->readahead_stats = ReadaheadStats{};
+        o->cache_stats = CacheStats{};
+        o->num_busy_entries = 0;
+        o->num_pinned_refs = 0;
+        
+        for (auto &list : o->evict_lists) {
+            list.init();
+        }
+        
+        for (auto &slot : o->block_index) {
+            slot = -1;
+        }
         
         for (CacheEntry &entry : o->cache_entries) {
             entry.init(c);
@@ -140,70 +190,293 @@ public:
         o->io_queue_event.deinit(c);
     }
     
-    static BlockIndexType hintBlocks (Context c, BlockIndexType protect_block, BlockIndexType start_block, BlockIndexType end_block, BlockIndexType write_stride, uint8_t write_count)
+    struct HintExtent {
+        BlockIndexType start_block;
+        BlockIndexType end_block;
+        BlockIndexType write_stride;
+        uint8_t write_count;
+    };
+    
+    struct ReadaheadStats {
+        uint32_t hits;
+        uint32_t stalls;
+        uint32_t misses;
+        uint32_t hinted_blocks;
+        uint32_t cancelled_blocks;
+    };
+    
+    // Block requests which found the block already read (hits) or not (misses).
+    struct CacheStats {
+        uint32_t hits;
+        uint32_t misses;
+    };
+    
+    static int const MaxHintExtents = 4;
+    
+    /**
+     * Starts reading blocks which are expected to be requested soon.
+     * 
+     * The extents are processed in order, and blocks which are already
+     * in the cache are skipped. Entries holding blocks in any of the extents
+     * are not reassigned. At least HintReserveEntries entries are left
+     * available for regular requests, so that these cannot fail just
+     * because all entries are waiting for hinted reads.
+     * 
+     * Returns the number of blocks (counted from the start of the first extent)
+     * which are now in the cache or being read, before running out of entries.
+     * 
+     * If owner is given, reads started here which have not been submitted
+     * yet are cancelled when that Readahead sees a non-sequential access.
+     */
+    static BlockIndexType hintExtents (Context c, HintExtent const *extents, uint8_t num_extents, Readahead *owner=nullptr)
     {
         auto *o = Object::self(c);
         TheDebugObject::access(c);
-        AMBRO_ASSERT(protect_block <= start_block)
-        AMBRO_ASSERT(start_block <= end_block)
-        
-        // Create two lists, of:
-        // 1) Block indices in the given range which are already in the cache.
-        // 2) Indices of cache entries which we may use to assign the blocks.
-        
-        BlockIndexType cached_blocks[NumCacheEntries];
-        CacheEntryIndexType num_cached_blocks = 0;
-        
-        CacheEntryIndexType free_entries[NumCacheEntries];
-        CacheEntryIndexType num_free_entries = 0;
-        
-        for (auto i : LoopRange<CacheEntryIndexType>(NumCacheEntries)) {
-            CacheEntry *e = &o->cache_entries[i];
-            if (e->isAssigned(c)) {
-                BlockIndexType block = e->getBlock(c);
-                if (block >= protect_block && block < end_block) {
-                    if (block >= start_block) {
-                        cached_blocks[num_cached_blocks++] = block;
-                    }
-                    // This entry is assigned with a block in the while protected range,
-                    // so prevent it from being reassigned now to another hinted block.
-                    continue;
+        AMBRO_ASSERT(num_extents <= MaxHintExtents)
+        
+        // Move unreferenced entries holding blocks in the extents to the
+        // most recently used end of the clean list. Entries are taken from
+        // the other end below, so if that one holds a block in the extents,
+        // there is nothing left which we could reassign.
+        for (auto extent_index : LoopRange<uint8_t>(num_extents)) {
+            HintExtent const *extent = &extents[extent_index];
+            
+            for (BlockIndexType block = extent->start_block; block < extent->end_block; block++) {
+                CacheEntryIndexType entry_index = index_find(c, block);
+                if (entry_index != -1) {
+                    o->cache_entries[entry_index].touch(c);
                 }
             }
-            if (!e->isBeingReleased(c) && !e->isReferencedIncludingWeak(c) && (!e->isAssigned(c) || e->canReassign(c))) {
-                free_entries[num_free_entries++] = i;
+        }
+        
+        BlockIndexType num_covered = 0;
+        
+        for (auto extent_index : LoopRange<uint8_t>(num_extents)) {
+            HintExtent const *extent = &extents[extent_index];
+            
+            for (BlockIndexType block = extent->start_block; block < extent->end_block; block++) {
+                // Skip this block if it is already in the cache.
+                if (index_find(c, block) == -1) {
+                    if (o->num_busy_entries >= NumCacheEntries - HintReserveEntries) {
+                        return num_covered;
+                    }
+                    
+                    CacheEntry *free_entry = evict_list(c, EvictClass::FREE)->first();
+                    if (!free_entry) {
+                        free_entry = evict_list(c, EvictClass::CLEAN)->first();
+                        if (!free_entry || is_block_in_extents(free_entry->getBlock(c), extents, num_extents)) {
+                            return num_covered;
+                        }
+                    }
+                    
+                    // Assign this block to this entry.
+                    free_entry->assignBlockAndAttachUser(c, block, extent->write_stride, extent->write_count, false, nullptr);
+                    free_entry->m_hint_owner = owner;
+                    o->readahead_stats.hinted_blocks++;
+                }
+                
+                num_covered++;
             }
         }
         
-        // Assign blocks based on information in these lists.
+        return num_covered;
+    }
+    
+    /**
+     * Returns the data of a block if it is in the cache and has been read,
+     * otherwise null. No reference is taken, so the pointer must not be
+     * used after returning to the event loop.
+     */
+    static char const * peekBlock (Context c, BlockIndexType block)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        CacheEntryIndexType entry_index = index_find(c, block);
+        if (entry_index == -1 || !o->cache_entries[entry_index].isInitialized(c)) {
+            return nullptr;
+        }
+        return o->cache_entries[entry_index].getDataForReading(c);
+    }
+    
+    // Pinned references keep entries in use after their file is closed,
+    // so the cache must not be deinited while there are any.
+    static bool hasPinnedRefs (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
         
-        BlockIndexType block = start_block;
-        while (block < end_block && num_free_entries > 0) {
-            // Skip this block if it is already in the cache.
-            bool already = false;
-            for (auto i : LoopRange<CacheEntryIndexType>(num_cached_blocks)) {
-                if (cached_blocks[i] == block) {
-                    already = true;
-                    break;
+        return o->num_pinned_refs > 0;
+    }
+    
+    static ReadaheadStats getReadaheadStats (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        return o->readahead_stats;
+    }
+    
+    static void resetReadaheadStats (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        o->readahead_stats = ReadaheadStats{};
+    }
+    
+    static CacheStats getCacheStats (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        return o->cache_stats;
+    }
+    
+    static void resetCacheStats (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        o->cache_stats = CacheStats{};
+    }
+    
+    /**
+     * Readahead state for one sequential stream of blocks, such as a file.
+     * 
+     * The user calls access() before requesting each block, giving the position
+     * of the block in the stream. While positions are consecutive, the window
+     * grows (doubling on each refill) up to MaxReadaheadWindow blocks, and
+     * access() asks for a refill once enough of the window has been consumed
+     * to make up a multi-block read of up to MaxIoBlocks blocks. A non-sequential
+     * access drops the window, which then has to build up again.
+     * 
+     * When access() returns a nonzero length, the user should map that many
+     * stream positions following the accessed one to block extents (as far as
+     * it can), and pass them to hint().
+     * 
+     * Hinted reads which are still waiting to be submitted are cancelled on
+     * a non-sequential access, by reset() and by deinit(), since they are
+     * likely not needed any more. Reads which someone is waiting for are not
+     * affected.
+     * 
+     * Entries remember their Readahead by address, so deinit() must be called
+     * before the object is freed or reused, or a later Readahead at the same
+     * address would take over (and possibly cancel) these reads.
+     */
+    class Readahead {
+    public:
+        void init (Context c)
+        {
+            m_next_pos = 0;
+            m_hint_pos = 0;
+            m_window = 0;
+        }
+        
+        void reset (Context c)
+        {
+            TheDebugObject::access(c);
+            
+            cancel_queued_reads(c);
+            init(c);
+        }
+        
+        void deinit (Context c)
+        {
+            auto *o = Object::self(c);
+            TheDebugObject::access(c);
+            
+            cancel_queued_reads(c);
+            
+            // Forget this owner in reads which could not be cancelled.
+            for (CacheEntry &entry : o->cache_entries) {
+                if (entry.m_hint_owner == this) {
+                    entry.m_hint_owner = nullptr;
                 }
             }
+        }
+        
+        BlockIndexType access (Context c, BlockIndexType pos, BlockIndexType block)
+        {
+            TheDebugObject::access(c);
             
-            if (!already) {
-                // Pop a free entry from the list.
-                CacheEntryIndexType free_entry_index = free_entries[--num_free_entries];
-                CacheEntry *free_entry = &o->cache_entries[free_entry_index];
-                
-                // Assign this block to this entry.
-                free_entry->assignBlockAndAttachUser(c, block, write_stride, write_count, false, nullptr);
+            account_access(c, block);
+            
+            if (pos != m_next_pos) {
+                if (m_hint_pos > m_next_pos) {
+                    cancel_queued_reads(c);
+                }
+                m_window = 0;
+                m_hint_pos = pos + 1;
+            }
+            else if (m_window == 0) {
+                m_window = MinValue(MaxReadaheadWindow, InitialReadaheadWindow);
+            }
+            m_next_pos = pos + 1;
+            if (m_hint_pos < m_next_pos) {
+                m_hint_pos = m_next_pos;
             }
             
-            block++;
+            BlockIndexType ahead = m_hint_pos - m_next_pos;
+            if (m_window == 0 || ahead >= m_window || m_window - ahead < refill_batch()) {
+                return 0;
+            }
+            
+            BlockIndexType length = m_window;
+            m_window = MinValue((BlockIndexType)MaxReadaheadWindow, (BlockIndexType)(2 * m_window));
+            return length;
         }
         
-        // Inform them at which block we ran out of free entries, so they may
-        // start the next hint at that block.
-        return block;
-    }
+        // The extents must be in stream order starting at the position following
+        // the accessed one, with the first stream_length blocks being stream blocks.
+        // Further extents (e.g. metadata needed to continue the mapping) may follow.
+        void hint (Context c, HintExtent const *extents, uint8_t num_extents, BlockIndexType stream_length)
+        {
+            BlockIndexType num_covered = (num_extents == 0) ? 0 : hintExtents(c, extents, num_extents, this);
+            m_hint_pos = m_next_pos + MinValue(num_covered, stream_length);
+        }
+        
+    private:
+        BlockIndexType refill_batch ()
+        {
+            return MinValue((BlockIndexType)MaxIoBlocks, MaxValue((BlockIndexType)1, (BlockIndexType)(m_window / 2)));
+        }
+        
+        void cancel_queued_reads (Context c)
+        {
+            auto *o = Object::self(c);
+            
+            CacheEntry *e = o->io_queue.first();
+            while (e) {
+                CacheEntry *next_e = o->io_queue.next(e);
+                if (e->m_hint_owner == this && e->canCancelRead(c)) {
+                    e->cancelRead(c);
+                    o->readahead_stats.cancelled_blocks++;
+                }
+                e = next_e;
+            }
+        }
+        
+        static void account_access (Context c, BlockIndexType block)
+        {
+            auto *o = Object::self(c);
+            
+            CacheEntryIndexType entry_index = index_find(c, block);
+            if (entry_index == -1) {
+                o->readahead_stats.misses++;
+            }
+            else if (o->cache_entries[entry_index].isInitialized(c)) {
+                o->readahead_stats.hits++;
+            }
+            else {
+                o->readahead_stats.stalls++;
+            }
+        }
+        
+        BlockIndexType m_next_pos;
+        BlockIndexType m_hint_pos;
+        BlockIndexType m_window;
+    };
     
     template <typename Dummy=void>
     class FlushRequest : private SimpleDebugObject<Context> {
@@ -319,6 +592,7 @@ public:
             m_event.init(c, APRINTER_CB_OBJFUNC_T(&CacheRef::event_handler, this));
             m_state = State::INVALID;
             m_entry_index = -1;
+            m_pinned = false;
             this->debugInit(c);
         }
         
@@ -335,11 +609,26 @@ public:
             reset_internal(c);
         }
         
+        // Like reset(), but if this leaves the block unreferenced and clean,
+        // its entry becomes the first to be reused. Used for data which is
+        // read once, so that it does not push metadata out of the cache.
+        void resetNoReuse (Context c)
+        {
+            this->debugAccess(c);
+            
+            CacheEntryIndexType entry_index = m_entry_index;
+            reset_internal(c);
+            if (entry_index != -1) {
+                auto *o = Object::self(c);
+                o->cache_entries[entry_index].demote(c);
+            }
+        }
+        
         void resetWeak (Context c)
         {
             this->debugAccess(c);
             
-            if (m_state == State::AVAILABLE) {
+            if (m_state == State::AVAILABLE && !m_pinned) {
                 m_state = State::WEAK_REF;
                 get_entry(c)->detachUser(c, this, CacheEntry::DetachMode::HARD_TO_WEAK);
             } else {
@@ -352,6 +641,8 @@ public:
             this->debugAccess(c);
             TheDebugObject::access(c);
             
+            account_request(c, block);
+            
             if (!(flags & FLAG_NO_IMMEDIATE_COMPLETION) && (is_allocating_block(block) || is_attached_to_block(c, block))) {
                 check_write_params(write_stride, write_count);
                 if (m_state == State::WEAK_REF) {
@@ -386,6 +677,36 @@ public:
             return false; // never do we end up in State::AVAILABLE in this branch
         }
         
+        // Makes this reference refer to the block of the available reference src,
+        // completing immediately, and pins the buffer with the block data: the pointer
+        // returned by getData() remains valid for as long as this reference is held.
+        // The pinned data is a snapshot; if the block is written meanwhile, the new
+        // data goes to another buffer and is not seen through this reference. This is
+        // for passing the data on without copying it. Returns false if the block
+        // cannot be pinned right now.
+        bool pinFrom (Context c, CacheRef *src)
+        {
+            auto *o = Object::self(c);
+            this->debugAccess(c);
+            AMBRO_ASSERT(src != this)
+            AMBRO_ASSERT(src->isAvailable(c))
+            
+            reset_internal(c);
+            
+            CacheEntry *entry = src->get_entry(c);
+            if (o->num_pinned_refs >= MaxPinnedRefs || !entry->canIncrementRefCnt(c) || !entry->canPin(c)) {
+                return false;
+            }
+            
+            o->num_pinned_refs++;
+            copy_write_params(src);
+            m_entry_index = src->m_entry_index;
+            m_state = State::AVAILABLE;
+            m_pinned = true;
+            entry->attachPinnedUser(c, this);
+            return true;
+        }
+        
         bool isAvailable (Context c)
         {
             this->debugAccess(c);
@@ -405,6 +726,9 @@ public:
             this->debugAccess(c);
             AMBRO_ASSERT(isAvailable(c))
             
+            if (m_pinned) {
+                return get_entry(c)->getPinnedData(c);
+            }
             return get_entry(c)->getDataForReading(c);
         }
         
@@ -412,6 +736,7 @@ public:
         {
             this->debugAccess(c);
             AMBRO_ASSERT(isAvailable(c))
+            AMBRO_ASSERT(!m_pinned)
             
             return get_entry(c)->getDataForWriting(c);
         }
@@ -438,6 +763,13 @@ public:
             this->m_no_need_to_read = (flags & FLAG_NO_NEED_TO_READ);
         }
         
+        APRINTER_FUNCTION_IF_OR_EMPTY(Writable, void, copy_write_params (CacheRef *src))
+        {
+            this->m_write_stride = src->m_write_stride;
+            this->m_write_count = src->m_write_count;
+            this->m_no_need_to_read = false;
+        }
+        
         APRINTER_FUNCTION_IF_OR_EMPTY(Writable, void, register_allocation (Context c, BlockIndexType block))
         {
             auto *o = Object::self(c);
@@ -477,6 +809,12 @@ public:
                 AMBRO_ASSERT(!m_event.isSet(c))
                 return;
             }
+            if (m_pinned) {
+                auto *o = Object::self(c);
+                get_entry(c)->unpinUser(c);
+                o->num_pinned_refs--;
+                m_pinned = false;
+            }
             if (m_entry_index != -1) {
                 auto mode = (m_state == State::WEAK_REF) ? CacheEntry::DetachMode::DETACH_WEAK : CacheEntry::DetachMode::DETACH_HARD;
                 get_entry(c)->detachUser(c, this, mode);
@@ -587,20 +925,127 @@ public:
         DoubleEndedListNode<CacheRef> m_list_node;
         CacheEntryIndexType m_entry_index;
         State m_state;
+        bool m_pinned;
     };
     
 private:
+    static bool is_block_in_extents (BlockIndexType block, HintExtent const *extents, uint8_t num_extents)
+    {
+        for (auto i : LoopRange<uint8_t>(num_extents)) {
+            if (block >= extents[i].start_block && block < extents[i].end_block) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    static size_t index_hash (BlockIndexType block)
+    {
+        return (uint32_t)((uint32_t)block * UINT32_C(2654435769)) >> (32 - IndexBits);
+    }
+    
+    static size_t index_next (size_t pos)
+    {
+        return (pos + 1) & (IndexSize - 1);
+    }
+    
+    // Returns the index of the entry assigned to this block, or -1.
+    static CacheEntryIndexType index_find (Context c, BlockIndexType block)
+    {
+        auto *o = Object::self(c);
+        
+        for (size_t pos = index_hash(block);; pos = index_next(pos)) {
+            CacheEntryIndexType entry_index = o->block_index[pos];
+            if (entry_index == -1 || o->cache_entries[entry_index].getBlock(c) == block) {
+                return entry_index;
+            }
+        }
+    }
+    
+    static void index_insert (Context c, CacheEntryIndexType entry_index, BlockIndexType block)
+    {
+        auto *o = Object::self(c);
+        
+        size_t pos = index_hash(block);
+        while (o->block_index[pos] != -1) {
+            AMBRO_ASSERT(o->cache_entries[o->block_index[pos]].getBlock(c) != block)
+            pos = index_next(pos);
+        }
+        o->block_index[pos] = entry_index;
+    }
+    
+    static void index_remove (Context c, CacheEntryIndexType entry_index, BlockIndexType block)
+    {
+        auto *o = Object::self(c);
+        
+        size_t hole = index_hash(block);
+        while (o->block_index[hole] != entry_index) {
+            AMBRO_ASSERT(o->block_index[hole] != -1)
+            hole = index_next(hole);
+        }
+        o->block_index[hole] = -1;
+        
+        // Move back any following entries in the probe run which would
+        // otherwise no longer be found, since there are no tombstones.
+        for (size_t pos = index_next(hole); o->block_index[pos] != -1; pos = index_next(pos)) {
+            size_t home = index_hash(o->cache_entries[o->block_index[pos]].getBlock(c));
+            if (((pos - home) & (IndexSize - 1)) >= ((pos - hole) & (IndexSize - 1))) {
+                o->block_index[hole] = o->block_index[pos];
+                o->block_index[pos] = -1;
+                hole = pos;
+            }
+        }
+    }
+    
+    static typename CacheEntry::EvictList * evict_list (Context c, EvictClass evict_class)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(evict_class != EvictClass::NONE)
+        
+        return &o->evict_lists[(int)evict_class - 1];
+    }
+    
     APRINTER_FUNCTION_IF_OR_EMPTY_EXT(Writable, static, void, writable_init (Context c))
     {
         auto *o = Object::self(c);
         
         o->allocations_event.init(c, APRINTER_CB_STATFUNC_T(&BlockCache::allocations_event_handler<>));
         o->current_dirt_time = 0;
+        o->dirty_list.init();
         o->waiting_flush_requests.init();
         o->pending_allocations.init();
         for (auto i : LoopRange<BufferIndexType>(NumBuffers)) {
             o->buffer_usage[i] = false;
         }
+        writeback_init(c);
+    }
+    
+    APRINTER_FUNCTION_IF_OR_EMPTY_EXT(EnableWriteBack, static, void, writeback_init (Context c))
+    {
+        auto *o = Object::self(c);
+        o->writeback_timer.init(c, APRINTER_CB_STATFUNC_T(&BlockCache::writeback_timer_handler<>));
+    }
+    
+    APRINTER_FUNCTION_IF_OR_EMPTY_EXT(EnableWriteBack, static, void, writeback_deinit (Context c))
+    {
+        auto *o = Object::self(c);
+        o->writeback_timer.deinit(c);
+    }
+    
+    APRINTER_FUNCTION_IF_OR_EMPTY_EXT(EnableWriteBack, static, void, start_writeback_timer (Context c))
+    {
+        auto *o = Object::self(c);
+        
+        if (!o->writeback_timer.isSet(c)) {
+            o->writeback_timer.appendAfter(c, WriteBackDelayTicks);
+        }
+    }
+    
+    APRINTER_FUNCTION_IF_EXT(EnableWriteBack, static, void, writeback_timer_handler (Context c))
+    {
+        TheDebugObject::access(c);
+        
+        start_writing_for_flush(c);
     }
     
     APRINTER_FUNCTION_IF_OR_EMPTY_EXT(Writable, static, void, writable_deinit_assert (Context c))
@@ -613,6 +1058,7 @@ private:
     APRINTER_FUNCTION_IF_OR_EMPTY_EXT(Writable, static, void, writable_deinit (Context c))
     {
         auto *o = Object::self(c);
+        writeback_deinit(c);
         o->allocations_event.deinit(c);
     }
     
@@ -621,14 +1067,13 @@ private:
         auto *o = Object::self(c);
         
         bool error = false;
-        for (CacheEntry &ce : o->cache_entries) {
-            if (ce.isDirty(c)) {
-                if (!for_new_request && ce.hasFlushWriteFailed(c)) {
-                    error = true;
-                } else {
-                    AMBRO_ASSERT(for_new_request || ce.isWriteScheduledOrActive(c))
-                    return false;
-                }
+        for (CacheEntry *ce = o->dirty_list.first(); ce; ce = o->dirty_list.next(ce)) {
+            AMBRO_ASSERT(ce->isDirty(c))
+            if (!for_new_request && ce->hasFlushWriteFailed(c)) {
+                error = true;
+            } else {
+                AMBRO_ASSERT(for_new_request || ce->isWriteScheduledOrActive(c))
+                return false;
             }
         }
         
@@ -642,9 +1087,9 @@ private:
     {
         auto *o = Object::self(c);
         
-        for (CacheEntry &ce : o->cache_entries) {
-            if (ce.canStartWrite(c)) {
-                ce.scheduleWriting(c);
+        for (CacheEntry *ce = o->dirty_list.first(); ce; ce = o->dirty_list.next(ce)) {
+            if (ce->canStartWrite(c)) {
+                ce->scheduleWriting(c);
             }
         }
     }
@@ -659,6 +1104,18 @@ private:
         o->waiting_flush_requests.init();
     }
     
+    static void account_request (Context c, BlockIndexType block)
+    {
+        auto *o = Object::self(c);
+        
+        CacheEntryIndexType entry_index = index_find(c, block);
+        if (entry_index != -1 && o->cache_entries[entry_index].isInitialized(c)) {
+            o->cache_stats.hits++;
+        } else {
+            o->cache_stats.misses++;
+        }
+    }
+    
     // Meaning of the return value:
     // >=0 - Can use this entry right away. It could be either free, assigned to the requested block,
     //       or assigned to another block but suitable for immediate reassignment.
@@ -680,62 +1137,27 @@ private:
     {
         auto *o = Object::self(c);
         
-        CacheEntryIndexType free_entry = -1;
-        CacheEntryIndexType evictable_entry = -1;
-        CacheEntryIndexType releasing_entry = -1;
-        
-        for (auto entry_index : LoopRange<CacheEntryIndexType>(NumCacheEntries)) {
-            CacheEntry *ce = &o->cache_entries[entry_index];
-            
-            if (ce->isAssigned(c) && ce->getBlock(c) == block) {
-                return ce->isBeingReleased(c) ? -1 : entry_index;
-            }
-            
-            if (!ce->isBeingReleased(c)) {
-                if (!ce->isAssigned(c)) {
-                    free_entry = entry_index;
-                }
-                else if (!Writable ? ce->canReassign(c) : (ce->isAssigned(c) && !ce->isReferenced(c))) {
-                    if (evictable_entry == -1 || eviction_lesser_than(c, ce, &o->cache_entries[evictable_entry])) {
-                        evictable_entry = entry_index;
-                    }
-                }
-            } else {
-                releasing_entry = entry_index;
-            }
+        CacheEntryIndexType assigned_entry = index_find(c, block);
+        if (assigned_entry != -1) {
+            return o->cache_entries[assigned_entry].isBeingReleased(c) ? -1 : assigned_entry;
         }
         
-        if (free_entry != -1) {
-            return free_entry;
+        CacheEntry *free_entry = evict_list(c, EvictClass::FREE)->first();
+        if (free_entry) {
+            return free_entry->getEntryIndex(c);
         }
         
-        if (evictable_entry != -1) {
-            CacheEntry *ee = &o->cache_entries[evictable_entry];
-            
-            if (!Writable) {
-                AMBRO_ASSERT(ee->canReassign(c))
-                return evictable_entry;
-            }
-            
-            if (ee->canReassign(c) && (releasing_entry == -1 || !eviction_lesser_than(c, &o->cache_entries[releasing_entry], ee))) {
-                return evictable_entry;
-            }
-            
-            if (releasing_entry == -1) {
-                ee->startRelease(c);
-                releasing_entry = evictable_entry;
-            }
+        // Completely unreferenced clean entries, least recently used first.
+        CacheEntry *clean_entry = evict_list(c, EvictClass::CLEAN)->first();
+        if (clean_entry) {
+            return clean_entry->getEntryIndex(c);
         }
         
-        if (Writable && releasing_entry != -1) {
-            return -1;
-        }
-        
-        return -2;
+        return get_entry_for_eviction(c);
     }
     
     /**
-     * Determines if eviction of e1 is preferred to eviction of e2.
+     * Picks an entry to evict when there is no free or unreferenced clean entry.
      * 
      * We want, in order:
      * (1) Eviction of completely unreferenced entries is preferred to eviction of
@@ -745,23 +1167,55 @@ private:
      * 
      * The purpose of (1) is to minimize writing of FAT table entries.
      * The purpose of (2) and (3) is to take advantage of multi-block writes.
+     * 
+     * Entries which cannot be reassigned right away are released, and the
+     * caller waits for that. An entry already being released is unreferenced,
+     * so if there is one, we always wait for it instead of releasing another.
+     * Only the dirty list is walked, skipping entries with hard references.
      */
-    APRINTER_FUNCTION_IF_ELSE_EXT(Writable, static, bool, eviction_lesser_than (Context c, CacheEntry *e1, CacheEntry *e2), {
+    APRINTER_FUNCTION_IF_ELSE_EXT(Writable, static, CacheEntryIndexType, get_entry_for_eviction (Context c), {
         auto *o = Object::self(c);
-        bool r1 = e1->isReferencedIncludingWeak(c);
-        bool r2 = e2->isReferencedIncludingWeak(c);
-        if (r1 < r2) {
-            return true;
+        
+        if (!evict_list(c, EvictClass::RELEASING)->isEmpty()) {
+            return -1;
+        }
+        
+        // A hinted read nobody is waiting for yet counts as a clean entry.
+        CacheEntry *release_entry = evict_list(c, EvictClass::PENDING_READ)->first();
+        
+        CacheEntry *weak_dirty_entry = nullptr;
+        if (!release_entry) {
+            for (CacheEntry *ce = o->dirty_list.first(); ce; ce = o->dirty_list.next(ce)) {
+                if (ce->isReferenced(c)) {
+                    continue;
+                }
+                if (!ce->isReferencedIncludingWeak(c)) {
+                    release_entry = ce;
+                    break;
+                }
+                if (!weak_dirty_entry) {
+                    weak_dirty_entry = ce;
+                }
+            }
         }
-        if (r1 == r2) {
-            DirtTimeType current = o->current_dirt_time;
-            DirtTimeType t1 = e1->isDirty(c) ? e1->getDirtTime(c) : (current + 1);
-            DirtTimeType t2 = e2->isDirty(c) ? e2->getDirtTime(c) : (current + 1);
-            return (DirtTimeType)(current - t1) > (DirtTimeType)(current - t2);
+        
+        if (!release_entry) {
+            CacheEntry *weak_entry = evict_list(c, EvictClass::CLEAN_WEAK)->first();
+            if (weak_entry) {
+                return weak_entry->getEntryIndex(c);
+            }
+            release_entry = weak_dirty_entry;
         }
-        return false;
+        
+        if (!release_entry) {
+            return -2;
+        }
+        
+        release_entry->startRelease(c);
+        return -1;
     }, {
-        return e1->isReferencedIncludingWeak(c) < e2->isReferencedIncludingWeak(c);
+        CacheEntry *weak_entry = evict_list(c, EvictClass::CLEAN_WEAK)->first();
+        return weak_entry ? weak_entry->getEntryIndex(c) : -2;
     })
     
     APRINTER_FUNCTION_IF_EXT(Writable, static, void, report_allocation_event (Context c, bool error))
@@ -788,10 +1242,13 @@ private:
         auto *o = Object::self(c);
         TheDebugObject::access(c);
         
-        for (CacheEntry &ce : o->cache_entries) {
-            if (ce.isBeingReleased(c) && !ce.isAssigned(c)) {
-                ce.completeRelease(c);
+        CacheEntry *ce = evict_list(c, EvictClass::RELEASING)->first();
+        while (ce) {
+            CacheEntry *next = evict_list(c, EvictClass::RELEASING)->next(ce);
+            if (!ce->isAssigned(c)) {
+                ce->completeRelease(c);
             }
+            ce = next;
         }
         
         report_allocation_event(c, false);
@@ -817,8 +1274,6 @@ private:
         AMBRO_ASSERT(o->buffer_usage[i])
     }
     
-    enum class DirtState : uint8_t {CLEAN, DIRTY, WRITING};
-    
     APRINTER_STRUCT_IF_TEMPLATE(CacheEntryWritableMemebers) {
         typename Context::EventLoop::QueuedEvent m_write_event;
         bool m_releasing;
@@ -831,6 +1286,8 @@ private:
         BlockIndexType m_write_stride;
         BufferIndexType m_active_buffer;
         BufferIndexType m_writing_buffer;
+        BufferIndexType m_pinned_buffer;
+        NumRefsType m_num_pins;
     };
     
     class CacheEntry : private CacheEntryWritableMemebers<Writable> {
@@ -845,8 +1302,13 @@ private:
             m_cache_users_list.init();
             m_num_hard_refs = 0;
             m_state = State::INVALID;
+            m_evict_class = EvictClass::NONE;
+            m_busy = false;
+            m_hint_owner = nullptr;
             IoQueue::markRemoved(this);
+            DirtyList::markRemoved(this);
             writable_entry_init(c);
+            update_lists(c);
         }
         
         void deinit (Context c)
@@ -893,6 +1355,38 @@ private:
             return m_num_hard_refs != 0;
         }
         
+        // A read nobody is waiting for, which has not been submitted yet.
+        bool canCancelRead (Context c)
+        {
+            return m_state == State::READING && !IoQueue::isRemoved(this) && !isReferencedIncludingWeak(c);
+        }
+        
+        void cancelRead (Context c)
+        {
+            auto *o = Object::self(c);
+            AMBRO_ASSERT(canCancelRead(c))
+            
+            APRINTER_BLOCKCACHE_MSG("c RC %" PRIu32, (uint32_t)m_block);
+            
+            o->io_queue.remove(this);
+            IoQueue::markRemoved(this);
+            set_unassigned(c);
+            update_lists(c);
+            if (isBeingReleased(c)) {
+                schedule_allocations_check(c);
+            }
+        }
+        
+        // Reads which someone is waiting for go first, then reads for
+        // readahead, and finally writes.
+        IoPriority getIoPriority (Context c)
+        {
+            if (Writable && m_state == State::WRITING) {
+                return IoPriority::LOW;
+            }
+            return isReferencedIncludingWeak(c) ? IoPriority::HIGH : IoPriority::NORMAL;
+        }
+        
         bool isReferencedIncludingWeak (Context c)
         {
             AMBRO_ASSERT(!m_cache_users_list.isEmpty() || m_num_hard_refs == 0)
@@ -941,8 +1435,10 @@ private:
             auto *o = Object::self(c);
             AMBRO_ASSERT(isInitialized(c))
             
-            if (this->m_active_buffer == this->m_writing_buffer) {
-                AMBRO_ASSERT(m_state == State::WRITING)
+            // The buffers being written out and pinned must not change, so the
+            // data is moved to a fresh buffer first.
+            if (this->m_active_buffer == this->m_writing_buffer || (this->m_num_pins > 0 && this->m_active_buffer == this->m_pinned_buffer)) {
+                AMBRO_ASSERT(this->m_active_buffer != this->m_writing_buffer || m_state == State::WRITING)
                 BufferIndexType new_buffer = find_free_buffer(c);
                 AMBRO_ASSERT(new_buffer != -1)
                 o->buffer_usage[new_buffer] = true;
@@ -964,6 +1460,30 @@ private:
             return m_num_hard_refs < MaxNumRefs;
         }
         
+        CacheEntryIndexType getEntryIndex (Context c)
+        {
+            auto *o = Object::self(c);
+            return (this - o->cache_entries);
+        }
+        
+        // Marks an unreferenced clean entry as most recently used.
+        void touch (Context c)
+        {
+            if (m_evict_class == EvictClass::CLEAN) {
+                evict_list(c, EvictClass::CLEAN)->remove(this);
+                evict_list(c, EvictClass::CLEAN)->append(this);
+            }
+        }
+        
+        // Marks an unreferenced clean entry as least recently used.
+        void demote (Context c)
+        {
+            if (m_evict_class == EvictClass::CLEAN) {
+                evict_list(c, EvictClass::CLEAN)->remove(this);
+                evict_list(c, EvictClass::CLEAN)->prepend(this);
+            }
+        }
+        
         void assignBlockAndAttachUser (Context c, BlockIndexType block, BlockIndexType write_stride, uint8_t write_count, bool no_need_to_read, CacheRef *user)
         {
             AMBRO_ASSERT(write_count >= 1)
@@ -979,7 +1499,12 @@ private:
                 
                 break_weak_refs(c);
                 
+                if (isAssigned(c)) {
+                    index_remove(c, getEntryIndex(c), m_block);
+                }
                 m_block = block;
+                m_hint_owner = nullptr;
+                index_insert(c, getEntryIndex(c), m_block);
                 writable_assign(c, write_stride, write_count);
                 
                 if (Writable && no_need_to_read) {
@@ -997,6 +1522,8 @@ private:
                 m_cache_users_list.prepend(user);
                 m_num_hard_refs++;
             }
+            
+            update_lists(c);
         }
         
         enum class DetachMode {HARD_TO_WEAK, DETACH_HARD, DETACH_WEAK};
@@ -1011,8 +1538,44 @@ private:
             if (mode != DetachMode::DETACH_WEAK) {
                 m_num_hard_refs--;
             }
+            
+            update_lists(c);
+        }
+        
+        // All pins of an entry share one buffer, so once the block has been written
+        // to after being pinned, it cannot be pinned again until the pins are released.
+        APRINTER_FUNCTION_IF_ELSE(Writable, bool, canPin (Context c), {
+            return this->m_num_pins == 0 || this->m_pinned_buffer == this->m_active_buffer;
+        }, {
+            return true;
+        })
+        
+        void attachPinnedUser (Context c, CacheRef *user)
+        {
+            AMBRO_ASSERT(isInitialized(c))
+            AMBRO_ASSERT(isReferenced(c))
+            AMBRO_ASSERT(canIncrementRefCnt(c))
+            AMBRO_ASSERT(canPin(c))
+            
+            m_cache_users_list.prepend(user);
+            m_num_hard_refs++;
+            writable_pin(c, true);
+            update_lists(c);
         }
         
+        void unpinUser (Context c)
+        {
+            writable_pin(c, false);
+        }
+        
+        APRINTER_FUNCTION_IF_ELSE(Writable, char const *, getPinnedData (Context c), {
+            auto *o = Object::self(c);
+            AMBRO_ASSERT(this->m_num_pins > 0)
+            return (char const *)o->buffers[this->m_pinned_buffer];
+        }, {
+            return getDataForReading(c);
+        })
+        
         void hardenWeakUser (Context c, CacheRef *user)
         {
             AMBRO_ASSERT(canIncrementRefCnt(c))
@@ -1020,6 +1583,7 @@ private:
             AMBRO_ASSERT(!isBeingReleased(c))
             
             m_num_hard_refs++;
+            update_lists(c);
         }
         
         APRINTER_FUNCTION_IF(Writable, void, markDirty (Context c))
@@ -1032,6 +1596,15 @@ private:
             if (this->m_dirt_state != DirtState::DIRTY) {
                 this->m_dirt_state = DirtState::DIRTY;
                 this->m_dirt_time = o->current_dirt_time++;
+                
+                // Keep the dirty list ordered by dirt time.
+                if (!DirtyList::isRemoved(this)) {
+                    o->dirty_list.remove(this);
+                    DirtyList::markRemoved(this);
+                }
+                update_lists(c);
+                
+                start_writeback_timer(c);
             }
             
             if (!o->waiting_flush_requests.isEmpty() && m_state == State::IDLE) {
@@ -1057,6 +1630,7 @@ private:
             break_weak_refs(c);
             
             this->m_releasing = true;
+            update_lists(c);
             if (m_state == State::IDLE) {
                 scheduleWriting(c);
             }
@@ -1066,13 +1640,86 @@ private:
         {
             AMBRO_ASSERT(this->m_releasing)
             this->m_releasing = false;
+            update_lists(c);
         }
         
     private:
-        CacheEntryIndexType get_entry_index (Context c)
+        /**
+         * Determines which of the eviction lists the entry belongs to.
+         * 
+         * FREE         - unassigned;
+         * CLEAN        - reassignable, without any users (kept in LRU order);
+         * CLEAN_WEAK   - reassignable, with only weak users;
+         * PENDING_READ - being read without hard references (hinted reads);
+         * RELEASING    - being released;
+         * NONE         - anything else, i.e. referenced or dirty.
+         */
+        EvictClass get_evict_class (Context c)
+        {
+            if (isBeingReleased(c)) {
+                return EvictClass::RELEASING;
+            }
+            if (!isAssigned(c)) {
+                return EvictClass::FREE;
+            }
+            if (canReassign(c)) {
+                return isReferencedIncludingWeak(c) ? EvictClass::CLEAN_WEAK : EvictClass::CLEAN;
+            }
+            if (m_state == State::READING && !isReferenced(c)) {
+                return EvictClass::PENDING_READ;
+            }
+            return EvictClass::NONE;
+        }
+        
+        // Must be called after any change which may affect get_evict_class(),
+        // the busy state (used for hinting) or the dirty state.
+        void update_lists (Context c)
         {
             auto *o = Object::self(c);
-            return (this - o->cache_entries);
+            
+            EvictClass evict_class = get_evict_class(c);
+            if (evict_class != m_evict_class) {
+                if (m_evict_class != EvictClass::NONE) {
+                    evict_list(c, m_evict_class)->remove(this);
+                }
+                if (evict_class != EvictClass::NONE) {
+                    evict_list(c, evict_class)->append(this);
+                }
+                m_evict_class = evict_class;
+            }
+            
+            bool busy = isIoActive(c) || isReferenced(c) || isBeingReleased(c);
+            if (busy != m_busy) {
+                if (busy) {
+                    o->num_busy_entries++;
+                } else {
+                    o->num_busy_entries--;
+                }
+                m_busy = busy;
+            }
+            
+            update_dirty_list(c);
+        }
+        
+        APRINTER_FUNCTION_IF_OR_EMPTY(Writable, void, update_dirty_list (Context c))
+        {
+            auto *o = Object::self(c);
+            
+            bool dirty = isAssigned(c) && this->m_dirt_state != DirtState::CLEAN;
+            if (dirty != !DirtyList::isRemoved(this)) {
+                if (dirty) {
+                    o->dirty_list.append(this);
+                } else {
+                    o->dirty_list.remove(this);
+                    DirtyList::markRemoved(this);
+                }
+            }
+        }
+        
+        void set_unassigned (Context c)
+        {
+            index_remove(c, getEntryIndex(c), m_block);
+            m_state = State::INVALID;
         }
         
         APRINTER_FUNCTION_IF_OR_EMPTY(Writable, void, writable_entry_init (Context c))
@@ -1081,9 +1728,34 @@ private:
             
             this->m_write_event.init(c, APRINTER_CB_OBJFUNC_T(&CacheEntry::write_event_handler<>, this));
             this->m_releasing = false;
-            this->m_active_buffer = get_entry_index(c);
+            this->m_active_buffer = getEntryIndex(c);
             o->buffer_usage[this->m_active_buffer] = true;
             this->m_writing_buffer = -1;
+            this->m_pinned_buffer = -1;
+            this->m_num_pins = 0;
+        }
+        
+        APRINTER_FUNCTION_IF_OR_EMPTY(Writable, void, writable_pin (Context c, bool pin_else_unpin))
+        {
+            auto *o = Object::self(c);
+            
+            if (pin_else_unpin) {
+                if (this->m_num_pins == 0) {
+                    this->m_pinned_buffer = this->m_active_buffer;
+                }
+                AMBRO_ASSERT(this->m_pinned_buffer == this->m_active_buffer)
+                this->m_num_pins++;
+            } else {
+                AMBRO_ASSERT(this->m_num_pins > 0)
+                assert_used_buffer(c, this->m_pinned_buffer);
+                this->m_num_pins--;
+                if (this->m_num_pins == 0) {
+                    if (this->m_pinned_buffer != this->m_active_buffer && this->m_pinned_buffer != this->m_writing_buffer) {
+                        o->buffer_usage[this->m_pinned_buffer] = false;
+                    }
+                    this->m_pinned_buffer = -1;
+                }
+            }
         }
         
         APRINTER_FUNCTION_IF_OR_EMPTY(Writable, void, writable_entry_deinit (Context c))
@@ -1108,6 +1780,7 @@ private:
             AMBRO_ASSERT(!this->m_write_event.isSet(c))
             AMBRO_ASSERT(!this->m_releasing)
             AMBRO_ASSERT(this->m_writing_buffer == -1)
+            AMBRO_ASSERT(this->m_num_pins == 0)
             
             this->m_last_write_failed = false;
             this->m_flush_write_failed = false;
@@ -1121,7 +1794,7 @@ private:
             return o->buffers[this->m_active_buffer];
         }, {
             auto *o = Object::self(c);
-            return o->buffers[get_entry_index(c)];
+            return o->buffers[getEntryIndex(c)];
         })
         
         void raise_read_completed (Context c, bool error)
@@ -1162,10 +1835,16 @@ private:
             if (m_state == State::READING) {
                 APRINTER_BLOCKCACHE_MSG("c RD %" PRIu32 " e%d", (uint32_t)m_block, (int)error);
                 if (isBeingReleased(c)) {
-                    m_state = State::INVALID;
+                    set_unassigned(c);
+                    update_lists(c);
                     return schedule_allocations_check(c);
                 }
-                m_state = error ? State::INVALID : State::IDLE;
+                if (error) {
+                    set_unassigned(c);
+                } else {
+                    m_state = State::IDLE;
+                }
+                update_lists(c);
                 raise_read_completed(c, error);
                 AMBRO_ASSERT(!error || !isReferencedIncludingWeak(c))
             }
@@ -1189,7 +1868,7 @@ private:
             } else {
                 assert_used_buffer(c, this->m_active_buffer);
                 assert_used_buffer(c, this->m_writing_buffer);
-                if (this->m_active_buffer != this->m_writing_buffer) {
+                if (this->m_writing_buffer != this->m_active_buffer && !(this->m_num_pins > 0 && this->m_writing_buffer == this->m_pinned_buffer)) {
                     o->buffer_usage[this->m_writing_buffer] = false;
                 }
                 this->m_writing_buffer = -1;
@@ -1213,6 +1892,7 @@ private:
             this->m_dirt_state = DirtState::WRITING;
             this->m_write_index = 0;
             this->m_write_event.unset(c);
+            update_lists(c);
             
             APRINTER_BLOCKCACHE_MSG("c WS %" PRIu32 " 1/%d", (uint32_t)m_block, (int)this->m_write_count);
         }
@@ -1238,6 +1918,7 @@ private:
             this->m_last_write_failed = error;
             this->m_flush_write_failed = error;
             this->m_dirt_state = (!error && this->m_dirt_state == DirtState::WRITING) ? DirtState::CLEAN : DirtState::DIRTY;
+            update_lists(c);
             
             if (!error && this->m_dirt_state == DirtState::DIRTY && (!o->waiting_flush_requests.isEmpty() || this->m_releasing)) {
                 return write_event_handler(c);
@@ -1249,11 +1930,17 @@ private:
                     report_allocation_event(c, true);
                 } else {
                     AMBRO_ASSERT(this->m_dirt_state == DirtState::CLEAN)
-                    m_state = State::INVALID;
+                    set_unassigned(c);
+                    update_lists(c);
                     schedule_allocations_check(c);
                 }
             }
             
+            if (this->m_dirt_state == DirtState::DIRTY) {
+                // Dirtied again while writing, or the write failed.
+                start_writeback_timer(c);
+            }
+            
             if (!o->waiting_flush_requests.isEmpty()) {
                 bool flush_error;
                 if (is_flush_completed(c, false, &flush_error)) {
@@ -1264,12 +1951,19 @@ private:
         
         DoubleEndedList<CacheRef, &CacheRef::m_list_node, false> m_cache_users_list;
         DoubleEndedListNode<CacheEntry> m_queue_node;
+        DoubleEndedListNode<CacheEntry> m_evict_node;
+        DoubleEndedListNode<CacheEntry> m_dirty_node;
         BlockIndexType m_block;
         NumRefsType m_num_hard_refs;
         State m_state;
+        EvictClass m_evict_class;
+        bool m_busy;
+        Readahead *m_hint_owner; // only compared, never dereferenced
         
     public:
         using IoQueue = DoubleEndedList<CacheEntry, &CacheEntry::m_queue_node>;
+        using EvictList = DoubleEndedList<CacheEntry, &CacheEntry::m_evict_node>;
+        using DirtyList = DoubleEndedList<CacheEntry, &CacheEntry::m_dirty_node>;
     };
     
     class IoDispatcher {
@@ -1290,15 +1984,15 @@ private:
         {
             auto *o = Object::self(c);
             
-            CacheEntry *e;
-            while ((e = o->io_queue.first())) {
-                AMBRO_ASSERT(!CacheEntry::IoQueue::isRemoved(e))
-                
+            while (!o->io_queue.isEmpty()) {
                 IoUnit *unit = find_empty_unit(c);
                 if (!unit) {
                     break;
                 }
                 
+                CacheEntry *e = next_job(c);
+                AMBRO_ASSERT(!CacheEntry::IoQueue::isRemoved(e))
+                
                 o->io_queue.remove(e);
                 CacheEntry::IoQueue::markRemoved(e);
                 
@@ -1307,6 +2001,28 @@ private:
         }
         
     private:
+        // Picks the queued entry with the highest priority (see CacheEntry::getIoPriority).
+        // Reads of the same priority are done in order. Writes are done starting with
+        // the lowest block, so that a flush sweeps through the device in order and
+        // each write can be extended into the blocks which follow.
+        static CacheEntry * next_job (Context c)
+        {
+            auto *o = Object::self(c);
+            
+            CacheEntry *best_e = nullptr;
+            IoPriority best_priority = IoPriority::LOW;
+            for (CacheEntry *e = o->io_queue.first(); e; e = o->io_queue.next(e)) {
+                IoPriority priority = e->getIoPriority(c);
+                if (!best_e || priority < best_priority ||
+                    (priority == best_priority && priority == IoPriority::LOW && e->get_io_block_index() < best_e->get_io_block_index()))
+                {
+                    best_e = e;
+                    best_priority = priority;
+                }
+            }
+            return best_e;
+        }
+        
         static IoUnit * find_empty_unit (Context c)
         {
             auto *o = Object::self(c);
@@ -1366,17 +2082,19 @@ private:
                 extend_io(c, first_e, start_block);
             }
             
-            // Build transfer descriptors.
+            // Build transfer descriptors. The I/O gets the highest priority of the entries involved.
+            IoPriority priority = IoPriority::LOW;
             for (auto i : LoopRange<IoBlockIndexType>(m_num_blocks)) {
                 CacheEntry *this_e = &o->cache_entries[m_entry_indices[i]];
                 m_descriptors[i] = TransferDescriptor<DataWordType>{this_e->get_buffer(c), BlockSizeInWords};
+                priority = MinValue(priority, this_e->getIoPriority(c));
             }
             
             APRINTER_BLOCKCACHE_MSG("c I%c %" PRIu32 " %d", (is_write?'W':'R'), start_block, (int)m_num_blocks);
             
             // Finally start this I/O.
             m_state = is_write ? State::WRITING : State::READING;
-            m_block_user.startReadOrWrite(c, is_write, start_block, m_num_blocks, TransferVector<DataWordType>{m_descriptors, m_num_blocks});
+            m_block_user.startReadOrWrite(c, is_write, start_block, m_num_blocks, TransferVector<DataWordType>{m_descriptors, m_num_blocks}, priority);
         }
         
     private:
@@ -1401,42 +2119,23 @@ private:
                 m_entry_indices[i] = -1;
             }
             
-            // Find candidate blocks to add to the sequence.
-            for (CacheEntry &this_e : o->cache_entries) {
-                // Ignore unassigned entries (they do not have a block index).
-                if (!this_e.isAssigned(c)) {
-                    continue;
-                }
-                
-                // Check if the entry has a place in the sequence.
-                BlockIndexType block_index = this_e.get_io_block_index();
-                if (!(block_index > start_block && block_index - start_block < MaxIoBlocks)) {
-                    continue;
-                }
-                
-                // See above...
-                if (this_e.hasLastWriteFailed(c)) {
-                    continue;
-                }
-                
-                if (this_e.isIoActive(c)) {
-                    // Active I/O - we can take the entry if the I/O direction matches and it is still in the queue.
-                    if (!((!Writable || first_e->m_state == this_e.m_state) && !CacheEntry::IoQueue::isRemoved(&this_e))) {
-                        continue;
-                    }
-                } else {
-                    // Inactive I/O - we can take the entry if we are writing and the entry is ready for writing.
-                    if (!(Writable && first_e->m_state == CacheEntry::State::WRITING && this_e.canStartWrite(c))) {
-                        continue;
+            // Find candidate blocks to add to the sequence. Entries doing I/O for their
+            // own block are found through the block index. Entries which are writing
+            // further copies of their block can only be in the I/O queue.
+            for (auto i : LoopRange<IoBlockIndexType>(1, MaxIoBlocks)) {
+                CacheEntryIndexType entry_index = index_find(c, start_block + i);
+                if (entry_index != -1) {
+                    CacheEntry *this_e = &o->cache_entries[entry_index];
+                    if (this_e->get_io_block_index() == this_e->getBlock(c)) {
+                        add_io_candidate(c, first_e, start_block, this_e);
                     }
                 }
-                
-                // The entry is a candidate, add it to the list.
-                // Unless some other entry is already in this place - but the only way this can
-                // happen if the user caused a conflict with the write strides.
-                IoBlockIndexType io_index = block_index - start_block;
-                if (m_entry_indices[io_index] == -1) {
-                    m_entry_indices[io_index] = (&this_e - o->cache_entries);
+            }
+            if (Writable && first_e->m_state == CacheEntry::State::WRITING) {
+                for (CacheEntry *this_e = o->io_queue.first(); this_e; this_e = o->io_queue.next(this_e)) {
+                    if (this_e->get_io_block_index() != this_e->getBlock(c)) {
+                        add_io_candidate(c, first_e, start_block, this_e);
+                    }
                 }
             }
             
@@ -1459,6 +2158,42 @@ private:
             }
         }
         
+        void add_io_candidate (Context c, CacheEntry *first_e, BlockIndexType start_block, CacheEntry *this_e)
+        {
+            auto *o = Object::self(c);
+            
+            // Check if the entry has a place in the sequence.
+            BlockIndexType block_index = this_e->get_io_block_index();
+            if (!(block_index > start_block && block_index - start_block < MaxIoBlocks)) {
+                return;
+            }
+            
+            // See above...
+            if (this_e->hasLastWriteFailed(c)) {
+                return;
+            }
+            
+            if (this_e->isIoActive(c)) {
+                // Active I/O - we can take the entry if the I/O direction matches and it is still in the queue.
+                if (!((!Writable || first_e->m_state == this_e->m_state) && !CacheEntry::IoQueue::isRemoved(this_e))) {
+                    return;
+                }
+            } else {
+                // Inactive I/O - we can take the entry if we are writing and the entry is ready for writing.
+                if (!(Writable && first_e->m_state == CacheEntry::State::WRITING && this_e->canStartWrite(c))) {
+                    return;
+                }
+            }
+            
+            // The entry is a candidate, add it to the list.
+            // Unless some other entry is already in this place - but the only way this can
+            // happen if the user caused a conflict with the write strides.
+            IoBlockIndexType io_index = block_index - start_block;
+            if (m_entry_indices[io_index] == -1) {
+                m_entry_indices[io_index] = (this_e - o->cache_entries);
+            }
+        }
+        
         APRINTER_FUNCTION_IF(Writable, void, block_user_locker (Context c, bool lock_else_unlock))
         {
             auto *o = Object::self(c);
@@ -1506,17 +2241,28 @@ private:
         DirtTimeType current_dirt_time;
         DoubleEndedList<FlushRequest<>, &FlushRequest<>::m_waiting_flush_requests_node, false> waiting_flush_requests;
         DoubleEndedList<CacheRef, &CacheRef::m_list_node> pending_allocations;
+        typename CacheEntry::DirtyList dirty_list;
         bool buffer_usage[NumBuffers];
     };
     
+    APRINTER_STRUCT_IF_TEMPLATE(CacheWriteBackMembers) {
+        typename Context::EventLoop::TimedEvent writeback_timer;
+    };
+    
 public:
     struct Object : public ObjBase<BlockCache, ParentObject, MakeTypeList<
         TheDebugObject
-    >>, public CacheWritableMembers<Writable> {
+    >>, public CacheWritableMembers<Writable>, public CacheWriteBackMembers<EnableWriteBack> {
         CacheEntry cache_entries[NumCacheEntries];
         IoUnit io_units[NumIoUnits];
         typename CacheEntry::IoQueue io_queue;
         typename Context::EventLoop::QueuedEvent io_queue_event;
+        ReadaheadStats readahead_stats;
+        CacheStats cache_stats;
+        CacheEntryIndexType num_busy_entries;
+        CacheEntryIndexType num_pinned_refs;
+        typename CacheEntry::EvictList evict_lists[NumEvictLists];
+        CacheEntryIndexType block_index[IndexSize];
         DataWordType buffers[NumBuffers][BlockSizeInWords];
     };
 };
@@ -1528,7 +2274,8 @@ APRINTER_ALIAS_STRUCT_EXT(BlockCacheArg, (
     APRINTER_AS_VALUE(int, NumCacheEntries),
     APRINTER_AS_VALUE(int, NumIoUnits),
     APRINTER_AS_VALUE(int, MaxIoBlocks),
-    APRINTER_AS_VALUE(bool, Writable)
+    APRINTER_AS_VALUE(bool, Writable),
+    APRINTER_AS_TYPE(WriteBackDelay)
 ), (
     APRINTER_DEF_INSTANCE(BlockCacheArg, BlockCache)
 ))
@@ -25,6 +25,7 @@
 #ifndef APRINTER_BUFFERED_FILE_H
 #define APRINTER_BUFFERED_FILE_H
 
+#include <stdint.h>
 #include <stddef.h>
 #include <string.h>
 
@@ -40,11 +41,12 @@ class BufferedFile {
 private:
     using TheFs = typename TheFsAccess::TheFileSystem;
     using TheOpener = typename TheFs::Opener;
+    using TheCreator = typename TheFs::Creator;
     using TheFile = typename TheFs::template File<true>;
     
     enum class State {
         IDLE,
-        OPEN_ACCESS, OPEN_BASEDIR, OPEN_OPEN, OPEN_OPENWR,
+        OPEN_ACCESS, OPEN_BASEDIR, OPEN_OPEN, OPEN_CREATE, OPEN_OPENWR,
         READY,
         WRITE_EVENT, WRITE_WRITE, WRITE_TRUNCATE, WRITE_FLUSH,
         READ_EVENT, READ_READ
@@ -55,6 +57,7 @@ public:
     enum class Error {NO_ERROR, OTHER_ERROR, NOT_FOUND};
     
     using CompletionHandler = Callback<void(Context c, Error error, size_t read_length)>;
+    using CacheRef = typename TheFs::CacheRefForUser;
     
     void init (Context c, CompletionHandler completion_handler)
     {
@@ -63,6 +66,7 @@ public:
         m_access_client.init(c, APRINTER_CB_OBJFUNC_T(&BufferedFile::access_client_handler, this));
         m_state = State::IDLE;
         m_have_opener = false;
+        m_have_creator = false;
         m_have_file = false;
         m_have_flush = false;
     }
@@ -117,7 +121,11 @@ public:
         m_event.prependNowNotAlready(c);
     }
     
-    void startReadData (Context c, char *data, size_t avail)
+    // If pin_ref is given, the data is not copied if the cache block holding
+    // it can be pinned into pin_ref instead (see FatFs::File::pinReadBlock()).
+    // Such a read ends at the end of the block, and getPinnedReadData()
+    // gives the data.
+    void startReadData (Context c, char *data, size_t avail, CacheRef *pin_ref=nullptr)
     {
         AMBRO_ASSERT(m_state == State::READY)
         AMBRO_ASSERT(!m_write_mode)
@@ -125,15 +133,44 @@ public:
         m_read_data = data;
         m_read_avail = avail;
         m_read_pos = 0;
+        m_read_pin_ref = pin_ref;
+        m_read_pinned_data = nullptr;
         m_state = State::READ_EVENT;
         m_event.prependNowNotAlready(c);
     }
     
+    // The data of the last read if it was pinned, or null if it was copied.
+    char const * getPinnedReadData (Context c)
+    {
+        AMBRO_ASSERT(m_state == State::READY)
+        AMBRO_ASSERT(!m_write_mode)
+        
+        return m_read_pinned_data;
+    }
+    
+    // Tells the file system how large the file being written will be,
+    // so that it can allocate clusters for it in contiguous runs.
+    void setExpectedSize (Context c, uint32_t size)
+    {
+        AMBRO_ASSERT(m_state == State::READY)
+        AMBRO_ASSERT(m_write_mode)
+        
+        m_fs_file.setExpectedSize(c, size);
+    }
+    
     bool isReady (Context c)
     {
         return (m_state == State::READY);
     }
     
+    // The directory entry of the file, as it was when the file was opened.
+    typename TheFs::FsEntry getFileEntry (Context c)
+    {
+        AMBRO_ASSERT(m_have_file)
+        
+        return m_file_entry;
+    }
+    
 private:
     void reset_internal (Context c)
     {
@@ -145,6 +182,10 @@ private:
             m_fs_file.deinit(c);
             m_have_file = false;
         }
+        if (m_have_creator) {
+            m_fs_creator.deinit(c);
+            m_have_creator = false;
+        }
         if (m_have_opener) {
             m_fs_opener.deinit(c);
             m_have_opener = false;
@@ -175,6 +216,7 @@ private:
             m_fs_opener.init(c, dir_entry, TheFs::EntryType::DIR_TYPE, m_basedir, APRINTER_CB_OBJFUNC_T(&BufferedFile::fs_opener_handler, this));
         } else {
             m_state = State::OPEN_OPEN;
+            m_dir_entry = dir_entry;
             m_fs_opener.init(c, dir_entry, TheFs::EntryType::FILE_TYPE, m_filename, APRINTER_CB_OBJFUNC_T(&BufferedFile::fs_opener_handler, this));
         }
         m_have_opener = true;
@@ -186,6 +228,19 @@ private:
         AMBRO_ASSERT(m_have_opener)
         AMBRO_ASSERT(!m_have_file)
         
+        if (status == TheOpener::OpenerStatus::NOT_FOUND && m_state == State::OPEN_OPEN &&
+            m_write_mode && !strchr(m_filename, '/'))
+        {
+            // Writing a file which does not exist yet, create it.
+            m_fs_opener.deinit(c);
+            m_have_opener = false;
+            
+            m_state = State::OPEN_CREATE;
+            m_fs_creator.init(c, m_dir_entry, m_filename, APRINTER_CB_OBJFUNC_T(&BufferedFile::fs_creator_handler, this));
+            m_have_creator = true;
+            return;
+        }
+        
         if (status != TheOpener::OpenerStatus::SUCCESS) {
             Error user_error = (status == TheOpener::OpenerStatus::NOT_FOUND) ? Error::NOT_FOUND : Error::OTHER_ERROR;
             return reset_and_complete(c, user_error);
@@ -195,14 +250,37 @@ private:
         
         if (m_state == State::OPEN_BASEDIR) {
             m_state = State::OPEN_OPEN;
+            m_dir_entry = entry;
             m_fs_opener.init(c, entry, TheFs::EntryType::FILE_TYPE, m_filename, APRINTER_CB_OBJFUNC_T(&BufferedFile::fs_opener_handler, this));
             return;
         }
         
         m_have_opener = false;
         
+        return open_file(c, entry);
+    }
+    
+    void fs_creator_handler (Context c, typename TheCreator::CreatorStatus status, typename TheFs::FsEntry entry)
+    {
+        AMBRO_ASSERT(m_state == State::OPEN_CREATE)
+        AMBRO_ASSERT(m_have_creator)
+        AMBRO_ASSERT(!m_have_file)
+        
+        if (status != TheCreator::CreatorStatus::SUCCESS) {
+            return reset_and_complete(c, Error::OTHER_ERROR);
+        }
+        
+        m_fs_creator.deinit(c);
+        m_have_creator = false;
+        
+        return open_file(c, entry);
+    }
+    
+    void open_file (Context c, typename TheFs::FsEntry entry)
+    {
         m_fs_file.init(c, entry, APRINTER_CB_OBJFUNC_T(&BufferedFile::fs_file_handler, this), TheFile::IoMode::FS_BUFFER);
         m_have_file = true;
+        m_file_entry = entry;
         
         if (m_write_mode) {
             m_state = State::OPEN_OPENWR;
@@ -313,8 +391,14 @@ private:
     {
         size_t to_copy = MinValue(m_read_avail, (size_t)(m_read_buffer_length - m_read_buffer_pos));
         if (to_copy > 0) {
-            memcpy(m_read_data, m_fs_file.getReadPointer(c) + m_read_buffer_pos, to_copy);
-            m_read_data += to_copy;
+            char const *block_data = m_fs_file.getReadPointer(c) + m_read_buffer_pos;
+            if (m_read_pin_ref && m_read_pos == 0 && m_fs_file.pinReadBlock(c, m_read_pin_ref)) {
+                m_read_pinned_data = block_data;
+                m_read_avail = to_copy;
+            } else {
+                memcpy(m_read_data, block_data, to_copy);
+                m_read_data += to_copy;
+            }
             m_read_avail -= to_copy;
             m_read_pos += to_copy;
             m_read_buffer_pos += to_copy;
@@ -340,11 +424,14 @@ private:
     typename TheFsAccess::Client m_access_client;
     union {
         TheOpener m_fs_opener;
+        TheCreator m_fs_creator;
         TheFile m_fs_file;
         typename TheFs::template FlushRequest<> m_fs_flush;
     };
+    typename TheFs::FsEntry m_file_entry;
     State m_state;
     bool m_have_opener : 1;
+    bool m_have_creator : 1;
     bool m_have_file : 1;
     bool m_have_flush : 1;
     bool m_write_mode : 1;
@@ -354,6 +441,7 @@ private:
         struct {
             char const *m_filename;
             char const *m_basedir;
+            typename TheFs::FsEntry m_dir_entry;
         };
         union {
             struct {
@@ -367,6 +455,8 @@ private:
                 size_t m_read_pos;
                 size_t m_read_buffer_pos;
                 size_t m_read_buffer_length;
+                CacheRef *m_read_pin_ref;
+                char const *m_read_pinned_data;
             };
         };
     };
@@ -68,9 +68,10 @@ public:
 private:
     static_assert(Params::NumCacheEntries >= 1, "");
     static_assert(Params::MaxFileNameSize >= 12, "");
+    static_assert(Params::NumLookupCacheEntries >= 0 && Params::NumLookupCacheEntries <= 255, "");
     
     using TheDebugObject = DebugObject<Context, Object>;
-    APRINTER_MAKE_INSTANCE(TheBlockCache, (BlockCacheArg<Context, Object, TheBlockAccess, Params::NumCacheEntries, Params::NumIoUnits, Params::MaxIoBlocks, FsWritable>))
+    APRINTER_MAKE_INSTANCE(TheBlockCache, (BlockCacheArg<Context, Object, TheBlockAccess, Params::NumCacheEntries, Params::NumIoUnits, Params::MaxIoBlocks, FsWritable, typename Params::WriteBackDelay>))
     
     using BlockAccessUser = typename TheBlockAccess::User;
     using BlockIndexType = typename TheBlockAccess::BlockIndexType;
@@ -100,8 +101,13 @@ private:
     static ClusterIndexType const EmptyFileMarker = UINT32_C(0x00000000);
     static ClusterIndexType const NormalClusterIndexEnd = UINT32_C(0x0FFFFFF8);
     
+    static size_t const DirEntryModifyTimeOffset = 0x16;
     static size_t const DirEntrySizeOffset = 0x1C;
     
+    static int const NumLookupCacheEntries = Params::NumLookupCacheEntries;
+    static bool const EnableLookupCache = (NumLookupCacheEntries > 0);
+    static size_t const LookupCacheNameSize = MinValue((size_t)Params::MaxFileNameSize, (size_t)48);
+    
     static size_t const FsInfoSig1Offset = 0x0;
     static size_t const FsInfoSig2Offset = 0x1E4;
     static size_t const FsInfoFreeClustersOffset = 0x1E8;
@@ -124,6 +130,8 @@ private:
     
 public:
     static size_t const TheBlockSize = BlockSize;
+    using ReadaheadStats = typename TheBlockCache::ReadaheadStats;
+    using CacheStats = typename TheBlockCache::CacheStats;
     
     enum class EntryType : uint8_t {DIR_TYPE, FILE_TYPE};
     
@@ -134,9 +142,15 @@ public:
         inline EntryType getType () const { return type; }
         inline uint32_t getFileSize () const { return file_size; }
         
+        // The modification time as in the directory entry, the date in the high
+        // and the time in the low 16 bits, or 0 if unknown. Entries created or
+        // written by us have it 0, since we have no clock.
+        inline uint32_t getModifyTime () const { return modify_time; }
+        
     private:
         EntryType type;
         uint32_t file_size;
+        uint32_t modify_time;
         ClusterIndexType cluster_index;
     };
     
@@ -158,6 +172,7 @@ public:
         o->init_block_ref.requestBlock(c, get_abs_block_index(c, 0), 0, 1, CacheBlockRef::FLAG_NO_IMMEDIATE_COMPLETION);
         
         fs_writable_init(c);
+        lookup_cache_clear(c);
         
         TheDebugObject::init(c);
     }
@@ -185,11 +200,56 @@ public:
         FsEntry entry;
         entry.type = EntryType::DIR_TYPE;
         entry.file_size = 0;
+        entry.modify_time = 0;
         entry.cluster_index = o->root_cluster;
         set_fs_entry_extra(&entry, 0, 0);
         return entry;
     }
     
+    static size_t getClusterSize (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        AMBRO_ASSERT(o->state == FsState::READY)
+        
+        return (size_t)o->blocks_per_cluster * BlockSize;
+    }
+    
+    static bool hasPinnedBlocks (Context c)
+    {
+        TheDebugObject::access(c);
+        
+        return TheBlockCache::hasPinnedRefs(c);
+    }
+    
+    static ReadaheadStats getReadaheadStats (Context c)
+    {
+        TheDebugObject::access(c);
+        
+        return TheBlockCache::getReadaheadStats(c);
+    }
+    
+    static void resetReadaheadStats (Context c)
+    {
+        TheDebugObject::access(c);
+        
+        TheBlockCache::resetReadaheadStats(c);
+    }
+    
+    static CacheStats getCacheStats (Context c)
+    {
+        TheDebugObject::access(c);
+        
+        return TheBlockCache::getCacheStats(c);
+    }
+    
+    static void resetCacheStats (Context c)
+    {
+        TheDebugObject::access(c);
+        
+        TheBlockCache::resetCacheStats(c);
+    }
+    
     APRINTER_FUNCTION_IF_EXT(FsWritable, static, void, startWriteMount (Context c))
     {
         auto *o = Object::self(c);
@@ -251,7 +311,7 @@ public:
     };
     
     class Opener {
-        enum class State : uint8_t {NO_NAMES, REQUESTING_ENTRY, COMPLETED};
+        enum class State : uint8_t {EVENT, REQUESTING_ENTRY, COMPLETED};
         
     public:
         enum class OpenerStatus : uint8_t {SUCCESS, NOT_FOUND, ERROR};
@@ -273,23 +333,19 @@ public:
             find_name_component_length();
             
             if (m_path_comp_len == 0) {
-                m_state = State::NO_NAMES;
-                m_no_names_event.init(c, APRINTER_CB_OBJFUNC_T(&Opener::no_names_event_handler, this));
-                m_no_names_event.prependNowNotAlready(c);
-                m_no_names_entry = dir_entry;
-            } else {
-                m_state = State::REQUESTING_ENTRY;
-                m_dir_iter.init(c, dir_entry.cluster_index, APRINTER_CB_OBJFUNC_T(&Opener::dir_iter_handler, this));
-                m_dir_iter.requestEntry(c);
+                OpenerStatus status = (dir_entry.type == m_entry_type) ? OpenerStatus::SUCCESS : OpenerStatus::NOT_FOUND;
+                return complete_with_event(c, status, dir_entry);
             }
+            
+            look_up_component(c, dir_entry);
         }
         
         void deinit (Context c)
         {
             TheDebugObject::access(c);
             
-            if (m_state == State::NO_NAMES) {
-                m_no_names_event.deinit(c);
+            if (m_state == State::EVENT) {
+                m_event.deinit(c);
             }
             else if (m_state == State::REQUESTING_ENTRY) {
                 m_dir_iter.deinit(c);
@@ -313,19 +369,61 @@ public:
             return skipped_slashes;
         }
         
-        void no_names_event_handler (Context c)
+        void complete_with_event (Context c, OpenerStatus status, FsEntry entry)
+        {
+            m_state = State::EVENT;
+            m_event.init(c, APRINTER_CB_OBJFUNC_T(&Opener::event_handler, this));
+            m_event.prependNowNotAlready(c);
+            m_event_status = status;
+            m_event_entry = (status == OpenerStatus::SUCCESS) ? entry : FsEntry{};
+        }
+        
+        void event_handler (Context c)
         {
             TheDebugObject::access(c);
-            AMBRO_ASSERT(m_state == State::NO_NAMES)
+            AMBRO_ASSERT(m_state == State::EVENT)
             
             m_state = State::COMPLETED;
-            m_no_names_event.deinit(c);
+            m_event.deinit(c);
             
-            if (m_no_names_entry.type == m_entry_type) {
-                return m_handler(c, OpenerStatus::SUCCESS, m_no_names_entry);
-            } else {
-                return m_handler(c, OpenerStatus::NOT_FOUND, FsEntry{});
+            return m_handler(c, m_event_status, m_event_entry);
+        }
+        
+        void look_up_component (Context c, FsEntry dir_entry)
+        {
+            // Resolve what we can from the lookup cache.
+            FsEntry entry;
+            while (lookup_cache_find(c, dir_entry.cluster_index, m_path_comp, m_path_comp_len, &entry)) {
+                OpenerStatus status;
+                if (!next_component(entry, &status)) {
+                    return complete_with_event(c, status, entry);
+                }
+                dir_entry = entry;
             }
+            
+            m_state = State::REQUESTING_ENTRY;
+            m_dir_cluster = dir_entry.cluster_index;
+            m_dir_iter.init(c, dir_entry.cluster_index, APRINTER_CB_OBJFUNC_T(&Opener::dir_iter_handler, this));
+            m_dir_iter.requestEntry(c);
+        }
+        
+        // Moves past the component which was found as the given entry. Returns true if
+        // there is another component to look up in it, else false with the final status.
+        bool next_component (FsEntry entry, OpenerStatus *out_status)
+        {
+            m_path_comp += m_path_comp_len;
+            bool skipped_slashes = find_name_component_length();
+            
+            if (m_path_comp_len > 0) {
+                if (entry.type != EntryType::DIR_TYPE) {
+                    *out_status = OpenerStatus::NOT_FOUND;
+                    return false;
+                }
+                return true;
+            }
+            
+            *out_status = (entry.type == m_entry_type && !skipped_slashes) ? OpenerStatus::SUCCESS : OpenerStatus::NOT_FOUND;
+            return false;
         }
         
         void dir_iter_handler (Context c, bool is_error, char const *name, FsEntry entry)
@@ -347,25 +445,15 @@ public:
             
             m_dir_iter.deinit(c);
             
-            m_path_comp += m_path_comp_len;
-            bool skipped_slashes = find_name_component_length();
+            lookup_cache_insert(c, m_dir_cluster, m_path_comp, m_path_comp_len, entry);
             
-            if (m_path_comp_len > 0) {
-                if (entry.type != EntryType::DIR_TYPE) {
-                    m_state = State::COMPLETED;
-                    return m_handler(c, OpenerStatus::NOT_FOUND, FsEntry{});
-                }
-                m_dir_iter.init(c, entry.cluster_index, APRINTER_CB_OBJFUNC_T(&Opener::dir_iter_handler, this));
-                m_dir_iter.requestEntry(c);
-                return;
+            OpenerStatus status;
+            if (next_component(entry, &status)) {
+                return look_up_component(c, entry);
             }
             
             m_state = State::COMPLETED;
-            if (entry.type == m_entry_type && !skipped_slashes) {
-                return m_handler(c, OpenerStatus::SUCCESS, entry);
-            } else {
-                return m_handler(c, OpenerStatus::NOT_FOUND, FsEntry{});
-            }
+            return m_handler(c, status, (status == OpenerStatus::SUCCESS) ? entry : FsEntry{});
         }
         
         static bool compare_filename_equal (char const *str1, char const *str2, size_t str2_len)
@@ -380,13 +468,522 @@ public:
         OpenerHandler m_handler;
         union {
             struct {
-                typename Context::EventLoop::QueuedEvent m_no_names_event;
-                FsEntry m_no_names_entry;
+                typename Context::EventLoop::QueuedEvent m_event;
+                OpenerStatus m_event_status;
+                FsEntry m_event_entry;
+            };
+            struct {
+                DirectoryIterator m_dir_iter;
+                ClusterIndexType m_dir_cluster;
             };
-            DirectoryIterator m_dir_iter;
         };
     };
     
+    class Creator {
+        static_assert(FsWritable, "");
+        
+        enum class State : uint8_t {
+            START_EVENT, SCAN_EVENT, SCAN_NEXT_CLUSTER, SCAN_BLOCK,
+            EXTEND_DIR, CLEAR_EVENT, CLEAR_BLOCK, WRITE_EVENT, WRITE_BLOCK,
+            FILL_EVENT, FILL_BLOCK, COMPLETED
+        };
+        enum class ScanResult : uint8_t {CONTINUE, END, EXISTS};
+        
+        static size_t const LfnCharsPerEntry = 13;
+        static size_t const MaxNameLength = MinValue((size_t)Params::MaxFileNameSize, (DirEntriesPerBlock - 1) * LfnCharsPerEntry);
+        static uint8_t const MaxShortNameTail = 31;
+        
+    public:
+        enum class CreatorStatus : uint8_t {SUCCESS, EXISTS, BAD_NAME, ERROR};
+        
+        using CreatorHandler = Callback<void(Context c, CreatorStatus status, FsEntry entry)>;
+        
+        // Creates an empty file in the given directory. The name is a single path
+        // component of printable ASCII characters and must stay valid until the handler
+        // is called. If it is not a valid 8.3 name, long file name entries are written
+        // along with a generated short name. Only short names are checked for
+        // conflicts, so the caller should make sure the name does not exist yet.
+        void init (Context c, FsEntry dir_entry, char const *name, CreatorHandler handler)
+        {
+            auto *o = Object::self(c);
+            TheDebugObject::access(c);
+            AMBRO_ASSERT(o->state == FsState::READY)
+            AMBRO_ASSERT(dir_entry.type == EntryType::DIR_TYPE)
+            AMBRO_ASSERT(name)
+            
+            m_event.init(c, APRINTER_CB_OBJFUNC_T(&Creator::event_handler, this));
+            m_chain.init(c, dir_entry.cluster_index, APRINTER_CB_OBJFUNC_T(&Creator::chain_handler, this));
+            m_block_ref.init(c, APRINTER_CB_OBJFUNC_T(&Creator::block_ref_handler, this));
+            m_write_ref.init(c);
+            
+            m_handler = handler;
+            m_name = name;
+            m_state = State::START_EVENT;
+            m_event.prependNowNotAlready(c);
+        }
+        
+        void deinit (Context c)
+        {
+            TheDebugObject::access(c);
+            
+            m_write_ref.deinit(c);
+            m_block_ref.deinit(c);
+            m_chain.deinit(c);
+            m_event.deinit(c);
+        }
+        
+    private:
+        void complete_request (Context c, CreatorStatus status, FsEntry entry=FsEntry{})
+        {
+            m_state = State::COMPLETED;
+            m_block_ref.reset(c);
+            m_write_ref.release(c);
+            return m_handler(c, status, entry);
+        }
+        
+        void event_handler (Context c)
+        {
+            auto *o = Object::self(c);
+            TheDebugObject::access(c);
+            
+            switch (m_state) {
+                case State::START_EVENT: {
+                    if (!m_write_ref.take(c)) {
+                        return complete_request(c, CreatorStatus::ERROR);
+                    }
+                    if (!make_names()) {
+                        return complete_request(c, CreatorStatus::BAD_NAME);
+                    }
+                    m_tails_used = 0;
+                    m_have_slot = false;
+                    m_have_fill = false;
+                    m_block_in_cluster = o->blocks_per_cluster;
+                    m_state = State::SCAN_EVENT;
+                    m_event.prependNowNotAlready(c);
+                } break;
+                
+                case State::SCAN_EVENT: {
+                    if (m_block_in_cluster == o->blocks_per_cluster) {
+                        m_block_ref.reset(c);
+                        m_state = State::SCAN_NEXT_CLUSTER;
+                        m_chain.requestNext(c);
+                        return;
+                    }
+                    if (!is_cluster_idx_valid_for_data(c, m_chain.getCurrentCluster(c))) {
+                        return complete_request(c, CreatorStatus::ERROR);
+                    }
+                    BlockIndexType abs_block_idx = get_cluster_data_abs_block_index(c, m_chain.getCurrentCluster(c), m_block_in_cluster);
+                    if (!m_block_ref.requestBlock(c, abs_block_idx, 0, 1, 0)) {
+                        m_state = State::SCAN_BLOCK;
+                        return;
+                    }
+                    ScanResult result = scan_block(c);
+                    if (result == ScanResult::EXISTS) {
+                        return complete_request(c, CreatorStatus::EXISTS);
+                    }
+                    if (result == ScanResult::END) {
+                        return start_write(c);
+                    }
+                    m_block_in_cluster++;
+                    m_event.prependNowNotAlready(c);
+                } break;
+                
+                case State::CLEAR_EVENT: {
+                    if (m_block_in_cluster == o->blocks_per_cluster) {
+                        m_slot_block = get_cluster_data_block_index(c, m_chain.getCurrentCluster(c), 0);
+                        m_slot_offset = 0;
+                        m_have_slot = true;
+                        return start_write(c);
+                    }
+                    BlockIndexType abs_block_idx = get_cluster_data_abs_block_index(c, m_chain.getCurrentCluster(c), m_block_in_cluster);
+                    if (!m_block_ref.requestBlock(c, abs_block_idx, 0, 1, CacheBlockRef::FLAG_NO_NEED_TO_READ)) {
+                        m_state = State::CLEAR_BLOCK;
+                        return;
+                    }
+                    memset(m_block_ref.getData(c, WrapBool<true>()), 0, BlockSize);
+                    m_block_ref.markDirty(c);
+                    m_block_in_cluster++;
+                    m_event.prependNowNotAlready(c);
+                } break;
+                
+                case State::WRITE_EVENT: {
+                    if (!m_block_ref.requestBlock(c, get_abs_block_index(c, m_slot_block), 0, 1, 0)) {
+                        m_state = State::WRITE_BLOCK;
+                        return;
+                    }
+                    char *slot_ptr = m_block_ref.getData(c, WrapBool<true>()) + ((size_t)m_slot_offset * 32);
+                    
+                    // Check that the entries are still free, another creator may have taken them.
+                    for (auto i : LoopRange<size_t>(m_num_lfn_entries + 1)) {
+                        uint8_t first_byte = ReadBinaryInt<uint8_t, BinaryLittleEndian>(slot_ptr + i * 32);
+                        if (first_byte != 0 && first_byte != 0xE5) {
+                            return complete_request(c, CreatorStatus::ERROR);
+                        }
+                    }
+                    
+                    write_entries(slot_ptr);
+                    m_block_ref.markDirty(c);
+                    
+                    if (m_have_fill) {
+                        m_block_ref.reset(c);
+                        m_state = State::FILL_EVENT;
+                        m_event.prependNowNotAlready(c);
+                        return;
+                    }
+                    return complete_success(c);
+                } break;
+                
+                case State::FILL_EVENT: {
+                    if (!m_block_ref.requestBlock(c, get_abs_block_index(c, m_fill_block), 0, 1, 0)) {
+                        m_state = State::FILL_BLOCK;
+                        return;
+                    }
+                    char *block_ptr = m_block_ref.getData(c, WrapBool<true>());
+                    
+                    // Mark the free entries from the old end of the directory as deleted,
+                    // which links the new entries into the directory. Another creator
+                    // may have used some of these entries meanwhile.
+                    for (auto i : LoopRange<DirEntriesPerBlockType>(m_fill_offset, DirEntriesPerBlock)) {
+                        char *entry_ptr = block_ptr + ((size_t)i * 32);
+                        if (ReadBinaryInt<uint8_t, BinaryLittleEndian>(entry_ptr) == 0) {
+                            WriteBinaryInt<uint8_t, BinaryLittleEndian>(0xE5, entry_ptr);
+                        }
+                    }
+                    m_block_ref.markDirty(c);
+                    
+                    return complete_success(c);
+                } break;
+                
+                default: AMBRO_ASSERT(false);
+            }
+        }
+        
+        void chain_handler (Context c, bool error, bool first_cluster_changed)
+        {
+            TheDebugObject::access(c);
+            AMBRO_ASSERT(m_state == State::SCAN_NEXT_CLUSTER || m_state == State::EXTEND_DIR)
+            
+            if (error || first_cluster_changed) {
+                return complete_request(c, CreatorStatus::ERROR);
+            }
+            if (m_state == State::SCAN_NEXT_CLUSTER && m_chain.endReached(c)) {
+                if (m_have_slot) {
+                    return start_write(c);
+                }
+                // No room in the directory, extend it with a cleared cluster.
+                m_state = State::EXTEND_DIR;
+                m_chain.requestNew(c);
+                return;
+            }
+            m_block_in_cluster = 0;
+            m_state = (m_state == State::SCAN_NEXT_CLUSTER) ? State::SCAN_EVENT : State::CLEAR_EVENT;
+            m_event.prependNowNotAlready(c);
+        }
+        
+        void block_ref_handler (Context c, bool error)
+        {
+            TheDebugObject::access(c);
+            
+            State success_state;
+            switch (m_state) {
+                case State::SCAN_BLOCK:  success_state = State::SCAN_EVENT;  break;
+                case State::CLEAR_BLOCK: success_state = State::CLEAR_EVENT; break;
+                case State::WRITE_BLOCK: success_state = State::WRITE_EVENT; break;
+                case State::FILL_BLOCK:  success_state = State::FILL_EVENT;  break;
+                default: AMBRO_ASSERT(false);
+            }
+            if (error) {
+                return complete_request(c, CreatorStatus::ERROR);
+            }
+            m_state = success_state;
+            m_event.prependNowNotAlready(c);
+        }
+        
+        ScanResult scan_block (Context c)
+        {
+            char const *block_ptr = m_block_ref.getData(c, WrapBool<false>());
+            size_t num_entries = m_num_lfn_entries + 1;
+            DirEntriesPerBlockType free_start = 0;
+            DirEntriesPerBlockType free_count = 0;
+            
+            for (auto i : LoopRange<DirEntriesPerBlockType>(DirEntriesPerBlock)) {
+                char const *entry_ptr = block_ptr + ((size_t)i * 32);
+                uint8_t first_byte = ReadBinaryInt<uint8_t, BinaryLittleEndian>(entry_ptr + 0x0);
+                uint8_t attrs =      ReadBinaryInt<uint8_t, BinaryLittleEndian>(entry_ptr + 0xB);
+                
+                if (first_byte == 0) {
+                    // End of directory, the remaining entries are free.
+                    if (!m_have_slot) {
+                        if (free_count == 0) {
+                            free_start = i;
+                        }
+                        if (DirEntriesPerBlock - free_start < num_entries) {
+                            // Not enough room in this block, the entries will go to the next
+                            // block. The rest of this block is marked as deleted only after
+                            // they have been written, so that a failure leaves it unchanged.
+                            if (!m_have_fill) {
+                                m_fill_block = get_cluster_data_block_index(c, m_chain.getCurrentCluster(c), m_block_in_cluster);
+                                m_fill_offset = i;
+                                m_have_fill = true;
+                            }
+                            return ScanResult::CONTINUE;
+                        }
+                        set_slot(c, free_start);
+                    }
+                    return ScanResult::END;
+                }
+                
+                if (first_byte == 0xE5) {
+                    if (free_count == 0) {
+                        free_start = i;
+                    }
+                    free_count++;
+                    if (!m_have_slot && free_count == num_entries) {
+                        set_slot(c, free_start);
+                    }
+                    continue;
+                }
+                free_count = 0;
+                
+                // Ignore: VFAT entry or volume label.
+                if (attrs == 0xF || (attrs & 0x8)) {
+                    continue;
+                }
+                
+                if (m_num_lfn_entries == 0) {
+                    if (!memcmp(entry_ptr, m_short_name, 11)) {
+                        return ScanResult::EXISTS;
+                    }
+                } else {
+                    note_short_name_tail(entry_ptr);
+                }
+            }
+            
+            return ScanResult::CONTINUE;
+        }
+        
+        void complete_success (Context c)
+        {
+            FsEntry entry;
+            entry.type = EntryType::FILE_TYPE;
+            entry.file_size = 0;
+            entry.modify_time = 0;
+            entry.cluster_index = EmptyFileMarker;
+            set_fs_entry_extra(&entry, m_slot_block, m_slot_offset + m_num_lfn_entries);
+            return complete_request(c, CreatorStatus::SUCCESS, entry);
+        }
+        
+        void set_slot (Context c, DirEntriesPerBlockType offset)
+        {
+            m_slot_block = get_cluster_data_block_index(c, m_chain.getCurrentCluster(c), m_block_in_cluster);
+            m_slot_offset = offset;
+            m_have_slot = true;
+        }
+        
+        void start_write (Context c)
+        {
+            AMBRO_ASSERT(m_have_slot)
+            
+            if (m_num_lfn_entries > 0 && !apply_short_name_tail()) {
+                return complete_request(c, CreatorStatus::ERROR);
+            }
+            m_block_ref.reset(c);
+            m_state = State::WRITE_EVENT;
+            m_event.prependNowNotAlready(c);
+        }
+        
+        bool make_names ()
+        {
+            m_name_len = strlen(m_name);
+            if (m_name_len == 0 || m_name_len > MaxNameLength || strspn(m_name, ".") == m_name_len) {
+                return false;
+            }
+            for (auto i : LoopRange<size_t>(m_name_len)) {
+                char ch = m_name[i];
+                if ((uint8_t)ch < 0x20 || (uint8_t)ch >= 0x7F || strchr("\\/:*?\"<>|", ch)) {
+                    return false;
+                }
+            }
+            
+            char const *dot = strrchr(m_name, '.');
+            size_t base_len = dot ? (size_t)(dot - m_name) : m_name_len;
+            char const *ext = dot ? dot + 1 : m_name + m_name_len;
+            size_t ext_len = m_name_len - (ext - m_name);
+            
+            // A valid 8.3 name where each part is all upper or all lower case
+            // needs just the short entry, with the case in the flags.
+            memset(m_short_name, ' ', 11);
+            m_case_flags = 0;
+            if (base_len >= 1 && base_len <= 8 && ext_len <= 3 && (!dot || ext_len >= 1) &&
+                make_83_part(m_name, base_len, m_short_name, 0x8) && make_83_part(ext, ext_len, m_short_name + 8, 0x10))
+            {
+                m_num_lfn_entries = 0;
+                return true;
+            }
+            
+            // Otherwise the short name is derived from the long name, and a numeric
+            // tail is added when we know which ones are in use.
+            memset(m_short_name, ' ', 11);
+            m_case_flags = 0;
+            m_num_lfn_entries = (m_name_len + (LfnCharsPerEntry - 1)) / LfnCharsPerEntry;
+            m_basis_length = make_basis_part(m_name, base_len, m_short_name, 8);
+            make_basis_part(ext, ext_len, m_short_name + 8, 3);
+            if (m_basis_length == 0) {
+                m_short_name[0] = '_';
+                m_basis_length = 1;
+            }
+            return true;
+        }
+        
+        bool make_83_part (char const *src, size_t len, char *dst, uint8_t lower_case_flag)
+        {
+            bool have_upper = false;
+            bool have_lower = false;
+            for (auto i : LoopRange<size_t>(len)) {
+                char ch = src[i];
+                if (!is_short_name_char(ch)) {
+                    return false;
+                }
+                if (ch >= 'a' && ch <= 'z') {
+                    have_lower = true;
+                    ch -= 32;
+                } else if (ch >= 'A' && ch <= 'Z') {
+                    have_upper = true;
+                }
+                dst[i] = ch;
+            }
+            if (have_lower && have_upper) {
+                return false;
+            }
+            if (have_lower) {
+                m_case_flags |= lower_case_flag;
+            }
+            return true;
+        }
+        
+        static uint8_t make_basis_part (char const *src, size_t len, char *dst, uint8_t max_len)
+        {
+            uint8_t out_len = 0;
+            for (auto i : LoopRange<size_t>(len)) {
+                if (out_len == max_len) {
+                    break;
+                }
+                char ch = src[i];
+                if (ch == ' ' || ch == '.') {
+                    continue;
+                }
+                if (ch >= 'a' && ch <= 'z') {
+                    ch -= 32;
+                } else if (!is_short_name_char(ch)) {
+                    ch = '_';
+                }
+                dst[out_len++] = ch;
+            }
+            return out_len;
+        }
+        
+        static bool is_short_name_char (char ch)
+        {
+            return (ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9') || (ch != '\0' && strchr("!#$%&'()-@^_`{}~", ch));
+        }
+        
+        uint8_t short_name_tail_pos (uint8_t tail)
+        {
+            return MinValue(m_basis_length, (uint8_t)(tail < 10 ? 6 : 5));
+        }
+        
+        void note_short_name_tail (char const *entry_ptr)
+        {
+            if (memcmp(entry_ptr + 8, m_short_name + 8, 3)) {
+                return;
+            }
+            char const *tilde = (char const *)memchr(entry_ptr, '~', 8);
+            if (!tilde) {
+                return;
+            }
+            uint8_t pos = tilde - entry_ptr;
+            uint8_t tail = 0;
+            for (auto i : LoopRange<uint8_t>(pos + 1, 8)) {
+                char ch = entry_ptr[i];
+                if (ch == ' ') {
+                    break;
+                }
+                if (ch < '0' || ch > '9' || tail > MaxShortNameTail) {
+                    return;
+                }
+                tail = 10 * tail + (ch - '0');
+            }
+            if (tail >= 1 && tail <= MaxShortNameTail && pos == short_name_tail_pos(tail) && !memcmp(entry_ptr, m_short_name, pos)) {
+                m_tails_used |= (uint32_t)1 << tail;
+            }
+        }
+        
+        bool apply_short_name_tail ()
+        {
+            uint8_t tail = 1;
+            while (m_tails_used & ((uint32_t)1 << tail)) {
+                if (tail == MaxShortNameTail) {
+                    return false;
+                }
+                tail++;
+            }
+            char *ptr = m_short_name + short_name_tail_pos(tail);
+            *ptr++ = '~';
+            if (tail >= 10) {
+                *ptr++ = '0' + (tail / 10);
+            }
+            *ptr++ = '0' + (tail % 10);
+            return true;
+        }
+        
+        void write_entries (char *slot_ptr)
+        {
+            uint8_t checksum = vfat_checksum(m_short_name);
+            
+            for (auto k : LoopRange<uint8_t>(m_num_lfn_entries)) {
+                uint8_t seq = m_num_lfn_entries - k;
+                char *entry_ptr = slot_ptr + ((size_t)k * 32);
+                memset(entry_ptr, 0, 32);
+                WriteBinaryInt<uint8_t, BinaryLittleEndian>(seq | (k == 0 ? 0x40 : 0), entry_ptr + 0x0);
+                WriteBinaryInt<uint8_t, BinaryLittleEndian>(0xF, entry_ptr + 0xB);
+                WriteBinaryInt<uint8_t, BinaryLittleEndian>(checksum, entry_ptr + 0xD);
+                for (auto j : LoopRange<size_t>(LfnCharsPerEntry)) {
+                    size_t pos = (seq - 1) * LfnCharsPerEntry + j;
+                    uint16_t ch = (pos < m_name_len) ? (uint8_t)m_name[pos] : (pos == m_name_len) ? 0 : UINT16_C(0xFFFF);
+                    size_t offset = (j < 5) ? (0x1 + 2 * j) : (j < 11) ? (0xE + 2 * (j - 5)) : (0x1C + 2 * (j - 11));
+                    WriteBinaryInt<uint16_t, BinaryLittleEndian>(ch, entry_ptr + offset);
+                }
+            }
+            
+            char *entry_ptr = slot_ptr + ((size_t)m_num_lfn_entries * 32);
+            memset(entry_ptr, 0, 32);
+            memcpy(entry_ptr, m_short_name, 11);
+            WriteBinaryInt<uint8_t, BinaryLittleEndian>(0x20, entry_ptr + 0xB);
+            WriteBinaryInt<uint8_t, BinaryLittleEndian>(m_case_flags, entry_ptr + 0xC);
+        }
+        
+        typename Context::EventLoop::QueuedEvent m_event;
+        ClusterChain<true> m_chain;
+        CacheBlockRef m_block_ref;
+        WriteReference<true> m_write_ref;
+        CreatorHandler m_handler;
+        char const *m_name;
+        size_t m_name_len;
+        BlockIndexType m_slot_block;
+        BlockIndexType m_fill_block;
+        uint32_t m_tails_used;
+        ClusterBlockIndexType m_block_in_cluster;
+        DirEntriesPerBlockType m_slot_offset;
+        DirEntriesPerBlockType m_fill_offset;
+        State m_state;
+        bool m_have_slot;
+        bool m_have_fill;
+        uint8_t m_num_lfn_entries;
+        uint8_t m_basis_length;
+        uint8_t m_case_flags;
+        char m_short_name[11];
+    };
+    
     APRINTER_STRUCT_IF_TEMPLATE(FileWritableMembers) {
         DirEntryRef<true> m_dir_entry;
         size_t m_write_bytes_in_block;
@@ -394,10 +991,12 @@ public:
         DirEntriesPerBlockType m_dir_entry_block_offset;
         bool m_no_need_to_read_for_write;
         WriteReference<true> m_write_ref;
+        uint32_t m_expected_size;
+        ClusterIndexType m_alloc_length;
     };
     
     APRINTER_STRUCT_IF_TEMPLATE(FileHintingMembers) {
-        BlockIndexType m_hint_block_pos;
+        typename TheBlockCache::Readahead m_readahead;
     };
     
     template <bool Writable>
@@ -442,6 +1041,7 @@ public:
             m_block_in_cluster = o->blocks_per_cluster;
             
             writable_init(c, file_entry);
+            hinting_init(c);
         }
         
         // NOTE: Not allowed when reader is busy, except when deiniting the whole FatFs and underlying storage!
@@ -449,6 +1049,7 @@ public:
         {
             TheDebugObject::access(c);
             
+            hinting_deinit(c);
             writable_deinit(c);
             
             if (m_io_mode == IoMode::USER_BUFFER) {
@@ -470,15 +1071,21 @@ public:
             m_chain.rewind(c);
             m_file_pos = 0;
             m_block_in_cluster = o->blocks_per_cluster;
+            hinting_reset(c);
         }
         
-        void startReadUserBuf (Context c, DataWordType *buf)
+        // Reads up to max_blocks blocks directly into buf, bypassing the cache.
+        // Fewer blocks may be read; the handler reports the number of bytes, which
+        // is a multiple of BlockSize except at the end of the file.
+        void startReadUserBuf (Context c, DataWordType *buf, size_t max_blocks=1)
         {
             TheDebugObject::access(c);
             AMBRO_ASSERT(m_state == State::IDLE)
             AMBRO_ASSERT(m_io_mode == IoMode::USER_BUFFER)
+            AMBRO_ASSERT(max_blocks >= 1)
             
-            m_user_buffer_mode.transfer_desc = TransferDescriptor<DataWordType>{buf, BlockSize/sizeof(DataWordType)};
+            m_user_buffer_mode.transfer_desc = TransferDescriptor<DataWordType>{buf, 0};
+            m_user_buffer_mode.max_blocks = max_blocks;
             m_state = State::READ_EVENT;
             m_event.prependNowNotAlready(c);
         }
@@ -502,6 +1109,18 @@ public:
             return m_fs_buffer_mode.block_ref.getData(c, WrapBool<false>());
         }
         
+        // Pins the block available for reading into the given reference, so that
+        // the data from getReadPointer() remains valid also after finishRead(),
+        // until the reference is reset. See BlockCache::CacheRef::pinFrom().
+        bool pinReadBlock (Context c, CacheBlockRef *ref)
+        {
+            TheDebugObject::access(c);
+            AMBRO_ASSERT(m_state == State::READ_READY)
+            AMBRO_ASSERT(m_io_mode == IoMode::FS_BUFFER)
+            
+            return ref->pinFrom(c, &m_fs_buffer_mode.block_ref);
+        }
+        
         void finishRead (Context c)
         {
             TheDebugObject::access(c);
@@ -509,7 +1128,7 @@ public:
             AMBRO_ASSERT(m_io_mode == IoMode::FS_BUFFER)
             
             finish_read(c, get_bytes_in_block(c));
-            m_fs_buffer_mode.block_ref.reset(c);
+            m_fs_buffer_mode.block_ref.resetNoReuse(c);
             m_state = State::IDLE;
         }
         
@@ -577,6 +1196,17 @@ public:
             m_event.prependNowNotAlready(c);
         }
         
+        // Tells how large the file is expected to become, so that when writing needs
+        // new clusters, enough are allocated at once as a contiguous run. Without this,
+        // the runs double in length as the file grows. Clusters which end up unused
+        // are released by startTruncate().
+        APRINTER_FUNCTION_IF(Writable, void, setExpectedSize (Context c, uint32_t size))
+        {
+            TheDebugObject::access(c);
+            
+            this->m_expected_size = size;
+        }
+        
     private:
         APRINTER_FUNCTION_IF_OR_EMPTY(Writable, void, writable_init (Context c, FsEntry file_entry))
         {
@@ -585,6 +1215,8 @@ public:
             
             this->m_dir_entry_block_index = file_entry.dir_entry_block_index;
             this->m_dir_entry_block_offset = file_entry.dir_entry_block_offset;
+            this->m_expected_size = 0;
+            this->m_alloc_length = 1;
         }
         
         APRINTER_FUNCTION_IF_OR_EMPTY(Writable, void, writable_deinit (Context c))
@@ -593,6 +1225,21 @@ public:
             this->m_dir_entry.deinit(c);
         }
         
+        APRINTER_FUNCTION_IF_OR_EMPTY(EnableReadHinting, void, hinting_init (Context c))
+        {
+            this->m_readahead.init(c);
+        }
+        
+        APRINTER_FUNCTION_IF_OR_EMPTY(EnableReadHinting, void, hinting_reset (Context c))
+        {
+            this->m_readahead.reset(c);
+        }
+        
+        APRINTER_FUNCTION_IF_OR_EMPTY(EnableReadHinting, void, hinting_deinit (Context c))
+        {
+            this->m_readahead.deinit(c);
+        }
+        
         APRINTER_FUNCTION_IF_OR_EMPTY(Writable, void, handle_event_openwr (Context c))
         {
             if (!this->m_write_ref.take(c)) {
@@ -619,27 +1266,61 @@ public:
             m_state = State::READ_BLOCK;
             BlockIndexType abs_block_idx = get_cluster_data_abs_block_index(c, m_chain.getCurrentCluster(c), m_block_in_cluster);
             if (m_io_mode == IoMode::USER_BUFFER) {
-                m_user_buffer_mode.block_user.startReadOrWrite(c, false, abs_block_idx, 1, TransferVector<DataWordType>{&m_user_buffer_mode.transfer_desc, 1});
+                start_read_user_buf(c, abs_block_idx);
             } else {
+                BlockIndexType hint_length = readahead_access(c, abs_block_idx);
                 m_fs_buffer_mode.block_ref.requestBlock(c, abs_block_idx, 0, 1, CacheBlockRef::FLAG_NO_IMMEDIATE_COMPLETION);
-                do_read_hinting(c, abs_block_idx);
+                if (hint_length > 0) {
+                    do_read_hinting(c, abs_block_idx, hint_length);
+                }
             }
         }
         
-        APRINTER_FUNCTION_IF_OR_EMPTY(EnableReadHinting, void, do_read_hinting (Context c, BlockIndexType abs_block_idx))
+        void start_read_user_buf (Context c, BlockIndexType abs_block_idx)
         {
             auto *o = Object::self(c);
             
-            if (m_block_in_cluster == 0 || abs_block_idx >= this->m_hint_block_pos) {
-                BlockIndexType cluster_start_block = abs_block_idx - m_block_in_cluster;
-                BlockIndexType cluster_end_block = cluster_start_block + o->blocks_per_cluster;
-                if (m_block_in_cluster == 0) {
-                    this->m_hint_block_pos = cluster_start_block + 1;
-                }
-                if (m_block_in_cluster == 0 || abs_block_idx >= this->m_hint_block_pos) {
-                    this->m_hint_block_pos = TheBlockCache::hintBlocks(c, this->m_hint_block_pos, this->m_hint_block_pos, cluster_end_block, 0, 1);
-                }
+            // The cache may have newer data than the device, so take the block from there.
+            char const *cached_data = TheBlockCache::peekBlock(c, abs_block_idx);
+            if (cached_data) {
+                size_t bytes_in_block = get_bytes_in_block(c);
+                memcpy(m_user_buffer_mode.transfer_desc.buffer_ptr, cached_data, bytes_in_block);
+                finish_read(c, bytes_in_block);
+                return complete_request(c, false, bytes_in_block);
+            }
+            
+            // Read as many blocks as we can with one command, up to the end of the
+            // cluster or file, stopping before any block which is in the cache.
+            size_t blocks_in_cluster = o->blocks_per_cluster - m_block_in_cluster;
+            size_t blocks_in_file = (m_file_size - m_file_pos - 1) / BlockSize + 1;
+            size_t max_blocks = MinValue(MinValue(m_user_buffer_mode.max_blocks, (size_t)TheBlockAccess::MaxIoBlocks), MinValue(blocks_in_cluster, blocks_in_file));
+            size_t num_blocks = 1;
+            while (num_blocks < max_blocks && !TheBlockCache::peekBlock(c, abs_block_idx + num_blocks)) {
+                num_blocks++;
+            }
+            
+            m_user_buffer_mode.transfer_desc.num_words = num_blocks * (BlockSize / sizeof(DataWordType));
+            m_user_buffer_mode.block_user.startReadOrWrite(c, false, abs_block_idx, num_blocks, TransferVector<DataWordType>{&m_user_buffer_mode.transfer_desc, 1});
+        }
+        
+        APRINTER_FUNCTION_IF_ELSE(EnableReadHinting, BlockIndexType, readahead_access (Context c, BlockIndexType abs_block_idx), {
+            return this->m_readahead.access(c, m_file_pos / BlockSize, abs_block_idx);
+        }, {
+            return 0;
+        })
+        
+        APRINTER_FUNCTION_IF_OR_EMPTY(EnableReadHinting, void, do_read_hinting (Context c, BlockIndexType abs_block_idx, BlockIndexType hint_length))
+        {
+            auto *o = Object::self(c);
+            
+            // Don't hint past the end of the file.
+            BlockIndexType blocks_after = (m_file_size - m_file_pos - 1) / BlockSize;
+            if (hint_length > blocks_after) {
+                hint_length = blocks_after;
             }
+            
+            BlockIndexType cluster_blocks = o->blocks_per_cluster - (m_block_in_cluster + 1);
+            hint_cluster_chain(c, &this->m_readahead, m_chain.getCurrentCluster(c), abs_block_idx + 1, cluster_blocks, hint_length);
         }
         
         APRINTER_FUNCTION_IF_OR_EMPTY(Writable, void, handle_event_write (Context c))
@@ -711,7 +1392,7 @@ public:
                 return complete_request(c, true);
             }
             if (m_chain.endReached(c)) {
-                m_chain.requestNew(c);
+                m_chain.requestNew(c, get_alloc_length(c));
                 return;
             }
             m_block_in_cluster = 0;
@@ -719,17 +1400,35 @@ public:
             m_event.prependNowNotAlready(c);
         }
         
+        APRINTER_FUNCTION_IF(Writable, ClusterIndexType, get_alloc_length (Context c))
+        {
+            auto *o = Object::self(c);
+            
+            ClusterIndexType length;
+            if (this->m_expected_size > m_file_pos) {
+                uint32_t cluster_size = (uint32_t)o->blocks_per_cluster * BlockSize;
+                length = (this->m_expected_size - m_file_pos - 1) / cluster_size + 1;
+            } else {
+                length = this->m_alloc_length;
+                this->m_alloc_length = MinValue((ClusterIndexType)(2 * length), (ClusterIndexType)FatEntriesPerBlock);
+            }
+            return MinValue(length, (ClusterIndexType)FatEntriesPerBlock);
+        }
+        
         void handle_block_read (Context c, bool error)
         {
             if (error) {
                 return complete_request(c, true);
             }
-            size_t bytes_in_block = get_bytes_in_block(c);
-            AMBRO_ASSERT(bytes_in_block > 0)
             if (m_io_mode == IoMode::USER_BUFFER) {
-                finish_read(c, bytes_in_block);
-                return complete_request(c, false, bytes_in_block);
+                size_t num_blocks = m_user_buffer_mode.transfer_desc.num_words / (BlockSize / sizeof(DataWordType));
+                size_t length = MinValue((uint32_t)(num_blocks * BlockSize), (uint32_t)(m_file_size - m_file_pos));
+                AMBRO_ASSERT(length > 0)
+                finish_read(c, length, num_blocks);
+                return complete_request(c, false, length);
             } else {
+                size_t bytes_in_block = get_bytes_in_block(c);
+                AMBRO_ASSERT(bytes_in_block > 0)
                 return complete_request(c, false, bytes_in_block, State::READ_READY);
             }
         }
@@ -839,6 +1538,10 @@ public:
             if (this->m_dir_entry.getFileSize(c) != m_file_size) {
                 return complete_open_writable_request(c, true);
             }
+            
+            // The file may be changed now, and we cannot tell the time.
+            this->m_dir_entry.clearModifyTime(c);
+            
             return complete_open_writable_request(c, false);
         }
         
@@ -847,10 +1550,10 @@ public:
             return MinValue((uint32_t)BlockSize, (uint32_t)(m_file_size - m_file_pos));
         }
         
-        void finish_read (Context c, size_t bytes_in_block)
+        void finish_read (Context c, size_t bytes, size_t num_blocks=1)
         {
-            m_file_pos += bytes_in_block;
-            m_block_in_cluster++;
+            m_file_pos += bytes;
+            m_block_in_cluster += num_blocks;
         }
         
         APRINTER_FUNCTION_IF(Writable, void, finish_write (Context c, size_t bytes_in_block))
@@ -875,6 +1578,7 @@ public:
             struct {
                 BlockAccessUser block_user;
                 TransferDescriptor<DataWordType> transfer_desc;
+                size_t max_blocks;
             } m_user_buffer_mode;
             struct {
                 CacheBlockRef block_ref;
@@ -1167,6 +1871,149 @@ private:
         o->flush_request.requestFlush(c);
     }
     
+    APRINTER_FUNCTION_IF_EXT(EnableReadHinting, static, void, hint_cluster_chain (Context c, typename TheBlockCache::Readahead *readahead, ClusterIndexType cluster, BlockIndexType start_block, BlockIndexType cluster_blocks, BlockIndexType hint_length))
+    {
+        auto *o = Object::self(c);
+        
+        // Map the blocks starting at start_block to extents, first in the current cluster
+        // and then following the cluster chain as far as the FAT is in the cache.
+        // Physically adjacent clusters are merged into a single extent.
+        typename TheBlockCache::HintExtent extents[TheBlockCache::MaxHintExtents];
+        uint8_t num_extents = 0;
+        BlockIndexType stream_length = 0;
+        
+        while (true) {
+            BlockIndexType length = MinValue(cluster_blocks, (BlockIndexType)(hint_length - stream_length));
+            if (length > 0) {
+                if (num_extents > 0 && extents[num_extents - 1].end_block == start_block) {
+                    extents[num_extents - 1].end_block += length;
+                } else {
+                    extents[num_extents++] = typename TheBlockCache::HintExtent{start_block, start_block + length, 0, 1};
+                }
+                stream_length += length;
+            }
+            if (stream_length == hint_length || !is_cluster_idx_valid_for_fat(c, cluster)) {
+                break;
+            }
+            
+            BlockIndexType fat_block = get_abs_block_index_for_fat_entry(c, cluster);
+            char const *fat_data = TheBlockCache::peekBlock(c, fat_block);
+            if (!fat_data) {
+                // Have the FAT block read too, so the chain can be followed next time.
+                if (num_extents < TheBlockCache::MaxHintExtents) {
+                    BlockIndexType num_blocks_per_fat = o->num_fat_entries / FatEntriesPerBlock;
+                    extents[num_extents++] = typename TheBlockCache::HintExtent{fat_block, fat_block + 1, num_blocks_per_fat, o->num_fats};
+                }
+                break;
+            }
+            
+            cluster = mask_cluster_entry(ReadBinaryInt<uint32_t, BinaryLittleEndian>(fat_data + (size_t)4 * (cluster % FatEntriesPerBlock)));
+            if (!is_cluster_idx_normal(cluster) || !is_cluster_idx_valid_for_data(c, cluster)) {
+                break;
+            }
+            
+            start_block = get_cluster_data_abs_block_index(c, cluster, 0);
+            cluster_blocks = o->blocks_per_cluster;
+            if (num_extents == TheBlockCache::MaxHintExtents && extents[num_extents - 1].end_block != start_block) {
+                break;
+            }
+        }
+        
+        readahead->hint(c, extents, num_extents, stream_length);
+    }
+    
+    // The lookup cache remembers recently found directory entries by parent
+    // directory and name, so that repeated opens of the same paths don't scan
+    // directories. It is emptied whenever something takes a write reference
+    // and is not used while any is held, so it never sees stale entries.
+    APRINTER_FUNCTION_IF_OR_EMPTY_EXT(EnableLookupCache, static, void, lookup_cache_clear (Context c))
+    {
+        auto *o = Object::self(c);
+        
+        for (LookupCacheEntry &cache_entry : o->lookup_cache) {
+            cache_entry.dir_cluster = 0;
+        }
+        o->lookup_cache_next = 0;
+    }
+    
+    APRINTER_FUNCTION_IF_EXT(EnableLookupCache, static, bool, lookup_cache_find (Context c, ClusterIndexType dir_cluster, char const *name, size_t name_len, FsEntry *out_entry))
+    {
+        auto *o = Object::self(c);
+        
+        if (name_len > LookupCacheNameSize || !lookup_cache_usable(c)) {
+            return false;
+        }
+        
+        uint16_t name_hash = lookup_cache_hash(name, name_len);
+        for (LookupCacheEntry const &cache_entry : o->lookup_cache) {
+            if (cache_entry.dir_cluster == dir_cluster && cache_entry.name_hash == name_hash &&
+                cache_entry.name_len == name_len && lookup_cache_name_equal(cache_entry.name, name, name_len))
+            {
+                *out_entry = cache_entry.entry;
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    APRINTER_FUNCTION_IF_EXT(!EnableLookupCache, static, bool, lookup_cache_find (Context c, ClusterIndexType dir_cluster, char const *name, size_t name_len, FsEntry *out_entry))
+    {
+        return false;
+    }
+    
+    APRINTER_FUNCTION_IF_OR_EMPTY_EXT(EnableLookupCache, static, void, lookup_cache_insert (Context c, ClusterIndexType dir_cluster, char const *name, size_t name_len, FsEntry entry))
+    {
+        auto *o = Object::self(c);
+        
+        if (name_len > LookupCacheNameSize || !lookup_cache_usable(c)) {
+            return;
+        }
+        
+        LookupCacheEntry *cache_entry = &o->lookup_cache[o->lookup_cache_next];
+        o->lookup_cache_next = (o->lookup_cache_next + 1) % NumLookupCacheEntries;
+        
+        cache_entry->dir_cluster = dir_cluster;
+        cache_entry->name_hash = lookup_cache_hash(name, name_len);
+        cache_entry->name_len = name_len;
+        memcpy(cache_entry->name, name, name_len);
+        cache_entry->entry = entry;
+    }
+    
+    APRINTER_FUNCTION_IF_ELSE_EXT(FsWritable, static, bool, lookup_cache_usable (Context c), {
+        return Object::self(c)->num_write_references == 0;
+    }, {
+        return true;
+    })
+    
+    static uint16_t lookup_cache_hash (char const *name, size_t name_len)
+    {
+        uint16_t hash = 0;
+        for (auto i : LoopRange<size_t>(name_len)) {
+            char ch = Params::CaseInsens ? AsciiToLower(name[i]) : name[i];
+            hash = (uint16_t)(31 * hash) + (uint8_t)ch;
+        }
+        return hash;
+    }
+    
+    static bool lookup_cache_name_equal (char const *name1, char const *name2, size_t name_len)
+    {
+        for (auto i : LoopRange<size_t>(name_len)) {
+            if (Params::CaseInsens ? (AsciiToLower(name1[i]) != AsciiToLower(name2[i])) : (name1[i] != name2[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    static uint8_t vfat_checksum (char const *data)
+    {
+        uint8_t csum = 0;
+        for (auto i : LoopRange<int>(11)) {
+            csum = (uint8_t)((uint8_t)((csum & 1) << 7) + (csum >> 1)) + (uint8_t)data[i];
+        }
+        return csum;
+    }
+    
     static ClusterIndexType mask_cluster_entry (uint32_t entry_value)
     {
         return (entry_value & UINT32_C(0x0FFFFFFF));
@@ -1411,8 +2258,23 @@ private:
             
             ClusterIndexType fat_value = read_fat_entry_in_cache_block(c, &o->write_block_ref, current_cluster);
             if (fat_value == FreeClusterMarker) {
-                update_fat_entry_in_cache_block(c, &o->write_block_ref, current_cluster, EndOfChainMarker);
+                // Take as many of the following clusters as requested while they are free
+                // and their FAT entries are in this same FAT block, linking them into a chain.
+                ClusterIndexType max_length = o->allocating_chains_list.first()->m_alloc_max_length;
+                ClusterIndexType last_cluster = current_cluster;
                 update_fs_info_free_clusters(c, false);
+                while (last_cluster - current_cluster + 1 < max_length && o->alloc_position != 0 && (last_cluster + 1) % FatEntriesPerBlock != 0 &&
+                       read_fat_entry_in_cache_block(c, &o->write_block_ref, last_cluster + 1) == FreeClusterMarker)
+                {
+                    update_fat_entry_in_cache_block(c, &o->write_block_ref, last_cluster, last_cluster + 1);
+                    update_fs_info_free_clusters(c, false);
+                    last_cluster++;
+                    o->alloc_position++;
+                    if (o->alloc_position == o->num_valid_clusters) {
+                        o->alloc_position = 0;
+                    }
+                }
+                update_fat_entry_in_cache_block(c, &o->write_block_ref, last_cluster, EndOfChainMarker);
                 update_fs_info_allocated_cluster(c);
                 return complete_allocation(c, false, current_cluster);
             }
@@ -1445,6 +2307,7 @@ private:
         CacheBlockRef m_fat_cache_ref2;
         DoubleEndedListNode<ClusterChain<true>> m_allocating_chains_node;
         ClusterIndexType m_prev_cluster;
+        ClusterIndexType m_alloc_max_length;
     };
     
     template <bool Writable>
@@ -1513,13 +2376,18 @@ private:
             return m_current_cluster;
         }
         
-        APRINTER_FUNCTION_IF(Writable, void, requestNew (Context c))
+        // Appends a new cluster to the chain and moves to it. Up to max_length
+        // clusters may be allocated as a contiguous run; the ones after the first
+        // are reached with requestNext() and released by startTruncate().
+        APRINTER_FUNCTION_IF(Writable, void, requestNew (Context c, ClusterIndexType max_length=1))
         {
             auto *o = Object::self(c);
             AMBRO_ASSERT(o->write_mount_state == WriteMountState::MOUNTED)
             AMBRO_ASSERT(m_state == State::IDLE)
             AMBRO_ASSERT(m_iter_state == IterState::END)
+            AMBRO_ASSERT(max_length >= 1)
             
+            this->m_alloc_max_length = max_length;
             m_state = State::NEW_CHECK;
             m_event.prependNowNotAlready(c);
         }
@@ -1790,6 +2658,16 @@ private:
             m_block_ref.markDirty(c);
         }
         
+        void clearModifyTime (Context c)
+        {
+            AMBRO_ASSERT(m_state == State::READY)
+            
+            if (ReadBinaryInt<uint32_t, BinaryLittleEndian>(get_entry_ptr<false>(c) + DirEntryModifyTimeOffset) != 0) {
+                WriteBinaryInt<uint32_t, BinaryLittleEndian>(0, get_entry_ptr<true>(c) + DirEntryModifyTimeOffset);
+                m_block_ref.markDirty(c);
+            }
+        }
+        
     private:
         void block_ref_handler (Context c, bool error)
         {
@@ -1812,7 +2690,12 @@ private:
         DirEntriesPerBlockType m_block_offset;
     };
     
-    class DirectoryIterator {
+    APRINTER_STRUCT_IF_TEMPLATE(DirectoryIteratorHintingMembers) {
+        typename TheBlockCache::Readahead m_readahead;
+        BlockIndexType m_dir_block_pos;
+    };
+    
+    class DirectoryIterator : public DirectoryIteratorHintingMembers<EnableReadHinting> {
         enum class State : uint8_t {WAIT_REQUEST, CHECK_NEXT_EVENT, REQUESTING_CLUSTER, REQUESTING_BLOCK};
         
     public:
@@ -1831,10 +2714,12 @@ private:
             m_block_in_cluster = o->blocks_per_cluster;
             m_block_entry_pos = DirEntriesPerBlock;
             m_vfat_seq = -1;
+            hinting_init(c);
         }
         
         void deinit (Context c)
         {
+            hinting_deinit(c);
             m_dir_block_ref.deinit(c);
             m_chain.deinit(c);
             m_event.deinit(c);
@@ -1854,6 +2739,31 @@ private:
             return m_handler(c, error, name, entry);
         }
         
+        APRINTER_FUNCTION_IF_OR_EMPTY(EnableReadHinting, void, hinting_init (Context c))
+        {
+            this->m_readahead.init(c);
+            this->m_dir_block_pos = 0;
+        }
+        
+        APRINTER_FUNCTION_IF_OR_EMPTY(EnableReadHinting, void, hinting_deinit (Context c))
+        {
+            this->m_readahead.deinit(c);
+        }
+        
+        // Directory blocks are read in order, so long listings and lookups
+        // can get the following blocks in multi-block reads.
+        APRINTER_FUNCTION_IF_OR_EMPTY(EnableReadHinting, void, do_read_hinting (Context c, BlockIndexType abs_block_idx))
+        {
+            auto *o = Object::self(c);
+            
+            BlockIndexType hint_length = this->m_readahead.access(c, this->m_dir_block_pos, abs_block_idx);
+            this->m_dir_block_pos++;
+            if (hint_length > 0) {
+                BlockIndexType cluster_blocks = o->blocks_per_cluster - (m_block_in_cluster + 1);
+                hint_cluster_chain(c, &this->m_readahead, m_chain.getCurrentCluster(c), abs_block_idx + 1, cluster_blocks, hint_length);
+            }
+        }
+        
         void schedule_event (Context c)
         {
             m_state = State::CHECK_NEXT_EVENT;
@@ -1884,6 +2794,8 @@ private:
                     return;
                 }
                 
+                do_read_hinting(c, abs_block_idx);
+                
                 m_block_in_cluster++;
                 m_block_entry_pos = 0;
             }
@@ -1999,6 +2911,7 @@ private:
             FsEntry entry;
             entry.type = is_dir ? EntryType::DIR_TYPE : EntryType::FILE_TYPE;
             entry.file_size = file_size;
+            entry.modify_time = ReadBinaryInt<uint32_t, BinaryLittleEndian>(entry_ptr + DirEntryModifyTimeOffset);
             entry.cluster_index = first_cluster;
             set_fs_entry_extra(&entry,
                 get_cluster_data_block_index(c, m_chain.getCurrentCluster(c), m_block_in_cluster - 1),
@@ -2030,15 +2943,6 @@ private:
             schedule_event(c);
         }
         
-        static uint8_t vfat_checksum (char const *data)
-        {
-            uint8_t csum = 0;
-            for (auto i : LoopRange<int>(11)) {
-                csum = (uint8_t)((uint8_t)((csum & 1) << 7) + (csum >> 1)) + (uint8_t)data[i];
-            }
-            return csum;
-        }
-        
         static size_t fixup_83_name (char *data, size_t length, bool lowercase)
         {
             while (length > 0 && data[length - 1] == ' ') {
@@ -2096,6 +3000,7 @@ private:
                 }
                 o->num_write_references++;
                 m_taken = true;
+                lookup_cache_clear(c);
             }
             return true;
         }
@@ -2128,11 +3033,24 @@ private:
         size_t num_write_references;
     };
     
+    struct LookupCacheEntry {
+        ClusterIndexType dir_cluster;
+        uint16_t name_hash;
+        uint8_t name_len;
+        char name[LookupCacheNameSize];
+        FsEntry entry;
+    };
+    
+    APRINTER_STRUCT_IF_TEMPLATE(LookupCacheMembers) {
+        LookupCacheEntry lookup_cache[NumLookupCacheEntries];
+        uint8_t lookup_cache_next;
+    };
+    
 public:
     struct Object : public ObjBase<FatFs, ParentObject, MakeTypeList<
         TheDebugObject,
         TheBlockCache
-    >>, public FsWritableMembers<FsWritable> {
+    >>, public FsWritableMembers<FsWritable>, public LookupCacheMembers<EnableLookupCache> {
         BlockRange<BlockIndexType> block_range;
         FsState state;
         union {
@@ -2156,7 +3074,9 @@ APRINTER_ALIAS_STRUCT_EXT(FatFsService, (
     APRINTER_AS_VALUE(int, MaxIoBlocks),
     APRINTER_AS_VALUE(bool, CaseInsens),
     APRINTER_AS_VALUE(bool, Writable),
-    APRINTER_AS_VALUE(bool, EnableReadHinting)
+    APRINTER_AS_VALUE(bool, EnableReadHinting),
+    APRINTER_AS_VALUE(int, NumLookupCacheEntries),
+    APRINTER_AS_TYPE(WriteBackDelay)
 ), (
     APRINTER_ALIAS_STRUCT_EXT(Fs, (
         APRINTER_AS_TYPE(Context),
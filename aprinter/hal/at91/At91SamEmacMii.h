@@ -70,7 +70,7 @@ private:
     
     static int const RxFrameOffset = 2;
     
-    using FastEvent = typename Context::EventLoop::template FastEventSpec<At91SamEmacMii>;
+    using FastEvent = typename Context::EventLoop::template FastEventSpec<At91SamEmacMii, Context::EventLoop::FastPriority::Low>;
     
 public:
     static uint8_t const SupportedSpeeds = MiiSpeed::SPEED_10M_HD|MiiSpeed::SPEED_10M_FD|MiiSpeed::SPEED_100M_HD|MiiSpeed::SPEED_100M_FD;
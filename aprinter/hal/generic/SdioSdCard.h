@@ -188,6 +188,20 @@ public:
         TheSdio::startCommand(c, SdioIface::CommandParams{cmd, addr, SdioIface::RESPONSE_SHORT, 0, dir, num_blocks, data_vector});
         o->io_state = IO_STATE_DATA;
         o->is_write = is_write;
+        o->data_phase_done = false;
+    }
+    
+    // Time from the end of the data transfer until the card finished the
+    // command (stop command and programming), for the last command. Busy
+    // time before a read transfer starts is not visible here.
+    static TimeType getBusyTime (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        AMBRO_ASSERT(o->state == STATE_RUNNING)
+        AMBRO_ASSERT(o->io_state == IO_STATE_IDLE)
+        
+        return o->busy_time;
     }
     
     using GetSdio = TheSdio;
@@ -345,7 +359,11 @@ private:
             case STATE_RUNNING: {
                 switch (o->io_state) {
                     case IO_STATE_DATA: {
+                        // The busy time starts after the data phase. If the command
+                        // failed without one, there is no busy time to report.
                         o->io_error = (!check_r1_response(results) || data_error != SdioIface::DATA_ERROR_NONE);
+                        o->busy_start = Context::Clock::getTime(c);
+                        o->data_phase_done = (results.error_code == SdioIface::CMD_ERROR_NONE);
                         if (o->multi_block) {
                             send_stop_command(c);
                             o->stop_attempts_left = StopAttemptCount;
@@ -437,6 +455,7 @@ private:
         AMBRO_ASSERT(o->io_state != IO_STATE_IDLE)
         
         o->io_state = IO_STATE_IDLE;
+        o->busy_time = o->data_phase_done ? (TimeType)(Context::Clock::getTime(c) - o->busy_start) : 0;
         
         return CommandHandler::call(c, error);
     }
@@ -487,6 +506,9 @@ public:
         bool is_write;
         bool multi_block;
         bool io_error;
+        bool data_phase_done;
+        TimeType busy_start;
+        TimeType busy_time;
     };
 };
 
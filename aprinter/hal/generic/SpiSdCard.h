@@ -31,6 +31,7 @@
 #include <aprinter/meta/WrapFunction.h>
 #include <aprinter/meta/MinMax.h>
 #include <aprinter/meta/BitsInInt.h>
+#include <aprinter/meta/ChooseInt.h>
 #include <aprinter/meta/ServiceUtils.h>
 #include <aprinter/base/Object.h>
 #include <aprinter/base/Hints.h>
@@ -66,14 +67,19 @@ private:
     
     static TimeType const IdleStateTimeoutTicks = 1.2 * TheClockUtils::time_freq;
     static TimeType const InitTimeoutTicks = 1.2 * TheClockUtils::time_freq;
+    static TimeType const ReadTokenTimeoutTicks = 0.3 * TheClockUtils::time_freq;
     static TimeType const WriteBusyTimeoutTicks = 5.0 * TheClockUtils::time_freq;
     
 public:
     using BlockIndexType = uint32_t;
     static size_t const BlockSize = 512;
     using DataWordType = uint8_t;
-    static size_t const MaxIoBlocks = 1;
-    static int const MaxIoDescriptors = 1;
+    // The card has no limit of its own. Multi-block requests come from the
+    // block cache and from FAT reads into user buffers, which stay within one
+    // cluster, and a FAT cluster is at most 64 KiB. Each descriptor holds
+    // whole blocks, so there are never more descriptors than blocks.
+    static size_t const MaxIoBlocks = 128;
+    static int const MaxIoDescriptors = MaxIoBlocks;
     
     static void init (Context c)
     {
@@ -144,23 +150,52 @@ public:
         AMBRO_ASSERT(o->m_state == STATE_RUNNING)
         AMBRO_ASSERT(o->m_io_state == IO_STATE_IDLE)
         AMBRO_ASSERT(block < o->m_capacity_blocks)
-        AMBRO_ASSERT(num_blocks == 1)
-        AMBRO_ASSERT(data_vector.num_descriptors == 1)
-        AMBRO_ASSERT(data_vector.descriptors[0].num_words == BlockSize)
+        AMBRO_ASSERT(num_blocks > 0)
+        AMBRO_ASSERT(num_blocks <= MaxIoBlocks)
+        AMBRO_ASSERT(num_blocks <= o->m_capacity_blocks - block)
+        AMBRO_ASSERT(data_vector.num_descriptors <= MaxIoDescriptors)
+        AMBRO_ASSERT(CheckTransferVector(data_vector, num_blocks * BlockSize))
         
-        o->m_request_buf = data_vector.descriptors[0].buffer_ptr;
-        uint32_t addr = o->m_sdhc ? block : (block * 512);
-        sd_command(c, (is_write ? CMD_WRITE_BLOCK : CMD_READ_SINGLE_BLOCK), addr, true, o->m_io_buf, o->m_io_buf);
+        o->m_data_vector = data_vector;
+        o->m_desc_index = 0;
+        o->m_desc_offset = 0;
+        o->m_blocks_left = num_blocks;
+        o->m_multi = (num_blocks > 1);
+        o->m_io_error = false;
+        o->m_prev_buf = nullptr;
+        o->m_busy_time = 0;
+        
+        o->m_io_addr = o->m_sdhc ? block : (block * 512);
         if (!is_write) {
+            sd_command(c, (o->m_multi ? CMD_READ_MULTIPLE_BLOCK : CMD_READ_SINGLE_BLOCK), o->m_io_addr, true, o->m_io_buf, o->m_io_buf);
             TheSpi::cmdReadUntilDifferent(c, 0xff, 255, 0xff, o->m_io_buf + 1);
+            start_busy_wait(c, ReadTokenTimeoutTicks);
+            o->m_io_state = IO_STATE_READING_CMD;
+        } else if (o->m_multi) {
+            // Tell the card how many blocks are coming so it can pre-erase them.
+            sd_command(c, CMD_APP_CMD, 0, true, o->m_io_buf, o->m_io_buf);
+            o->m_io_state = IO_STATE_WRITING_APPCMD;
+        } else {
+            sd_command(c, CMD_WRITE_BLOCK, o->m_io_addr, true, o->m_io_buf, o->m_io_buf);
+            o->m_io_state = IO_STATE_WRITING_CMD;
         }
-        o->m_io_state = is_write ? IO_STATE_WRITING_CMD : IO_STATE_READING_CMD;
+    }
+    
+    static TimeType getBusyTime (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        AMBRO_ASSERT(o->m_state == STATE_RUNNING)
+        AMBRO_ASSERT(o->m_io_state == IO_STATE_IDLE)
+        
+        return o->m_busy_time;
     }
     
     using GetSpi = TheSpi;
     
 private:
     using SsPin = typename Params::SsPin;
+    using IoBlocksType = ChooseIntForMax<MaxIoBlocks, false>;
     
     enum {
         STATE_INACTIVE,
@@ -179,21 +214,29 @@ private:
     
     enum {
         IO_STATE_IDLE,
-        IO_STATE_READING_CMD, IO_STATE_READING_DATA,
-        IO_STATE_WRITING_CMD, IO_STATE_WRITING_DATA, IO_STATE_WRITING_DATARESP, IO_STATE_WRITING_BUSY, IO_STATE_WRITING_STATUS
+        IO_STATE_READING_CMD, IO_STATE_READING_TOKEN, IO_STATE_READING_DATA, IO_STATE_READING_STOP, IO_STATE_READING_STOP_BUSY,
+        IO_STATE_WRITING_APPCMD, IO_STATE_WRITING_PREERASE, IO_STATE_WRITING_CMD, IO_STATE_WRITING_DATA, IO_STATE_WRITING_BUSY,
+        IO_STATE_WRITING_STOP, IO_STATE_WRITING_STATUS
     };
     
     static const uint8_t CMD_GO_IDLE_STATE = 0;
     static const uint8_t CMD_SEND_IF_COND = 8;
     static const uint8_t CMD_SEND_CSD = 9;
+    static const uint8_t CMD_STOP_TRANSMISSION = 12;
     static const uint8_t CMD_SEND_STATUS = 13;
     static const uint8_t CMD_SET_BLOCKLEN = 16;
     static const uint8_t CMD_READ_SINGLE_BLOCK = 17;
+    static const uint8_t CMD_READ_MULTIPLE_BLOCK = 18;
     static const uint8_t CMD_WRITE_BLOCK = 24;
+    static const uint8_t CMD_WRITE_MULTIPLE_BLOCK = 25;
     static const uint8_t CMD_APP_CMD = 55;
     static const uint8_t CMD_READ_OCR = 58;
     static const uint8_t CMD_CRC_ON_OFF = 59;
+    static const uint8_t ACMD_SET_WR_BLK_ERASE_COUNT = 23;
     static const uint8_t ACMD_SD_SEND_OP_COND = 41;
+    static const uint8_t TOKEN_START_BLOCK = 0xfe;
+    static const uint8_t TOKEN_START_BLOCK_MULTI = 0xfc;
+    static const uint8_t TOKEN_STOP_TRAN = 0xfd;
     static const uint8_t R1_IN_IDLE_STATE = (1 << 0);
     static const uint8_t R1_ILLEGAL_COMMAND = (1 << 2);
     static const uint32_t OCR_CCS = (UINT32_C(1) << 30);
@@ -386,90 +429,250 @@ private:
         }
     }
     
-    static void spi_for_io_completed (Context c)
+    // Each descriptor must hold a whole number of blocks.
+    static DataWordType * next_block_buf (Context c)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(o->m_desc_index < o->m_data_vector.num_descriptors)
+        
+        TransferDescriptor<DataWordType> const *desc = &o->m_data_vector.descriptors[o->m_desc_index];
+        AMBRO_ASSERT(desc->num_words - o->m_desc_offset >= BlockSize)
+        DataWordType *buf = desc->buffer_ptr + o->m_desc_offset;
+        o->m_desc_offset += BlockSize;
+        if (o->m_desc_offset == desc->num_words) {
+            o->m_desc_index++;
+            o->m_desc_offset = 0;
+        }
+        return buf;
+    }
+    
+    // The CRC of a received block is checked while the next block is being
+    // transferred, or at the end of the request for the last block.
+    static void check_prev_crc (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        if (o->m_prev_buf) {
+            if (CrcItuTUpdate(CrcItuTInitial, (char const *)o->m_prev_buf, BlockSize) != o->m_prev_crc) {
+                o->m_io_error = true;
+            }
+            o->m_prev_buf = nullptr;
+        }
+    }
+    
+    static void read_token_received (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        if (o->m_io_buf[1] == 0xff && !o->m_poll_timer.isExpired(c)) {
+            TheSpi::cmdReadUntilDifferent(c, 0xff, 255, 0xff, o->m_io_buf + 1);
+            o->m_io_state = IO_STATE_READING_TOKEN;
+            return;
+        }
+        end_busy_wait(c);
+        if (o->m_io_buf[1] != TOKEN_START_BLOCK) {
+            o->m_io_error = true;
+            return read_finish(c);
+        }
+        o->m_block_buf = next_block_buf(c);
+        TheSpi::cmdReadBuffer(c, o->m_block_buf, BlockSize, 0xff);
+        TheSpi::cmdReadBuffer(c, o->m_io_buf + 2, 2, 0xff);
+        o->m_io_state = IO_STATE_READING_DATA;
+        check_prev_crc(c);
+    }
+    
+    static void read_finish (Context c)
     {
         auto *o = Object::self(c);
         
-        bool error = true;
+        check_prev_crc(c);
+        if (!o->m_multi) {
+            return complete_request(c, o->m_io_error);
+        }
+        // CMD12 is followed by a stuff byte before the response.
+        o->m_io_buf[0] = CMD_STOP_TRANSMISSION | 0x40;
+        o->m_io_buf[1] = 0;
+        o->m_io_buf[2] = 0;
+        o->m_io_buf[3] = 0;
+        o->m_io_buf[4] = 0;
+        o->m_io_buf[5] = 1 | (crc7(o->m_io_buf, 5, 0) << 1);
+        TheSpi::cmdWriteBuffer(c, 0xff, o->m_io_buf, 6);
+        TheSpi::cmdWriteByte(c, 0xff, 0);
+        TheSpi::cmdReadUntilDifferent(c, 0xff, 255, 0xff, o->m_io_buf);
+        o->m_io_state = IO_STATE_READING_STOP;
+    }
+    
+    static void write_block (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        // The CRC is computed while the data is being sent.
+        o->m_block_buf = next_block_buf(c);
+        TheSpi::cmdWriteBuffer(c, (o->m_multi ? TOKEN_START_BLOCK_MULTI : TOKEN_START_BLOCK), o->m_block_buf, BlockSize);
+        uint16_t checksum = CrcItuTUpdate(CrcItuTInitial, (char const *)o->m_block_buf, BlockSize);
+        WriteBinaryInt<uint16_t, BinaryBigEndian>(checksum, (char *)o->m_io_buf);
+        TheSpi::cmdWriteBuffer(c, o->m_io_buf[0], o->m_io_buf + 1, 1);
+        TheSpi::cmdReadBuffer(c, o->m_io_buf + 2, 1, 0xff);
+        o->m_io_state = IO_STATE_WRITING_DATA;
+    }
+    
+    // Times spent waiting for the card are summed up for getBusyTime().
+    static void start_busy_wait (Context c, TimeType timeout_ticks)
+    {
+        auto *o = Object::self(c);
+        
+        o->m_poll_timer.setAfter(c, timeout_ticks);
+        o->m_busy_start = Context::Clock::getTime(c);
+    }
+    
+    static void end_busy_wait (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        o->m_busy_time += (TimeType)(Context::Clock::getTime(c) - o->m_busy_start);
+    }
+    
+    static void wait_write_busy (Context c, uint8_t io_state)
+    {
+        auto *o = Object::self(c);
+        
+        TheSpi::cmdReadUntilDifferent(c, 0x00, 255, 0xff, o->m_io_buf);
+        o->m_io_state = io_state;
+    }
+    
+    static void write_send_status (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        sd_command(c, CMD_SEND_STATUS, 0, true, o->m_io_buf, o->m_io_buf);
+        TheSpi::cmdReadBuffer(c, o->m_io_buf + 1, 1, 0xff);
+        o->m_io_state = IO_STATE_WRITING_STATUS;
+    }
+    
+    static void spi_for_io_completed (Context c)
+    {
+        auto *o = Object::self(c);
         
         switch (o->m_io_state) {
             case IO_STATE_READING_CMD: {
-                if (o->m_io_buf[0] != 0 || o->m_io_buf[1] != 0xfe) {
-                    goto complete_request;
+                if (o->m_io_buf[0] != 0) {
+                    return complete_request(c, true);
                 }
-                TheSpi::cmdReadBuffer(c, o->m_request_buf, BlockSize, 0xff);
-                TheSpi::cmdReadBuffer(c, o->m_io_buf + 2, 2, 0xff);
-                o->m_io_state = IO_STATE_READING_DATA;
-                return;
+                return read_token_received(c);
+            } break;
+            
+            case IO_STATE_READING_TOKEN: {
+                return read_token_received(c);
             } break;
             
             case IO_STATE_READING_DATA: {
-                uint16_t checksum_received = ReadBinaryInt<uint16_t, BinaryBigEndian>((char *)(o->m_io_buf + 2));
-                uint16_t checksum_computed = CrcItuTUpdate(CrcItuTInitial, (char const *)o->m_request_buf, BlockSize);
-                if (checksum_received != checksum_computed) {
-                    goto complete_request;
+                o->m_prev_buf = o->m_block_buf;
+                o->m_prev_crc = ReadBinaryInt<uint16_t, BinaryBigEndian>((char *)(o->m_io_buf + 2));
+                o->m_blocks_left--;
+                if (o->m_blocks_left == 0 || o->m_io_error) {
+                    return read_finish(c);
                 }
-                error = false;
+                TheSpi::cmdReadUntilDifferent(c, 0xff, 255, 0xff, o->m_io_buf + 1);
+                start_busy_wait(c, ReadTokenTimeoutTicks);
+                o->m_io_state = IO_STATE_READING_TOKEN;
             } break;
             
-            case IO_STATE_WRITING_CMD: {
+            case IO_STATE_READING_STOP: {
+                start_busy_wait(c, WriteBusyTimeoutTicks);
+                wait_write_busy(c, IO_STATE_READING_STOP_BUSY);
+            } break;
+            
+            case IO_STATE_READING_STOP_BUSY: {
+                if (o->m_io_buf[0] == 0x00 && !o->m_poll_timer.isExpired(c)) {
+                    return wait_write_busy(c, IO_STATE_READING_STOP_BUSY);
+                }
+                end_busy_wait(c);
+                if (o->m_io_buf[0] == 0x00) {
+                    return complete_request(c, true);
+                }
+                return complete_request(c, o->m_io_error);
+            } break;
+            
+            case IO_STATE_WRITING_APPCMD: {
                 if (o->m_io_buf[0] != 0) {
-                    goto complete_request;
+                    return complete_request(c, true);
                 }
-                TheSpi::cmdWriteBuffer(c, 0xfe, o->m_request_buf, BlockSize);
-                uint16_t checksum = CrcItuTUpdate(CrcItuTInitial, (char const *)o->m_request_buf, BlockSize);
-                WriteBinaryInt<uint16_t, BinaryBigEndian>(checksum, (char *)o->m_io_buf);
-                TheSpi::cmdWriteBuffer(c, o->m_io_buf[0], o->m_io_buf + 1, 1);
-                o->m_io_state = IO_STATE_WRITING_DATA;
-                return;
+                sd_command(c, ACMD_SET_WR_BLK_ERASE_COUNT, o->m_blocks_left, true, o->m_io_buf, o->m_io_buf);
+                o->m_io_state = IO_STATE_WRITING_PREERASE;
             } break;
             
-            case IO_STATE_WRITING_DATA: {
-                TheSpi::cmdReadBuffer(c, o->m_io_buf + 2, 1, 0xff);
-                o->m_io_state = IO_STATE_WRITING_DATARESP;
-                return;
+            case IO_STATE_WRITING_PREERASE: {
+                // The pre-erase count is only a hint, so a failure is not fatal.
+                sd_command(c, CMD_WRITE_MULTIPLE_BLOCK, o->m_io_addr, true, o->m_io_buf, o->m_io_buf);
+                o->m_io_state = IO_STATE_WRITING_CMD;
             } break;
             
-            case IO_STATE_WRITING_DATARESP: {
+            case IO_STATE_WRITING_CMD: {
+                if (o->m_io_buf[0] != 0) {
+                    return complete_request(c, true);
+                }
+                write_block(c);
+            } break;
+            
+            case IO_STATE_WRITING_DATA: {
                 uint8_t data_response = o->m_io_buf[2];
                 if ((data_response & 0x1F) != 5) {
-                    goto complete_request;
+                    o->m_io_error = true;
                 }
-                TheSpi::cmdReadUntilDifferent(c, 0x00, 255, 0xff, o->m_io_buf);
-                o->m_io_state = IO_STATE_WRITING_BUSY;
-                o->m_poll_timer.setAfter(c, WriteBusyTimeoutTicks);
-                return;
+                start_busy_wait(c, WriteBusyTimeoutTicks);
+                wait_write_busy(c, IO_STATE_WRITING_BUSY);
             } break;
             
             case IO_STATE_WRITING_BUSY: {
+                if (o->m_io_buf[0] == 0x00 && !o->m_poll_timer.isExpired(c)) {
+                    return wait_write_busy(c, IO_STATE_WRITING_BUSY);
+                }
+                end_busy_wait(c);
                 if (o->m_io_buf[0] == 0x00) {
-                    if (o->m_poll_timer.isExpired(c)) {
-                        goto complete_request;
-                    }
-                    TheSpi::cmdReadUntilDifferent(c, 0x00, 255, 0xff, o->m_io_buf);
-                    return;
+                    return complete_request(c, true);
+                }
+                o->m_blocks_left--;
+                if (o->m_blocks_left > 0 && !o->m_io_error) {
+                    return write_block(c);
+                }
+                if (o->m_multi) {
+                    // Stop token, then one byte before the card goes busy.
+                    TheSpi::cmdWriteByte(c, TOKEN_STOP_TRAN, 0);
+                    TheSpi::cmdWriteByte(c, 0xff, 0);
+                    start_busy_wait(c, WriteBusyTimeoutTicks);
+                    return wait_write_busy(c, IO_STATE_WRITING_STOP);
                 }
-                sd_command(c, CMD_SEND_STATUS, 0, true, o->m_io_buf, o->m_io_buf);
-                TheSpi::cmdReadBuffer(c, o->m_io_buf + 1, 1, 0xff);
-                o->m_io_state = IO_STATE_WRITING_STATUS;
-                return;
+                write_send_status(c);
             } break;
             
-            case IO_STATE_WRITING_STATUS: {
-                if (o->m_io_buf[0] != 0 || o->m_io_buf[1] != 0) {
-                    goto complete_request;
+            case IO_STATE_WRITING_STOP: {
+                if (o->m_io_buf[0] == 0x00 && !o->m_poll_timer.isExpired(c)) {
+                    return wait_write_busy(c, IO_STATE_WRITING_STOP);
+                }
+                end_busy_wait(c);
+                if (o->m_io_buf[0] == 0x00) {
+                    return complete_request(c, true);
                 }
-                error = false;
+                write_send_status(c);
+            } break;
+            
+            case IO_STATE_WRITING_STATUS: {
+                bool error = (o->m_io_error || o->m_io_buf[0] != 0 || o->m_io_buf[1] != 0);
+                return complete_request(c, error);
             } break;
             
             default: AMBRO_ASSERT(false);
         }
+    }
     
-    complete_request:
+    static void complete_request (Context c, bool error)
+    {
+        auto *o = Object::self(c);
+        
         o->m_io_state = IO_STATE_IDLE;
         return CommandHandler::call(c, error);
     }
-    
+
     static void deactivate_common (Context c)
     {
         auto *o = Object::self(c);
@@ -493,8 +696,10 @@ public:
         TheSpi
     >> {
         uint8_t m_state : 4;
-        uint8_t m_io_state : 3;
+        uint8_t m_io_state : 4;
         bool m_sdhc : 1;
+        bool m_multi : 1;
+        bool m_io_error : 1;
         typename TheClockUtils::PollTimer m_poll_timer;
         union {
             struct {
@@ -504,7 +709,16 @@ public:
             struct {
                 uint32_t m_capacity_blocks;
                 uint8_t m_io_buf[6];
-                DataWordType *m_request_buf;
+                uint32_t m_io_addr;
+                TransferVector<DataWordType> m_data_vector;
+                IoBlocksType m_desc_index;
+                size_t m_desc_offset;
+                IoBlocksType m_blocks_left;
+                DataWordType *m_block_buf;
+                DataWordType *m_prev_buf;
+                uint16_t m_prev_crc;
+                TimeType m_busy_start;
+                TimeType m_busy_time;
             };
         };
     };
@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef APRINTER_LINUX_CLOCK_H
+#define APRINTER_LINUX_CLOCK_H
+
+#include <stdint.h>
+
+#include <aprinter/base/Object.h>
+#include <aprinter/meta/ServiceUtils.h>
+#include <aprinter/meta/MinMax.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Assert.h>
+#include <aprinter/base/Lock.h>
+#include <aprinter/system/InterruptLock.h>
+
+#include <aprinter/BeginNamespace.h>
+
+/*
+ * Simulated clock for the Linux host platform.
+ * 
+ * The time is derived from linux_get_sim_time_ns() and scaled to the
+ * configured frequency, so that the firmware sees the same tick rate
+ * as on the board whose configuration is being run. The timers list is
+ * accepted for compatibility with the generator but otherwise ignored.
+ */
+
+template <typename>
+class LinuxClockInterruptTimer;
+
+struct LinuxClockTimer {};
+
+template <typename Arg>
+class LinuxClock {
+    using Context      = typename Arg::Context;
+    using ParentObject = typename Arg::ParentObject;
+    using Params       = typename Arg::Params;
+    
+    template <typename>
+    friend class LinuxClockInterruptTimer;
+    
+public:
+    struct Object;
+    using TimeType = uint32_t;
+    
+    static constexpr double time_freq = Params::TimeFreq;
+    static constexpr double time_unit = 1.0 / time_freq;
+    
+private:
+    using TheDebugObject = DebugObject<Context, Object>;
+    
+    static constexpr double ns_to_ticks = time_freq / 1000000000.0;
+    
+public:
+    static void init (Context c)
+    {
+        TheDebugObject::init(c);
+    }
+    
+    static void deinit (Context c)
+    {
+        TheDebugObject::deinit(c);
+    }
+    
+    template <typename ThisContext>
+    static TimeType getTime (ThisContext c)
+    {
+        TheDebugObject::access(c);
+        
+        // Reading the clock is where the main loop gives the simulated
+        // interrupts a chance to run.
+        linux_check_interrupts();
+        
+        return get_raw_time();
+    }
+    
+    // Fine-grained time for benchmarks (MOTIONPLANNER_BENCHMARK), in simulated
+    // nanoseconds. Unlike getTime, reading it does not run simulated interrupts.
+    struct BenchTime {
+        using TimeType = uint64_t;
+        static constexpr double time_freq = 1000000000.0;
+        
+        template <typename ThisContext>
+        static TimeType getTime (ThisContext c)
+        {
+            return linux_get_sim_time_ns();
+        }
+    };
+    
+private:
+    static TimeType get_raw_time ()
+    {
+        return (uint64_t)(linux_get_sim_time_ns() * ns_to_ticks);
+    }
+    
+public:
+    struct Object : public ObjBase<LinuxClock, ParentObject, MakeTypeList<TheDebugObject>> {};
+};
+
+APRINTER_ALIAS_STRUCT_EXT(LinuxClockService, (
+    APRINTER_AS_VALUE(uint32_t, TimeFreq)
+), (
+    APRINTER_ALIAS_STRUCT_EXT(Clock, (
+        APRINTER_AS_TYPE(Context),
+        APRINTER_AS_TYPE(ParentObject),
+        APRINTER_AS_TYPE(TcsList)
+    ), (
+        using Params = LinuxClockService;
+        APRINTER_DEF_INSTANCE(Clock, LinuxClock)
+    ))
+))
+
+template <typename Arg>
+class LinuxClockInterruptTimer {
+    using Context      = typename Arg::Context;
+    using ParentObject = typename Arg::ParentObject;
+    using Handler      = typename Arg::Handler;
+    using Params       = typename Arg::Params;
+    
+public:
+    struct Object;
+    using Clock = typename Context::Clock;
+    using TimeType = typename Clock::TimeType;
+    using HandlerContext = InterruptContext<Context>;
+    using ExtraClearance = typename Params::ExtraClearance;
+    
+private:
+    using TheDebugObject = DebugObject<Context, Object>;
+    
+public:
+    static void init (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        o->m_enabled = false;
+        
+        TheDebugObject::init(c);
+    }
+    
+    static void deinit (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::deinit(c);
+        
+        o->m_enabled = false;
+        
+        memory_barrier();
+    }
+    
+    template <typename ThisContext>
+    static void setFirst (ThisContext c, TimeType time)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        AMBRO_ASSERT(!o->m_enabled)
+        
+        AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+            o->m_time = time;
+            o->m_fire_time = adjust_time(time);
+            o->m_enabled = true;
+        }
+    }
+    
+    static void setNext (HandlerContext c, TimeType time)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(o->m_enabled)
+        
+        o->m_time = time;
+        o->m_fire_time = adjust_time(time);
+    }
+    
+    template <typename ThisContext>
+    static void unset (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+            o->m_enabled = false;
+        }
+    }
+    
+    template <typename ThisContext>
+    static TimeType getLastSetTime (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        
+        return o->m_time;
+    }
+    
+    static void irq_handler (InterruptContext<Context> c)
+    {
+        auto *o = Object::self(c);
+        
+        // Like a compare match which stays pending, keep calling the
+        // handler for as long as the set time is in the past.
+        while (o->m_enabled && (TimeType)(Clock::get_raw_time() - o->m_fire_time) < UINT32_C(0x80000000)) {
+            if (!Handler::call(c)) {
+                o->m_enabled = false;
+            }
+        }
+    }
+    
+private:
+    static TimeType adjust_time (TimeType time)
+    {
+        // Never fire sooner than the clearance from now, the same as
+        // the hardware drivers do.
+        TimeType now = Clock::get_raw_time();
+        now -= time;
+        now += clearance;
+        if (now < UINT32_C(0x80000000)) {
+            time += now;
+        }
+        return time;
+    }
+    
+    static const TimeType clearance = MaxValue<TimeType>(2, ExtraClearance::value() * Clock::time_freq);
+    
+public:
+    struct Object : public ObjBase<LinuxClockInterruptTimer, ParentObject, MakeTypeList<TheDebugObject>> {
+        TimeType m_time;
+        TimeType m_fire_time;
+        bool m_enabled;
+    };
+};
+
+APRINTER_ALIAS_STRUCT_EXT(LinuxClockInterruptTimerService, (
+    APRINTER_AS_TYPE(ExtraClearance)
+), (
+    APRINTER_ALIAS_STRUCT_EXT(InterruptTimer, (
+        APRINTER_AS_TYPE(Context),
+        APRINTER_AS_TYPE(ParentObject),
+        APRINTER_AS_TYPE(Handler)
+    ), (
+        using Params = LinuxClockInterruptTimerService;
+        APRINTER_DEF_INSTANCE(InterruptTimer, LinuxClockInterruptTimer)
+    ))
+))
+
+#define APRINTER_LINUX_CLOCK_INTERRUPT_TIMER_GLOBAL(timer, context) \
+APRINTER_LINUX_IRQ_GLOBAL(timer::irq_handler(MakeInterruptContext((context))))
+
+#include <aprinter/EndNamespace.h>
+
+#endif
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef APRINTER_LINUX_PINS_H
+#define APRINTER_LINUX_PINS_H
+
+#include <stdint.h>
+
+#include <aprinter/meta/ServiceUtils.h>
+#include <aprinter/base/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Assert.h>
+
+// Provided by the generated code, maps pin indices to the pin names
+// from the configuration.
+extern char const * const linux_pin_names[];
+
+#include <aprinter/BeginNamespace.h>
+
+/*
+ * Simulated pins for the Linux host platform.
+ * 
+ * The generator maps every pin of the board configuration to a
+ * LinuxPin<Index>. Outputs only remember their state and report
+ * changes to linux_pin_log(). Inputs read as high if configured with
+ * a pull-up and as low otherwise, unless overridden using
+ * linux_get_pin_input().
+ */
+
+template <int TIndex>
+struct LinuxPin {
+    static int const Index = TIndex;
+};
+
+template <bool TPullUp>
+struct LinuxPinInputMode {
+    static bool const PullUp = TPullUp;
+};
+using LinuxPinInputModeNormal = LinuxPinInputMode<false>;
+using LinuxPinInputModePullUp = LinuxPinInputMode<true>;
+
+template <typename Arg>
+class LinuxPins {
+    using Context      = typename Arg::Context;
+    using ParentObject = typename Arg::ParentObject;
+    
+public:
+    struct Object;
+    
+private:
+    using TheDebugObject = DebugObject<Context, Object>;
+    
+    static int const MaxPins = 256;
+    
+public:
+    static void init (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        for (int i = 0; i < MaxPins; i++) {
+            o->m_state[i] = false;
+        }
+        
+        TheDebugObject::init(c);
+    }
+    
+    static void deinit (Context c)
+    {
+        TheDebugObject::deinit(c);
+    }
+    
+    template <typename Pin, typename Mode = LinuxPinInputModeNormal, typename ThisContext>
+    static void setInput (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        static_assert(Pin::Index < MaxPins, "");
+        
+        o->m_state[Pin::Index] = linux_get_pin_input(linux_pin_names[Pin::Index], Mode::PullUp);
+    }
+    
+    template <typename Pin, typename ThisContext>
+    static void setOutput (ThisContext c)
+    {
+        TheDebugObject::access(c);
+        static_assert(Pin::Index < MaxPins, "");
+    }
+    
+    template <typename Pin, typename ThisContext>
+    static bool get (ThisContext c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        return o->m_state[Pin::Index];
+    }
+    
+    template <typename Pin, typename ThisContext>
+    static void set (ThisContext c, bool x)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        if (x != o->m_state[Pin::Index]) {
+            o->m_state[Pin::Index] = x;
+            linux_pin_log(linux_pin_names[Pin::Index], x);
+        }
+    }
+    
+    template <typename Pin>
+    static void emergencySet (bool x)
+    {
+        linux_pin_log(linux_pin_names[Pin::Index], x);
+    }
+    
+public:
+    struct Object : public ObjBase<LinuxPins, ParentObject, MakeTypeList<TheDebugObject>> {
+        bool m_state[MaxPins];
+    };
+};
+
+struct LinuxPinsService {
+    APRINTER_ALIAS_STRUCT_EXT(Pins, (
+        APRINTER_AS_TYPE(Context),
+        APRINTER_AS_TYPE(ParentObject)
+    ), (
+        APRINTER_DEF_INSTANCE(Pins, LinuxPins)
+    ))
+};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef APRINTER_LINUX_PWM_H
+#define APRINTER_LINUX_PWM_H
+
+#include <stdint.h>
+
+#include <aprinter/base/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Assert.h>
+#include <aprinter/hal/linux/LinuxPins.h>
+
+#include <aprinter/BeginNamespace.h>
+
+/*
+ * Simulated hardware PWM channel for the Linux host platform.
+ * Changes of the duty cycle are reported to linux_pin_log().
+ */
+
+template <typename Context, typename ParentObject, typename Params>
+class LinuxPwmChannel {
+public:
+    struct Object;
+    
+private:
+    using TheDebugObject = DebugObject<Context, Object>;
+    using Pin = typename Params::Pin;
+    
+public:
+    using DutyCycleType = uint16_t;
+    static DutyCycleType const MaxDutyCycle = 1000;
+    
+    static void init (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        o->m_duty_cycle = 0;
+        
+        TheDebugObject::init(c);
+    }
+    
+    static void deinit (Context c)
+    {
+        TheDebugObject::deinit(c);
+    }
+    
+    template <typename ThisContext>
+    static void setDutyCycle (ThisContext c, DutyCycleType duty_cycle)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        AMBRO_ASSERT(duty_cycle <= MaxDutyCycle)
+        
+        if (duty_cycle != o->m_duty_cycle) {
+            o->m_duty_cycle = duty_cycle;
+            linux_pin_log(linux_pin_names[Pin::Index], duty_cycle);
+        }
+    }
+    
+    static void emergencySetOff ()
+    {
+        linux_pin_log(linux_pin_names[Pin::Index], 0);
+    }
+    
+public:
+    struct Object : public ObjBase<LinuxPwmChannel, ParentObject, MakeTypeList<TheDebugObject>> {
+        DutyCycleType m_duty_cycle;
+    };
+};
+
+template <typename TPin>
+struct LinuxPwmChannelService {
+    using Pin = TPin;
+    
+    template <typename Context, typename ParentObject>
+    using Pwm = LinuxPwmChannel<Context, ParentObject, LinuxPwmChannelService>;
+};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
@@ -0,0 +1,362 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef APRINTER_LINUX_SD_CARD_H
+#define APRINTER_LINUX_SD_CARD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <aprinter/meta/ServiceUtils.h>
+#include <aprinter/base/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Assert.h>
+#include <aprinter/base/Callback.h>
+#include <aprinter/base/TransferVector.h>
+
+#include <aprinter/BeginNamespace.h>
+
+/*
+ * Simulated SD card for the Linux host platform, backed by a disk image.
+ * 
+ * The image is named by the APRINTER_LINUX_SD_IMAGE environment variable
+ * and is opened each time the card is activated. If APRINTER_LINUX_SD_RAMDISK
+ * is set, the image is instead loaded into memory on the first activation and
+ * writes only go to memory, so the image file is never modified.
+ * 
+ * Each command completes after a simulated latency of
+ * APRINTER_LINUX_SD_CMD_LATENCY plus APRINTER_LINUX_SD_BLOCK_LATENCY for
+ * each block, both in microseconds of simulated time (defaults 500 and 100).
+ * If APRINTER_LINUX_SD_STATS is set, the number of commands and blocks
+ * transferred is printed to stderr when the card is deactivated.
+ */
+
+template <typename Arg>
+class LinuxSdCard {
+    using Context        = typename Arg::Context;
+    using ParentObject   = typename Arg::ParentObject;
+    using InitHandler    = typename Arg::InitHandler;
+    using CommandHandler = typename Arg::CommandHandler;
+    
+public:
+    struct Object;
+    
+private:
+    using TheDebugObject = DebugObject<Context, Object>;
+    using Clock = typename Context::Clock;
+    using TimeType = typename Clock::TimeType;
+    
+    enum {STATE_INACTIVE, STATE_ACTIVATING, STATE_RUNNING};
+    
+    static TimeType const ActivateTimeTicks = 0.01 * Clock::time_freq;
+    
+    static uint8_t const ErrorNoImage = 1;
+    static uint8_t const ErrorImageSize = 2;
+    
+public:
+    using BlockIndexType = uint32_t;
+    static size_t const BlockSize = 512;
+    using DataWordType = uint32_t;
+    static size_t const MaxIoBlocks = 1024;
+    static int const MaxIoDescriptors = 1024;
+    
+    static void init (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        o->timer.init(c, APRINTER_CB_STATFUNC_T(&LinuxSdCard::timer_handler));
+        o->state = STATE_INACTIVE;
+        o->fd = -1;
+        o->ram_data = nullptr;
+        o->cmd_latency_us = get_env_double("APRINTER_LINUX_SD_CMD_LATENCY", 500.0);
+        o->block_latency_us = get_env_double("APRINTER_LINUX_SD_BLOCK_LATENCY", 100.0);
+        
+        TheDebugObject::init(c);
+    }
+    
+    static void deinit (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::deinit(c);
+        
+        close_image(c);
+        free(o->ram_data);
+        o->timer.deinit(c);
+    }
+    
+    static void activate (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        AMBRO_ASSERT(o->state == STATE_INACTIVE)
+        
+        o->state = STATE_ACTIVATING;
+        o->timer.appendAfter(c, ActivateTimeTicks);
+    }
+    
+    static void deactivate (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        if (o->state == STATE_RUNNING && getenv("APRINTER_LINUX_SD_STATS")) {
+            fprintf(stderr, "LinuxSdCard: commands=%lu read_blocks=%lu write_blocks=%lu\n",
+                    (unsigned long)o->num_commands, (unsigned long)o->num_read_blocks, (unsigned long)o->num_write_blocks);
+        }
+        
+        close_image(c);
+        o->timer.unset(c);
+        o->state = STATE_INACTIVE;
+    }
+    
+    static BlockIndexType getCapacityBlocks (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        AMBRO_ASSERT(o->state == STATE_RUNNING)
+        
+        return o->capacity_blocks;
+    }
+    
+    static bool isWritable (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        AMBRO_ASSERT(o->state == STATE_RUNNING)
+        
+        return true;
+    }
+    
+    static void startReadOrWrite (Context c, bool is_write, BlockIndexType block, size_t num_blocks, TransferVector<DataWordType> data_vector)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        AMBRO_ASSERT(o->state == STATE_RUNNING)
+        AMBRO_ASSERT(!o->busy)
+        AMBRO_ASSERT(num_blocks > 0)
+        AMBRO_ASSERT(num_blocks <= MaxIoBlocks)
+        
+        o->busy = true;
+        o->is_write = is_write;
+        o->io_block = block;
+        o->io_num_blocks = num_blocks;
+        o->data_vector = data_vector;
+        
+        o->num_commands++;
+        if (is_write) {
+            o->num_write_blocks += num_blocks;
+        } else {
+            o->num_read_blocks += num_blocks;
+        }
+        
+        o->busy_ticks = o->cmd_latency_us * 1e-6 * Clock::time_freq;
+        TimeType transfer_ticks = num_blocks * o->block_latency_us * 1e-6 * Clock::time_freq;
+        o->timer.appendAfter(c, (TimeType)(o->busy_ticks + transfer_ticks));
+    }
+    
+    // The command latency is taken to be busy time, the per-block latency transfer time.
+    static TimeType getBusyTime (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        AMBRO_ASSERT(o->state == STATE_RUNNING)
+        AMBRO_ASSERT(!o->busy)
+        
+        return o->busy_ticks;
+    }
+    
+private:
+    static double get_env_double (char const *name, double default_value)
+    {
+        char const *str = getenv(name);
+        return str ? atof(str) : default_value;
+    }
+    
+    static uint8_t open_image (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        char const *image = getenv("APRINTER_LINUX_SD_IMAGE");
+        if (!image) {
+            return ErrorNoImage;
+        }
+        
+        int fd = open(image, O_RDWR);
+        if (fd < 0) {
+            return ErrorNoImage;
+        }
+        
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size < (off_t)BlockSize) {
+            close(fd);
+            return ErrorImageSize;
+        }
+        uint64_t capacity_blocks = (uint64_t)st.st_size / BlockSize;
+        if (capacity_blocks > UINT32_MAX) {
+            close(fd);
+            return ErrorImageSize;
+        }
+        
+        if (getenv("APRINTER_LINUX_SD_RAMDISK")) {
+            // Load the image only once, so that the data written
+            // is still there when the card is activated again.
+            if (!o->ram_data) {
+                size_t size = capacity_blocks * BlockSize;
+                o->ram_data = (char *)malloc(size);
+                if (!o->ram_data || pread(fd, o->ram_data, size, 0) != (ssize_t)size) {
+                    free(o->ram_data);
+                    o->ram_data = nullptr;
+                    close(fd);
+                    return ErrorImageSize;
+                }
+            }
+            close(fd);
+        } else {
+            o->fd = fd;
+        }
+        
+        o->capacity_blocks = capacity_blocks;
+        return 0;
+    }
+    
+    static void close_image (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        if (o->fd >= 0) {
+            close(o->fd);
+            o->fd = -1;
+        }
+    }
+    
+    static bool do_transfer (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        if (o->io_block > o->capacity_blocks || o->io_num_blocks > o->capacity_blocks - o->io_block) {
+            return false;
+        }
+        
+        uint64_t offset = (uint64_t)o->io_block * BlockSize;
+        size_t rem_bytes = o->io_num_blocks * BlockSize;
+        
+        for (int i = 0; i < o->data_vector.num_descriptors && rem_bytes > 0; i++) {
+            auto const &desc = o->data_vector.descriptors[i];
+            size_t bytes = desc.num_words * sizeof(DataWordType);
+            if (bytes > rem_bytes) {
+                bytes = rem_bytes;
+            }
+            
+            if (o->ram_data) {
+                if (o->is_write) {
+                    memcpy(o->ram_data + offset, desc.buffer_ptr, bytes);
+                } else {
+                    memcpy(desc.buffer_ptr, o->ram_data + offset, bytes);
+                }
+            } else {
+                ssize_t res = o->is_write ? pwrite(o->fd, desc.buffer_ptr, bytes, offset) : pread(o->fd, desc.buffer_ptr, bytes, offset);
+                if (res != (ssize_t)bytes) {
+                    return false;
+                }
+            }
+            
+            offset += bytes;
+            rem_bytes -= bytes;
+        }
+        
+        return rem_bytes == 0;
+    }
+    
+    static void timer_handler (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        AMBRO_ASSERT(o->state == STATE_ACTIVATING || o->state == STATE_RUNNING)
+        
+        if (o->state == STATE_ACTIVATING) {
+            uint8_t error_code = open_image(c);
+            if (error_code) {
+                o->state = STATE_INACTIVE;
+            } else {
+                o->state = STATE_RUNNING;
+                o->busy = false;
+                o->num_commands = 0;
+                o->num_read_blocks = 0;
+                o->num_write_blocks = 0;
+            }
+            return InitHandler::call(c, error_code);
+        }
+        
+        AMBRO_ASSERT(o->busy)
+        
+        bool error = !do_transfer(c);
+        o->busy = false;
+        
+        return CommandHandler::call(c, error);
+    }
+    
+public:
+    struct Object : public ObjBase<LinuxSdCard, ParentObject, MakeTypeList<
+        TheDebugObject
+    >> {
+        typename Context::EventLoop::TimedEvent timer;
+        uint8_t state;
+        bool busy;
+        bool is_write;
+        int fd;
+        char *ram_data;
+        BlockIndexType capacity_blocks;
+        BlockIndexType io_block;
+        size_t io_num_blocks;
+        TransferVector<DataWordType> data_vector;
+        double cmd_latency_us;
+        double block_latency_us;
+        TimeType busy_ticks;
+        uint32_t num_commands;
+        uint32_t num_read_blocks;
+        uint32_t num_write_blocks;
+    };
+};
+
+struct LinuxSdCardService {
+    APRINTER_ALIAS_STRUCT_EXT(SdCard, (
+        APRINTER_AS_TYPE(Context),
+        APRINTER_AS_TYPE(ParentObject),
+        APRINTER_AS_TYPE(InitHandler),
+        APRINTER_AS_TYPE(CommandHandler)
+    ), (
+        APRINTER_DEF_INSTANCE(SdCard, LinuxSdCard)
+    ))
+};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
@@ -0,0 +1,379 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef APRINTER_LINUX_SERIAL_H
+#define APRINTER_LINUX_SERIAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <termios.h>
+
+#include <aprinter/meta/BoundedInt.h>
+#include <aprinter/meta/TypeListUtils.h>
+#include <aprinter/base/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Assert.h>
+#include <aprinter/base/Callback.h>
+
+#include <aprinter/BeginNamespace.h>
+
+/*
+ * Serial port for the Linux host platform.
+ * 
+ * By default stdin and stdout are used. If the APRINTER_LINUX_SERIAL_PTY
+ * environment variable is set, a pseudo-terminal is created instead and
+ * the name of its slave side is printed to stderr, so that host software
+ * can connect to it like to a real printer.
+ * 
+ * The file descriptors are non-blocking and are polled from a timed
+ * event, so everything here runs in the main context.
+ */
+
+template <typename Context, typename ParentObject, int RecvBufferBits, int SendBufferBits, typename RecvHandler, typename SendHandler, typename Params>
+class LinuxSerial {
+private:
+    using RecvFastEvent = typename Context::EventLoop::template FastEventSpec<LinuxSerial>;
+    using SendFastEvent = typename Context::EventLoop::template FastEventSpec<RecvFastEvent>;
+    
+public:
+    struct Object;
+    
+private:
+    using TheDebugObject = DebugObject<Context, Object>;
+    using Loop = typename Context::EventLoop;
+    using Clock = typename Context::Clock;
+    using TimeType = typename Clock::TimeType;
+    
+    static TimeType const PollIntervalTicks = 0.001 * Clock::time_freq;
+    
+public:
+    using RecvSizeType = BoundedInt<RecvBufferBits, false>;
+    using SendSizeType = BoundedInt<SendBufferBits, false>;
+    
+    static void init (Context c, uint32_t baud)
+    {
+        auto *o = Object::self(c);
+        
+        Context::EventLoop::template initFastEvent<RecvFastEvent>(c, LinuxSerial::recv_event_handler);
+        o->m_recv_start = RecvSizeType::import(0);
+        o->m_recv_end = RecvSizeType::import(0);
+        o->m_recv_overrun = false;
+        
+        Context::EventLoop::template initFastEvent<SendFastEvent>(c, LinuxSerial::send_event_handler);
+        o->m_send_start = SendSizeType::import(0);
+        o->m_send_end = SendSizeType::import(0);
+        o->m_send_event = SendSizeType::import(0);
+        
+        open_fds(c);
+        
+        o->m_poll_event.init(c, APRINTER_CB_STATFUNC_T(&LinuxSerial::poll_event_handler));
+        o->m_poll_event.appendAfter(c, PollIntervalTicks);
+        
+        TheDebugObject::init(c);
+    }
+    
+    static void deinit (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::deinit(c);
+        
+        o->m_poll_event.deinit(c);
+        
+        if (o->m_in_fd != o->m_out_fd) {
+            close(o->m_in_fd);
+        }
+        close(o->m_out_fd);
+        
+        Context::EventLoop::template resetFastEvent<SendFastEvent>(c);
+        Context::EventLoop::template resetFastEvent<RecvFastEvent>(c);
+    }
+    
+    static RecvSizeType recvQuery (Context c, bool *out_overrun)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        AMBRO_ASSERT(out_overrun)
+        
+        *out_overrun = o->m_recv_overrun;
+        return recv_avail(o->m_recv_start, o->m_recv_end);
+    }
+    
+    static char * recvGetChunkPtr (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        return (o->m_recv_buffer + o->m_recv_start.value());
+    }
+    
+    static void recvConsume (Context c, RecvSizeType amount)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        AMBRO_ASSERT(amount <= recv_avail(o->m_recv_start, o->m_recv_end))
+        
+        o->m_recv_start = BoundedModuloAdd(o->m_recv_start, amount);
+    }
+    
+    static void recvClearOverrun (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        AMBRO_ASSERT(o->m_recv_overrun)
+        
+        o->m_recv_overrun = false;
+        
+        char discard[64];
+        while (read(o->m_in_fd, discard, sizeof(discard)) > 0);
+    }
+    
+    static void recvForceEvent (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        Context::EventLoop::template triggerFastEvent<RecvFastEvent>(c);
+    }
+    
+    static SendSizeType sendQuery (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        return send_avail(o->m_send_start, o->m_send_end);
+    }
+    
+    static SendSizeType sendGetChunkLen (Context c, SendSizeType rem_length)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        if (o->m_send_end.value() > 0 && rem_length > BoundedModuloNegative(o->m_send_end)) {
+            rem_length = BoundedModuloNegative(o->m_send_end);
+        }
+        
+        return rem_length;
+    }
+    
+    static char * sendGetChunkPtr (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        return (o->m_send_buffer + o->m_send_end.value());
+    }
+    
+    static void sendProvide (Context c, SendSizeType amount)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        AMBRO_ASSERT(amount <= send_avail(o->m_send_start, o->m_send_end))
+        
+        o->m_send_end = BoundedModuloAdd(o->m_send_end, amount);
+    }
+    
+    static void sendPoke (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        do_send(c);
+    }
+    
+    static void sendRequestEvent (Context c, SendSizeType min_amount)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        o->m_send_event = min_amount;
+        Context::EventLoop::template triggerFastEvent<SendFastEvent>(c);
+    }
+    
+    static void sendWaitFinished (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        while (o->m_send_start != o->m_send_end) {
+            if (!do_send(c)) {
+                usleep(1000);
+            }
+        }
+    }
+    
+    using EventLoopFastEvents = MakeTypeList<RecvFastEvent, SendFastEvent>;
+    
+private:
+    static void open_fds (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        if (getenv("APRINTER_LINUX_SERIAL_PTY")) {
+            int fd = posix_openpt(O_RDWR | O_NOCTTY);
+            if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+                fprintf(stderr, "LinuxSerial: failed to create pty\n");
+                exit(1);
+            }
+            
+            struct termios tio;
+            if (tcgetattr(fd, &tio) == 0) {
+                cfmakeraw(&tio);
+                tcsetattr(fd, TCSANOW, &tio);
+            }
+            
+            fprintf(stderr, "LinuxSerial: %s\n", ptsname(fd));
+            o->m_in_fd = fd;
+            o->m_out_fd = fd;
+        } else {
+            o->m_in_fd = STDIN_FILENO;
+            o->m_out_fd = STDOUT_FILENO;
+        }
+        
+        fcntl(o->m_in_fd, F_SETFL, fcntl(o->m_in_fd, F_GETFL) | O_NONBLOCK);
+        fcntl(o->m_out_fd, F_SETFL, fcntl(o->m_out_fd, F_GETFL) | O_NONBLOCK);
+    }
+    
+    static RecvSizeType recv_avail (RecvSizeType start, RecvSizeType end)
+    {
+        return BoundedModuloSubtract(end, start);
+    }
+    
+    static SendSizeType send_avail (SendSizeType start, SendSizeType end)
+    {
+        return BoundedModuloDec(BoundedModuloSubtract(start, end));
+    }
+    
+    static void do_recv (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        if (o->m_recv_overrun) {
+            return;
+        }
+        
+        // Unlike a UART, unread input stays in the file descriptor, so when the
+        // buffer is full we just stop reading instead of reporting an overrun.
+        char buf[64];
+        size_t space = BoundedModuloDec(BoundedModuloSubtract(o->m_recv_start, o->m_recv_end)).value();
+        size_t amount = (space < sizeof(buf)) ? space : sizeof(buf);
+        if (amount == 0) {
+            return;
+        }
+        
+        ssize_t res = read(o->m_in_fd, buf, amount);
+        if (res > 0) {
+            for (size_t i = 0; i < (size_t)res; i++) {
+                o->m_recv_buffer[o->m_recv_end.value()] = buf[i];
+                o->m_recv_buffer[o->m_recv_end.value() + (sizeof(o->m_recv_buffer) / 2)] = buf[i];
+                o->m_recv_end = BoundedModuloInc(o->m_recv_end);
+            }
+            Context::EventLoop::template triggerFastEvent<RecvFastEvent>(c);
+        }
+    }
+    
+    static bool do_send (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        bool progress = false;
+        
+        while (o->m_send_start != o->m_send_end) {
+            size_t amount = (o->m_send_end > o->m_send_start) ?
+                BoundedModuloSubtract(o->m_send_end, o->m_send_start).value() :
+                BoundedModuloNegative(o->m_send_start).value();
+            
+            ssize_t res = write(o->m_out_fd, o->m_send_buffer + o->m_send_start.value(), amount);
+            if (res <= 0) {
+                break;
+            }
+            
+            o->m_send_start = BoundedModuloAdd(o->m_send_start, SendSizeType::import(res));
+            progress = true;
+        }
+        
+        if (progress && o->m_send_event != SendSizeType::import(0)) {
+            Context::EventLoop::template triggerFastEvent<SendFastEvent>(c);
+        }
+        
+        return progress;
+    }
+    
+    static void poll_event_handler (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        o->m_poll_event.appendAfterPrevious(c, PollIntervalTicks);
+        
+        do_recv(c);
+        do_send(c);
+    }
+    
+    static void recv_event_handler (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        RecvHandler::call(c);
+    }
+    
+    static void send_event_handler (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        if (o->m_send_event != SendSizeType::import(0) && send_avail(o->m_send_start, o->m_send_end) >= o->m_send_event) {
+            o->m_send_event = SendSizeType::import(0);
+            SendHandler::call(c);
+        }
+    }
+    
+public:
+    struct Object : public ObjBase<LinuxSerial, ParentObject, MakeTypeList<TheDebugObject>> {
+        typename Loop::TimedEvent m_poll_event;
+        int m_in_fd;
+        int m_out_fd;
+        RecvSizeType m_recv_start;
+        RecvSizeType m_recv_end;
+        bool m_recv_overrun;
+        char m_recv_buffer[2 * ((size_t)RecvSizeType::maxIntValue() + 1)];
+        SendSizeType m_send_start;
+        SendSizeType m_send_end;
+        SendSizeType m_send_event;
+        char m_send_buffer[(size_t)SendSizeType::maxIntValue() + 1];
+    };
+};
+
+struct LinuxSerialService {
+    template <typename Context, typename ParentObject, int RecvBufferBits, int SendBufferBits, typename RecvHandler, typename SendHandler>
+    using Serial = LinuxSerial<Context, ParentObject, RecvBufferBits, SendBufferBits, RecvHandler, SendHandler, LinuxSerialService>;
+};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef APRINTER_LINUX_TAP_ETHERNET_H
+#define APRINTER_LINUX_TAP_ETHERNET_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+
+#include <aprinter/meta/ServiceUtils.h>
+#include <aprinter/base/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Assert.h>
+#include <aprinter/base/Callback.h>
+
+#include <aprinter/BeginNamespace.h>
+
+/*
+ * Ethernet interface for the Linux host platform, backed by a TAP device.
+ * 
+ * The device is named by the APRINTER_LINUX_TAP environment variable
+ * (default "aptap0") and is attached to each time the interface is
+ * activated. It must already exist and be configured on the host, e.g.:
+ *   ip tuntap add dev aptap0 mode tap
+ *   ip addr add 192.168.64.1/24 dev aptap0
+ *   ip link set aptap0 up
+ * 
+ * The link is reported up as soon as the device is attached. Like with
+ * LinuxSerial, the non-blocking file descriptor is polled from a timed
+ * event, so frames are received in the main context.
+ */
+
+template <typename Arg>
+class LinuxTapEthernet {
+    using Context      = typename Arg::Context;
+    using ParentObject = typename Arg::ParentObject;
+    using ClientParams = typename Arg::ClientParams;
+    
+public:
+    struct Object;
+    
+private:
+    using TheDebugObject = DebugObject<Context, Object>;
+    using Loop = typename Context::EventLoop;
+    using Clock = typename Context::Clock;
+    using TimeType = typename Clock::TimeType;
+    using SendBufferType = typename ClientParams::SendBufferType;
+    
+    static TimeType const PollIntervalTicks = 0.001 * Clock::time_freq;
+    static size_t const MaxFrameSize = 1514;
+    static int const MaxFramesPerPoll = 32;
+    
+    enum class InitState : uint8_t {INACTIVE, ACTIVATING, RUNNING};
+    
+public:
+    static void init (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        o->poll_event.init(c, APRINTER_CB_STATFUNC_T(&LinuxTapEthernet::poll_event_handler));
+        o->init_state = InitState::INACTIVE;
+        o->fd = -1;
+        
+        TheDebugObject::init(c);
+    }
+    
+    static void deinit (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::deinit(c);
+        
+        close_tap(c);
+        o->poll_event.deinit(c);
+    }
+    
+    static void reset (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        close_tap(c);
+        o->poll_event.unset(c);
+        o->init_state = InitState::INACTIVE;
+    }
+    
+    static void activate (Context c, uint8_t const *mac_addr)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        AMBRO_ASSERT(o->init_state == InitState::INACTIVE)
+        
+        // The MAC address is lwIP's own, the TAP device has a separate one
+        // on the host side, so there is nothing to configure here.
+        
+        open_tap(c);
+        
+        // Report the result from the event loop, as real drivers do.
+        o->init_state = InitState::ACTIVATING;
+        o->poll_event.appendNowNotAlready(c);
+    }
+    
+    static bool sendFrame (Context c, SendBufferType *send_buffer)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        if (o->init_state != InitState::RUNNING) {
+            return false;
+        }
+        
+        size_t total_len = send_buffer->getTotalLength();
+        if (total_len > MaxFrameSize) {
+            return false;
+        }
+        
+        size_t pos = 0;
+        do {
+            size_t chunk_len = send_buffer->getChunkLength();
+            AMBRO_ASSERT(chunk_len <= total_len - pos)
+            memcpy(o->tx_frame + pos, send_buffer->getChunkPtr(), chunk_len);
+            pos += chunk_len;
+        } while (send_buffer->nextChunk());
+        AMBRO_ASSERT(pos == total_len)
+        
+        return write(o->fd, o->tx_frame, total_len) == (ssize_t)total_len;
+    }
+    
+    static bool getLinkUp (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        return o->init_state == InitState::RUNNING;
+    }
+    
+private:
+    static void open_tap (Context c)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(o->fd < 0)
+        
+        char const *name = getenv("APRINTER_LINUX_TAP");
+        if (!name) {
+            name = "aptap0";
+        }
+        
+        int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+        if (fd < 0) {
+            fprintf(stderr, "LinuxTapEthernet: cannot open /dev/net/tun: %s\n", strerror(errno));
+            return;
+        }
+        
+        struct ifreq ifr;
+        memset(&ifr, 0, sizeof(ifr));
+        ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+        strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+        
+        if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+            fprintf(stderr, "LinuxTapEthernet: cannot attach to %s: %s\n", name, strerror(errno));
+            close(fd);
+            return;
+        }
+        
+        o->fd = fd;
+    }
+    
+    static void close_tap (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        if (o->fd >= 0) {
+            close(o->fd);
+            o->fd = -1;
+        }
+    }
+    
+    static void poll_event_handler (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        AMBRO_ASSERT(o->init_state != InitState::INACTIVE)
+        
+        if (o->init_state == InitState::ACTIVATING) {
+            if (o->fd < 0) {
+                o->init_state = InitState::INACTIVE;
+                return ClientParams::ActivateHandler::call(c, true);
+            }
+            o->init_state = InitState::RUNNING;
+            o->poll_event.appendAfter(c, PollIntervalTicks);
+            ClientParams::ActivateHandler::call(c, false);
+            if (o->init_state == InitState::RUNNING) {
+                ClientParams::LinkHandler::call(c, true);
+            }
+            return;
+        }
+        
+        o->poll_event.appendAfterPrevious(c, PollIntervalTicks);
+        
+        for (int i = 0; i < MaxFramesPerPoll && o->init_state == InitState::RUNNING; i++) {
+            ssize_t res = read(o->fd, o->rx_frame, sizeof(o->rx_frame));
+            if (res <= 0) {
+                break;
+            }
+            ClientParams::ReceiveHandler::call(c, o->rx_frame, nullptr, res, 0);
+        }
+    }
+    
+public:
+    struct Object : public ObjBase<LinuxTapEthernet, ParentObject, MakeTypeList<TheDebugObject>> {
+        typename Loop::TimedEvent poll_event;
+        InitState init_state;
+        int fd;
+        uint8_t rx_frame[MaxFrameSize];
+        uint8_t tx_frame[MaxFrameSize];
+    };
+};
+
+struct LinuxTapEthernetService {
+    APRINTER_ALIAS_STRUCT_EXT(Ethernet, (
+        APRINTER_AS_TYPE(Context),
+        APRINTER_AS_TYPE(ParentObject),
+        APRINTER_AS_TYPE(ClientParams)
+    ), (
+        APRINTER_DEF_INSTANCE(Ethernet, LinuxTapEthernet)
+    ))
+};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
@@ -58,7 +58,7 @@ private:
     
     using TheClockUtils = ClockUtils<Context>;
     using TheDebugObject = DebugObject<Context, Object>;
-    using FastEvent = typename Context::EventLoop::template FastEventSpec<Stm32f4Sdio>;
+    using FastEvent = typename Context::EventLoop::template FastEventSpec<Stm32f4Sdio, Context::EventLoop::FastPriority::Low>;
     
     enum {INIT_STATE_OFF, INIT_STATE_POWERON, INIT_STATE_ON};
     enum {CMD_STATE_READY, CMD_STATE_BUSY, CMD_STATE_WAIT_BUSY};
@@ -34,6 +34,7 @@
 #include <aprinter/meta/BasicMetaUtils.h>
 #include <aprinter/meta/PowerOfTwo.h>
 #include <aprinter/meta/IntTypeInfo.h>
+#include <aprinter/meta/StaticArray.h>
 #include <aprinter/base/Hints.h>
 #include <aprinter/math/PrintInt.h>
 
@@ -131,6 +132,145 @@ T StrToFloat (char const *nptr, char **endptr)
 #endif
 }
 
+template <typename T>
+struct FloatDecimalPowers {
+    template <int Exp>
+    struct Power {
+        static constexpr T value ()
+        {
+            return (Exp == 0) ? 1 : (10 * Power<(Exp - (Exp > 0))>::value());
+        }
+    };
+    
+    // Powers of ten which are exact in T (5^10 < 2^24).
+    static int const MaxExp = 10;
+    
+    using Table = StaticArray<T, MaxExp + 1, Power>;
+};
+
+/**
+ * A number of the form [+-]digits[.digits], as the integer of all its
+ * digits and the number of digits after the decimal point.
+ */
+struct PlainDecimal {
+    uint32_t mantissa;
+    // Number of fractional digits, -1 if there is no decimal point.
+    int frac_digits;
+    bool negative;
+};
+
+/**
+ * Parses a plain decimal number without using strtod.
+ * Returns false for anything else (exponents, inf/nan, trailing garbage)
+ * and when the digits do not fit into the mantissa exactly. The mantissa
+ * is limited to what the division in PlainDecimalToFloat can represent
+ * exactly: 2^24 if double is the same as float, otherwise 32 bits.
+ */
+inline bool ParsePlainDecimal (char const *str, PlainDecimal *out)
+{
+    bool const double_wider = sizeof(double) > sizeof(float);
+    uint32_t const max_mantissa = double_wider ? UINT32_MAX : (UINT32_C(1) << 24);
+    
+    bool negative = false;
+    if (*str == '-') {
+        negative = true;
+        str++;
+    } else if (*str == '+') {
+        str++;
+    }
+    
+    uint32_t mantissa = 0;
+    bool have_digits = false;
+    int frac_digits = -1;
+    
+    while (1) {
+        char ch = *str++;
+        if (AMBRO_LIKELY((unsigned char)(ch - '0') < 10)) {
+            uint32_t digit = ch - '0';
+            if (AMBRO_UNLIKELY(mantissa > (max_mantissa - digit) / 10)) {
+                return false;
+            }
+            mantissa = 10 * mantissa + digit;
+            have_digits = true;
+            if (frac_digits >= 0) {
+                frac_digits++;
+            }
+        } else if (ch == '.' && frac_digits < 0) {
+            frac_digits = 0;
+        } else if (ch == '\0') {
+            break;
+        } else {
+            return false;
+        }
+    }
+    
+    if (AMBRO_UNLIKELY(!have_digits)) {
+        return false;
+    }
+    
+    out->mantissa = mantissa;
+    out->frac_digits = frac_digits;
+    out->negative = negative;
+    return true;
+}
+
+/**
+ * Converts a parsed plain decimal number to floating point.
+ * 
+ * The mantissa is divided by a power of ten. This is done only when both are
+ * exactly representable, so the single rounding of the division gives the
+ * same result as a correctly rounded strtod. For float, mantissas with more
+ * bits than a float holds are divided in double precision; the result is
+ * then rounded again to float, which is exact unless the double lands on a
+ * point halfway between two floats.
+ * Returns false if the result could be inexact (too many fractional digits
+ * or the halfway case), then the caller should fall back to StrToFloat.
+ */
+template <typename T>
+bool PlainDecimalToFloat (PlainDecimal dec, T *out)
+{
+    static_assert(IsFpType<T>::Value, "");
+    
+    if (AMBRO_UNLIKELY(dec.frac_digits > FloatDecimalPowers<T>::MaxExp)) {
+        return false;
+    }
+    
+    T value;
+    if (sizeof(T) == sizeof(double) || dec.mantissa <= (UINT32_C(1) << 24)) {
+        value = dec.mantissa;
+        if (dec.frac_digits > 0) {
+            value /= FloatDecimalPowers<T>::Table::readAt(dec.frac_digits);
+        }
+    } else {
+        double dvalue = dec.mantissa;
+        if (dec.frac_digits > 0) {
+            dvalue /= FloatDecimalPowers<double>::Table::readAt(dec.frac_digits);
+        }
+        uint64_t bits = 0;
+        memcpy(&bits, &dvalue, sizeof(dvalue));
+        if (AMBRO_UNLIKELY((bits & ((UINT64_C(1) << 29) - 1)) == (UINT64_C(1) << 28))) {
+            return false;
+        }
+        value = dvalue;
+    }
+    
+    *out = dec.negative ? -value : value;
+    return true;
+}
+
+/**
+ * Converts a plain decimal number, [+-]digits[.digits], without using strtod.
+ * The result is the same as from StrToFloat (with correct rounding).
+ * Returns false if the fast conversion is not possible, then the caller
+ * should fall back to StrToFloat.
+ */
+template <typename T>
+bool FastDecimalToFloat (char const *str, T *out)
+{
+    PlainDecimal dec;
+    return ParsePlainDecimal(str, &dec) && PlainDecimalToFloat(dec, out);
+}
+
 double FloatLdexp (double x, int exp)
 {
     return ldexp(x, exp);
@@ -73,6 +73,7 @@ public:
     struct Object;
     class TcpListener;
     class TcpConnection;
+    class TcpSendRef;
     
 private:
     static_assert(TCP_WND <= 0xFFFF, "");
@@ -88,12 +89,21 @@ private:
     using TheEthernetClientParams = EthernetClientParams<EthernetActivateHandler, EthernetLinkHandler, EthernetReceiveHandler, EthernetSendBuffer>;
     APRINTER_MAKE_INSTANCE(TheEthernet, (EthernetService::template Ethernet<Context, Object, TheEthernetClientParams>))
     
-    using TimeoutsFastEvent = typename Context::EventLoop::template FastEventSpec<LwipNetwork>;
+    using TimeoutsFastEvent = typename Context::EventLoop::template FastEventSpec<LwipNetwork, Context::EventLoop::FastPriority::Low>;
     
     static TimeType const WriteDelayTicks      = 0.00015 * Context::Clock::time_freq;
     static TimeType const ShortWriteDelayTicks = 0.00005 * Context::Clock::time_freq;
     
 public:
+    // Connections queued by listeners (waiting for a free client slot) are held
+    // in entries of a pool shared by all listeners. Each listener limits its own
+    // use of the pool via TcpListenerQueueParams::size.
+    static int const QueuePoolSize = APRINTER_NUM_TCP_CONN_QUEUED;
+    
+    // Maximum number of TcpSendRef's which may be queued to connections at
+    // any one time (over all connections); lwIP's pbuf pools are sized for it.
+    static int const MaxSendRefs = APRINTER_NUM_TCP_SEND_REFS;
+    
     struct NetworkParams {
         uint8_t mac_addr[6];
         bool link_up; // for getStatus() only 
@@ -118,6 +128,10 @@ public:
             // We statically allocate PBUF_REF pbufs instead of using pbuf_alloc().
             init_rx_pbuf(&o->rx_pbuf[i]);
         }
+        for (TcpListenerQueueEntry &entry : o->queue_pool) {
+            entry.m_listener = nullptr;
+            entry.m_pcb = nullptr;
+        }
         Context::EventLoop::template triggerFastEvent<TimeoutsFastEvent>(c);
     }
     
@@ -252,6 +266,7 @@ public:
     };
     
     class TcpListenerQueueEntry {
+        friend LwipNetwork;
         friend class TcpListener;
         
     private:
@@ -263,7 +278,6 @@ public:
     struct TcpListenerQueueParams {
         int size;
         TimeType timeout;
-        TcpListenerQueueEntry *entries;
     };
     
     class TcpListener {
@@ -306,19 +320,13 @@ public:
             AMBRO_ASSERT(!m_pcb)
             AMBRO_ASSERT(max_clients > 0)
             AMBRO_ASSERT(queue_params.size >= 0)
-            AMBRO_ASSERT(queue_params.size == 0 || queue_params.entries)
             
             max_clients = MinValue(255, max_clients);
             
-            m_queue = queue_params.entries;
             m_queue_timeout = queue_params.timeout;
             m_num_clients = 0;
-            m_queue_size = MinValue(255 - max_clients, queue_params.size);
-            
-            for (int i = 0; i < m_queue_size; i++) {
-                m_queue[i].m_listener = this;
-                m_queue[i].m_pcb = nullptr;
-            }
+            m_num_queued = 0;
+            m_queue_size = MinValue(255 - max_clients, MinValue(QueuePoolSize, queue_params.size));
             
             do {
                 m_pcb = tcp_new_listen();
@@ -362,6 +370,13 @@ public:
             }
         }
         
+        bool hasQueuedConnections (Context c)
+        {
+            AMBRO_ASSERT(m_pcb)
+            
+            return m_num_queued > 0;
+        }
+        
     private:
         void reset_internal (Context c)
         {
@@ -369,9 +384,10 @@ public:
             AMBRO_ASSERT(!m_pcb || m_num_clients == 0)
             
             if (m_pcb) {
-                for (int i = 0; i < m_queue_size; i++) {
-                    if (m_queue[i].m_pcb) {
-                        close_queued_connection(&m_queue[i], false);
+                auto *o = Object::self(c);
+                for (TcpListenerQueueEntry &entry : o->queue_pool) {
+                    if (entry.m_pcb && entry.m_listener == this) {
+                        close_queued_connection(&entry, false);
                     }
                 }
                 
@@ -428,10 +444,18 @@ public:
         
         bool queue_connection (Context c, struct tcp_pcb *pcb)
         {
-            for (int i = 0; i < m_queue_size; i++) {
-                TcpListenerQueueEntry *entry = &m_queue[i];
+            auto *o = Object::self(c);
+            
+            if (m_num_queued >= m_queue_size) {
+                return false;
+            }
+            
+            for (TcpListenerQueueEntry &entry_ref : o->queue_pool) {
+                TcpListenerQueueEntry *entry = &entry_ref;
                 if (!entry->m_pcb) {
+                    entry->m_listener = this;
                     entry->m_pcb = pcb;
+                    m_num_queued++;
                     entry->m_time = Context::Clock::getTime(c);
                     tcp_arg((struct tcp_pcb_base *)pcb, entry);
                     tcp_err(pcb, &TcpListener::queued_pcb_err_handler_wrapper);
@@ -466,7 +490,17 @@ public:
                 tcp_close(entry->m_pcb);
             }
             
+            release_queue_entry(entry);
+        }
+        
+        void release_queue_entry (TcpListenerQueueEntry *entry)
+        {
+            AMBRO_ASSERT(entry->m_pcb)
+            AMBRO_ASSERT(entry->m_listener == this)
+            AMBRO_ASSERT(m_num_queued > 0)
+            
             entry->m_pcb = nullptr;
+            m_num_queued--;
         }
         
         static void queued_pcb_err_handler_wrapper (void *arg, err_t err)
@@ -531,12 +565,18 @@ public:
             m_num_clients--;
         }
         
-        TcpListenerQueueEntry * find_oldest_queued_pcb ()
+        TcpListenerQueueEntry * find_oldest_queued_pcb (Context c)
         {
+            auto *o = Object::self(c);
+            
+            if (m_num_queued == 0) {
+                return nullptr;
+            }
+            
             TcpListenerQueueEntry *oldest_entry = nullptr;
-            for (int i = 0; i < m_queue_size; i++) {
-                TcpListenerQueueEntry *entry = &m_queue[i];
-                if (entry->m_pcb && (!oldest_entry || !TheClockUtils::timeGreaterOrEqual(entry->m_time, oldest_entry->m_time))) {
+            for (TcpListenerQueueEntry &entry_ref : o->queue_pool) {
+                TcpListenerQueueEntry *entry = &entry_ref;
+                if (entry->m_pcb && entry->m_listener == this && (!oldest_entry || !TheClockUtils::timeGreaterOrEqual(entry->m_time, oldest_entry->m_time))) {
                     oldest_entry = entry;
                 }
             }
@@ -550,7 +590,7 @@ public:
             AMBRO_ASSERT(!m_newpcb)
             
             // Find the connection that has been queued for the longest time.
-            TcpListenerQueueEntry *oldest_entry = find_oldest_queued_pcb();
+            TcpListenerQueueEntry *oldest_entry = find_oldest_queued_pcb(c);
             if (!oldest_entry) {
                 return;
             }
@@ -567,14 +607,14 @@ public:
             
             // If the handler took the connection, release the queue entry.
             if (m_newpcb_taken) {
-                oldest_entry->m_pcb = nullptr;
+                release_queue_entry(oldest_entry);
                 update_timeout(c);
             }
         }
         
         void update_timeout (Context c)
         {
-            TcpListenerQueueEntry *oldest_entry = find_oldest_queued_pcb();
+            TcpListenerQueueEntry *oldest_entry = find_oldest_queued_pcb(c);
             if (oldest_entry) {
                 TimeType expire_time = oldest_entry->m_time + m_queue_timeout;
                 m_timeout_event.appendAt(c, expire_time);
@@ -589,7 +629,7 @@ public:
             AMBRO_ASSERT(m_queue_size > 0)
             
             // The oldest queued connection has expired, close it.
-            TcpListenerQueueEntry *oldest_entry = find_oldest_queued_pcb();
+            TcpListenerQueueEntry *oldest_entry = find_oldest_queued_pcb(c);
             AMBRO_ASSERT(oldest_entry)
             close_queued_connection(oldest_entry, false);
             update_timeout(c);
@@ -600,9 +640,9 @@ public:
         AcceptHandler m_accept_handler;
         struct tcp_pcb_listen *m_pcb;
         struct tcp_pcb *m_newpcb;
-        TcpListenerQueueEntry *m_queue;
         TimeType m_queue_timeout;
         uint8_t m_num_clients;
+        uint8_t m_num_queued;
         uint8_t m_queue_size;
         bool m_newpcb_taken;
     };
@@ -640,6 +680,45 @@ public:
         virtual void connectionSendHandler (Context c) = 0;
     };
     
+    // Data to be sent from the user's memory instead of being copied into the
+    // send buffer of a connection, see TcpConnection::provideSendRef().
+    // The data must remain valid until SentHandler is called, which happens
+    // when all of it has been acked, or when the connection is reset or fails.
+    class TcpSendRef {
+        friend class TcpConnection;
+        
+    public:
+        // WARNING: Do not call any network functions from this callback.
+        // This may be called from within TcpConnection::reset() or deinit().
+        using SentHandler = Callback<void(Context)>;
+        
+        void init (Context c, SentHandler sent_handler)
+        {
+            m_sent_handler = sent_handler;
+            m_connection = nullptr;
+        }
+        
+        void deinit (Context c)
+        {
+            AMBRO_ASSERT(!m_connection)
+        }
+        
+        bool isQueued (Context c)
+        {
+            return m_connection != nullptr;
+        }
+        
+    private:
+        SentHandler m_sent_handler;
+        TcpConnection *m_connection;
+        TcpSendRef *m_next;
+        char const *m_data;
+        size_t m_ring_pos;
+        size_t m_length;
+        size_t m_passed_length;
+        size_t m_acked_length;
+    };
+    
     class TcpConnection {
         enum class State : uint8_t {IDLE, RUNNING, ERRORING, ERRORED};
         
@@ -660,6 +739,10 @@ public:
             m_state = State::IDLE;
             m_pcb = nullptr;
             m_received_pbuf = nullptr;
+            m_send_refs_first = nullptr;
+            m_send_refs_last = nullptr;
+            m_send_refs_to_pass = nullptr;
+            m_send_refs_length = 0;
         }
         
         void deinit (Context c)
@@ -681,6 +764,7 @@ public:
             AMBRO_ASSERT(m_state == State::IDLE)
             AMBRO_ASSERT(!m_pcb)
             AMBRO_ASSERT(!m_received_pbuf)
+            AMBRO_ASSERT(!m_send_refs_first)
             
             m_pcb = listener->yank_client_pcb();
             m_listener = listener;
@@ -697,6 +781,7 @@ public:
             m_send_buf_start = 0;
             m_send_buf_length = 0;
             m_send_buf_passed_length = 0;
+            m_send_buf_acked_pos = 0;
         }
         
         void copyReceivedData (Context c, char *buffer, size_t length)
@@ -740,7 +825,8 @@ public:
             AMBRO_ASSERT(m_state == OneOf(State::RUNNING, State::ERRORING))
             // No assert !m_send_closed, so this can be used to see when data was acked.
             
-            return (ProvidedTxBufSize - m_send_buf_length);
+            // Data queued via provideSendRef() takes space like the data in the send buffer.
+            return (ProvidedTxBufSize - m_send_buf_length - m_send_refs_length);
         }
         
         WrapBuffer getSendBufferPtr (Context c)
@@ -755,7 +841,7 @@ public:
         {
             AMBRO_ASSERT(m_state == OneOf(State::RUNNING, State::ERRORING))
             AMBRO_ASSERT(!m_send_closed)
-            AMBRO_ASSERT(amount <= ProvidedTxBufSize - m_send_buf_length)
+            AMBRO_ASSERT(amount <= getSendBufferSpace(c))
             
             m_send_buf_length += amount;
         }
@@ -764,19 +850,50 @@ public:
         {
             AMBRO_ASSERT(m_state == OneOf(State::RUNNING, State::ERRORING))
             AMBRO_ASSERT(!m_send_closed)
-            AMBRO_ASSERT(data.len <= ProvidedTxBufSize - m_send_buf_length)
+            AMBRO_ASSERT(data.len <= getSendBufferSpace(c))
             
             make_send_avail_wrap_buffer(c).copyIn(data);
             m_send_buf_length += data.len;
         }
         
+        // Queues data to be sent without copying, following any data provided
+        // so far. The data is passed to lwIP by reference, and ref is
+        // released (its SentHandler called) when lwIP no longer needs it.
+        void provideSendRef (Context c, TcpSendRef *ref, char const *data, size_t length)
+        {
+            AMBRO_ASSERT(m_state == OneOf(State::RUNNING, State::ERRORING))
+            AMBRO_ASSERT(!m_send_closed)
+            AMBRO_ASSERT(!ref->m_connection)
+            AMBRO_ASSERT(length > 0)
+            AMBRO_ASSERT(length <= getSendBufferSpace(c))
+            
+            ref->m_connection = this;
+            ref->m_next = nullptr;
+            ref->m_data = data;
+            ref->m_ring_pos = m_send_buf_acked_pos + m_send_buf_length;
+            ref->m_length = length;
+            ref->m_passed_length = 0;
+            ref->m_acked_length = 0;
+            
+            if (m_send_refs_last) {
+                m_send_refs_last->m_next = ref;
+            } else {
+                m_send_refs_first = ref;
+            }
+            m_send_refs_last = ref;
+            if (!m_send_refs_to_pass) {
+                m_send_refs_to_pass = ref;
+            }
+            m_send_refs_length += length;
+        }
+        
         void pokeSending (Context c)
         {
             AMBRO_ASSERT(m_state == OneOf(State::RUNNING, State::ERRORING))
             AMBRO_ASSERT(!m_send_closed)
             
             if (m_state == State::RUNNING && !m_write_event.isSet(c)) {
-                TimeType delay = (m_send_buf_passed_length == 0) ? ShortWriteDelayTicks : WriteDelayTicks;
+                TimeType delay = have_unacked_passed_data() ? WriteDelayTicks : ShortWriteDelayTicks;
                 m_write_event.appendAfterNotAlready(c, delay);
             }
         }
@@ -802,7 +919,7 @@ public:
                 if (m_pcb == m_listener->m_newpcb) {
                     m_listener->m_newpcb = nullptr;
                 }
-                close_pcb(m_pcb, m_send_buf_passed_length);
+                close_pcb(m_pcb, have_unacked_passed_data());
                 m_pcb = nullptr;
                 m_listener->client_pcb_closed();
             }
@@ -810,6 +927,8 @@ public:
             m_write_event.unset(c);
             m_closed_event.unset(c);
             m_state = State::IDLE;
+            
+            release_send_refs(c);
         }
         
         void go_erroring (Context c, bool pcb_gone)
@@ -818,7 +937,7 @@ public:
             AMBRO_ASSERT(m_pcb)
             
             if (!pcb_gone) {
-                close_pcb(m_pcb, m_send_buf_passed_length);
+                close_pcb(m_pcb, have_unacked_passed_data());
             }
             m_pcb = nullptr;
             m_listener->client_pcb_closed();
@@ -826,6 +945,34 @@ public:
             m_state = State::ERRORING;
             m_write_event.unset(c);
             m_closed_event.prependNow(c);
+            
+            // lwIP is done with any referenced data now, the rest will not be sent.
+            release_send_refs(c);
+        }
+        
+        // Whether lwIP has (or may have) references to data which has not been acked.
+        bool have_unacked_passed_data ()
+        {
+            return m_send_buf_passed_length > 0 ||
+                   (m_send_refs_first && m_send_refs_first->m_passed_length > m_send_refs_first->m_acked_length);
+        }
+        
+        // Number of bytes in the send buffer which go before the given reference.
+        size_t send_buf_length_before_ref (TcpSendRef *ref)
+        {
+            return (size_t)(ref->m_ring_pos - m_send_buf_acked_pos);
+        }
+        
+        void release_send_refs (Context c)
+        {
+            while (TcpSendRef *ref = m_send_refs_first) {
+                m_send_refs_first = ref->m_next;
+                ref->m_connection = nullptr;
+                ref->m_sent_handler(c);
+            }
+            m_send_refs_last = nullptr;
+            m_send_refs_to_pass = nullptr;
+            m_send_refs_length = 0;
         }
         
         static void pcb_err_handler_wrapper (void *arg, err_t err)
@@ -886,14 +1033,50 @@ public:
         {
             Context c;
             AMBRO_ASSERT(m_state == State::RUNNING)
-            AMBRO_ASSERT(len <= m_send_buf_passed_length)
             AMBRO_ASSERT(m_send_buf_passed_length <= m_send_buf_length)
             
-            m_send_buf_start = send_buf_add(m_send_buf_start, len);
-            m_send_buf_length -= len;
-            m_send_buf_passed_length -= len;
+            // The data was passed to lwIP in order, so it is acked in the same order:
+            // the send buffer data before the first reference, then that reference,
+            // and so on.
+            size_t rem_len = len;
+            while (rem_len > 0) {
+                size_t buf_len = m_send_refs_first ? send_buf_length_before_ref(m_send_refs_first) : m_send_buf_passed_length;
+                buf_len = MinValue(buf_len, rem_len);
+                AMBRO_ASSERT(buf_len <= m_send_buf_passed_length)
+                
+                m_send_buf_start = send_buf_add(m_send_buf_start, buf_len);
+                m_send_buf_length -= buf_len;
+                m_send_buf_passed_length -= buf_len;
+                m_send_buf_acked_pos += buf_len;
+                rem_len -= buf_len;
+                
+                if (rem_len == 0) {
+                    break;
+                }
+                
+                TcpSendRef *ref = m_send_refs_first;
+                AMBRO_ASSERT(ref)
+                AMBRO_ASSERT(send_buf_length_before_ref(ref) == 0)
+                
+                size_t ref_len = MinValue(rem_len, (size_t)(ref->m_passed_length - ref->m_acked_length));
+                AMBRO_ASSERT(ref_len > 0)
+                
+                ref->m_acked_length += ref_len;
+                m_send_refs_length -= ref_len;
+                rem_len -= ref_len;
+                
+                if (ref->m_acked_length == ref->m_length) {
+                    AMBRO_ASSERT(m_send_refs_to_pass != ref)
+                    m_send_refs_first = ref->m_next;
+                    if (!m_send_refs_first) {
+                        m_send_refs_last = nullptr;
+                    }
+                    ref->m_connection = nullptr;
+                    ref->m_sent_handler(c);
+                }
+            }
             
-            if (m_send_buf_passed_length < m_send_buf_length) {
+            if (m_send_buf_passed_length < m_send_buf_length || m_send_refs_to_pass) {
                 m_write_event.appendAfter(c, WriteDelayTicks);
             }
             
@@ -918,23 +1101,52 @@ public:
         {
             AMBRO_ASSERT(m_state == State::RUNNING)
             
-            while (m_send_buf_passed_length < m_send_buf_length) {
-                size_t pass_offset = send_buf_add(m_send_buf_start, m_send_buf_passed_length);
-                size_t pass_avail = m_send_buf_length - m_send_buf_passed_length;
-                size_t pass_length = MinValue(pass_avail, (size_t)(ProvidedTxBufSize - pass_offset));
+            while (true) {
+                // Pass the send buffer data up to the next reference, or all of it.
+                size_t buf_end = m_send_refs_to_pass ? send_buf_length_before_ref(m_send_refs_to_pass) : m_send_buf_length;
+                AMBRO_ASSERT(buf_end <= m_send_buf_length)
+                
+                while (m_send_buf_passed_length < buf_end) {
+                    size_t pass_offset = send_buf_add(m_send_buf_start, m_send_buf_passed_length);
+                    size_t pass_avail = buf_end - m_send_buf_passed_length;
+                    size_t pass_length = MinValue(pass_avail, (size_t)(ProvidedTxBufSize - pass_offset));
+                    
+                    u16_t written;
+                    auto err = tcp_write(m_pcb, m_send_buf + pass_offset, pass_length, TCP_WRITE_FLAG_PARTIAL, &written);
+                    if (err != ERR_OK) {
+                        return go_erroring(c, false);
+                    }
+                    
+                    AMBRO_ASSERT(written <= pass_length)
+                    m_send_buf_passed_length += written;
+                    
+                    if (written < pass_length) {
+                        goto output;
+                    }
+                }
+                
+                TcpSendRef *ref = m_send_refs_to_pass;
+                if (!ref) {
+                    break;
+                }
+                
+                // Pass the referenced data.
+                size_t pass_length = ref->m_length - ref->m_passed_length;
                 
                 u16_t written;
-                auto err = tcp_write(m_pcb, m_send_buf + pass_offset, pass_length, TCP_WRITE_FLAG_PARTIAL, &written);
+                auto err = tcp_write(m_pcb, ref->m_data + ref->m_passed_length, pass_length, TCP_WRITE_FLAG_PARTIAL, &written);
                 if (err != ERR_OK) {
                     return go_erroring(c, false);
                 }
                 
                 AMBRO_ASSERT(written <= pass_length)
-                m_send_buf_passed_length += written;
+                ref->m_passed_length += written;
                 
                 if (written < pass_length) {
                     goto output;
                 }
+                
+                m_send_refs_to_pass = ref->m_next;
             }
             
             if (m_send_closed && m_send_shut_pending) {
@@ -966,7 +1178,7 @@ public:
             return WrapBuffer(ProvidedTxBufSize - write_offset, m_send_buf + write_offset, m_send_buf);
         }
         
-        static void close_pcb (struct tcp_pcb *pcb, size_t send_buf_passed_length)
+        static void close_pcb (struct tcp_pcb *pcb, bool have_unacked_passed_data)
         {
             tcp_arg((struct tcp_pcb_base *)pcb, nullptr);
             tcp_err(pcb, nullptr);
@@ -974,8 +1186,9 @@ public:
             tcp_sent(pcb, nullptr);
             
             // If we have unacked data queued for sending, we have to resort
-            // to tcp_abort() because the referenced m_send_buf may go away.
-            if (send_buf_passed_length > 0) {
+            // to tcp_abort() because the referenced m_send_buf (or the data
+            // of TcpSendRef's) may go away.
+            if (have_unacked_passed_data) {
                 tcp_abort(pcb);
             } else {
                 tcp_close(pcb);
@@ -1006,6 +1219,11 @@ public:
         size_t m_send_buf_start;
         size_t m_send_buf_length;
         size_t m_send_buf_passed_length;
+        size_t m_send_buf_acked_pos;
+        TcpSendRef *m_send_refs_first;
+        TcpSendRef *m_send_refs_last;
+        TcpSendRef *m_send_refs_to_pass;
+        size_t m_send_refs_length;
         char m_send_buf[ProvidedTxBufSize];
     };
     
@@ -1303,6 +1521,7 @@ public:
         struct pbuf rx_pbuf[2];
         struct netif netif;
         struct dhcp dhcp;
+        TcpListenerQueueEntry queue_pool[MaxValue(1, QueuePoolSize)];
     };
 };
 
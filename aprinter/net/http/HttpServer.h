@@ -43,6 +43,7 @@
 #include <aprinter/base/MemRef.h>
 #include <aprinter/base/OneOf.h>
 #include <aprinter/misc/StringTools.h>
+#include <aprinter/misc/ClockUtils.h>
 #include <aprinter/net/http/HttpServerConstants.h>
 #include <aprinter/net/http/HttpPathParser.h>
 
@@ -64,10 +65,10 @@ private:
     class Client;
     
     using TimeType = typename Context::Clock::TimeType;
+    using TheClockUtils = ClockUtils<Context>;
     using TheNetwork = typename Context::Network;
     using TheTcpListener            = typename TheNetwork::TcpListener;
     using TheTcpListenerQueueParams = typename TheNetwork::TcpListenerQueueParams;
-    using TheTcpListenerQueueEntry  = typename TheNetwork::TcpListenerQueueEntry;
     using TheTcpConnection          = typename TheNetwork::TcpConnection;
     
     static size_t const RxBufferSize = TheTcpConnection::RequiredRxBufSize;
@@ -107,17 +108,21 @@ private:
     
 public:
     using TheRequestInterface = Client;
+    using ResponseBodyRef = typename TheNetwork::TcpSendRef;
     
     static size_t const MaxTxChunkOverhead = TxChunkOverhead;
     static size_t const MaxTxChunkSize = TxBufferSizeForChunkData;
     static size_t const MaxGuaranteedBufferAvailBeforeHeadSent = TxBufferSizeForChunkData - MinValue(TxBufferSizeForChunkData, Params::ExpectedResponseLength);
     
+    // Longest If-None-Match header value which is remembered, longer ones are ignored.
+    static size_t const MaxIfNoneMatchLength = 32;
+    
     static void init (Context c)
     {
         auto *o = Object::self(c);
         
         o->listener.init(c, APRINTER_CB_STATFUNC_T(&HttpServer::listener_accept_handler));
-        if (!o->listener.startListening(c, Params::Net::Port, Params::Net::MaxClients, TheTcpListenerQueueParams{Params::Net::QueueSize, QueueTimeoutTicks, o->queue})) {
+        if (!o->listener.startListening(c, Params::Net::Port, Params::Net::MaxClients, TheTcpListenerQueueParams{Params::Net::QueueSize, QueueTimeoutTicks})) {
             TheMain::print_pgm_string(c, AMBRO_PSTR("//HttpServerListenError\n"));
         }
         for (Client &client : o->clients) {
@@ -145,6 +150,24 @@ private:
                 return client.accept_connection(c, &o->listener);
             }
         }
+        
+        // All clients are busy. Rather than leave the new connection queued,
+        // reuse the client of the persistent connection which has been idle
+        // the longest (between requests). Browsers open several connections
+        // and keep them alive, which would otherwise block other connections.
+        Client *idle_client = nullptr;
+        for (Client &client : o->clients) {
+            if (client.is_idle(c) && (!idle_client || !TheClockUtils::timeGreaterOrEqual(client.m_idle_time, idle_client->m_idle_time))) {
+                idle_client = &client;
+            }
+        }
+        if (idle_client) {
+#if APRINTER_DEBUG_HTTP_SERVER
+            TheMain::print_pgm_string(c, AMBRO_PSTR("//HttpClientIdleClosed\n"));
+#endif
+            idle_client->disconnect(c);
+            return idle_client->accept_connection(c, &o->listener);
+        }
     }
     
     static size_t buf_add (size_t start, size_t count)
@@ -161,8 +184,9 @@ private:
         
     private:
         enum class State : uint8_t {
-            NOT_CONNECTED, WAIT_SEND_BUF_FOR_REQUEST,
+            NOT_CONNECTED,
             RECV_REQUEST_LINE, RECV_HEADER_LINE,
+            WAIT_SEND_BUF_FOR_RESPONSE,
             HEAD_RECEIVED, USER_GONE,
             DISCONNECT_AFTER_SENDING, CALLING_REQUEST_TERMINATED
         };
@@ -238,11 +262,10 @@ private:
             m_rx_buf_start = 0;
             m_rx_buf_length = 0;
             m_rx_buf_eof = false;
+            m_kept_alive = false;
             
-            // Go prepare_for_request() very soon through this state for simplicity.
-            // Really there will be no waiting.
-            m_state = State::WAIT_SEND_BUF_FOR_REQUEST;
-            m_send_event.prependNow(c);
+            // Start receiving the first request.
+            prepare_for_request(c);
         }
         
         void disconnect (Context c)
@@ -299,6 +322,8 @@ private:
             m_bad_transfer_encoding = false;
             m_expect_100_continue = false;
             m_expectation_failed = false;
+            m_accept_gzip = false;
+            m_if_none_match[0] = '\0';
             m_rem_allowed_length = Params::MaxRequestHeadLength;
             
             // And set some values related to higher-level processing of the request.
@@ -313,11 +338,23 @@ private:
             // Prepare for parsing the request as a sequence of lines.
             prepare_line_parsing(c);
             
-            // Waiting for space in the send buffer.
+            // Start receiving the request head. This does not wait for the previous
+            // response to leave the send buffer, so that pipelined requests are parsed
+            // while it is being sent (we wait for send buffer space after the head).
             m_state = State::RECV_REQUEST_LINE;
+            m_idle_time = Context::Clock::getTime(c);
             m_recv_event.prependNow(c);
         }
         
+        bool is_idle (Context c)
+        {
+            // A persistent connection waiting for another request with no part of
+            // it received and with the previous response completely sent.
+            return m_state == State::RECV_REQUEST_LINE && m_kept_alive &&
+                   m_line_length == 0 && m_rx_buf_length == 0 && !m_rx_buf_eof &&
+                   m_connection.getSendBufferSpace(c) >= TxBufferSize;
+        }
+        
         bool have_request (Context c)
         {
             return (m_state == OneOf(State::HEAD_RECEIVED, State::USER_GONE));
@@ -331,14 +368,19 @@ private:
             {
                 // The request is processed.
                 // If closing is desired, we want to wait until the send buffer is emptied,
-                // otherwise just until we have enough space in the send buffer for the next request.
+                // otherwise start receiving the next request right away.
                 AMBRO_ASSERT(!m_user)
                 AMBRO_ASSERT(!m_send_timeout_event.isSet(c))
                 AMBRO_ASSERT(!m_recv_timeout_event.isSet(c))
-                m_state = m_close_connection ? State::DISCONNECT_AFTER_SENDING : State::WAIT_SEND_BUF_FOR_REQUEST;
                 m_recv_state = RecvState::INVALID;
                 m_send_state = SendState::INVALID;
-                m_send_event.prependNow(c);
+                if (m_close_connection) {
+                    m_state = State::DISCONNECT_AFTER_SENDING;
+                    m_send_event.prependNow(c);
+                } else {
+                    m_kept_alive = true;
+                    prepare_for_request(c);
+                }
             }
         }
         
@@ -390,11 +432,11 @@ private:
         void send_event_handler (Context c)
         {
             switch (m_state) {
-                case State::WAIT_SEND_BUF_FOR_REQUEST: {
-                    // When we have sufficient space in the send buffer, start receiving a request.
+                case State::WAIT_SEND_BUF_FOR_RESPONSE: {
+                    // When we have sufficient space in the send buffer, start processing the request.
                     if (m_connection.getSendBufferSpace(c) >= Params::ExpectedResponseLength) {
                         m_send_timeout_event.unset(c);
-                        prepare_for_request(c);
+                        request_head_received(c);
                     } else {
                         m_send_timeout_event.appendAfter(c, InactivityTimeoutTicks);
                     }
@@ -529,7 +571,7 @@ private:
 #endif
             
             switch (m_state) {
-                case State::WAIT_SEND_BUF_FOR_REQUEST:
+                case State::WAIT_SEND_BUF_FOR_RESPONSE:
                 case State::DISCONNECT_AFTER_SENDING: {
                     disconnect(c);
                 } break;
@@ -672,9 +714,13 @@ private:
                 
                 case State::RECV_HEADER_LINE: {
                     // An empty line terminates the request head.
+                    // The previous response may still occupy the send buffer,
+                    // so wait for space for the response before processing it.
                     if (length == 0) {
                         m_recv_timeout_event.unset(c);
-                        return request_head_received(c);
+                        m_state = State::WAIT_SEND_BUF_FOR_RESPONSE;
+                        m_send_event.prependNow(c);
+                        return;
                     }
                     
                     // Extract and remember any useful information the header and continue parsing.
@@ -787,6 +833,54 @@ private:
                     }
                 });
             }
+            else if (StringRemoveHttpHeader(&header, "accept-encoding")) {
+                // Only gzip is of interest. Its parameters may follow in separate
+                // tokens (e.g. "gzip; q=0"), a zero qvalue means it is not acceptable.
+                bool in_gzip = false;
+                StringIterHttpTokens(header, [this, &in_gzip](MemRef token) {
+                    if (!is_http_param(token)) {
+                        size_t name_len = 0;
+                        while (name_len < token.len && token.ptr[name_len] != ';') {
+                            name_len++;
+                        }
+                        in_gzip = MemEqualsCaseIns(token.subTo(name_len), "gzip");
+                        if (in_gzip) {
+                            m_accept_gzip = true;
+                        }
+                        token = token.subFrom(name_len);
+                    }
+                    if (in_gzip && is_zero_qvalue_param(token)) {
+                        m_accept_gzip = false;
+                    }
+                });
+            }
+            else if (StringRemoveHttpHeader(&header, "if-none-match")) {
+                size_t length = strlen(header);
+                if (length <= MaxIfNoneMatchLength) {
+                    memcpy(m_if_none_match, header, length + 1);
+                }
+            }
+        }
+        
+        static bool is_http_param (MemRef token)
+        {
+            return token.len > 0 && (token.ptr[0] == ';' || (token.len >= 2 && AsciiToLower(token.ptr[0]) == 'q' && token.ptr[1] == '='));
+        }
+        
+        static bool is_zero_qvalue_param (MemRef token)
+        {
+            while (token.len > 0 && token.ptr[0] == ';') {
+                token = token.subFrom(1);
+            }
+            if (token.len < 3 || AsciiToLower(token.ptr[0]) != 'q' || token.ptr[1] != '=' || token.ptr[2] != '0') {
+                return false;
+            }
+            for (size_t i = 3; i < token.len; i++) {
+                if (token.ptr[i] != '.' && token.ptr[i] != '0') {
+                    return false;
+                }
+            }
+            return true;
         }
         
         void request_head_received (Context c)
@@ -1004,13 +1098,15 @@ private:
         {
             AMBRO_ASSERT(m_state != State::NOT_CONNECTED)
             AMBRO_ASSERT(m_state != State::DISCONNECT_AFTER_SENDING)
-            AMBRO_ASSERT(!resp_status || m_state != State::WAIT_SEND_BUF_FOR_REQUEST)
             
             // Terminate the request with the user, if any.
             terminate_user(c);
             
-            // Send an error response if desired and possible.
-            if (resp_status && m_send_state == OneOf(SendState::INVALID, SendState::HEAD_NOT_SENT, SendState::SEND_HEAD)) {
+            // Send an error response if desired and possible. Before the request head
+            // is received, the previous response may not have left enough space.
+            if (resp_status && m_send_state == OneOf(SendState::INVALID, SendState::HEAD_NOT_SENT, SendState::SEND_HEAD) &&
+                (have_request(c) || m_connection.getSendBufferSpace(c) >= Params::ExpectedResponseLength))
+            {
                 send_response(c, resp_status, true, nullptr, nullptr, true);
             }
             
@@ -1033,24 +1129,33 @@ private:
                 content_type = HttpContentTypes::TextPlainUtf8();
             }
             
+            // A 304 response has no body, not even the status.
+            bool no_body = !strcmp(resp_status, HttpStatusCodes::NotModified());
+            if (no_body) {
+                send_status_as_body = false;
+            }
+            
             // Send the response head.
             send_string(c, "HTTP/1.1 ");
             send_string(c, resp_status);
             if (connection_close) {
                 send_string(c, "\r\nConnection: close");
             }
-            send_string(c, "\r\nServer: Aprinter\r\nContent-Type: ");
-            send_string(c, content_type);
-            send_string(c, "\r\n");
-            if (send_status_as_body) {
-                send_string(c, "Content-Length: ");
-                char length_buf[12];
-                sprintf(length_buf, "%d", (int)(strlen(resp_status) + 1));
-                send_string(c, length_buf);
-            } else {
-                send_string(c, "Transfer-Encoding: chunked");
+            send_string(c, "\r\nServer: Aprinter\r\n");
+            if (!no_body) {
+                send_string(c, "Content-Type: ");
+                send_string(c, content_type);
+                send_string(c, "\r\n");
+                if (send_status_as_body) {
+                    send_string(c, "Content-Length: ");
+                    char length_buf[12];
+                    sprintf(length_buf, "%d", (int)(strlen(resp_status) + 1));
+                    send_string(c, length_buf);
+                } else {
+                    send_string(c, "Transfer-Encoding: chunked");
+                }
+                send_string(c, "\r\n");
             }
-            send_string(c, "\r\n");
             if (extra_headers) {
                 send_string(c, extra_headers);
             }
@@ -1065,6 +1170,17 @@ private:
             m_connection.pokeSending(c);
         }
         
+        void check_close_for_queued (Context c)
+        {
+            auto *o = Object::self(c);
+            
+            // Don't keep the connection alive while other connections are
+            // queued waiting for a client, so that clients take turns.
+            if (o->listener.hasQueuedConnections(c)) {
+                m_close_connection = true;
+            }
+        }
+        
         void abandon_response_body (Context c)
         {
             AMBRO_ASSERT(m_send_state != SendState::INVALID)
@@ -1072,7 +1188,8 @@ private:
             if (m_send_state == OneOf(SendState::HEAD_NOT_SENT, SendState::SEND_HEAD)) {
                 // The response head has not been sent.
                 // Send the response now, with the status as the body.
-                send_response(c, m_resp_status, true, nullptr, nullptr, m_close_connection);
+                check_close_for_queued(c);
+                send_response(c, m_resp_status, true, nullptr, m_resp_extra_headers, m_close_connection);
                 
                 // Close sending on the connection if needed.
                 if (m_close_connection) {
@@ -1156,6 +1273,34 @@ private:
             return m_have_request_body;
         }
         
+        // Returns whether the request body has a length given by Content-Length
+        // (and is not chunked), and if so stores the length to *length.
+        bool getRequestBodyLength (Context c, uint64_t *length)
+        {
+            AMBRO_ASSERT(m_state == State::HEAD_RECEIVED)
+            
+            if (!m_have_request_body || m_have_chunked) {
+                return false;
+            }
+            *length = m_rem_req_body_length;
+            return true;
+        }
+        
+        bool acceptsGzipEncoding (Context c)
+        {
+            AMBRO_ASSERT(m_state == State::HEAD_RECEIVED)
+            
+            return m_accept_gzip;
+        }
+        
+        // Returns the value of the If-None-Match header, or nullptr if there was none.
+        char const * getIfNoneMatch (Context c)
+        {
+            AMBRO_ASSERT(m_state == State::HEAD_RECEIVED)
+            
+            return (m_if_none_match[0] != '\0') ? m_if_none_match : nullptr;
+        }
+        
         void setCallback (Context c, RequestUserCallback *callback)
         {
             AMBRO_ASSERT(m_state == State::HEAD_RECEIVED)
@@ -1300,6 +1445,7 @@ private:
             
             // Send the response head, unless delay is requested.
             if (!delay_response) {
+                check_close_for_queued(c);
                 send_response(c, m_resp_status, false, m_resp_content_type, m_resp_extra_headers, m_close_connection);
             }
             
@@ -1361,16 +1507,7 @@ private:
             AMBRO_ASSERT(con_space_avail >= TxChunkOverhead)
             AMBRO_ASSERT(length <= con_space_avail - TxChunkOverhead)
             
-            // Prepare the chunk header, with speed.
-            if (AMBRO_UNLIKELY(length != m_last_chunk_length)) {
-                size_t rem_length = length;
-                for (int i = TxChunkHeaderDigits-1; i >= 0; i--) {
-                    char digit_num = rem_length & 0xF;
-                    m_chunk_header[i] = (digit_num < 10) ? ('0' + digit_num) : ('A' + (digit_num - 10));
-                    rem_length >>= 4;
-                }
-                m_last_chunk_length = length;
-            }
+            prepare_chunk_header(length);
             
             // Write the chunk header and footer.
             WrapBuffer con_space_buffer = m_connection.getSendBufferPtr(c);
@@ -1382,6 +1519,30 @@ private:
             m_connection.pokeSending(c);
         }
         
+        // Like provideResponseBodyData(), but the data is sent from where it is,
+        // and must remain valid until the handler of ref is called (see
+        // TcpSendRef). The space for the data is as reported by
+        // getResponseBodyBufferState(), but the buffer pointer is not used.
+        void provideResponseBodyRef (Context c, char const *data, size_t length, ResponseBodyRef *ref)
+        {
+            AMBRO_ASSERT(m_state == State::HEAD_RECEIVED)
+            AMBRO_ASSERT(m_send_state == SendState::SEND_BODY)
+            AMBRO_ASSERT(m_user)
+            AMBRO_ASSERT(length > 0)
+            
+            size_t con_space_avail = m_connection.getSendBufferSpace(c);
+            AMBRO_ASSERT(con_space_avail >= TxChunkOverhead)
+            AMBRO_ASSERT(length <= con_space_avail - TxChunkOverhead)
+            
+            prepare_chunk_header(length);
+            
+            // Only the chunk header and footer go into the send buffer.
+            m_connection.copySendData(c, MemRef(m_chunk_header, TxChunkHeaderSize));
+            m_connection.provideSendRef(c, ref, data, length);
+            m_connection.copySendData(c, MemRef(m_chunk_header+TxChunkHeaderDigits, 2));
+            m_connection.pokeSending(c);
+        }
+        
         void pokeResponseBodyBufferEvent (Context c)
         {
             AMBRO_ASSERT(m_state == State::HEAD_RECEIVED)
@@ -1405,6 +1566,20 @@ private:
         }
         
     private:
+        // Prepare the chunk header, with speed.
+        void prepare_chunk_header (size_t length)
+        {
+            if (AMBRO_UNLIKELY(length != m_last_chunk_length)) {
+                size_t rem_length = length;
+                for (int i = TxChunkHeaderDigits-1; i >= 0; i--) {
+                    char digit_num = rem_length & 0xF;
+                    m_chunk_header[i] = (digit_num < 10) ? ('0' + digit_num) : ('A' + (digit_num - 10));
+                    rem_length >>= 4;
+                }
+                m_last_chunk_length = length;
+            }
+        }
+        
         typename Context::EventLoop::QueuedEvent m_send_event;
         typename Context::EventLoop::QueuedEvent m_recv_event;
         typename Context::EventLoop::TimedEvent m_send_timeout_event;
@@ -1423,6 +1598,7 @@ private:
         char const *m_resp_status;
         char const *m_resp_content_type;
         char const *m_resp_extra_headers;
+        TimeType m_idle_time;
         State m_state;
         RecvState m_recv_state;
         SendState m_send_state;
@@ -1433,22 +1609,24 @@ private:
         bool m_bad_transfer_encoding : 1;
         bool m_expect_100_continue : 1;
         bool m_expectation_failed : 1;
+        bool m_accept_gzip : 1;
         bool m_have_request_body : 1;
         bool m_close_connection : 1;
         bool m_req_body_recevied : 1;
         bool m_user_accepting_request_body : 1;
         bool m_rx_buf_eof : 1;
         bool m_assuming_timeout : 1;
+        bool m_kept_alive : 1;
         char m_rx_buf[RxBufferSize];
         char m_request_line[Params::MaxRequestLineLength];
         char m_header_line[Params::MaxHeaderLineLength];
+        char m_if_none_match[MaxIfNoneMatchLength + 1];
         char m_chunk_header[TxChunkHeaderSize];
     };
     
 public:
     struct Object : public ObjBase<HttpServer, ParentObject, EmptyTypeList> {
         TheTcpListener listener;
-        TheTcpListenerQueueEntry queue[Params::Net::QueueSize];
         Client clients[Params::Net::MaxClients];
     };
 };
@@ -29,6 +29,7 @@
 
 struct HttpStatusCodes {
     static constexpr char const * Okay() { return "200 OK"; }
+    static constexpr char const * NotModified() { return "304 Not Modified"; }
     static constexpr char const * BadRequest() { return "400 Bad Request"; }
     static constexpr char const * NotFound() { return "404 Not Found"; }
     static constexpr char const * MethodNotAllowed() { return "405 Method Not Allowed"; }
@@ -28,6 +28,7 @@
 //#define APRINTER_NUM_TCP_LISTEN <count>
 //#define APRINTER_TCP_RX_BUF <bytes>
 //#define APRINTER_TCP_TX_BUF <bytes>
+//#define APRINTER_NUM_TCP_SEND_REFS <count>
 //#define APRINTER_MEM_ALIGNMENT <type>
 
 #ifdef IN_KDEVELOP_PARSER
@@ -36,6 +37,7 @@
 #define APRINTER_NUM_TCP_LISTEN 10
 #define APRINTER_TCP_RX_BUF 8192
 #define APRINTER_TCP_TX_BUF 8192
+#define APRINTER_NUM_TCP_SEND_REFS 4
 #define APRINTER_MEM_ALIGNMENT u32_t
 #endif
 
@@ -103,8 +105,10 @@
 // We compute this based on our estimation of how many segments are needed,
 // counting, each segment twice, since segments will typically have a header
 // pbuf and a data pbuf. Allow one more to accomodate segments with one
-// additional pbuf at ring buffer wrap-around.
-#define TCP_SND_QUEUELEN (2 * APRINTER_NUM_TCP_DATA_SEG + 1)
+// additional pbuf at ring buffer wrap-around, and two more for each data
+// reference (LwipNetwork::TcpSendRef), one for the referenced data and one
+// for the ring buffer data which follows it.
+#define TCP_SND_QUEUELEN (2 * APRINTER_NUM_TCP_DATA_SEG + 1 + 2 * APRINTER_NUM_TCP_SEND_REFS)
 
 // Number of TCP segments in the pool.
 // For each connection we reserve:
@@ -126,10 +130,13 @@
 //   pbufs always appear as part of TCP segments together with a header
 //   pbuf; usually we have a single REF pbuf following a header, except
 //   at buffer wrap-around we may have one extra REF pbuf.
+//   Data references (LwipNetwork::TcpSendRef) need up to two more each.
+//   APRINTER_NUM_TCP_SEND_REFS is the number of references in use at
+//   any time over all connections, so we need these only once.
 // - In the fragmentation of IP packets, they reference parts of the
 //   original full packet. Since we don't need and disable fragmentation,
 //   we don't reserve anything for this.
-#define MEMP_NUM_PBUF (APRINTER_NUM_TCP_CONN * (APRINTER_NUM_TCP_DATA_SEG + 1))
+#define MEMP_NUM_PBUF (APRINTER_NUM_TCP_CONN * (APRINTER_NUM_TCP_DATA_SEG + 1) + 2 * APRINTER_NUM_TCP_SEND_REFS)
 
 // Number of pbufs in PBUF_POOL pool.
 // In a typical lwIP application these would be allocated by the drive for RX.
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "linux_support.h"
+
+LinuxIrqState linux_irq_state = {false, false, nullptr};
+
+static struct timespec linux_start_time;
+static double linux_speedup = 1.0;
+static FILE *linux_pin_log_file;
+static volatile sig_atomic_t linux_quit_requested;
+
+static uint64_t linux_timespec_ns (struct timespec const *ts)
+{
+    return (uint64_t)ts->tv_sec * UINT64_C(1000000000) + (uint64_t)ts->tv_nsec;
+}
+
+static void linux_quit_signal_handler (int signum)
+{
+    linux_quit_requested = 1;
+}
+
+static void linux_atexit_handler (void)
+{
+    if (linux_pin_log_file) {
+        fclose(linux_pin_log_file);
+        linux_pin_log_file = nullptr;
+    }
+}
+
+void platform_init (void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &linux_start_time);
+    
+    char const *speedup_str = getenv("APRINTER_LINUX_SPEEDUP");
+    if (speedup_str) {
+        double speedup = strtod(speedup_str, nullptr);
+        if (!(speedup > 0.0)) {
+            fprintf(stderr, "APRINTER_LINUX_SPEEDUP must be positive\n");
+            exit(1);
+        }
+        linux_speedup = speedup;
+    }
+    
+    char const *pin_log_str = getenv("APRINTER_LINUX_PIN_LOG");
+    if (pin_log_str) {
+        linux_pin_log_file = fopen(pin_log_str, "w");
+        if (!linux_pin_log_file) {
+            fprintf(stderr, "Failed to open pin log file %s\n", pin_log_str);
+            exit(1);
+        }
+    }
+    
+    // Exit through the main loop so that buffered output is not lost.
+    signal(SIGINT, linux_quit_signal_handler);
+    signal(SIGTERM, linux_quit_signal_handler);
+    atexit(linux_atexit_handler);
+}
+
+void linux_register_irq (LinuxIrq *irq)
+{
+    irq->next = linux_irq_state.first_irq;
+    linux_irq_state.first_irq = irq;
+}
+
+void linux_dispatch_interrupts (void)
+{
+    if (linux_quit_requested) {
+        exit(0);
+    }
+    
+    linux_irq_state.in_interrupt = true;
+    asm volatile ("" : : : "memory");
+    
+    for (LinuxIrq *irq = linux_irq_state.first_irq; irq; irq = irq->next) {
+        irq->handler();
+    }
+    
+    asm volatile ("" : : : "memory");
+    linux_irq_state.enabled = true;
+    linux_irq_state.in_interrupt = false;
+}
+
+uint64_t linux_get_sim_time_ns (void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    uint64_t elapsed = linux_timespec_ns(&now) - linux_timespec_ns(&linux_start_time);
+    if (linux_speedup == 1.0) {
+        return elapsed;
+    }
+    return (uint64_t)(elapsed * linux_speedup);
+}
+
+void linux_pin_log (char const *name, int value)
+{
+    if (linux_pin_log_file) {
+        fprintf(linux_pin_log_file, "%" PRIu64 " %s %d\n", linux_get_sim_time_ns(), name, value);
+    }
+}
+
+bool linux_get_pin_input (char const *name, bool default_value)
+{
+    char const *inputs = getenv("APRINTER_LINUX_PIN_INPUTS");
+    if (!inputs) {
+        return default_value;
+    }
+    
+    size_t name_len = strlen(name);
+    char const *pos = inputs;
+    while (*pos) {
+        size_t entry_len = strcspn(pos, ",");
+        if (entry_len == name_len + 2 && !memcmp(pos, name, name_len) && pos[name_len] == '=') {
+            return pos[name_len + 1] == '1';
+        }
+        pos += entry_len;
+        if (*pos == ',') {
+            pos++;
+        }
+    }
+    
+    return default_value;
+}
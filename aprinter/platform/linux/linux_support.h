@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef APRINTER_LINUX_SUPPORT_H
+#define APRINTER_LINUX_SUPPORT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Support for running the firmware as an ordinary Linux process.
+ * 
+ * There are no real interrupts. Instead, HAL drivers register their
+ * interrupt handlers using LinuxIrq, and these are polled whenever
+ * interrupts are (re-)enabled using sei() and whenever the main
+ * context reads the clock. The effect is as if the CPU was infinitely
+ * fast but could only take interrupts at these points.
+ * 
+ * Time is derived from CLOCK_MONOTONIC, multiplied by a speedup factor
+ * which is taken from the APRINTER_LINUX_SPEEDUP environment variable
+ * (default 1.0).
+ * 
+ * If APRINTER_LINUX_PIN_LOG names a file, changes of output pins and
+ * PWM duty cycles are written there, one "<time_ns> <pin> <value>"
+ * line per change. Input pins can be given fixed values using
+ * APRINTER_LINUX_PIN_INPUTS, for example "MegaPin3=1,MegaPin14=0".
+ */
+
+// Nominal CPU frequency. This is only used to derive the clock
+// frequency and some performance parameters.
+#ifndef F_CPU
+#define F_CPU 84000000
+#endif
+
+#define AMBROLIB_ABORT_ACTION { ::abort(); }
+
+struct LinuxIrq {
+    void (*handler) (void);
+    LinuxIrq *next;
+};
+
+struct LinuxIrqState {
+    bool enabled;
+    bool in_interrupt;
+    LinuxIrq *first_irq;
+};
+
+extern LinuxIrqState linux_irq_state;
+
+void platform_init (void);
+void linux_register_irq (LinuxIrq *irq);
+void linux_dispatch_interrupts (void);
+uint64_t linux_get_sim_time_ns (void);
+void linux_pin_log (char const *name, int value);
+bool linux_get_pin_input (char const *name, bool default_value);
+
+inline static void linux_check_interrupts (void)
+{
+    if (linux_irq_state.enabled && !linux_irq_state.in_interrupt) {
+        linux_dispatch_interrupts();
+    }
+}
+
+inline static void sei (void)
+{
+    asm volatile ("" : : : "memory");
+    linux_irq_state.enabled = true;
+    linux_check_interrupts();
+}
+
+inline static void cli (void)
+{
+    linux_irq_state.enabled = false;
+    asm volatile ("" : : : "memory");
+}
+
+inline static bool interrupts_enabled (void)
+{
+    return linux_irq_state.enabled && !linux_irq_state.in_interrupt;
+}
+
+inline static void memory_barrier (void)
+{
+    asm volatile ("" : : : "memory");
+}
+
+inline static void memory_barrier_dma (void)
+{
+    asm volatile ("" : : : "memory");
+}
+
+#define APRINTER_LINUX_IRQ_GLOBAL(...) APRINTER_LINUX_IRQ_GLOBAL_(__COUNTER__, __VA_ARGS__)
+#define APRINTER_LINUX_IRQ_GLOBAL_(id, ...) APRINTER_LINUX_IRQ_GLOBAL__(id, __VA_ARGS__)
+#define APRINTER_LINUX_IRQ_GLOBAL__(id, ...) \
+static void linux_irq_handler_##id (void) \
+{ \
+    __VA_ARGS__; \
+} \
+static LinuxIrq linux_irq_##id = {linux_irq_handler_##id, nullptr}; \
+static struct linux_irq_registrar_##id { \
+    linux_irq_registrar_##id () { linux_register_irq(&linux_irq_##id); } \
+} linux_irq_registrar_instance_##id;
+
+#endif
@@ -796,6 +796,7 @@ public:
                     case GCODE_ERROR_CHECKSUM:       err = AMBRO_PSTR("incorrect checksum");     break;
                     case GCODE_ERROR_RECV_OVERRUN:   err = AMBRO_PSTR("receive buffer overrun"); break;
                     case GCODE_ERROR_BAD_ESCAPE:     err = AMBRO_PSTR("bad escape sequence");    break;
+                    case GCODE_ERROR_BAD_BLOCK:      err = AMBRO_PSTR("bad block sequence");     break;
                 }
                 
                 reportError(c, err);
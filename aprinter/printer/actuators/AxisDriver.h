@@ -25,6 +25,7 @@
 #ifndef AMBROLIB_AXIS_DRIVER_H
 #define AMBROLIB_AXIS_DRIVER_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include <aprinter/meta/FixedPoint.h>
@@ -40,11 +41,19 @@
 #include <aprinter/base/DebugObject.h>
 #include <aprinter/base/Assert.h>
 #include <aprinter/base/Hints.h>
+#include <aprinter/base/Lock.h>
+#include <aprinter/system/InterruptLock.h>
 #include <aprinter/misc/ClockUtils.h>
 #include <aprinter/printer/actuators/AxisDriverConsumer.h>
 
 #include <aprinter/BeginNamespace.h>
 
+#ifdef AXISDRIVER_STEP_TRACE
+#ifndef AXISDRIVER_STEP_TRACE_SIZE
+#define AXISDRIVER_STEP_TRACE_SIZE 128
+#endif
+#endif
+
 #define AXIS_STEPPER_AMUL_EXPR(x, t, a) ((a).template shiftBits<(-amul_shift)>())
 #define AXIS_STEPPER_V0_EXPR(x, t, a) (((x) + (a).absVal()).template shiftBits<(-discriminant_prec)>())
 #define AXIS_STEPPER_DISCRIMINANT_EXPR(x, t, a) ((((x).toSigned() - (a)).toUnsignedUnsafe() * ((x).toSigned() - (a)).toUnsignedUnsafe()).template shiftBits<(-2 * discriminant_prec)>())
@@ -69,6 +78,18 @@ APRINTER_ALIAS_STRUCT(AxisDriverPrecisionParams, (
 using AxisDriverAvrPrecisionParams = AxisDriverPrecisionParams<11, 22, 24, 1, 0, true>;
 using AxisDriverDuePrecisionParams = AxisDriverPrecisionParams<11, 28, 28, 3, 4, false>;
 
+template <typename TimeType>
+struct AxisDriverStepTraceEntry {
+    // Flag: this is the first step of a newly loaded command.
+    static uint8_t const FlagCommandStart = 1 << 0;
+    // Flag: the overload detection tripped for this step.
+    static uint8_t const FlagOverload = 1 << 1;
+    
+    TimeType sched_time;
+    TimeType actual_time;
+    uint8_t flags;
+};
+
 template <typename Arg>
 class AxisDriver {
     using Context       = typename Arg::Context;
@@ -203,6 +224,10 @@ public:
 #ifdef AXISDRIVER_DETECT_OVERLOAD
         o->m_overload = false;
 #endif
+#ifdef AXISDRIVER_STEP_TRACE
+        o->m_trace_count = 0;
+        o->m_trace_flags = 0;
+#endif
         
         TheDebugObject::init(c);
     }
@@ -238,6 +263,9 @@ public:
 #endif
 #ifdef AXISDRIVER_DETECT_OVERLOAD
         o->m_overload = false;
+#endif
+#ifdef AXISDRIVER_STEP_TRACE
+        o->m_trace_flags = 0;
 #endif
         o->m_consumer_id = TypeListIndex<typename ConsumersList::List, TheConsumer>::Value;
         o->m_time = start_time;
@@ -295,6 +323,54 @@ public:
     }
 #endif
     
+#ifdef AXISDRIVER_STEP_TRACE
+    using StepTraceEntry = AxisDriverStepTraceEntry<TimeType>;
+    static size_t const StepTraceSize = AXISDRIVER_STEP_TRACE_SIZE;
+    static_assert(StepTraceSize > 0 && (StepTraceSize & (StepTraceSize - 1)) == 0, "AXISDRIVER_STEP_TRACE_SIZE must be a power of two");
+    
+    // Returns the total number of steps recorded since the last reset.
+    // Only the last StepTraceSize of these are retained.
+    static uint32_t getStepTraceCount (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        uint32_t count;
+        AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+            count = o->m_trace_count;
+        }
+        return count;
+    }
+    
+    // Retrieves the entry with the given sequence number. Returns false
+    // if it has not been recorded yet or has already been overwritten.
+    static bool getStepTraceEntry (Context c, uint32_t seq, StepTraceEntry *out_entry)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        bool available;
+        AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+            uint32_t age = o->m_trace_count - seq;
+            available = (age > 0 && age <= StepTraceSize);
+            if (available) {
+                *out_entry = o->m_trace[seq % StepTraceSize];
+            }
+        }
+        return available;
+    }
+    
+    static void resetStepTrace (Context c)
+    {
+        auto *o = Object::self(c);
+        TheDebugObject::access(c);
+        
+        AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
+            o->m_trace_count = 0;
+        }
+    }
+#endif
+    
     using GetTimer = TimerInstance;
     
 private:
@@ -348,6 +424,9 @@ private:
         DirStepFixedType dir_x = DirStepFixedType::importBits(volatile_read(command->dir_x.m_bits.m_int));
         
         o->m_current_command = command;
+#ifdef AXISDRIVER_STEP_TRACE
+        o->m_trace_flags |= StepTraceEntry::FlagCommandStart;
+#endif
         o->m_notdecel = (dir_x.bitsValue() & ((DirStepIntType)1 << (step_bits + 1)));
         StepFixedType x = StepFixedType::importBits(dir_x.bitsValue() & (((DirStepIntType)1 << step_bits) - 1));
         o->m_notend = (x.bitsValue() != 0);
@@ -398,6 +477,9 @@ private:
 #ifdef AXISDRIVER_DETECT_OVERLOAD
         if ((TimeType)(Clock::getTime(c) - TimerInstance::getLastSetTime(c)) >= (TimeType)(0.001 * Clock::time_freq)) {
             o->m_overload = true;
+#ifdef AXISDRIVER_STEP_TRACE
+            o->m_trace_flags |= StepTraceEntry::FlagOverload;
+#endif
         }
 #endif
         
@@ -440,6 +522,9 @@ private:
             DelayFeature::wait_for_dir(c);
             
             DelayFeature::wait_for_step_low(c);
+#ifdef AXISDRIVER_STEP_TRACE
+            record_step_trace(c);
+#endif
             Stepper::stepOn(c);
             DelayFeature::set_step_timer_for_high(c);
             
@@ -501,6 +586,21 @@ private:
     }
     struct TimerHandler : public AMBRO_WFUNC_TD(&AxisDriver::timer_handler) {};
     
+#ifdef AXISDRIVER_STEP_TRACE
+    AMBRO_ALWAYS_INLINE
+    static void record_step_trace (StepContext c)
+    {
+        auto *o = Object::self(c);
+        
+        StepTraceEntry *entry = &o->m_trace[o->m_trace_count % StepTraceSize];
+        entry->sched_time = TimerInstance::getLastSetTime(c);
+        entry->actual_time = Clock::getTime(c);
+        entry->flags = o->m_trace_flags;
+        o->m_trace_flags = 0;
+        o->m_trace_count++;
+    }
+#endif
+    
     AMBRO_STRUCT_IF(DelayFeature, DelayParams::Enabled) {
         using DelayClockUtils = FastClockUtils<Context>;
         using DelayTimeType = typename DelayClockUtils::TimeType;
@@ -613,6 +713,11 @@ public:
 #endif
 #ifdef AXISDRIVER_DETECT_OVERLOAD
         bool m_overload;
+#endif
+#ifdef AXISDRIVER_STEP_TRACE
+        uint8_t m_trace_flags;
+        uint32_t m_trace_count;
+        StepTraceEntry m_trace[StepTraceSize];
 #endif
         bool m_prestep_callback_enabled;
         bool m_notend;
@@ -76,6 +76,10 @@ private:
     static size_t const DirListReplyRequestExtra = 24;
     static_assert(BlockSize == 512, "BlockSize must be 512");
     
+    // With smaller clusters, direct multi-block reads are too short to
+    // beat reading through the cache with readahead.
+    static size_t const MinStreamingClusterSize = 4 * BlockSize;
+    
     // NOTE: Check bit field widths at the bottom before adding new state values.
     enum InitState {
         INIT_STATE_INACTIVE,
@@ -187,7 +191,7 @@ public:
         return !o->file_eof;
     }
     
-    static void startRead (Context c, DataWordType *buf)
+    static void startRead (Context c, DataWordType *buf, size_t max_blocks)
     {
         auto *o = Object::self(c);
         auto *fs_o = UnionFsPart::Object::self(c);
@@ -195,7 +199,14 @@ public:
         AMBRO_ASSERT(o->file_state == FILE_STATE_RUNNING)
         AMBRO_ASSERT(!o->file_eof)
         
-        fs_o->file.startReadUserBuf(c, buf);
+        // Normally read directly into the buffer. If the file is being read through
+        // the cache for the sake of readahead, the data is copied in file_handler.
+        if (fs_o->streaming) {
+            fs_o->file.startReadUserBuf(c, buf, max_blocks);
+        } else {
+            fs_o->read_buf = buf;
+            fs_o->file.startRead(c);
+        }
         o->file_state = FILE_STATE_READING;
     }
     
@@ -216,6 +227,14 @@ public:
             handle_navigation_command(c, cmd, (cmd_num == 20), (cmd_num == 32));
             return false;
         }
+        if (TheFs::EnableReadHinting && cmd_num == 934) {
+            handle_readahead_stats_command(c, cmd);
+            return false;
+        }
+        if (cmd_num == 939) {
+            handle_latency_stats_command(c, cmd);
+            return false;
+        }
         return true;
     }
     
@@ -246,6 +265,32 @@ public:
         
         json->addSafeKeyVal("mntState", JsonSafeString{mntState});
         json->addSafeKeyVal("rwState", JsonSafeString{rwState});
+        
+        auto counters = TheBlockAccess::getIoCounters(c);
+        json->addKeyObject(JsonSafeString{"io"});
+        json->addSafeKeyVal("readBlocks", JsonUint32{counters.read_blocks});
+        json->addSafeKeyVal("writeBlocks", JsonUint32{counters.write_blocks});
+        json->addSafeKeyVal("readRate", JsonUint32{counters.read_rate});
+        json->addSafeKeyVal("writeRate", JsonUint32{counters.write_rate});
+        if (o->init_state == INIT_STATE_DONE) {
+            auto cache_stats = TheFs::getCacheStats(c);
+            json->addSafeKeyVal("cacheHits", JsonUint32{cache_stats.hits});
+            json->addSafeKeyVal("cacheMisses", JsonUint32{cache_stats.misses});
+        }
+        json->addKeyArray(JsonSafeString{"bucketLimitsUs"});
+        for (int i = 0; i < TheBlockAccess::NumLatencyBuckets - 1; i++) {
+            json->add(JsonDouble{TheBlockAccess::getLatencyBucketLimit(i) * (1e6 / Context::Clock::time_freq)});
+        }
+        json->endArray();
+        for (int i = 0; i < TheBlockAccess::NumTimingKinds; i++) {
+            json->addKeyArray(JsonSafeString{timing_kind_json_key((TimingKind)i)});
+            auto histogram = TheBlockAccess::getLatencyHistogram(c, (TimingKind)i);
+            for (int j = 0; j < TheBlockAccess::NumLatencyBuckets; j++) {
+                json->add(JsonUint32{histogram.counts[j]});
+            }
+            json->endArray();
+        }
+        json->endObject();
     }
     
     using GetSdCard = typename TheBlockAccess::GetSd;
@@ -567,7 +612,9 @@ private:
     static bool can_unmount (Context c)
     {
         auto *o = Object::self(c);
-        return (!(o->file_state >= FILE_STATE_RUNNING) && !AccessInterface::has_references(c, false));
+        // Blocks pinned for sending (by the web interface) are still in use
+        // even though their files have been closed.
+        return (!(o->file_state >= FILE_STATE_RUNNING) && !AccessInterface::has_references(c, false) && !TheFs::hasPinnedBlocks(c));
     }
     
     static void complete_unmount (Context c)
@@ -589,6 +636,109 @@ private:
         cmd->finishCommand(c);
     }
     
+    static void handle_readahead_stats_command (Context c, typename ThePrinterMain::TheCommand *cmd)
+    {
+        auto *o = Object::self(c);
+        
+        if (o->init_state != INIT_STATE_DONE) {
+            cmd->reportError(c, AMBRO_PSTR("SdNotInited"));
+        } else {
+            auto stats = TheFs::getReadaheadStats(c);
+            cmd->reply_append_pstr(c, AMBRO_PSTR("ReadaheadHits:"));
+            cmd->reply_append_uint32(c, stats.hits);
+            cmd->reply_append_pstr(c, AMBRO_PSTR(" Stalls:"));
+            cmd->reply_append_uint32(c, stats.stalls);
+            cmd->reply_append_pstr(c, AMBRO_PSTR(" Misses:"));
+            cmd->reply_append_uint32(c, stats.misses);
+            cmd->reply_append_pstr(c, AMBRO_PSTR(" HintedBlocks:"));
+            cmd->reply_append_uint32(c, stats.hinted_blocks);
+            cmd->reply_append_pstr(c, AMBRO_PSTR(" CancelledBlocks:"));
+            cmd->reply_append_uint32(c, stats.cancelled_blocks);
+            cmd->reply_append_ch(c, '\n');
+            if (cmd->find_command_param(c, 'R', nullptr)) {
+                TheFs::resetReadaheadStats(c);
+            }
+        }
+        cmd->finishCommand(c);
+    }
+    
+    using TimingKind = typename TheBlockAccess::TimingKind;
+    
+    static char const * timing_kind_json_key (TimingKind kind)
+    {
+        switch (kind) {
+            case TimingKind::QUEUE_WAIT: return "queueWait";
+            case TimingKind::CARD_BUSY:  return "cardBusy";
+            default:                     return "transfer";
+        }
+    }
+    
+    static void handle_latency_stats_command (Context c, typename ThePrinterMain::TheCommand *cmd)
+    {
+        auto *o = Object::self(c);
+        using FpType = typename ThePrinterMain::FpType;
+        using Priority = typename TheBlockAccess::Priority;
+        
+        FpType const us_per_tick = 1e6 / Context::Clock::time_freq;
+        
+        for (int i = 0; i < TheBlockAccess::NumPriorities; i++) {
+            auto stats = TheBlockAccess::getLatencyStats(c, (Priority)i);
+            cmd->reply_append_pstr(c, (i == (int)Priority::HIGH) ? AMBRO_PSTR("SdLatencyHigh") :
+                                      (i == (int)Priority::NORMAL) ? AMBRO_PSTR("SdLatencyNormal") : AMBRO_PSTR("SdLatencyLow"));
+            cmd->reply_append_pstr(c, AMBRO_PSTR(" Count:"));
+            cmd->reply_append_uint32(c, stats.num_requests);
+            cmd->reply_append_pstr(c, AMBRO_PSTR(" AvgUs:"));
+            FpType avg_ticks = (stats.num_requests == 0) ? 0.0f : (FpType)stats.total_latency / stats.num_requests;
+            cmd->reply_append_fp(c, avg_ticks * us_per_tick);
+            cmd->reply_append_pstr(c, AMBRO_PSTR(" MaxUs:"));
+            cmd->reply_append_fp(c, (FpType)stats.max_latency * us_per_tick);
+            cmd->reply_append_ch(c, '\n');
+        }
+        
+        cmd->reply_append_pstr(c, AMBRO_PSTR("SdHistLimitsUs:"));
+        for (int i = 0; i < TheBlockAccess::NumLatencyBuckets - 1; i++) {
+            cmd->reply_append_ch(c, ' ');
+            cmd->reply_append_fp(c, (FpType)TheBlockAccess::getLatencyBucketLimit(i) * us_per_tick);
+        }
+        cmd->reply_append_ch(c, '\n');
+        for (int i = 0; i < TheBlockAccess::NumTimingKinds; i++) {
+            auto histogram = TheBlockAccess::getLatencyHistogram(c, (TimingKind)i);
+            cmd->reply_append_pstr(c, (i == (int)TimingKind::QUEUE_WAIT) ? AMBRO_PSTR("SdHistQueueWait:") :
+                                      (i == (int)TimingKind::CARD_BUSY) ? AMBRO_PSTR("SdHistCardBusy:") : AMBRO_PSTR("SdHistTransfer:"));
+            for (int j = 0; j < TheBlockAccess::NumLatencyBuckets; j++) {
+                cmd->reply_append_ch(c, ' ');
+                cmd->reply_append_uint32(c, histogram.counts[j]);
+            }
+            cmd->reply_append_ch(c, '\n');
+        }
+        
+        auto counters = TheBlockAccess::getIoCounters(c);
+        cmd->reply_append_pstr(c, AMBRO_PSTR("SdReadBlocks:"));
+        cmd->reply_append_uint32(c, counters.read_blocks);
+        cmd->reply_append_pstr(c, AMBRO_PSTR(" WriteBlocks:"));
+        cmd->reply_append_uint32(c, counters.write_blocks);
+        cmd->reply_append_pstr(c, AMBRO_PSTR(" ReadRate:"));
+        cmd->reply_append_uint32(c, counters.read_rate);
+        cmd->reply_append_pstr(c, AMBRO_PSTR(" WriteRate:"));
+        cmd->reply_append_uint32(c, counters.write_rate);
+        if (o->init_state == INIT_STATE_DONE) {
+            auto cache_stats = TheFs::getCacheStats(c);
+            cmd->reply_append_pstr(c, AMBRO_PSTR(" CacheHits:"));
+            cmd->reply_append_uint32(c, cache_stats.hits);
+            cmd->reply_append_pstr(c, AMBRO_PSTR(" CacheMisses:"));
+            cmd->reply_append_uint32(c, cache_stats.misses);
+        }
+        cmd->reply_append_ch(c, '\n');
+        
+        if (cmd->find_command_param(c, 'R', nullptr)) {
+            TheBlockAccess::resetLatencyStats(c);
+            if (o->init_state == INIT_STATE_DONE) {
+                TheFs::resetCacheStats(c);
+            }
+        }
+        cmd->finishCommand(c);
+    }
+    
     static void handle_navigation_command (Context c, typename ThePrinterMain::TheCommand *cmd, bool is_dirlist, bool start_stream)
     {
         auto *o = Object::self(c);
@@ -715,7 +865,9 @@ private:
                     fs_o->file.deinit(c);
                 }
                 
-                fs_o->file.init(c, entry, APRINTER_CB_STATFUNC_T(&SdFatInput::file_handler));
+                fs_o->streaming = !TheFs::EnableReadHinting || TheFs::getClusterSize(c) >= MinStreamingClusterSize;
+                auto io_mode = fs_o->streaming ? TheFs::template File<false>::IoMode::USER_BUFFER : TheFs::template File<false>::IoMode::FS_BUFFER;
+                fs_o->file.init(c, entry, APRINTER_CB_STATFUNC_T(&SdFatInput::file_handler), io_mode);
                 o->file_state = FILE_STATE_PAUSED;
                 o->file_eof = false;
                 ClientParams::ClearBufferHandler::call(c);
@@ -778,7 +930,13 @@ private:
         AMBRO_ASSERT(o->file_state == FILE_STATE_READING)
         AMBRO_ASSERT(!o->file_eof)
         
-        if (!is_error && length < BlockSize) {
+        auto *fs_o = UnionFsPart::Object::self(c);
+        if (!fs_o->streaming && !is_error && length > 0) {
+            memcpy(fs_o->read_buf, fs_o->file.getReadPointer(c), length);
+            fs_o->file.finishRead(c);
+        }
+        
+        if (!is_error && (length == 0 || length % BlockSize != 0)) {
             o->file_eof = true;
         }
         o->file_state = FILE_STATE_RUNNING;
@@ -1011,6 +1169,8 @@ private:
         >> {
             typename TheFs::FsEntry current_directory;
             typename TheFs::template File<false> file;
+            bool streaming;
+            DataWordType *read_buf;
         };
     };
     
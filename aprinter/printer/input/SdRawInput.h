@@ -132,15 +132,17 @@ public:
         return (o->block < TheSdCard::getCapacityBlocks(c));
     }
     
-    static void startRead (Context c, DataWordType *buf)
+    static void startRead (Context c, DataWordType *buf, size_t max_blocks)
     {
         auto *o = Object::self(c);
         TheDebugObject::access(c);
         AMBRO_ASSERT(o->state == STATE_READY)
         AMBRO_ASSERT(o->block < TheSdCard::getCapacityBlocks(c))
+        AMBRO_ASSERT(max_blocks >= 1)
         
-        o->desc = TransferDescriptor<DataWordType>{buf, BlockSize/sizeof(DataWordType)};
-        TheSdCard::startReadOrWrite(c, false, o->block, 1, TransferVector<DataWordType>{&o->desc, 1});
+        size_t num_blocks = MinValue(MinValue(max_blocks, (size_t)TheSdCard::MaxIoBlocks), (size_t)(TheSdCard::getCapacityBlocks(c) - o->block));
+        o->desc = TransferDescriptor<DataWordType>{buf, num_blocks * (BlockSize / sizeof(DataWordType))};
+        TheSdCard::startReadOrWrite(c, false, o->block, num_blocks, TransferVector<DataWordType>{&o->desc, 1});
         o->state = STATE_READING;
     }
     
@@ -242,8 +244,9 @@ private:
         o->state = STATE_READY;
         size_t bytes = 0;
         if (!error) {
-            bytes = BlockSize;
-            o->block++;
+            size_t num_blocks = o->desc.num_words / (BlockSize / sizeof(DataWordType));
+            bytes = num_blocks * BlockSize;
+            o->block += num_blocks;
         }
         return ClientParams::ReadHandler::call(c, error, bytes);
     }
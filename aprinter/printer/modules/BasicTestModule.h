@@ -25,9 +25,11 @@
 #ifndef APRINTER_BASIC_TEST_MODULE_H
 #define APRINTER_BASIC_TEST_MODULE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include <aprinter/meta/ServiceUtils.h>
+#include <aprinter/meta/BasicMetaUtils.h>
 #include <aprinter/base/Object.h>
 #include <aprinter/base/Assert.h>
 #include <aprinter/base/ProgramMemory.h>
@@ -39,11 +41,18 @@ template <typename ModuleArg>
 class BasicTestModule {
     APRINTER_UNPACK_MODULE_ARG(ModuleArg)
     
+#ifdef AXISDRIVER_STEP_TRACE
+    static size_t const StepTraceMaxLineLength = 64;
+#endif
+    
 public:
     static void init (Context c)
     {
         auto *o = Object::self(c);
         o->underrun_count = 0;
+#ifdef MOTIONPLANNER_BENCHMARK
+        ThePrinterMain::ThePlanner::resetBenchStats(c);
+#endif
     }
     
     static bool check_command (Context c, typename ThePrinterMain::TheCommand *cmd)
@@ -68,6 +77,71 @@ public:
                 cmd->reply_append_ch(c, '\n');
                 cmd->finishCommand(c);
             } break;
+            
+            case 919: { // print event loop scan statistics
+                if (!cmd->tryUnplannedCommand(c)) {
+                    break;
+                }
+                auto stats = Context::EventLoop::getBenchScanStats(c);
+                cmd->reply_append_pstr(c, AMBRO_PSTR("EventLoopScan Freq:"));
+                cmd->reply_append_uint32(c, Context::Clock::time_freq);
+                cmd->reply_append_pstr(c, AMBRO_PSTR(" Scans:"));
+                cmd->reply_append_uint32(c, stats.scan_count);
+                cmd->reply_append_pstr(c, AMBRO_PSTR(" Time:"));
+                cmd->reply_append_uint32(c, stats.scan_time);
+                cmd->reply_append_pstr(c, AMBRO_PSTR(" MaxTime:"));
+                cmd->reply_append_uint32(c, stats.max_scan_time);
+                cmd->reply_append_ch(c, '\n');
+                cmd->finishCommand(c);
+            } break;
+            
+            case 929: { // print fast event dispatch latency statistics
+                if (!cmd->tryUnplannedCommand(c)) {
+                    break;
+                }
+                using Loop = typename Context::EventLoop;
+                int num_events = Loop::getNumFastEvents();
+                cmd->reply_append_pstr(c, AMBRO_PSTR("FastEvents Freq:"));
+                cmd->reply_append_uint32(c, Context::Clock::time_freq);
+                cmd->reply_append_pstr(c, AMBRO_PSTR(" Count:"));
+                cmd->reply_append_uint32(c, num_events);
+                cmd->reply_append_ch(c, '\n');
+                if (cmd->find_command_param(c, 'I', nullptr)) {
+                    uint32_t index = cmd->get_command_param_uint32(c, 'I', 0);
+                    if (index >= (uint32_t)num_events) {
+                        cmd->reportError(c, AMBRO_PSTR("BadIndex"));
+                    } else {
+                        auto stats = Loop::getBenchFastEventStats(c, index);
+                        cmd->reply_append_pstr(c, AMBRO_PSTR("FastEvent I:"));
+                        cmd->reply_append_uint32(c, index);
+                        cmd->reply_append_pstr(c, AMBRO_PSTR(" P:"));
+                        cmd->reply_append_uint32(c, Loop::getFastEventPriority(index));
+                        print_fast_event_stats(c, cmd, stats.dispatch_count, stats.latency_time, stats.max_latency_time);
+                    }
+                } else {
+                    for (int priority = Loop::FastPriority::High; priority >= Loop::FastPriority::Low; priority--) {
+                        uint32_t events = 0;
+                        uint32_t dispatches = 0;
+                        uint32_t time = 0;
+                        uint32_t max_time = 0;
+                        for (int i = 0; i < num_events; i++) {
+                            if (Loop::getFastEventPriority(i) == priority) {
+                                auto stats = Loop::getBenchFastEventStats(c, i);
+                                events++;
+                                dispatches += stats.dispatch_count;
+                                time += stats.latency_time;
+                                max_time = MaxValue(max_time, (uint32_t)stats.max_latency_time);
+                            }
+                        }
+                        cmd->reply_append_pstr(c, AMBRO_PSTR("FastEventClass P:"));
+                        cmd->reply_append_uint32(c, priority);
+                        cmd->reply_append_pstr(c, AMBRO_PSTR(" Events:"));
+                        cmd->reply_append_uint32(c, events);
+                        print_fast_event_stats(c, cmd, dispatches, time, max_time);
+                    }
+                }
+                cmd->finishCommand(c);
+            } break;
 #endif
             
             case 918: { // test assertions
@@ -90,6 +164,68 @@ public:
                 cmd->finishCommand(c);
             } break;
             
+#ifdef AXISDRIVER_STEP_TRACE
+            case 923: { // dump step trace
+                if (!cmd->tryUnplannedCommand(c)) {
+                    break;
+                }
+                cmd->reply_append_pstr(c, AMBRO_PSTR("StepTrace Freq:"));
+                cmd->reply_append_uint32(c, Context::Clock::time_freq);
+                cmd->reply_append_pstr(c, AMBRO_PSTR(" TimeBits:"));
+                cmd->reply_append_uint32(c, 8 * sizeof(typename Context::Clock::TimeType));
+                cmd->reply_append_ch(c, '\n');
+                o->trace_axis = 0;
+                start_trace_axis(c);
+                next_trace_line(c);
+            } break;
+            
+            case 924: { // reset step trace
+                if (!cmd->tryUnplannedCommand(c)) {
+                    break;
+                }
+                ThePrinterMain::ThePlanner::resetStepTrace(c);
+                cmd->finishCommand(c);
+            } break;
+#endif
+            
+#ifdef MOTIONPLANNER_BENCHMARK
+            case 927: { // print planner benchmark statistics
+                if (!cmd->tryUnplannedCommand(c)) {
+                    break;
+                }
+                using ThePlanner = typename ThePrinterMain::ThePlanner;
+                auto stats = ThePlanner::getBenchStats(c);
+                cmd->reply_append_pstr(c, AMBRO_PSTR("PlannerBench Freq:"));
+                cmd->reply_append_uint32(c, ThePlanner::BenchTime::time_freq);
+                cmd->reply_append_pstr(c, AMBRO_PSTR(" Lookahead:"));
+                cmd->reply_append_uint32(c, ThePrinterMain::ThePlanner::BenchLookaheadBufferSize);
+                cmd->reply_append_pstr(c, AMBRO_PSTR(" Commit:"));
+                cmd->reply_append_uint32(c, ThePrinterMain::ThePlanner::BenchLookaheadCommitCount);
+                cmd->reply_append_pstr(c, AMBRO_PSTR(" Plans:"));
+                cmd->reply_append_uint32(c, stats.plan_count);
+                cmd->reply_append_pstr(c, AMBRO_PSTR(" Pushed:"));
+                cmd->reply_append_uint32(c, stats.lookahead_count);
+                cmd->reply_append_pstr(c, AMBRO_PSTR(" Committed:"));
+                cmd->reply_append_uint32(c, stats.commit_count);
+                // The average resolves times below one tick of the time source.
+                cmd->reply_append_pstr(c, AMBRO_PSTR(" AvgTime:"));
+                using FpType = typename ThePrinterMain::FpType;
+                cmd->reply_append_fp(c, (stats.plan_count == 0) ? 0.0f : (FpType)stats.plan_time / stats.plan_count);
+                cmd->reply_append_pstr(c, AMBRO_PSTR(" MaxTime:"));
+                cmd->reply_append_uint32(c, stats.max_plan_time);
+                cmd->reply_append_ch(c, '\n');
+                cmd->finishCommand(c);
+            } break;
+            
+            case 928: { // reset planner benchmark statistics
+                if (!cmd->tryUnplannedCommand(c)) {
+                    break;
+                }
+                ThePrinterMain::ThePlanner::resetBenchStats(c);
+                cmd->finishCommand(c);
+            } break;
+#endif
+            
             default:
                 return true;
         }
@@ -112,9 +248,88 @@ public:
 #endif
     }
     
+#ifdef EVENTLOOP_BENCHMARK
+private:
+    static void print_fast_event_stats (Context c, typename ThePrinterMain::TheCommand *cmd, uint32_t dispatches, uint32_t time, uint32_t max_time)
+    {
+        cmd->reply_append_pstr(c, AMBRO_PSTR(" Dispatches:"));
+        cmd->reply_append_uint32(c, dispatches);
+        cmd->reply_append_pstr(c, AMBRO_PSTR(" Time:"));
+        cmd->reply_append_uint32(c, time);
+        cmd->reply_append_pstr(c, AMBRO_PSTR(" MaxTime:"));
+        cmd->reply_append_uint32(c, max_time);
+        cmd->reply_append_ch(c, '\n');
+    }
+#endif
+    
+#ifdef AXISDRIVER_STEP_TRACE
+private:
+    static void start_trace_axis (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        o->trace_end = ThePrinterMain::ThePlanner::getStepTraceCount(c, o->trace_axis);
+        o->trace_seq = (o->trace_end > ThePrinterMain::ThePlanner::StepTraceSize) ? (o->trace_end - ThePrinterMain::ThePlanner::StepTraceSize) : 0;
+    }
+    
+    static void next_trace_line (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        auto *cmd = ThePrinterMain::get_locked(c);
+        
+        while (o->trace_seq == o->trace_end) {
+            o->trace_axis++;
+            if (o->trace_axis == ThePrinterMain::ThePlanner::StepTraceNumAxes) {
+                cmd->reply_append_pstr(c, AMBRO_PSTR("EndStepTrace\n"));
+                return cmd->finishCommand(c);
+            }
+            start_trace_axis(c);
+        }
+        
+        if (!cmd->requestSendBufEvent(c, StepTraceMaxLineLength, &BasicTestModule::trace_send_buf_event_handler)) {
+            cmd->reportError(c, AMBRO_PSTR("SendBufRequestFailed"));
+            return cmd->finishCommand(c);
+        }
+    }
+    
+    static void trace_send_buf_event_handler (Context c)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(o->trace_seq != o->trace_end)
+        
+        auto *cmd = ThePrinterMain::get_locked(c);
+        
+        typename ThePrinterMain::ThePlanner::StepTraceEntry entry;
+        if (ThePrinterMain::ThePlanner::getStepTraceEntry(c, o->trace_axis, o->trace_seq, &entry)) {
+            cmd->reply_append_pstr(c, AMBRO_PSTR("ST A:"));
+            cmd->reply_append_uint32(c, o->trace_axis);
+            cmd->reply_append_pstr(c, AMBRO_PSTR(" N:"));
+            cmd->reply_append_uint32(c, o->trace_seq);
+            cmd->reply_append_pstr(c, AMBRO_PSTR(" S:"));
+            cmd->reply_append_uint32(c, entry.sched_time);
+            cmd->reply_append_pstr(c, AMBRO_PSTR(" T:"));
+            cmd->reply_append_uint32(c, entry.actual_time);
+            cmd->reply_append_pstr(c, AMBRO_PSTR(" F:"));
+            cmd->reply_append_uint32(c, entry.flags);
+            cmd->reply_append_ch(c, '\n');
+            cmd->reply_poke(c);
+        }
+        
+        o->trace_seq++;
+        
+        return next_trace_line(c);
+    }
+#endif
+    
 public:
     struct Object : public ObjBase<BasicTestModule, ParentObject, EmptyTypeList> {
         uint32_t underrun_count;
+#ifdef AXISDRIVER_STEP_TRACE
+        uint8_t trace_axis;
+        uint32_t trace_seq;
+        uint32_t trace_end;
+#endif
     };
 };
 
@@ -82,6 +82,12 @@ private:
     static const size_t WrapExtraSize = MaxCommandSize - 1;
     static const size_t WrapExtraSizeWords = (WrapExtraSize + (sizeof(DataWordType) - 1)) / sizeof(DataWordType);
     
+    // Reading is deferred until this much of the buffer is free, so that the input
+    // can do multi-block reads. It is small enough that an incomplete command in
+    // the buffer never prevents reading more.
+    static const size_t ReadBatchSize = MinValue(MaxValue(BlockSize, BufferBaseSize / 2 / BlockSize * BlockSize), (BufferBaseSize - WrapExtraSize) / BlockSize * BlockSize);
+    static_assert(ReadBatchSize >= BlockSize, "");
+    
     using ParserSizeType = ChooseIntForMax<MaxCommandSize, false>;
     using TheGcodeParser = typename Params::TheGcodeParserService::template Parser<Context, ParserSizeType, typename ThePrinterMain::FpType>;
     
@@ -519,7 +525,7 @@ private:
     static bool can_read (Context c)
     {
         auto *o = Object::self(c);
-        return (BufferBaseSize - o->m_length >= BlockSize && TheInput::canRead(c));
+        return (BufferBaseSize - o->m_length >= ReadBatchSize && TheInput::canRead(c));
     }
     
     static size_t buf_add (size_t start, size_t count)
@@ -541,7 +547,8 @@ private:
         o->m_reading = true;
         size_t write_offset = buf_add(o->m_start, o->m_length);
         AMBRO_ASSERT(write_offset % BlockSize == 0)
-        TheInput::startRead(c, o->m_buffer + write_offset / sizeof(DataWordType));
+        size_t max_bytes = MinValue(BufferBaseSize - o->m_length, BufferBaseSize - write_offset);
+        TheInput::startRead(c, o->m_buffer + write_offset / sizeof(DataWordType), max_bytes / BlockSize);
     }
     
     static void buf_sanity (Context c)
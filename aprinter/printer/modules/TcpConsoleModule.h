@@ -52,6 +52,7 @@ private:
     using TimeType = typename Context::Clock::TimeType;
     using TheNetwork = typename Context::Network;
     using TheTcpListener = typename TheNetwork::TcpListener;
+    using TheTcpListenerQueueParams = typename TheNetwork::TcpListenerQueueParams;
     using TheTcpConnection = typename TheNetwork::TcpConnection;
     
     using TheConvenientStream = ConvenientCommandStream<Context, ThePrinterMain>;
@@ -60,6 +61,7 @@ private:
     
     static int const MaxClients = Params::MaxClients;
     static_assert(MaxClients > 0, "");
+    static_assert(Params::QueueSize >= 0, "");
     static size_t const MaxCommandSize = Params::MaxCommandSize;
     static_assert(MaxCommandSize > 0, "");
     static size_t const WrapExtraSize = MaxCommandSize - 1;
@@ -67,6 +69,7 @@ private:
     static_assert(BufferBaseSize >= MaxCommandSize, "");
     
     static TimeType const SendBufTimeoutTicks = Params::SendBufTimeout::value() * Context::Clock::time_freq;
+    static TimeType const QueueTimeoutTicks = Params::QueueTimeout::value() * Context::Clock::time_freq;
     
     static_assert(TheTcpConnection::ProvidedTxBufSize >= ThePrinterMain::CommandSendBufClearance, "TCP send buffer is too small");
     
@@ -77,7 +80,7 @@ public:
         
         o->listener.init(c, APRINTER_CB_STATFUNC_T(&TcpConsoleModule::listener_accept_handler));
         
-        if (!o->listener.startListening(c, Params::Port, Params::MaxClients)) {
+        if (!o->listener.startListening(c, Params::Port, Params::MaxClients, TheTcpListenerQueueParams{Params::QueueSize, QueueTimeoutTicks})) {
             ThePrinterMain::print_pgm_string(c, AMBRO_PSTR("//TcpConsoleListenError\n"));
         }
         
@@ -149,6 +152,7 @@ private:
         
         void disconnect (Context c)
         {
+            auto *o = Object::self(c);
             AMBRO_ASSERT(m_state == OneOf(State::CONNECTED, State::DISCONNECTED_WAIT_CMD))
             
             m_command_stream.deinit(c);
@@ -157,6 +161,8 @@ private:
             m_connection.reset(c);
             
             m_state = State::NOT_CONNECTED;
+            
+            o->listener.scheduleDequeue(c);
         }
         
         void start_disconnect (Context c)
@@ -344,6 +350,8 @@ APRINTER_ALIAS_STRUCT_EXT(TcpConsoleModuleService, (
     APRINTER_AS_TYPE(TheGcodeParserService),
     APRINTER_AS_VALUE(uint16_t, Port),
     APRINTER_AS_VALUE(int, MaxClients),
+    APRINTER_AS_VALUE(int, QueueSize),
+    APRINTER_AS_TYPE(QueueTimeout),
     APRINTER_AS_VALUE(size_t, MaxCommandSize),
     APRINTER_AS_TYPE(SendBufTimeout)
 ), (
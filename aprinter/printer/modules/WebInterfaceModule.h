@@ -27,7 +27,9 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#include <inttypes.h>
 
 #include <aprinter/meta/WrapFunction.h>
 #include <aprinter/meta/MinMax.h>
@@ -43,11 +45,13 @@
 #include <aprinter/base/Callback.h>
 #include <aprinter/base/OneOf.h>
 #include <aprinter/base/MemRef.h>
+#include <aprinter/structure/DoubleEndedList.h>
 #include <aprinter/net/http/HttpServer.h>
 #include <aprinter/fs/BufferedFile.h>
 #include <aprinter/misc/StringTools.h>
 #include <aprinter/printer/ServiceList.h>
 #include <aprinter/printer/utils/JsonBuilder.h>
+#include <aprinter/printer/utils/JsonStatusSnapshot.h>
 #include <aprinter/printer/utils/ConvenientCommandStream.h>
 #include <aprinter/printer/utils/WebRequest.h>
 #include <aprinter/printer/utils/ModuleUtils.h>
@@ -76,7 +80,7 @@ private:
         typename Params::HttpServerNetParams,
         128,   // MaxRequestLineLength
         64,    // MaxHeaderLineLength
-        283,   // ExpectedResponseLength
+        400,   // ExpectedResponseLength
         10000, // MaxRequestHeadLength
         256,   // MaxChunkHeaderLength
         1024,  // MaxTrailerLength
@@ -86,6 +90,7 @@ private:
     
     static size_t const GetSdChunkSize = 512;
     static size_t const GcodeParseChunkSize = 16;
+    static size_t const FileHeadersBufferSize = 160;
     
 private:
     using TimeType = typename Context::Clock::TimeType;
@@ -151,6 +156,33 @@ private:
     
     static TimeType const GcodeSendBufTimeoutTicks = Params::GcodeSendBufTimeout::value() * Context::Clock::time_freq;
     
+    // The status snapshot keeps the version at which each status value last
+    // changed, so that clients can request only the changes since the version
+    // they have (/rr_status?since=<version token>).
+    static size_t const StatusSnapshotSize = Params::StatusSnapshotSize;
+    using TheStatusSnapshot = JsonStatusSnapshot<StatusSnapshotSize>;
+    using StatusVersionToken = typename TheStatusSnapshot::VersionToken;
+    
+    // Status stream (/rr_statusstream): the status snapshot is updated at most
+    // once per StatusStreamInterval, and the changes since the version last
+    // sent are sent as a server-sent event to each client. The event is built
+    // once for all clients which have the previous version. Clients for which
+    // nothing changed are sent an empty delta after StatusStreamRefreshTicks
+    // (this also detects dead clients).
+    static int const MaxStatusStreams = Params::MaxStatusStreams;
+    static_assert(MaxStatusStreams >= 0, "");
+    static TimeType const StatusStreamIntervalTicks = Params::StatusStreamInterval::value() * Context::Clock::time_freq;
+    static TimeType const StatusStreamRefreshTicks = 10.0 * Context::Clock::time_freq;
+    static size_t const StatusStreamEventOverhead = 8; // "data: " and "\n\n"
+    static_assert(TheHttpServer::MaxTxChunkSize >= JsonBufferSize + StatusStreamEventOverhead, "");
+    
+    // File downloads send the data straight from the SD block cache when they
+    // can pin the cache block (see BlockCache::CacheRef::pinFrom), instead of
+    // copying it into the send buffer. Each block in flight uses a SendBlock.
+    static int const NumSendBlocks = Params::NumSendBlocks;
+    static_assert(NumSendBlocks >= 0, "");
+    static_assert(NumSendBlocks <= Context::Network::MaxSendRefs, "");
+    
 public:
     static void init (Context c)
     {
@@ -160,6 +192,15 @@ public:
             slot.init(c);
         }
         
+        o->status_snapshot.init();
+        o->status_streams.init();
+        o->num_status_streams = 0;
+        o->status_stream_timer.init(c, APRINTER_CB_STATFUNC_T(&WebInterfaceModule::status_stream_timer_handler));
+        
+        for (int i = 0; i < NumSendBlocks; i++) {
+            o->send_blocks[i].init(c);
+        }
+        
         TheHttpServer::init(c);
     }
     
@@ -174,6 +215,13 @@ public:
         for (GcodeSlot &slot : o->gcode_slots) {
             slot.deinit(c);
         }
+        
+        // The connections have released the send blocks by now.
+        for (int i = 0; i < NumSendBlocks; i++) {
+            o->send_blocks[i].deinit(c);
+        }
+        
+        o->status_stream_timer.deinit(c);
     }
     
 private:
@@ -197,8 +245,46 @@ private:
         return "application/octet-stream";
     }
     
+    // Files of these types may have a precompressed variant (with .gz appended
+    // to the name), which is served to clients that accept gzip.
+    static bool is_compressible_file (MemRef path)
+    {
+        return AsciiCaseInsensEndsWith(path, ".htm") || AsciiCaseInsensEndsWith(path, ".html") ||
+               AsciiCaseInsensEndsWith(path, ".css") || AsciiCaseInsensEndsWith(path, ".js");
+    }
+    
+    // Formats a FAT modification time as an HTTP date (29 characters).
+    // FAT times are local times, we present them as GMT for lack of anything better.
+    static bool format_http_date (uint32_t fat_time, char *out, size_t out_size)
+    {
+        static char const day_names[] = "ThuFriSatSunMonTueWed";
+        static char const month_names[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+        
+        int year   = 1980 + (int)(fat_time >> 25);
+        int month  = (fat_time >> 21) & 0xF;
+        int day    = (fat_time >> 16) & 0x1F;
+        int hour   = (fat_time >> 11) & 0x1F;
+        int minute = (fat_time >> 5) & 0x3F;
+        int second = 2 * (int)(fat_time & 0x1F);
+        if (month < 1 || month > 12 || day < 1 || hour > 23 || minute > 59 || second > 59) {
+            return false;
+        }
+        
+        // Days since 1970-01-01 (a Thursday), counting years from March.
+        int y = year - (month <= 2);
+        int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+        long days = 365L * y + y / 4 - y / 100 + y / 400 + doy - 719468;
+        
+        int weekday = days % 7;
+        snprintf(out, out_size, "%.3s, %02d %.3s %d %02d:%02d:%02d GMT",
+                 day_names + 3 * weekday, day, month_names + 3 * (month - 1), year, hour, minute, second);
+        return true;
+    }
+    
     static void http_request_handler (Context c, TheRequestInterface *request)
     {
+        auto *o = Object::self(c);
+        
         char const *method = request->getMethod(c);
         MemRef path = request->getPath(c);
         UserClientState *state = request->getUserState(c);
@@ -214,6 +300,15 @@ private:
             }
 #endif
             
+            if (MaxStatusStreams > 0 && path.equalTo("/rr_statusstream")) {
+                if (o->num_status_streams >= MaxStatusStreams) {
+                    request->setResponseStatus(c, HttpStatusCodes::ServiceUnavailable());
+                    goto error;
+                }
+                
+                return state->acceptStatusStreamRequest(c, request);
+            }
+            
             if (path.removePrefix("/rr_")) {
                 return state->acceptJsonResponseRequest(c, request, path);
             }
@@ -280,13 +375,17 @@ private:
     }
     struct HttpRequestHandler : public AMBRO_WFUNC_TD(&WebInterfaceModule::http_request_handler) {};
     
-    static bool handle_simple_json_resp_request (Context c, MemRef req_type, JsonBuilder *json)
+    static bool handle_simple_json_resp_request (Context c, MemRef req_type, TheRequestInterface *request, JsonBuilder *json)
     {
         if (req_type.equalTo("connect") || req_type.equalTo("disconnect")) {
             json->addSafeKeyVal("err", JsonUint32{0});
         }
         else if (req_type.equalTo("status")) {
-            ThePrinterMain::get_json_status(c, json);
+            StatusVersionToken since;
+            MemRef since_param;
+            bool have_since = request->getParam(c, "since", &since_param) &&
+                              TheStatusSnapshot::parseVersionToken(since_param, &since);
+            write_json_status(c, json, have_since ? &since : nullptr);
         }
         else {
             return false;
@@ -295,12 +394,182 @@ private:
         return true;
     }
     
+    // Updates the status snapshot and writes the status in the same pass.
+    // If the client has the status of version since, only the changes are
+    // written, marked with "delta" (a JSON merge patch). The version token
+    // is always included, after the status since it is known only then.
+    static void write_json_status (Context c, JsonBuilder *json, StatusVersionToken const *since)
+    {
+        auto *o = Object::self(c);
+        
+        // The first status is recorded when the first client asks for it,
+        // which varies from boot to boot, so the time then serves as the epoch.
+        if (o->status_snapshot.getVersion() == 0) {
+            o->status_snapshot.setEpoch((uint32_t)Context::Clock::getTime(c));
+        }
+        
+        auto start_pos = json->getPosition();
+        typename TheStatusSnapshot::Recorder recorder;
+        recorder.start(&o->status_snapshot, json, since);
+        ThePrinterMain::get_json_status(c, &recorder);
+        if (!recorder.finish()) {
+            ThePrinterMain::print_pgm_string(c, AMBRO_PSTR("//HttpStatusSnapshotOverrun\n"));
+        }
+        
+        switch (recorder.getOutputType()) {
+            case TheStatusSnapshot::OutputType::DELTA: {
+                json->addSafeKeyVal("delta", JsonBool{true});
+            } break;
+            
+            case TheStatusSnapshot::OutputType::INVALID: {
+                // The structure of the status changed while the delta was
+                // being written, the whole status is needed.
+                json->rollBack(start_pos);
+                ThePrinterMain::get_json_status(c, json);
+            } break;
+            
+            default: break;
+        }
+        
+        write_status_version_token(c, json);
+    }
+    
+    // Writes the status as of the last write_json_status(), which must have
+    // been done without returning to the event loop, for a client which has
+    // the status of the given version.
+    static void write_recorded_json_status (Context c, JsonBuilder *json, uint32_t since_version)
+    {
+        auto *o = Object::self(c);
+        
+        StatusVersionToken since = o->status_snapshot.getVersionToken();
+        since.version = since_version;
+        
+        if (o->status_snapshot.isDeltaPossible(since)) {
+            json->addSafeKeyVal("delta", JsonBool{true});
+            typename TheStatusSnapshot::Emitter emitter;
+            emitter.start(&o->status_snapshot, json, since);
+            ThePrinterMain::get_json_status(c, &emitter);
+        } else {
+            ThePrinterMain::get_json_status(c, json);
+        }
+        
+        write_status_version_token(c, json);
+    }
+    
+    static void write_status_version_token (Context c, JsonBuilder *json)
+    {
+        auto *o = Object::self(c);
+        
+        json->add(JsonSafeString{"version"});
+        json->entryValue();
+        TheStatusSnapshot::writeVersionToken(json, o->status_snapshot.getVersionToken());
+    }
+    
+    static void status_stream_timer_handler (Context c)
+    {
+        auto *o = Object::self(c);
+        AMBRO_ASSERT(!o->status_streams.isEmpty())
+        
+        o->status_stream_timer.appendAfter(c, StatusStreamIntervalTicks);
+        
+        // Update the snapshot while writing the changes since the current
+        // version, which is what the streams which keep up have.
+        StatusVersionToken prev = o->status_snapshot.getVersionToken();
+        JsonBuilder json;
+        json.loadBuffer(o->json_buffer, sizeof(o->json_buffer));
+        json.start();
+        json.startObject();
+        write_json_status(c, &json, &prev);
+        json.endObject();
+        size_t length = json.getLength();
+        uint32_t version = o->status_snapshot.getVersion();
+        
+        UserClientState *client = o->status_streams.first();
+        while (client) {
+            UserClientState *next = o->status_streams.next(client);
+            if (client->m_stream.version == prev.version) {
+                client->statusStreamUpdate(c, version, &length);
+            }
+            client = next;
+        }
+        
+        // Streams which are behind need their own event, written into the
+        // same buffer, so only now.
+        client = o->status_streams.first();
+        while (client) {
+            UserClientState *next = o->status_streams.next(client);
+            if (client->m_stream.version != version) {
+                client->statusStreamUpdate(c, version, nullptr);
+            }
+            client = next;
+        }
+    }
+    
+    class SendBlock {
+        friend WebInterfaceModule;
+        
+    public:
+        void init (Context c)
+        {
+            m_send_ref.init(c, APRINTER_CB_OBJFUNC_T(&SendBlock::send_ref_handler, this));
+            m_cache_ref.init(c, APRINTER_CB_OBJFUNC_T(&SendBlock::cache_ref_handler, this));
+            m_in_use = false;
+        }
+        
+        void deinit (Context c)
+        {
+            AMBRO_ASSERT(!m_in_use)
+            
+            m_cache_ref.deinit(c);
+            m_send_ref.deinit(c);
+        }
+        
+        void release (Context c)
+        {
+            AMBRO_ASSERT(m_in_use)
+            
+            m_cache_ref.resetNoReuse(c);
+            m_in_use = false;
+        }
+        
+    private:
+        void send_ref_handler (Context c)
+        {
+            release(c);
+        }
+        
+        void cache_ref_handler (Context c, bool error)
+        {
+            // Pinned references are available immediately, never with a callback.
+            AMBRO_ASSERT(false)
+        }
+        
+        typename TheHttpServer::ResponseBodyRef m_send_ref;
+        typename TheBufferedFile::CacheRef m_cache_ref;
+        bool m_in_use;
+    };
+    
+    static SendBlock * alloc_send_block (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        for (int i = 0; i < NumSendBlocks; i++) {
+            SendBlock *block = &o->send_blocks[i];
+            if (!block->m_in_use) {
+                block->m_in_use = true;
+                return block;
+            }
+        }
+        return nullptr;
+    }
+    
     class GcodeSlot;
     
     class UserClientState
     : private TheRequestInterface::RequestUserCallback,
       private TheWebRequest
     {
+        friend WebInterfaceModule;
         friend class GcodeSlot;
         
     private:
@@ -309,11 +578,11 @@ private:
             READ_OPEN, READ_WAIT, READ_READ,
             WRITE_OPEN, WRITE_WAIT, WRITE_WRITE, WRITE_EOF,
             JSONRESP_WAITBUF, JSONRESP_CUSTOM_TRY, JSONRESP_CUSTOM,
-            GCODE,
+            GCODE, STATUS_STREAM,
             DL_TEST, UL_TEST
         };
         
-        enum class ResourceState : uint8_t {NONE, FILE, GCODE_SLOT, CUSTOM_REQ};
+        enum class ResourceState : uint8_t {NONE, FILE, GCODE_SLOT, CUSTOM_REQ, STATUS_STREAM};
         
     public:
         void init (Context c)
@@ -326,9 +595,10 @@ private:
         {
             switch (m_resource_state) {
                 case ResourceState::NONE: break;
-                case ResourceState::FILE:       m_buffered_file.deinit(c);                     break;
-                case ResourceState::GCODE_SLOT: m_gcode_slot->detach(c);                       break;
-                case ResourceState::CUSTOM_REQ: m_custom_req.callback->cbRequestTerminated(c); break;
+                case ResourceState::FILE:          deinit_file(c);                                break;
+                case ResourceState::GCODE_SLOT:    m_gcode_slot->detach(c);                       break;
+                case ResourceState::CUSTOM_REQ:    m_custom_req.callback->cbRequestTerminated(c); break;
+                case ResourceState::STATUS_STREAM: remove_status_stream(c);                       break;
                 default: AMBRO_ASSERT(false);
             }
         }
@@ -361,6 +631,33 @@ private:
         {
             m_buffered_file.init(c, APRINTER_CB_OBJFUNC_T(&UserClientState::buffered_file_handler, this));
             m_resource_state = ResourceState::FILE;
+            m_send_block = nullptr;
+        }
+        
+        void deinit_file (Context c)
+        {
+            free_send_block(c);
+            m_buffered_file.deinit(c);
+        }
+        
+        void free_send_block (Context c)
+        {
+            if (m_send_block) {
+                m_send_block->release(c);
+                m_send_block = nullptr;
+            }
+        }
+        
+        void remove_status_stream (Context c)
+        {
+            auto *o = Object::self(c);
+            AMBRO_ASSERT(o->num_status_streams > 0)
+            
+            o->status_streams.remove(this);
+            o->num_status_streams--;
+            if (o->status_streams.isEmpty()) {
+                o->status_stream_timer.unset(c);
+            }
         }
         
     public:
@@ -369,9 +666,22 @@ private:
             accept_request_common(c, request);
             
             m_file_path = file_path;
+            m_file_base_dir = base_dir;
+            m_file_gzip = false;
+            
+            // Try the precompressed variant first if the client accepts it.
+            if (request->acceptsGzipEncoding(c) && is_compressible_file(file_path)) {
+                size_t path_len = strlen(file_path);
+                if (path_len + 4 <= sizeof(m_file_buf)) {
+                    memcpy(m_file_buf, file_path, path_len);
+                    memcpy(m_file_buf + path_len, ".gz", 4);
+                    m_file_gzip = true;
+                }
+            }
+            
             m_state = State::READ_OPEN;
             init_file(c);
-            m_buffered_file.startOpen(c, file_path, false, TheBufferedFile::OpenMode::OPEN_READ, base_dir);
+            m_buffered_file.startOpen(c, m_file_gzip ? m_file_buf : file_path, false, TheBufferedFile::OpenMode::OPEN_READ, base_dir);
         }
         
         void acceptUploadFileRequest (Context c, TheRequestInterface *request, char const *file_path)
@@ -405,6 +715,87 @@ private:
             m_resource_state = ResourceState::GCODE_SLOT;
         }
         
+        void acceptStatusStreamRequest (Context c, TheRequestInterface *request)
+        {
+            auto *o = Object::self(c);
+            AMBRO_ASSERT(o->num_status_streams < MaxStatusStreams)
+            
+            accept_request_common(c, request);
+            
+            m_request->setResponseContentType(c, "text/event-stream");
+            m_request->setResponseExtraHeaders(c, "Cache-Control: no-cache\r\n");
+            m_request->adoptResponseBody(c);
+            
+            m_state = State::STATUS_STREAM;
+            m_resource_state = ResourceState::STATUS_STREAM;
+            m_stream.version = 0;
+            m_stream.waiting_buf = false;
+            o->status_streams.prepend(this);
+            o->num_status_streams++;
+            
+            // The first stream starts the updates.
+            if (!o->status_stream_timer.isSet(c)) {
+                o->status_stream_timer.appendNowNotAlready(c);
+            }
+        }
+        
+        // Sends the status of the given version, if the stream does not have it
+        // yet or needs a refresh. If event_length is given, the event is the one
+        // in json_buffer, otherwise one is written for this stream.
+        void statusStreamUpdate (Context c, uint32_t version, size_t const *event_length)
+        {
+            auto *o = Object::self(c);
+            AMBRO_ASSERT(m_state == State::STATUS_STREAM)
+            
+            TimeType now = Context::Clock::getTime(c);
+            if (version == m_stream.version &&
+                (TimeType)(now - m_stream.send_time) < StatusStreamRefreshTicks)
+            {
+                return;
+            }
+            
+            // If the client is not keeping up, it will get the changes
+            // at the first update when there is space for any status.
+            auto buf_st = m_request->getResponseBodyBufferState(c);
+            if (buf_st.length < StatusStreamEventOverhead + JsonBufferSize) {
+                if (!m_stream.waiting_buf) {
+                    m_stream.waiting_buf = true;
+                    m_request->controlResponseBodyTimeout(c, true);
+                }
+                return;
+            }
+            
+            size_t length;
+            if (event_length) {
+                length = *event_length;
+            } else {
+                JsonBuilder json;
+                json.loadBuffer(o->json_buffer, sizeof(o->json_buffer));
+                json.start();
+                json.startObject();
+                write_recorded_json_status(c, &json, m_stream.version);
+                json.endObject();
+                length = json.getLength();
+            }
+            
+            if (length > JsonBufferSize) {
+                ThePrinterMain::print_pgm_string(c, AMBRO_PSTR("//HttpJsonBufOverrun\n"));
+                return;
+            }
+            
+            buf_st.data.copyIn(MemRef("data: "));
+            buf_st.data.subFrom(6).copyIn(MemRef(o->json_buffer, length));
+            buf_st.data.subFrom(6 + length).copyIn(MemRef("\n\n"));
+            m_request->provideResponseBodyData(c, StatusStreamEventOverhead + length);
+            
+            if (m_stream.waiting_buf) {
+                m_stream.waiting_buf = false;
+                m_request->controlResponseBodyTimeout(c, false);
+            }
+            m_stream.version = version;
+            m_stream.send_time = now;
+        }
+        
 #if APRINTER_ENABLE_HTTP_TEST
         void acceptDownloadTestRequest (Context c, TheRequestInterface *request)
         {
@@ -484,8 +875,13 @@ private:
                     auto buf_st = m_request->getResponseBodyBufferState(c);
                     size_t allowed_length = MinValue(GetSdChunkSize, buf_st.length);
                     if (m_cur_chunk_size < allowed_length) {
+                        // For a whole chunk, try to avoid the copy into the send buffer.
+                        if (m_cur_chunk_size == 0 && allowed_length == GetSdChunkSize) {
+                            m_send_block = alloc_send_block(c);
+                        }
+                        auto *pin_ref = m_send_block ? &m_send_block->m_cache_ref : nullptr;
                         auto dest_buf = buf_st.data.subFrom(m_cur_chunk_size);
-                        m_buffered_file.startReadData(c, dest_buf.ptr1, MinValue(dest_buf.wrap, (size_t)(allowed_length - m_cur_chunk_size)));
+                        m_buffered_file.startReadData(c, dest_buf.ptr1, MinValue(dest_buf.wrap, (size_t)(allowed_length - m_cur_chunk_size)), pin_ref);
                         m_state = State::READ_READ;
                         m_request->controlResponseBodyTimeout(c, false);
                     }
@@ -505,7 +901,7 @@ private:
                     m_json_req.builder.start();
                     m_json_req.builder.startObject();
                     
-                    if (handle_simple_json_resp_request(c, m_json_req.req_type, &m_json_req.builder)) {
+                    if (handle_simple_json_resp_request(c, m_json_req.req_type, m_request, &m_json_req.builder)) {
                         m_json_req.builder.endObject();
                         if (!send_json_buffer(c)) {
                             m_request->setResponseStatus(c, HttpStatusCodes::InternalServerError());
@@ -552,6 +948,9 @@ private:
                 case State::GCODE:
                     return m_gcode_slot->responseBufferEvent(c);
                 
+                case State::STATUS_STREAM:
+                    break;
+                
 #if APRINTER_ENABLE_HTTP_TEST
                 case State::DL_TEST: {
                     while (true) {
@@ -582,6 +981,13 @@ private:
             switch (m_state) {
                 case State::READ_OPEN:
                 case State::WRITE_OPEN: {
+                    if (m_state == State::READ_OPEN && m_file_gzip && error == TheBufferedFile::Error::NOT_FOUND) {
+                        // No precompressed variant, open the file itself.
+                        m_file_gzip = false;
+                        m_buffered_file.startOpen(c, m_file_path, false, TheBufferedFile::OpenMode::OPEN_READ, m_file_base_dir);
+                        return;
+                    }
+                    
                     if (error != TheBufferedFile::Error::NO_ERROR) {
                         auto status = (error == TheBufferedFile::Error::NOT_FOUND) ? HttpStatusCodes::NotFound() : HttpStatusCodes::InternalServerError();
                         m_request->setResponseStatus(c, status);
@@ -589,6 +995,13 @@ private:
                     }
                     
                     if (m_state == State::READ_OPEN) {
+                        bool not_modified = set_file_response_headers(c);
+                        if (not_modified) {
+                            // The client has this version, answer without reading the file.
+                            m_request->setResponseStatus(c, HttpStatusCodes::NotModified());
+                            return complete_request(c);
+                        }
+                        
                         m_request->setResponseContentType(c, get_content_type(m_file_path));
                         m_request->adoptResponseBody(c);
                         
@@ -596,6 +1009,12 @@ private:
                         m_cur_chunk_size = 0;
                         m_request->controlResponseBodyTimeout(c, true);
                     } else {
+                        // Let the file system allocate the whole file contiguously if it can.
+                        uint64_t body_length;
+                        if (m_request->getRequestBodyLength(c, &body_length) && body_length <= UINT32_MAX) {
+                            m_buffered_file.setExpectedSize(c, body_length);
+                        }
+                        
                         m_request->adoptRequestBody(c);
                         
                         m_state = State::WRITE_WAIT;
@@ -610,11 +1029,22 @@ private:
                     }
                     
                     AMBRO_ASSERT(read_length <= GetSdChunkSize - m_cur_chunk_size)
-                    m_cur_chunk_size += read_length;
                     
-                    if (m_cur_chunk_size == GetSdChunkSize || (read_length == 0 && m_cur_chunk_size > 0)) {
-                        m_request->provideResponseBodyData(c, m_cur_chunk_size);
-                        m_cur_chunk_size = 0;
+                    char const *pinned_data = m_send_block ? m_buffered_file.getPinnedReadData(c) : nullptr;
+                    if (pinned_data) {
+                        // The send block is released when the data has been sent.
+                        AMBRO_ASSERT(m_cur_chunk_size == 0)
+                        AMBRO_ASSERT(read_length > 0)
+                        m_request->provideResponseBodyRef(c, pinned_data, read_length, &m_send_block->m_send_ref);
+                        m_send_block = nullptr;
+                    } else {
+                        free_send_block(c);
+                        m_cur_chunk_size += read_length;
+                        
+                        if (m_cur_chunk_size == GetSdChunkSize || (read_length == 0 && m_cur_chunk_size > 0)) {
+                            m_request->provideResponseBodyData(c, m_cur_chunk_size);
+                            m_cur_chunk_size = 0;
+                        }
                     }
                     
                     if (read_length == 0) {
@@ -649,6 +1079,56 @@ private:
             }
         }
         
+        // Sets the caching related response headers for the opened file, and
+        // returns whether the client's If-None-Match matches the ETag. The ETag
+        // is made from the size and modification time in the directory entry;
+        // files without a modification time (written by us) get none.
+        bool set_file_response_headers (Context c)
+        {
+            auto entry = m_buffered_file.getFileEntry(c);
+            uint32_t modify_time = entry.getModifyTime();
+            
+            char *buf = m_file_buf;
+            size_t size = sizeof(m_file_buf);
+            size_t pos = 0;
+            
+            pos += snprintf(buf + pos, size - pos, "Cache-Control: no-cache\r\n");
+            if (is_compressible_file(m_file_path)) {
+                pos += snprintf(buf + pos, size - pos, "Vary: Accept-Encoding\r\n");
+            }
+            if (m_file_gzip) {
+                pos += snprintf(buf + pos, size - pos, "Content-Encoding: gzip\r\n");
+            }
+            
+            bool not_modified = false;
+            if (modify_time != 0) {
+                char etag[24];
+                snprintf(etag, sizeof(etag), "\"%" PRIx32 "-%" PRIx32 "%s\"", entry.getFileSize(), modify_time, m_file_gzip ? "-gz" : "");
+                pos += snprintf(buf + pos, size - pos, "ETag: %s\r\n", etag);
+                
+                char date[32];
+                if (format_http_date(modify_time, date, sizeof(date))) {
+                    pos += snprintf(buf + pos, size - pos, "Last-Modified: %s\r\n", date);
+                }
+                
+                char const *if_none_match = m_request->getIfNoneMatch(c);
+                if (if_none_match) {
+                    StringIterHttpTokens(if_none_match, [&](MemRef token) {
+                        if (token.len >= 2 && token.ptr[0] == 'W' && token.ptr[1] == '/') {
+                            token = token.subFrom(2);
+                        }
+                        if (token.equalTo("*") || token.equalTo(etag)) {
+                            not_modified = true;
+                        }
+                    });
+                }
+            }
+            
+            AMBRO_ASSERT(pos < size)
+            m_request->setResponseExtraHeaders(c, buf);
+            return not_modified;
+        }
+        
         void load_json_buffer (Context c)
         {
             auto *o = Object::self(c);
@@ -760,6 +1240,7 @@ private:
         
     private:
         TheRequestInterface *m_request;
+        DoubleEndedListNode<UserClientState> m_stream_node;
         State m_state;
         ResourceState m_resource_state;
         union {
@@ -773,7 +1254,12 @@ private:
         union {
             struct {
                 char const *m_file_path;
+                char const *m_file_base_dir;
                 size_t m_cur_chunk_size;
+                SendBlock *m_send_block;
+                bool m_file_gzip;
+                // The .gz path while opening, then the response headers.
+                char m_file_buf[FileHeadersBufferSize];
             };
             struct {
                 MemRef req_type;
@@ -781,6 +1267,11 @@ private:
                 bool resp_body_pending;
                 bool custom_waiting;
             } m_json_req;
+            struct {
+                uint32_t version;
+                TimeType send_time;
+                bool waiting_buf;
+            } m_stream;
         };
     };
     
@@ -1021,6 +1512,11 @@ public:
         TheHttpServer
     >> {
         GcodeSlot gcode_slots[NumGcodeSlots];
+        DoubleEndedList<UserClientState, &UserClientState::m_stream_node, false> status_streams;
+        int num_status_streams;
+        typename Context::EventLoop::TimedEvent status_stream_timer;
+        TheStatusSnapshot status_snapshot;
+        SendBlock send_blocks[MaxValue(1, NumSendBlocks)];
         char json_buffer[JsonBufferSize + 2];
     };
 };
@@ -1031,7 +1527,11 @@ APRINTER_ALIAS_STRUCT_EXT(WebInterfaceModuleService, (
     APRINTER_AS_VALUE(int, NumGcodeSlots),
     APRINTER_AS_TYPE(TheGcodeParserService),
     APRINTER_AS_VALUE(size_t, MaxGcodeCommandSize),
-    APRINTER_AS_TYPE(GcodeSendBufTimeout)
+    APRINTER_AS_TYPE(GcodeSendBufTimeout),
+    APRINTER_AS_TYPE(StatusStreamInterval),
+    APRINTER_AS_VALUE(int, MaxStatusStreams),
+    APRINTER_AS_VALUE(size_t, StatusSnapshotSize),
+    APRINTER_AS_VALUE(int, NumSendBlocks)
 ), (
     APRINTER_MODULE_TEMPLATE(WebInterfaceModuleService, WebInterfaceModule)
 ))
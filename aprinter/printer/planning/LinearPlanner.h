@@ -76,6 +76,13 @@ struct LinearPlanner {
         return FloatMin(segment->max_start_v, end_v + segment->a_x);
     }
 
+    // Given the value returned by push(), checks whether the start speed of the
+    // segment is at its upper bound, meaning that no later segments can change it.
+    static bool isStartSpeedFinal (SegmentData const *segment, FpType start_v)
+    {
+        return !(start_v < segment->max_start_v);
+    }
+    
     static FpType pull (SegmentData *segment, SegmentState *s, FpType start_v, SegmentResult *result)
     {
         AMBRO_ASSERT(s->end_v <= segment->max_v)
@@ -52,10 +52,23 @@
 #include <aprinter/system/InterruptLock.h>
 #include <aprinter/printer/actuators/AxisDriverConsumer.h>
 #include <aprinter/printer/planning/LinearPlanner.h>
+#include <aprinter/printer/planning/SCurveProfile.h>
 #include <aprinter/printer/Configuration.h>
 
 #include <aprinter/BeginNamespace.h>
 
+#ifdef MOTIONPLANNER_SCURVE
+#ifndef MOTIONPLANNER_SCURVE_RAMP_STEPS
+#define MOTIONPLANNER_SCURVE_RAMP_STEPS 2
+#endif
+#ifndef MOTIONPLANNER_SCURVE_RAMP_TIME
+#define MOTIONPLANNER_SCURVE_RAMP_TIME 0.02
+#endif
+#ifndef MOTIONPLANNER_SCURVE_MAX_RAMP_FRACTION
+#define MOTIONPLANNER_SCURVE_MAX_RAMP_FRACTION 0.25
+#endif
+#endif
+
 APRINTER_ALIAS_STRUCT(MotionPlannerAxisSpec, (
     APRINTER_AS_TYPE(TheAxisDriver),
     APRINTER_AS_VALUE(int, StepBits),
@@ -119,11 +132,27 @@ private:
     static_assert(NumAxes > 0, "");
     static const int NumChannels = TypeListLength<ParamsChannelsList>::Value;
     using SegmentBufferSizeType = ChooseIntForMax<2 * LookaheadBufferSize, false>; // twice for segments_add()
-    static const size_t StepperCommitBufferSize = 3 * StepperSegmentBufferSize;
-    static const size_t StepperBackupBufferSize = 3 * (LookaheadBufferSize - LookaheadCommitCount);
+#ifdef MOTIONPLANNER_SCURVE
+    using TheSCurveProfile = SCurveProfile<FpType, MOTIONPLANNER_SCURVE_RAMP_STEPS>;
+    using SCurvePhase = typename TheSCurveProfile::Phase;
+    static_assert(MOTIONPLANNER_SCURVE_MAX_RAMP_FRACTION > 0.0 && MOTIONPLANNER_SCURVE_MAX_RAMP_FRACTION <= 0.5, "");
+    // The peak acceleration of an S-curve phase is up to 1/(1-MaxRampFraction)
+    // times its average, so phases are planned with the configured accelerations
+    // lowered by this much, keeping the peak within them.
+    static constexpr FpType SCurveAccelRecFactor = 1.0 / (1.0 - MOTIONPLANNER_SCURVE_MAX_RAMP_FRACTION);
+    // The acceleration and deceleration phases take NumSubPhases commands each, so
+    // the stepper command buffers are that much larger (see README).
+    static const int StepperCommandsPerSegment = 2 * TheSCurveProfile::NumSubPhases + 1;
+#else
+    static const int StepperCommandsPerSegment = 3;
+#endif
+    static const size_t StepperCommitBufferSize = StepperCommandsPerSegment * StepperSegmentBufferSize;
+    static const size_t StepperBackupBufferSize = StepperCommandsPerSegment * (LookaheadBufferSize - LookaheadCommitCount);
     using StepperCommitBufferSizeType = ChooseIntForMax<StepperCommitBufferSize, false>;
     using StepperBackupBufferSizeType = ChooseIntForMax<2 * StepperBackupBufferSize, false>;
-    using StepperFastEvent = typename Context::EventLoop::template FastEventSpec<MotionPlanner>;
+    using StepperFastEvent = typename Context::EventLoop::template FastEventSpec<MotionPlanner, Context::EventLoop::FastPriority::High>;
+    // The callback event runs command processing, which can take long, so
+    // only the stepper event is High priority.
     using CallbackFastEvent = typename Context::EventLoop::template FastEventSpec<StepperFastEvent>;
     static const int TypeBits = BitsInInt<NumChannels>::Value;
     using AxisMaskType = ChooseInt<NumAxes + TypeBits, false>;
@@ -309,7 +338,7 @@ private:
         static bool have_commit_space (bool accum, Context c)
         {
             auto *o = Object::self(c);
-            return (accum && commit_avail(o->m_commit_start, o->m_commit_end) >= 3 * LookaheadCommitCount);
+            return (accum && commit_avail(o->m_commit_start, o->m_commit_end) >= StepperCommandsPerSegment * LookaheadCommitCount);
         }
         
         static void start_commands (Context c)
@@ -598,17 +627,43 @@ public:
             bool dir = entry->dir_and_type & TheAxisMask;
             FpType accel_conversion = entry->axes.lp_seg.a_x_rec * xfp;
             
+#ifdef MOTIONPLANNER_SCURVE
+            auto *m = MotionPlanner::Object::self(c);
+#endif
+            
             if (x0.bitsValue() != 0) {
-                TheCommon::gen_stepper_command(c, dir, x0, t0, FixedMin(x0, StepperStepFixedType::importFpSaturatedRound(accel_conversion * vdiff0_squared)));
+                StepperStepFixedType a0 = FixedMin(x0, StepperStepFixedType::importFpSaturatedRound(accel_conversion * vdiff0_squared));
+#ifdef MOTIONPLANNER_SCURVE
+                gen_scurve_stepper_commands(c, dir, x0, t0, a0, &m->m_scurve_phases[0], false);
+#else
+                TheCommon::gen_stepper_command(c, dir, x0, t0, a0);
+#endif
             }
             if (!skip1) {
                 TheCommon::gen_stepper_command(c, dir, x1, t1, StepperStepFixedType::importBits(0));
             }
             if (x2.bitsValue() != 0) {
-                TheCommon::gen_stepper_command(c, dir, x2, t2, -FixedMin(x2, StepperStepFixedType::importFpSaturatedRound(accel_conversion * vdiff2_squared)));
+                StepperStepFixedType a2 = FixedMin(x2, StepperStepFixedType::importFpSaturatedRound(accel_conversion * vdiff2_squared));
+#ifdef MOTIONPLANNER_SCURVE
+                gen_scurve_stepper_commands(c, dir, x2, t2, a2, &m->m_scurve_phases[1], true);
+#else
+                TheCommon::gen_stepper_command(c, dir, x2, t2, -a2);
+#endif
             }
         }
         
+#ifdef MOTIONPLANNER_SCURVE
+        // Generates the commands for one acceleration or deceleration phase
+        // split according to the S-curve profile.
+        template <typename TheMinTimeType>
+        static void gen_scurve_stepper_commands (Context c, bool dir, StepperStepFixedType x, TheMinTimeType t, StepperStepFixedType a, SCurvePhase const *phase, bool decel)
+        {
+            TheSCurveProfile::splitCommand(phase, x, t, a, decel, [&](auto sub_x, auto sub_t, auto sub_a) {
+                TheCommon::gen_stepper_command(c, dir, sub_x, sub_t, sub_a);
+            });
+        }
+#endif
+        
         static void start_stepping_impl (Context c, TimeType start_time, StepperCommand *cmd)
         {
             TheAxisDriver::template start<TheAxisDriverConsumer<AxisIndex>>(c, start_time, cmd);
@@ -1071,6 +1126,7 @@ public:
         o->m_segments_start = 0;
         o->m_segments_staging_length = 0;
         o->m_segments_length = 0;
+        o->m_segments_optimal = 0;
         o->m_staging_time = 0;
         o->m_staging_v_squared = 0.0f;
         o->m_staging_v = 0.0f;
@@ -1190,6 +1246,97 @@ public:
     }
 #endif
     
+#ifdef MOTIONPLANNER_BENCHMARK
+private:
+    // A plan() call often takes only a few clock ticks. Clocks which have a
+    // finer counter provide it as BenchTime (with the same interface as
+    // ClockBenchTime), and plan() is then timed with that.
+    AMBRO_DECLARE_HAS_MEMBER_TYPE_FUNC(HasBenchTime, BenchTime)
+    
+    struct ClockBenchTime {
+        using TimeType = typename Clock::TimeType;
+        static constexpr double time_freq = Clock::time_freq;
+        
+        template <typename ThisContext>
+        static TimeType getTime (ThisContext c)
+        {
+            return Clock::getTime(c);
+        }
+    };
+    
+    template <typename TheClock, bool ClockHasBenchTime = FuncCall<HasBenchTime, TheClock>::Value>
+    struct BenchTimeHelper {
+        using Type = typename TheClock::BenchTime;
+    };
+    
+    template <typename TheClock>
+    struct BenchTimeHelper<TheClock, false> {
+        using Type = ClockBenchTime;
+    };
+    
+public:
+    using BenchTime = typename BenchTimeHelper<Clock>::Type;
+    using BenchTimeType = typename BenchTime::TimeType;
+    
+    struct BenchStats {
+        // Number of plan() calls, including ones which failed to commit.
+        uint32_t plan_count;
+        // Number of segments processed by the backward pass of plan().
+        uint32_t lookahead_count;
+        // Number of segments committed to the steppers and channels.
+        uint32_t commit_count;
+        // Total and worst-case time spent in plan(), in BenchTime units.
+        // The total adds up many short calls, so it does not wrap.
+        uint64_t plan_time;
+        BenchTimeType max_plan_time;
+    };
+    
+    static int const BenchLookaheadBufferSize = LookaheadBufferSize;
+    static int const BenchLookaheadCommitCount = LookaheadCommitCount;
+    
+    // The statistics are kept across planner init/deinit so that a
+    // benchmark can cover multiple planned command sequences.
+    static void resetBenchStats (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        o->m_bench = BenchStats{};
+    }
+    
+    static BenchStats getBenchStats (Context c)
+    {
+        auto *o = Object::self(c);
+        
+        return o->m_bench;
+    }
+#endif
+    
+#ifdef AXISDRIVER_STEP_TRACE
+    using StepTraceEntry = typename Axis<0>::TheAxisDriver::StepTraceEntry;
+    
+    static int const StepTraceNumAxes = NumAxes;
+    static size_t const StepTraceSize = Axis<0>::TheAxisDriver::StepTraceSize;
+    
+    static uint32_t getStepTraceCount (Context c, int axis_index)
+    {
+        AMBRO_ASSERT(axis_index >= 0 && axis_index < NumAxes)
+        
+        return ListForOne<AxesList, 0, uint32_t>(axis_index, [&] APRINTER_TL(axis, return axis::TheAxisDriver::getStepTraceCount(c)));
+    }
+    
+    static bool getStepTraceEntry (Context c, int axis_index, uint32_t seq, StepTraceEntry *out_entry)
+    {
+        AMBRO_ASSERT(axis_index >= 0 && axis_index < NumAxes)
+        
+        return ListForOne<AxesList, 0, bool>(axis_index, [&] APRINTER_TL(axis, return axis::TheAxisDriver::getStepTraceEntry(c, seq, out_entry)));
+    }
+    
+    static void resetStepTrace (Context c)
+    {
+        ListFor<AxesList>([&] APRINTER_TL(axis, axis::TheAxisDriver::resetStepTrace(c)));
+    }
+#endif
+    
     template <int ChannelIndex>
     using GetChannelTimer = typename Channel<ChannelIndex>::TheTimer;
     
@@ -1221,6 +1368,20 @@ private:
 #endif
     }
     
+#ifdef MOTIONPLANNER_SCURVE
+    // Computes the S-curve split for an acceleration phase lasting t_double
+    // clock ticks. The acceleration takes the ramp time to rise to its peak,
+    // but at most MOTIONPLANNER_SCURVE_MAX_RAMP_FRACTION of the phase, which
+    // the lowered planning acceleration (see SCurveAccelRecFactor) allows for.
+    static void compute_scurve_phase (FpType t_double, SCurvePhase *phase)
+    {
+        FpType ramp_time = (FpType)(MOTIONPLANNER_SCURVE_RAMP_TIME * Clock::time_freq);
+        FpType max_fraction = (FpType)MOTIONPLANNER_SCURVE_MAX_RAMP_FRACTION;
+        FpType ramp_fraction = (t_double * max_fraction > ramp_time) ? (ramp_time / t_double) : max_fraction;
+        TheSCurveProfile::compute(ramp_fraction, phase);
+    }
+#endif
+    
     static bool plan (Context c)
     {
         auto *o = Object::self(c);
@@ -1230,15 +1391,36 @@ private:
         AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) { AMBRO_ASSERT(planner_have_commit_space(c)) }
 #endif
         
-        SegmentBufferSizeType i = o->m_segments_length;
+#ifdef MOTIONPLANNER_BENCHMARK
+        BenchTimeType bench_start_time = BenchTime::getTime(c);
+#endif
+        
+        // Backward pass. Adding segments at the end can only increase the speeds
+        // computed here, so once a segment's start speed reaches max_start_v it can
+        // never change again, and neither can the push states of the segments before
+        // it. The first m_segments_optimal segments are known to be in that state,
+        // so the pass stops there.
+        SegmentBufferSizeType optimal = o->m_segments_optimal;
+        SegmentBufferSizeType new_optimal = optimal;
+#ifdef MOTIONPLANNER_BENCHMARK
+        SegmentBufferSizeType segments_length_before = o->m_segments_length;
+#endif
+        SegmentBufferSizeType j = o->m_segments_length;
         FpType v = 0.0f;
-        do {
-            i--;
-            Segment *entry = &o->m_segments[segments_add(o->m_segments_start, i)];
+        while (j > optimal) {
+            j--;
+            SegmentBufferSizeType pos = segments_add(o->m_segments_start, j);
+            Segment *entry = &o->m_segments[pos];
             if (AMBRO_LIKELY((entry->dir_and_type & TypeMask) == 0)) {
-                v = TheLinearPlanner::push(&entry->axes.lp_seg, &o->m_segment_state[i], v);
+                v = TheLinearPlanner::push(&entry->axes.lp_seg, &o->m_segment_state[pos], v);
+                if (new_optimal == optimal && TheLinearPlanner::isStartSpeedFinal(&entry->axes.lp_seg, v)) {
+                    new_optimal = j;
+                }
             }
-        } while (i != 0);
+        }
+        o->m_segments_optimal = new_optimal;
+        
+        SegmentBufferSizeType i = 0;
         
         SegmentBufferSizeType commit_count = MinValue(o->m_segments_length, (SegmentBufferSizeType)LookaheadCommitCount);
         
@@ -1254,7 +1436,7 @@ private:
             Segment *entry = &o->m_segments[segments_add(o->m_segments_start, i)];
             if (AMBRO_LIKELY((entry->dir_and_type & TypeMask) == 0)) {
                 typename TheLinearPlanner::SegmentResult result;
-                v = TheLinearPlanner::pull(&entry->axes.lp_seg, &o->m_segment_state[i], v, &result);
+                v = TheLinearPlanner::pull(&entry->axes.lp_seg, &o->m_segment_state[segments_add(o->m_segments_start, i)], v, &result);
                 FpType v_end = FloatSqrt(v);
                 FpType v_const = FloatSqrt(result.const_v);
                 FpType vdiff0 = v_const - v_start;
@@ -1275,6 +1457,10 @@ private:
                     t1.m_bits.m_int -= t2.bitsValue();
                 }
                 time += t_sum.bitsValue();
+#ifdef MOTIONPLANNER_SCURVE
+                compute_scurve_phase(t0_double, &o->m_scurve_phases[0]);
+                compute_scurve_phase(t2_double, &o->m_scurve_phases[1]);
+#endif
                 ListFor<AxesList>([&] APRINTER_TL(axis, axis::gen_segment_stepper_commands(c, entry,
                                     result.const_start, result.const_end, t0, t2, t1,
                                     vdiff0 * vdiff0, vdiff2 * vdiff2)));
@@ -1317,10 +1503,23 @@ private:
             o->m_segments_start = segments_add(o->m_segments_start, commit_count);
             o->m_segments_length -= commit_count;
             o->m_segments_staging_length = o->m_segments_length;
+            o->m_segments_optimal = (new_optimal > commit_count) ? (new_optimal - commit_count) : 0;
 #ifdef AMBROLIB_ASSERTIONS
             o->m_planned = true;
 #endif
         }
+        
+#ifdef MOTIONPLANNER_BENCHMARK
+        BenchTimeType bench_time = BenchTime::getTime(c) - bench_start_time;
+        o->m_bench.plan_count++;
+        o->m_bench.lookahead_count += segments_length_before - optimal;
+        if (AMBRO_LIKELY(ok)) {
+            o->m_bench.commit_count += commit_count;
+        }
+        o->m_bench.plan_time += bench_time;
+        o->m_bench.max_plan_time = MaxValue(o->m_bench.max_plan_time, bench_time);
+#endif
+        
         return ok;
     }
     
@@ -1473,6 +1672,7 @@ private:
         o->m_segments_start = segments_add(o->m_segments_start, o->m_segments_staging_length);
         o->m_segments_length -= o->m_segments_staging_length;
         o->m_segments_staging_length = 0;
+        o->m_segments_optimal = 0;
         o->m_staging_time = 0;
         o->m_staging_v_squared = 0.0f;
         o->m_staging_v = 0.0f;
@@ -1515,6 +1715,9 @@ private:
             ListFor<LasersList>([&] APRINTER_TL(laser, laser::write_segment_buffer_entry_extra(c, entry, distance_rec)));
             
             FpType rel_max_accel_rec = ListForFold<AxesList>(FloatIdentity(), [&] APRINTER_TLA(axis, (auto accum), return axis::compute_segment_buffer_entry_accel(accum, c, &cst)));
+#ifdef MOTIONPLANNER_SCURVE
+            rel_max_accel_rec *= SCurveAccelRecFactor;
+#endif
             entry->axes.max_accel_rec = rel_max_accel_rec * distance_rec;
             FpType half_rel_max_accel = 0.5f / rel_max_accel_rec;
             
@@ -1561,6 +1764,7 @@ public:
         SegmentBufferSizeType m_segments_start;
         SegmentBufferSizeType m_segments_staging_length;
         SegmentBufferSizeType m_segments_length;
+        SegmentBufferSizeType m_segments_optimal;
         TimeType m_staging_time;
         FpType m_staging_v_squared;
         FpType m_staging_v;
@@ -1575,6 +1779,12 @@ public:
 #ifdef AMBROLIB_ASSERTIONS
         bool m_pulling;
         bool m_planned;
+#endif
+#ifdef MOTIONPLANNER_BENCHMARK
+        BenchStats m_bench;
+#endif
+#ifdef MOTIONPLANNER_SCURVE
+        SCurvePhase m_scurve_phases[2];
 #endif
         SplitBuffer m_split_buffer;
         Segment m_segments[LookaheadBufferSize];
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMBROLIB_SCURVE_PROFILE_H
+#define AMBROLIB_SCURVE_PROFILE_H
+
+#include <aprinter/meta/FixedPoint.h>
+#include <aprinter/base/Assert.h>
+#include <aprinter/math/FloatTools.h>
+
+#include <aprinter/BeginNamespace.h>
+
+/**
+ * Reshapes a constant-acceleration phase into a jerk-limited one.
+ * 
+ * The acceleration rises linearly at the start of the phase, stays at
+ * its peak in the middle and falls linearly at the end. The profile is
+ * symmetric and covers the same time as the constant-acceleration phase,
+ * so the velocity change and the distance are the same, and the
+ * LinearPlanner results stay valid. The ramps are approximated by
+ * RampSteps constant-acceleration steps each, so that every sub-phase can
+ * be executed as an ordinary AxisDriver command.
+ * 
+ * The peak acceleration is 1/(1-u) times the average, where u is the ramp
+ * duration relative to the phase. To stay within an acceleration limit,
+ * the phase has to be planned with the limit times 1-u, where u is the
+ * largest ramp fraction used (see MotionPlanner).
+ * 
+ * All quantities are normalized to the phase: time runs from 0 to 1 and
+ * the average acceleration is 1.
+ */
+template <typename FpType, int RampSteps>
+struct SCurveProfile {
+    static_assert(RampSteps >= 1, "");
+    
+    static int const NumSubPhases = 2 * RampSteps + 1;
+    
+    struct Phase {
+        // Time at the start of each sub-phase (the last entry is 1).
+        FpType time[NumSubPhases + 1];
+        // Distance covered due to acceleration at the start of each sub-phase,
+        // relative to that of the whole phase (the last entry is 1).
+        FpType dist[NumSubPhases + 1];
+        // Distance covered due to the acceleration within each sub-phase,
+        // relative to that of the whole phase.
+        FpType quad[NumSubPhases];
+    };
+    
+    /**
+     * Computes the split of a phase. ramp_fraction is the duration of each
+     * ramp relative to the phase. It is limited to 0.5, where the profile
+     * becomes triangular.
+     */
+    static void compute (FpType ramp_fraction, Phase *out)
+    {
+        AMBRO_ASSERT(FloatIsPosOrPosZero(ramp_fraction))
+        
+        FpType u = FloatMin(ramp_fraction, (FpType)0.5f);
+        // Each ramp reaches half of the peak on average, which the peak
+        // has to make up for to keep the average acceleration at 1.
+        FpType peak = 1.0f / (1.0f - u);
+        FpType step_time = u * (1.0f / RampSteps);
+        
+        FpType s = 0.0f;
+        FpType v = 0.0f;
+        FpType d = 0.0f;
+        for (int i = 0; i < NumSubPhases; i++) {
+            FpType ds;
+            FpType a;
+            if (i == RampSteps) {
+                ds = 1.0f - 2.0f * u;
+                a = peak;
+            } else {
+                int k = (i < RampSteps) ? i : (NumSubPhases - 1 - i);
+                ds = step_time;
+                a = peak * ((k + 0.5f) * (1.0f / RampSteps));
+            }
+            FpType q = a * ds * ds;
+            out->time[i] = s;
+            out->dist[i] = d;
+            out->quad[i] = q;
+            s += ds;
+            d += 2.0f * v * ds + q;
+            v += a * ds;
+        }
+        out->time[NumSubPhases] = 1.0f;
+        out->dist[NumSubPhases] = 1.0f;
+    }
+    
+    /**
+     * Splits a stepper command for a whole phase into one command per
+     * sub-phase, calling cmd(sub_x, sub_t, sub_a) for each. The phase moves
+     * by x steps in time t, and a is the magnitude of its acceleration term
+     * (see AxisDriver). A deceleration phase is the time-reverse of an
+     * acceleration phase, so its sub-phases come in reverse order, with
+     * negative acceleration terms. The sub-phase boundaries are rounded
+     * such that the sub-phases add up to exactly x and t.
+     */
+    template <typename StepFixedType, typename TimeFixedType, typename CmdFunc>
+    static void splitCommand (Phase const *phase, StepFixedType x, TimeFixedType t, StepFixedType a, bool decel, CmdFunc cmd)
+    {
+        AMBRO_ASSERT(a <= x)
+        
+        FpType xfp = x.template fpValue<FpType>();
+        FpType afp = a.template fpValue<FpType>();
+        FpType tfp = t.template fpValue<FpType>();
+        
+        for (int j = 0; j < NumSubPhases; j++) {
+            int i = decel ? (NumSubPhases - 1 - j) : j;
+            StepFixedType x_start = boundary_x(x, xfp, afp, phase, i);
+            StepFixedType x_end = boundary_x(x, xfp, afp, phase, i + 1);
+            TimeFixedType t_start = boundary_t(t, tfp, phase, i);
+            TimeFixedType t_end = boundary_t(t, tfp, phase, i + 1);
+            AMBRO_ASSERT(x_end >= x_start)
+            AMBRO_ASSERT(t_end >= t_start)
+            StepFixedType sub_x = StepFixedType::importBits(x_end.bitsValue() - x_start.bitsValue());
+            TimeFixedType sub_t = TimeFixedType::importBits(t_end.bitsValue() - t_start.bitsValue());
+            StepFixedType sub_a = FixedMin(sub_x, StepFixedType::importFpSaturatedRound(afp * phase->quad[i]));
+            if (decel) {
+                cmd(sub_x, sub_t, -sub_a);
+            } else {
+                cmd(sub_x, sub_t, sub_a);
+            }
+        }
+    }
+    
+private:
+    template <typename StepFixedType>
+    static StepFixedType boundary_x (StepFixedType x, FpType xfp, FpType afp, Phase const *phase, int i)
+    {
+        if (i == 0) {
+            return StepFixedType::importBits(0);
+        }
+        if (i == NumSubPhases) {
+            return x;
+        }
+        return FixedMin(x, StepFixedType::importFpSaturatedRound((xfp - afp) * phase->time[i] + afp * phase->dist[i]));
+    }
+    
+    template <typename TimeFixedType>
+    static TimeFixedType boundary_t (TimeFixedType t, FpType tfp, Phase const *phase, int i)
+    {
+        if (i == 0) {
+            return TimeFixedType::importBits(0);
+        }
+        if (i == NumSubPhases) {
+            return t;
+        }
+        return FixedMin(t, TimeFixedType::importFpSaturatedRound(tfp * phase->time[i]));
+    }
+};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
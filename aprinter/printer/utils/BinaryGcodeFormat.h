@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef APRINTER_BINARY_GCODE_FORMAT_H
+#define APRINTER_BINARY_GCODE_FORMAT_H
+
+#include <stdint.h>
+
+#include <aprinter/BeginNamespace.h>
+
+/**
+ * Constants of the binary G-code format, shared by BinaryGcodeParser and
+ * the host encoder (aprinter_encode.cpp).
+ * 
+ * Each command starts with a byte whose high nibble is the command type.
+ * All multi-byte values are little-endian.
+ * 
+ * Generic commands (version 1 format):
+ * - CMD_TYPE_G0, CMD_TYPE_G1, CMD_TYPE_G92: the low nibble is the number
+ *   of parameters N, followed by N index bytes and the parameter data.
+ * - CMD_TYPE_LONG: like the above, but two more header bytes encode any
+ *   command: letter-'A' (5 bits) and number (11 bits).
+ *   An index byte is (data_type << 5) | (letter - 'A'), data is 4 bytes for
+ *   DATA_TYPE_FLOAT and DATA_TYPE_UINT32 and none for DATA_TYPE_VOID.
+ * - CMD_TYPE_EOF: the end of the file.
+ * 
+ * Delta moves (version 2 format):
+ * - CMD_TYPE_BLOCK starts a block, with the low nibble BlockVersion:
+ *   uint32 block index, a byte with the number of decimal digits of the
+ *   fixed-point X/Y/Z values (low nibble) and E values (high nibble),
+ *   then the int32 fixed-point values of X, Y, Z and E which the deltas
+ *   in the block start from. Block indices increase by one through a file,
+ *   starting from zero.
+ * - CMD_TYPE_G0_DELTA, CMD_TYPE_G1_DELTA: the low nibble holds flags
+ *   (DeltaFlagF), the next byte is the width code of each of the axes
+ *   X, Y, Z, E (2 bits each, starting from the lowest bits). Then come the
+ *   signed deltas of the present axes relative to the last values of the
+ *   axes in the block, and with DeltaFlagF the feedrate as a float.
+ *   Axes which are not present are omitted from the command, as is F
+ *   when it is not given (feedrate is modal).
+ */
+struct BinaryGcodeFormat {
+    enum {
+        CMD_TYPE_G0 = 1,
+        CMD_TYPE_G1 = 2,
+        CMD_TYPE_G92 = 3,
+        CMD_TYPE_G0_DELTA = 4,
+        CMD_TYPE_G1_DELTA = 5,
+        CMD_TYPE_BLOCK = 13,
+        CMD_TYPE_EOF = 14,
+        CMD_TYPE_LONG = 15,
+    };
+    
+    enum {
+        DATA_TYPE_FLOAT = 1,
+        DATA_TYPE_DOUBLE = 2,
+        DATA_TYPE_UINT32 = 3,
+        DATA_TYPE_UINT64 = 4,
+        DATA_TYPE_VOID = 5
+    };
+    
+    enum {
+        DELTA_WIDTH_NONE = 0,
+        DELTA_WIDTH_8 = 1,
+        DELTA_WIDTH_16 = 2,
+        DELTA_WIDTH_32 = 3
+    };
+    
+    static int const NumDeltaAxes = 4;
+    static uint8_t const DeltaFlagF = 1 << 0;
+    static uint8_t const BlockVersion = 2;
+    static int const BlockHeaderSize = 1 + 4 + 1 + 4 * NumDeltaAxes;
+    static int const MaxDecimals = 9;
+    
+    static constexpr char deltaAxisName (int axis)
+    {
+        return (axis == 0) ? 'X' : (axis == 1) ? 'Y' : (axis == 2) ? 'Z' : 'E';
+    }
+    
+    static constexpr int deltaWidthBytes (int width_code)
+    {
+        return (width_code == DELTA_WIDTH_8) ? 1 : (width_code == DELTA_WIDTH_16) ? 2 : (width_code == DELTA_WIDTH_32) ? 4 : 0;
+    }
+};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
@@ -35,7 +35,9 @@
 #include <aprinter/base/Assert.h>
 #include <aprinter/base/Hints.h>
 #include <aprinter/base/LoopUtils.h>
+#include <aprinter/math/FloatTools.h>
 #include <aprinter/printer/utils/GcodeCommand.h>
+#include <aprinter/printer/utils/BinaryGcodeFormat.h>
 
 #include <aprinter/BeginNamespace.h>
 
@@ -46,21 +48,8 @@ class BinaryGcodeParser
 {
     static_assert(Params::MaxParts <= 14, "");
     
-    enum {
-        CMD_TYPE_G0 = 1,
-        CMD_TYPE_G1 = 2,
-        CMD_TYPE_G92 = 3,
-        CMD_TYPE_EOF = 14,
-        CMD_TYPE_LONG = 15,
-    };
-    
-    enum {
-        DATA_TYPE_FLOAT = 1,
-        DATA_TYPE_DOUBLE = 2,
-        DATA_TYPE_UINT32 = 3,
-        DATA_TYPE_UINT64 = 4,
-        DATA_TYPE_VOID = 5
-    };
+    using Format = BinaryGcodeFormat;
+    static int const NumDeltaAxes = Format::NumDeltaAxes;
     
 public:
     using BufferSizeType = TBufferSizeType;
@@ -69,17 +58,13 @@ public:
     using PartRef = typename TheGcodeCommand::PartRef;
     
 private:
-    struct Part {
-        uint8_t data_type;
-        char code;
-        uint8_t data_size;
-        uint8_t *data;
-    };
+    using Part = typename TheGcodeCommand::Part;
     
 public:
     void init (Context c)
     {
         m_state = STATE_NOCMD;
+        m_block_valid = false;
         
         this->debugInit(c);
     }
@@ -126,32 +111,50 @@ public:
                         return false;
                     }
                     m_length = 1;
+                    uint8_t cmd_type = m_buffer[0] >> 4;
+                    switch (cmd_type) {
+                        case Format::CMD_TYPE_G0_DELTA:
+                        case Format::CMD_TYPE_G1_DELTA: {
+                            m_cmd_code = 'G';
+                            m_cmd_num = (cmd_type == Format::CMD_TYPE_G1_DELTA);
+                            m_state = STATE_DELTA;
+                            continue;
+                        } break;
+                        case Format::CMD_TYPE_BLOCK: {
+                            m_state = STATE_BLOCK;
+                            continue;
+                        } break;
+                    }
                     m_num_parts = m_buffer[0] & 0x0f;
                     if (m_num_parts > Params::MaxParts) {
                         m_num_parts = GCODE_ERROR_TOO_MANY_PARTS;
                         goto finish;
                     }
                     m_state = STATE_INDEX;
-                    switch (m_buffer[0] >> 4) {
-                        case CMD_TYPE_G0: {
+                    switch (cmd_type) {
+                        case Format::CMD_TYPE_G0: {
                             m_cmd_code = 'G';
                             m_cmd_num = 0;
                         } break;
-                        case CMD_TYPE_G1: {
+                        case Format::CMD_TYPE_G1: {
                             m_cmd_code = 'G';
                             m_cmd_num = 1;
                         } break;
-                        case CMD_TYPE_G92: {
+                        case Format::CMD_TYPE_G92: {
                             m_cmd_code = 'G';
                             m_cmd_num = 92;
                         } break;
-                        case CMD_TYPE_EOF: {
+                        case Format::CMD_TYPE_EOF: {
                             m_num_parts = GCODE_ERROR_EOF;
                             goto finish;
                         } break;
-                        case CMD_TYPE_LONG: {
+                        case Format::CMD_TYPE_LONG: {
                             m_state = STATE_HEADER_LONG;
                         } break;
+                        default: {
+                            m_num_parts = GCODE_ERROR_INVALID_PART;
+                            goto finish;
+                        } break;
                     }
                 } break;
                 
@@ -176,23 +179,25 @@ public:
                     m_total_size = m_length;
                     for (auto i : LoopRange<PartsSizeType>(m_num_parts)) {
                         uint8_t index_byte = m_buffer[index_offset + i];
-                        BufferSizeType data_size;
+                        uint8_t type;
                         switch (index_byte >> 5) {
-                            case DATA_TYPE_FLOAT:
-                            case DATA_TYPE_UINT32:
-                                data_size = 4;
+                            case Format::DATA_TYPE_FLOAT:
+                                type = GCODE_PART_FP;
+                                break;
+                            case Format::DATA_TYPE_UINT32:
+                                type = GCODE_PART_UINT32;
                                 break;
-                            case DATA_TYPE_VOID:
-                                data_size = 0;
+                            case Format::DATA_TYPE_VOID:
+                                type = GCODE_PART_VOID;
                                 break;
                             default:
                                 m_num_parts = GCODE_ERROR_INVALID_PART;
                                 goto finish;
                         }
-                        m_parts[i].data_type = index_byte >> 5;
+                        m_parts[i].type = type;
                         m_parts[i].code = 'A' + (index_byte & 0x1f);
-                        m_parts[i].data_size = data_size;
-                        m_total_size += data_size;
+                        m_parts[i].text = nullptr;
+                        m_total_size += data_size(type);
                     }
                     m_state = STATE_PAYLOAD;
                 } break;
@@ -203,12 +208,56 @@ public:
                     }
                     BufferSizeType offset = m_length;
                     for (auto i : LoopRange<PartsSizeType>(m_num_parts)) {
-                        m_parts[i].data = m_buffer + offset;
-                        offset += m_parts[i].data_size;
+                        decode_part_value(&m_parts[i], m_buffer + offset);
+                        offset += data_size(m_parts[i].type);
                     }
                     m_length = m_total_size;
                     goto finish;
                 } break;
+                
+                case STATE_DELTA: {
+                    AMBRO_ASSERT(m_length == 1)
+                    if (avail < 2) {
+                        return false;
+                    }
+                    uint8_t flags = m_buffer[0] & 0x0f;
+                    uint8_t widths = m_buffer[1];
+                    BufferSizeType size = 2 + ((flags & Format::DeltaFlagF) ? 4 : 0);
+                    PartsSizeType num_parts = (flags & Format::DeltaFlagF) ? 1 : 0;
+                    for (auto axis : LoopRange<int>(NumDeltaAxes)) {
+                        uint8_t width_code = (widths >> (2 * axis)) & 0x3;
+                        size += Format::deltaWidthBytes(width_code);
+                        num_parts += (width_code != Format::DELTA_WIDTH_NONE);
+                    }
+                    if (avail < size) {
+                        return false;
+                    }
+                    m_length = size;
+                    if ((flags & ~Format::DeltaFlagF) != 0) {
+                        m_num_parts = GCODE_ERROR_INVALID_PART;
+                        goto finish;
+                    }
+                    if (num_parts > Params::MaxParts) {
+                        m_num_parts = GCODE_ERROR_TOO_MANY_PARTS;
+                        goto finish;
+                    }
+                    if (!m_block_valid) {
+                        m_num_parts = GCODE_ERROR_BAD_BLOCK;
+                        goto finish;
+                    }
+                    decode_delta_move(flags, widths);
+                    goto finish;
+                } break;
+                
+                case STATE_BLOCK: {
+                    AMBRO_ASSERT(m_length == 1)
+                    if (avail < Format::BlockHeaderSize) {
+                        return false;
+                    }
+                    m_length = Format::BlockHeaderSize;
+                    m_num_parts = decode_block_header();
+                    goto finish;
+                } break;
             }
         }
         
@@ -270,75 +319,142 @@ public:
         return PartRef{&m_parts[i]};
     }
     
-    char getPartCode (Context c, PartRef part)
+#ifdef AMBROLIB_ASSERTIONS
+    void checkPartAccess (Context c, PartRef part)
     {
         this->debugAccess(c);
         AMBRO_ASSERT(m_state == STATE_NOCMD)
         AMBRO_ASSERT(m_num_parts >= 0)
-        
-        return cast_part_ref(part)->code;
+        AMBRO_ASSERT(part.ptr >= &m_parts[0])
+        AMBRO_ASSERT(part.ptr < &m_parts[m_num_parts])
     }
+#endif
     
-    FpType getPartFpValue (Context c, PartRef part)
+private:
+    enum {STATE_NOCMD, STATE_HEADER, STATE_HEADER_LONG, STATE_INDEX, STATE_PAYLOAD, STATE_DELTA, STATE_BLOCK};
+    
+    static BufferSizeType data_size (uint8_t type)
     {
-        this->debugAccess(c);
-        AMBRO_ASSERT(m_state == STATE_NOCMD)
-        AMBRO_ASSERT(m_num_parts >= 0)
-        
-        switch (cast_part_ref(part)->data_type) {
-            case DATA_TYPE_FLOAT: {
+        return (type == GCODE_PART_VOID) ? 0 : 4;
+    }
+    
+    static void decode_part_value (Part *part, uint8_t *data)
+    {
+#if APRINTER_GCODE_COMPACT_PARTS
+        part->text = (part->type == GCODE_PART_VOID) ? nullptr : (char *)data;
+#else
+        switch (part->type) {
+            case GCODE_PART_FP: {
                 float val;
                 static_assert(sizeof(val) == 4, "");
-                memcpy(&val, cast_part_ref(part)->data, sizeof(val));
-                return val;
+                memcpy(&val, data, sizeof(val));
+                part->value.fp = val;
             } break;
             
-            case DATA_TYPE_UINT32: {
+            case GCODE_PART_UINT32: {
                 uint32_t val;
                 static_assert(sizeof(val) == 4, "");
-                memcpy(&val, cast_part_ref(part)->data, sizeof(val));
-                return val;
+                memcpy(&val, data, sizeof(val));
+                part->value.uint32 = val;
             } break;
-            
-            default:
-                return 0.0f;
         }
+#endif
     }
     
-    uint32_t getPartUint32Value (Context c, PartRef part)
+    void decode_delta_move (uint8_t flags, uint8_t widths)
     {
-        this->debugAccess(c);
-        AMBRO_ASSERT(m_state == STATE_NOCMD)
-        AMBRO_ASSERT(m_num_parts >= 0)
+        BufferSizeType offset = 2;
+        m_num_parts = 0;
         
-        switch (cast_part_ref(part)->data_type) {
-            case DATA_TYPE_UINT32: {
-                uint32_t val;
-                static_assert(sizeof(val) == 4, "");
-                memcpy(&val, cast_part_ref(part)->data, sizeof(val));
-                return val;
-            } break;
+        for (auto axis : LoopRange<int>(NumDeltaAxes)) {
+            uint8_t width_code = (widths >> (2 * axis)) & 0x3;
+            if (width_code == Format::DELTA_WIDTH_NONE) {
+                continue;
+            }
+            int32_t delta;
+            switch (width_code) {
+                case Format::DELTA_WIDTH_8: {
+                    delta = (int8_t)m_buffer[offset];
+                } break;
+                case Format::DELTA_WIDTH_16: {
+                    int16_t val;
+                    memcpy(&val, m_buffer + offset, sizeof(val));
+                    delta = val;
+                } break;
+                default: {
+                    memcpy(&delta, m_buffer + offset, sizeof(delta));
+                } break;
+            }
+            offset += Format::deltaWidthBytes(width_code);
+            
+            m_delta_pos[axis] += (uint32_t)delta;
             
-            default:
-                return 0;
+            Part *part = &m_parts[m_num_parts];
+            part->code = Format::deltaAxisName(axis);
+            part->type = GCODE_PART_FP;
+#if APRINTER_GCODE_COMPACT_PARTS
+            m_delta_values[m_num_parts] = fixed_to_fp(m_delta_pos[axis], get_decimals(axis));
+            part->text = (char *)&m_delta_values[m_num_parts];
+#else
+            part->value.fp = fixed_to_fp(m_delta_pos[axis], get_decimals(axis));
+            part->text = nullptr;
+#endif
+            m_num_parts++;
+        }
+        
+        if ((flags & Format::DeltaFlagF)) {
+            Part *part = &m_parts[m_num_parts++];
+            part->code = 'F';
+            part->type = GCODE_PART_FP;
+            part->text = nullptr;
+            decode_part_value(part, m_buffer + offset);
         }
     }
     
-    char const * getPartStringValue (Context c, PartRef part)
+    PartsSizeType decode_block_header ()
     {
-        this->debugAccess(c);
-        AMBRO_ASSERT(m_state == STATE_NOCMD)
-        AMBRO_ASSERT(m_num_parts >= 0)
+        if ((m_buffer[0] & 0x0f) != Format::BlockVersion) {
+            return GCODE_ERROR_INVALID_PART;
+        }
+        
+        uint32_t block_index;
+        memcpy(&block_index, m_buffer + 1, sizeof(block_index));
+        uint8_t decimals = m_buffer[5];
+        if ((decimals & 0x0f) > Format::MaxDecimals || (decimals >> 4) > Format::MaxDecimals) {
+            return GCODE_ERROR_INVALID_PART;
+        }
         
-        return nullptr;
+        // A block which does not follow the previous one means that data
+        // was lost. Report it, but continue from the state in this block.
+        bool in_sequence = (block_index == 0 || !m_block_valid || block_index == m_block_index + 1);
+        
+        m_block_valid = true;
+        m_block_index = block_index;
+        m_decimals = decimals;
+        for (auto axis : LoopRange<int>(NumDeltaAxes)) {
+            memcpy(&m_delta_pos[axis], m_buffer + 6 + 4 * axis, sizeof(int32_t));
+        }
+        
+        return in_sequence ? GCODE_ERROR_NO_PARTS : GCODE_ERROR_BAD_BLOCK;
     }
     
-private:
-    enum {STATE_NOCMD, STATE_HEADER, STATE_HEADER_LONG, STATE_INDEX, STATE_PAYLOAD};
+    int get_decimals (int axis)
+    {
+        return (axis == NumDeltaAxes - 1) ? (m_decimals >> 4) : (m_decimals & 0x0f);
+    }
     
-    static Part * cast_part_ref (PartRef part_ref)
+    static FpType fixed_to_fp (int32_t value, int decimals)
     {
-        return (Part *)part_ref.ptr;
+        PlainDecimal dec;
+        dec.negative = (value < 0);
+        dec.mantissa = dec.negative ? -(uint32_t)value : (uint32_t)value;
+        dec.frac_digits = decimals;
+        
+        FpType result;
+        if (AMBRO_UNLIKELY(!PlainDecimalToFloat(dec, &result))) {
+            result = (FpType)value / FloatDecimalPowers<FpType>::Table::readAt(decimals);
+        }
+        return result;
     }
     
     uint8_t m_state;
@@ -349,6 +465,14 @@ private:
     PartsSizeType m_num_parts;
     BufferSizeType m_total_size;
     Part m_parts[Params::MaxParts];
+    bool m_block_valid;
+    uint8_t m_decimals;
+    uint32_t m_block_index;
+    int32_t m_delta_pos[NumDeltaAxes];
+#if APRINTER_GCODE_COMPACT_PARTS
+    // Values of the axis parts of a delta move, which the parts refer to.
+    float m_delta_values[NumDeltaAxes];
+#endif
 };
 
 APRINTER_ALIAS_STRUCT_EXT(BinaryGcodeParserService, (
@@ -26,8 +26,12 @@
 #define APRINTER_GCODE_COMMAND_H
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <aprinter/base/Assert.h>
+#include <aprinter/base/Hints.h>
+#include <aprinter/math/FloatTools.h>
 
 #include <aprinter/BeginNamespace.h>
 
@@ -38,26 +42,175 @@ enum GcodeError {
     GCODE_ERROR_CHECKSUM = -4,
     GCODE_ERROR_RECV_OVERRUN = -5,
     GCODE_ERROR_EOF = -6,
-    GCODE_ERROR_BAD_ESCAPE = -7
+    GCODE_ERROR_BAD_ESCAPE = -7,
+    GCODE_ERROR_BAD_BLOCK = -8
 };
 
+enum GcodePartType {
+    GCODE_PART_TEXT = 0,
+    GCODE_PART_FP = 1,
+    GCODE_PART_UINT32 = 2,
+    GCODE_PART_VOID = 3
+};
+
+/**
+ * A command parameter, in the same form for all parsers.
+ * 
+ * The parser decodes the value once when it has the part, so that
+ * reading it, possibly many times, is cheap. Text values which are not
+ * plain numbers (GCODE_PART_TEXT) are still converted on access.
+ * 
+ * On 8-bit targets RAM matters more than the conversions, so parts are
+ * kept compact there (APRINTER_GCODE_COMPACT_PARTS): the text parser
+ * leaves all values as text, and FP and UINT32 values (from the binary
+ * parser) are 4 bytes which the pointer refers to, as float or uint32_t
+ * in native byte order and possibly unaligned.
+ */
+#ifndef APRINTER_GCODE_COMPACT_PARTS
+#if defined(AMBROLIB_AVR)
+#define APRINTER_GCODE_COMPACT_PARTS 1
+#else
+#define APRINTER_GCODE_COMPACT_PARTS 0
+#endif
+#endif
+
+#if APRINTER_GCODE_COMPACT_PARTS
+
+template <typename FpType>
+struct GcodePart {
+    char code;
+    uint8_t type;
+    // The value as text, or the raw value for FP and UINT32 (see above).
+    char *text;
+};
+
+#else
+
+template <typename FpType>
+struct GcodePart {
+    char code;
+    uint8_t type;
+    union {
+        FpType fp;
+        uint32_t uint32;
+    } value;
+    // The value as text, or null if the parser has none.
+    char *text;
+};
+
+#endif
+
 template <typename Context, typename FpType>
 class GcodeCommand {
 public:
     using PartsSizeType = int8_t;
+    using Part = GcodePart<FpType>;
     
     struct PartRef {
-        void *ptr;
+        Part *ptr;
     };
     
     virtual char getCmdCode (Context c) = 0;
     virtual uint16_t getCmdNumber (Context c) = 0;
     virtual PartsSizeType getNumParts (Context c) = 0;
     virtual PartRef getPart (Context c, PartsSizeType i) = 0;
-    virtual char getPartCode (Context c, PartRef part) = 0;
-    virtual FpType getPartFpValue (Context c, PartRef part) = 0;
-    virtual uint32_t getPartUint32Value (Context c, PartRef part) = 0;
-    virtual char const * getPartStringValue (Context c, PartRef part) = 0;
+    
+    char getPartCode (Context c, PartRef part)
+    {
+        check_part_access(c, part);
+        
+        return part.ptr->code;
+    }
+    
+    FpType getPartFpValue (Context c, PartRef part)
+    {
+        check_part_access(c, part);
+        
+        switch (part.ptr->type) {
+#if APRINTER_GCODE_COMPACT_PARTS
+            case GCODE_PART_FP:
+                return read_raw_value<float>(part.ptr->text);
+            case GCODE_PART_UINT32:
+                return read_raw_value<uint32_t>(part.ptr->text);
+            case GCODE_PART_TEXT: {
+                FpType value;
+                if (AMBRO_UNLIKELY(!FastDecimalToFloat<FpType>(part.ptr->text, &value))) {
+                    value = StrToFloat<FpType>(part.ptr->text, nullptr);
+                }
+                return value;
+            }
+#else
+            case GCODE_PART_FP:
+                return part.ptr->value.fp;
+            case GCODE_PART_UINT32:
+                return part.ptr->value.uint32;
+            case GCODE_PART_TEXT:
+                return StrToFloat<FpType>(part.ptr->text, nullptr);
+#endif
+            default:
+                return 0.0f;
+        }
+    }
+    
+    uint32_t getPartUint32Value (Context c, PartRef part)
+    {
+        check_part_access(c, part);
+        
+        switch (part.ptr->type) {
+#if APRINTER_GCODE_COMPACT_PARTS
+            case GCODE_PART_UINT32:
+                return read_raw_value<uint32_t>(part.ptr->text);
+            case GCODE_PART_TEXT:
+                return strtoul(part.ptr->text, nullptr, 10);
+#else
+            case GCODE_PART_UINT32:
+                return part.ptr->value.uint32;
+            case GCODE_PART_FP:
+            case GCODE_PART_TEXT:
+                return part.ptr->text ? strtoul(part.ptr->text, nullptr, 10) : 0;
+#endif
+            default:
+                return 0;
+        }
+    }
+    
+    char const * getPartStringValue (Context c, PartRef part)
+    {
+        check_part_access(c, part);
+        
+#if APRINTER_GCODE_COMPACT_PARTS
+        if (part.ptr->type == GCODE_PART_FP || part.ptr->type == GCODE_PART_UINT32) {
+            return nullptr;
+        }
+#endif
+        return part.ptr->text;
+    }
+    
+protected:
+#ifdef AMBROLIB_ASSERTIONS
+    // The parser checks that the part belongs to its current command.
+    virtual void checkPartAccess (Context c, PartRef part) = 0;
+#endif
+    
+private:
+    void check_part_access (Context c, PartRef part)
+    {
+        AMBRO_ASSERT(part.ptr)
+#ifdef AMBROLIB_ASSERTIONS
+        checkPartAccess(c, part);
+#endif
+    }
+    
+#if APRINTER_GCODE_COMPACT_PARTS
+    template <typename T>
+    static T read_raw_value (char const *data)
+    {
+        T val;
+        static_assert(sizeof(val) == 4, "");
+        memcpy(&val, data, sizeof(val));
+        return val;
+    }
+#endif
 };
 
 template <typename Context, typename FpType>
@@ -88,29 +241,12 @@ private:
         return PartRef{nullptr};
     }
     
-    char getPartCode (Context c, PartRef part)
+#ifdef AMBROLIB_ASSERTIONS
+    void checkPartAccess (Context c, PartRef part)
     {
         AMBRO_ASSERT(false);
-        return 0;
-    }
-    
-    FpType getPartFpValue (Context c, PartRef part)
-    {
-        AMBRO_ASSERT(false);
-        return 0;
-    }
-    
-    uint32_t getPartUint32Value (Context c, PartRef part)
-    {
-        AMBRO_ASSERT(false);
-        return 0;
-    }
-    
-    char const * getPartStringValue (Context c, PartRef part)
-    {
-        AMBRO_ASSERT(false);
-        return nullptr;
     }
+#endif
 };
 
 #include <aprinter/EndNamespace.h>
@@ -28,8 +28,10 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 
 #include <aprinter/meta/ServiceUtils.h>
+#include <aprinter/meta/StaticArray.h>
 #include <aprinter/math/FloatTools.h>
 #include <aprinter/base/DebugObject.h>
 #include <aprinter/base/Assert.h>
@@ -41,6 +43,31 @@
 struct GcodeParserTypeSerial {};
 struct GcodeParserTypeFile {};
 
+enum {
+    GCODE_CHAR_SPACE = 1 << 0,
+    GCODE_CHAR_CODE = 1 << 1,
+    GCODE_CHAR_NEWLINE = 1 << 2,
+    GCODE_CHAR_COMMENT = 1 << 3,
+    GCODE_CHAR_CHECKSUM = 1 << 4
+};
+
+template <int Ch>
+struct GcodeParserCharClass {
+    static constexpr uint8_t value ()
+    {
+        return
+            (Ch == ' ' || Ch == '\t' || Ch == '\r') ? GCODE_CHAR_SPACE :
+            ((Ch >= 'A' && Ch <= 'Z') || (Ch >= 'a' && Ch <= 'z')) ? GCODE_CHAR_CODE :
+            (Ch == '\n') ? GCODE_CHAR_NEWLINE :
+            (Ch == ';') ? GCODE_CHAR_COMMENT :
+            (Ch == '*') ? GCODE_CHAR_CHECKSUM :
+            0;
+    }
+};
+
+// Character classes of 7-bit characters, others have no class.
+using GcodeParserCharClassTable = StaticArray<uint8_t, 128, GcodeParserCharClass>;
+
 template <typename TheParserType>
 struct GcodeParserExtraMembers {
     bool m_continuing_comment_line;
@@ -69,10 +96,7 @@ public:
     template <typename TheParserType, typename Dummy = void>
     struct CommandExtra {};
     
-    struct CommandPart {
-        char code;
-        char *data;
-    };
+    using CommandPart = typename TheGcodeCommand::Part;
     
     struct Command : public CommandExtra<ParserType> {
         BufferSizeType length;
@@ -128,9 +152,22 @@ public:
         AMBRO_ASSERT(avail >= m_command.length)
         
         for (; m_command.length < avail; m_command.length++) {
+            if (AMBRO_UNLIKELY(is_skipping())) {
+                m_command.length = find_newline(m_command.length, avail);
+                if (m_command.length == avail) {
+                    break;
+                }
+            }
+            
             char ch = m_buffer[m_command.length];
+            uint8_t ch_class = get_char_class(ch);
+            
+            if (AMBRO_LIKELY(m_state == STATE_INSIDE && !(ch_class & TheTypeHelper::TerminatorClasses))) {
+                TheTypeHelper::checksum_add_hook(c, this, ch);
+                continue;
+            }
             
-            if (AMBRO_UNLIKELY(ch == '\n')) {
+            if (AMBRO_UNLIKELY(ch_class & GCODE_CHAR_NEWLINE)) {
                 if (m_command.num_parts >= 0) {
                     if (m_state == STATE_INSIDE) {
                         finish_part(c);
@@ -142,7 +179,11 @@ public:
                             m_command.num_parts = GCODE_ERROR_NO_PARTS;
                         } else {
                             m_command.num_parts--;
-                            m_command.cmd_number = atoi(m_command.parts[0].data);
+#if APRINTER_GCODE_COMPACT_PARTS
+                            m_command.cmd_number = atoi(m_command.parts[0].text);
+#else
+                            m_command.cmd_number = (m_command.parts[0].type == GCODE_PART_UINT32) ? m_command.parts[0].value.uint32 : atoi(m_command.parts[0].text);
+#endif
                         }
                     }
                 }
@@ -152,11 +193,7 @@ public:
                 return true;
             }
             
-            if (AMBRO_UNLIKELY(m_command.num_parts < 0 || (TheTypeHelper::ChecksumEnabled && m_state == STATE_CHECKSUM))) {
-                continue;
-            }
-            
-            if (AMBRO_UNLIKELY(TheTypeHelper::ChecksumEnabled && ch == '*')) {
+            if (AMBRO_UNLIKELY(TheTypeHelper::ChecksumEnabled && (ch_class & GCODE_CHAR_CHECKSUM))) {
                 if (m_state == STATE_INSIDE) {
                     finish_part(c);
                 }
@@ -168,10 +205,7 @@ public:
             TheTypeHelper::checksum_add_hook(c, this, ch);
             
             if (TheTypeHelper::CommentsEnabled) {
-                if (AMBRO_UNLIKELY(m_state == STATE_COMMENT)) {
-                    continue;
-                }
-                if (AMBRO_UNLIKELY(ch == ';')) {
+                if (AMBRO_UNLIKELY(ch_class & GCODE_CHAR_COMMENT)) {
                     if (m_state == STATE_INSIDE) {
                         finish_part(c);
                     }
@@ -181,7 +215,7 @@ public:
             }
             
             if (AMBRO_UNLIKELY(m_state == STATE_OUTSIDE)) {
-                if (AMBRO_LIKELY(!is_space(ch))) {
+                if (AMBRO_LIKELY(!(ch_class & GCODE_CHAR_SPACE))) {
                     if (TheTypeHelper::EofEnabled) {
                         if (m_command.num_parts == 0 && ch == 'E') {
                             m_command.length++;
@@ -190,14 +224,14 @@ public:
                             return true;
                         }
                     }
-                    if (!is_code(ch)) {
+                    if (!(ch_class & GCODE_CHAR_CODE)) {
                         m_command.num_parts = GCODE_ERROR_INVALID_PART;
                     }
                     m_temp = m_command.length;
                     m_state = STATE_INSIDE;
                 }
             } else {
-                if (AMBRO_UNLIKELY(is_space(ch))) {
+                if (AMBRO_UNLIKELY(ch_class & GCODE_CHAR_SPACE)) {
                     finish_part(c);
                     m_state = STATE_OUTSIDE;
                 }
@@ -266,41 +300,16 @@ public:
         return PartRef{&m_command.parts[1 + i]};
     }
     
-    char getPartCode (Context c, PartRef part)
+#ifdef AMBROLIB_ASSERTIONS
+    void checkPartAccess (Context c, PartRef part)
     {
         this->debugAccess(c);
         AMBRO_ASSERT(m_state == STATE_NOCMD)
         AMBRO_ASSERT(m_command.num_parts >= 0)
-        
-        return cast_part_ref(part)->code;
-    }
-    
-    FpType getPartFpValue (Context c, PartRef part)
-    {
-        this->debugAccess(c);
-        AMBRO_ASSERT(m_state == STATE_NOCMD)
-        AMBRO_ASSERT(m_command.num_parts >= 0)
-        
-        return StrToFloat<FpType>(cast_part_ref(part)->data, NULL);
-    }
-    
-    uint32_t getPartUint32Value (Context c, PartRef part)
-    {
-        this->debugAccess(c);
-        AMBRO_ASSERT(m_state == STATE_NOCMD)
-        AMBRO_ASSERT(m_command.num_parts >= 0)
-        
-        return strtoul(cast_part_ref(part)->data, NULL, 10);
-    }
-    
-    char const * getPartStringValue (Context c, PartRef part)
-    {
-        this->debugAccess(c);
-        AMBRO_ASSERT(m_state == STATE_NOCMD)
-        AMBRO_ASSERT(m_command.num_parts >= 0)
-        
-        return cast_part_ref(part)->data;
+        AMBRO_ASSERT(part.ptr >= &m_command.parts[1])
+        AMBRO_ASSERT(part.ptr < &m_command.parts[1 + m_command.num_parts])
     }
+#endif
     
     char * getBuffer (Context c)
     {
@@ -329,6 +338,7 @@ private:
         static const bool ChecksumEnabled = true;
         static const bool CommentsEnabled = false;
         static const bool EofEnabled = false;
+        static const uint8_t TerminatorClasses = GCODE_CHAR_SPACE | GCODE_CHAR_NEWLINE | GCODE_CHAR_CHECKSUM;
         
         static void init_hook (Context c, GcodeParser *o)
         {
@@ -383,6 +393,7 @@ private:
         static const bool ChecksumEnabled = false;
         static const bool CommentsEnabled = true;
         static const bool EofEnabled = true;
+        static const uint8_t TerminatorClasses = GCODE_CHAR_SPACE | GCODE_CHAR_NEWLINE | GCODE_CHAR_COMMENT;
         
         static void init_hook (Context c, GcodeParser *o)
         {
@@ -428,11 +439,6 @@ private:
     
     using TheTypeHelper = TypeHelper<ParserType>;
     
-    static CommandPart * cast_part_ref (PartRef part_ref)
-    {
-        return (CommandPart *)part_ref.ptr;
-    }
-    
     static bool is_code (char ch)
     {
         return ((ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z'));
@@ -443,6 +449,46 @@ private:
         return (ch == ' ' || ch == '\t' || ch == '\r');
     }
     
+    static uint8_t get_char_class (char ch)
+    {
+        unsigned char uch = ch;
+        return (uch < GcodeParserCharClassTable::Length) ? GcodeParserCharClassTable::readAt(uch) : 0;
+    }
+    
+    // In these states nothing but the newline matters.
+    bool is_skipping ()
+    {
+        return m_command.num_parts < 0 ||
+               (TheTypeHelper::ChecksumEnabled && m_state == STATE_CHECKSUM) ||
+               (TheTypeHelper::CommentsEnabled && m_state == STATE_COMMENT);
+    }
+    
+    BufferSizeType find_newline (BufferSizeType pos, BufferSizeType end)
+    {
+#ifndef AMBROLIB_AVR
+        // Check four bytes at a time for a zero byte after XOR with '\n'.
+        while (pos < end && ((uintptr_t)(m_buffer + pos) % sizeof(uint32_t)) != 0) {
+            if (m_buffer[pos] == '\n') {
+                return pos;
+            }
+            pos++;
+        }
+        while ((size_t)(end - pos) >= sizeof(uint32_t)) {
+            uint32_t word;
+            memcpy(&word, m_buffer + pos, sizeof(word));
+            word ^= UINT32_C(0x0A0A0A0A);
+            if (((word - UINT32_C(0x01010101)) & ~word & UINT32_C(0x80808080)) != 0) {
+                break;
+            }
+            pos += sizeof(uint32_t);
+        }
+#endif
+        while (pos < end && m_buffer[pos] != '\n') {
+            pos++;
+        }
+        return pos;
+    }
+    
     static bool compare_checksum (uint8_t expected, char const *received, BufferSizeType received_len)
     {
         while (received_len > 0 && is_space(received[received_len - 1])) {
@@ -503,11 +549,34 @@ private:
             return;
         }
         
-        m_command.parts[m_command.num_parts].code = code;
-        m_command.parts[m_command.num_parts].data = m_buffer + (m_temp + 1);
+        CommandPart *part = &m_command.parts[m_command.num_parts];
+        part->code = code;
+        part->text = m_buffer + (m_temp + 1);
+        decode_part_value(part);
         m_command.num_parts++;
     }
     
+    static void decode_part_value (CommandPart *part)
+    {
+#if APRINTER_GCODE_COMPACT_PARTS
+        part->type = (*part->text == '\0') ? GCODE_PART_VOID : GCODE_PART_TEXT;
+#else
+        PlainDecimal dec;
+        if (*part->text == '\0') {
+            part->type = GCODE_PART_VOID;
+        } else if (!ParsePlainDecimal(part->text, &dec)) {
+            part->type = GCODE_PART_TEXT;
+        } else if (!dec.negative && dec.frac_digits < 0 && *part->text != '+') {
+            part->type = GCODE_PART_UINT32;
+            part->value.uint32 = dec.mantissa;
+        } else if (PlainDecimalToFloat(dec, &part->value.fp)) {
+            part->type = GCODE_PART_FP;
+        } else {
+            part->type = GCODE_PART_TEXT;
+        }
+#endif
+    }
+    
     static int read_hex_digit (char ch)
     {
         return
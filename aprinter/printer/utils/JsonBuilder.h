@@ -68,6 +68,12 @@ struct JsonSafeChar {
 
 class JsonBuilder {
 public:
+    // A point in the output, to which it can be cut back.
+    struct Position {
+        size_t length;
+        bool inhibit_comma;
+    };
+    
     void loadBuffer (char *buffer, size_t buffer_total_size)
     {
         AMBRO_ASSERT(buffer_total_size > 0)
@@ -88,6 +94,20 @@ public:
         m_inhibit_comma = true;
     }
     
+    Position getPosition ()
+    {
+        return Position{m_length, m_inhibit_comma};
+    }
+    
+    // Drops everything written after the position.
+    void rollBack (Position pos)
+    {
+        AMBRO_ASSERT(pos.length <= m_length)
+        
+        m_length = pos.length;
+        m_inhibit_comma = pos.inhibit_comma;
+    }
+    
     void add (JsonUint32 val)
     {
         adding_element();
@@ -0,0 +1,798 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef APRINTER_JSON_STATUS_SNAPSHOT_H
+#define APRINTER_JSON_STATUS_SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include <aprinter/base/Hints.h>
+#include <aprinter/base/Assert.h>
+#include <aprinter/base/MemRef.h>
+#include <aprinter/base/LoopUtils.h>
+#include <aprinter/misc/StringTools.h>
+#include <aprinter/printer/utils/JsonBuilder.h>
+
+#include <aprinter/BeginNamespace.h>
+
+/*
+ * Versioned snapshot of a JSON document, for sending only those parts of
+ * the machine status which changed since a client last received it.
+ * 
+ * The document is generated with a Recorder in place of the JsonBuilder
+ * (the get_json_status functions are templated on the builder type).
+ * The Recorder stores a binary fingerprint of each value and remembers
+ * the version at which the value last changed. The version is incremented
+ * by each recording where something changed.
+ * 
+ * While recording, the Recorder can also write the document to a JsonBuilder,
+ * either whole or only the members changed after the version of a client,
+ * so that the result is a JSON merge patch (RFC 7386). Arrays are written
+ * whole. For a delta, members are written and then dropped again if they
+ * turn out to be unchanged, except that unchanged numbers and booleans
+ * outside arrays are never formatted.
+ * 
+ * An Emitter makes a delta from an already recorded snapshot, for clients
+ * whose version differs from the one the delta was written for. It needs
+ * the document to be generated again, which must be done without returning
+ * to the event loop after the recording so that both see the same document.
+ * 
+ * The generated document is the content of an object (members only).
+ * If its structure changes (keys or nesting), all values are considered
+ * changed and no delta from an earlier version can be made, the whole
+ * document needs to be sent. The same applies if the document has more
+ * than MaxEntries entries (keys, values and brackets).
+ * 
+ * Versions are paired with an epoch into a VersionToken, so that a client
+ * which kept a token from before a restart does not get a delta against
+ * a different document. The epoch should differ between restarts.
+ */
+template <size_t MaxEntries, int MaxDepth=8>
+class JsonStatusSnapshot {
+    static_assert(MaxEntries > 0, "");
+    static_assert(MaxDepth > 0, "");
+    
+    enum class Kind : uint8_t {VALUE, KEY, OPEN_OBJECT, OPEN_ARRAY, CLOSE};
+    
+    struct Entry {
+        uint64_t fingerprint;
+        uint32_t version;
+        Kind kind;
+    };
+    
+    // Where a member being written for a delta starts, and the highest
+    // version of the values within an open container.
+    struct Level {
+        JsonBuilder::Position member_pos;
+        uint32_t max_version;
+        bool is_member;
+        bool forced;
+    };
+    
+    // The helpers of JsonBuilder built from the basic functions.
+    template <typename Derived>
+    class BuilderHelpers {
+    public:
+        template <typename TKey, typename TVal>
+        void addKeyVal (TKey key, TVal val)
+        {
+            d()->add(key);
+            d()->entryValue();
+            d()->add(val);
+        }
+        
+        template <typename TVal>
+        void addSafeKeyVal (char const *key, TVal val)
+        {
+            addKeyVal(JsonSafeString{key}, val);
+        }
+        
+        template <typename TKey>
+        void addKeyObject (TKey key)
+        {
+            d()->add(key);
+            d()->entryValue();
+            d()->startObject();
+        }
+        
+        template <typename TKey>
+        void addKeyArray (TKey key)
+        {
+            d()->add(key);
+            d()->entryValue();
+            d()->startArray();
+        }
+        
+    private:
+        Derived * d () { return static_cast<Derived *>(this); }
+    };
+    
+public:
+    struct VersionToken {
+        uint32_t epoch;
+        uint32_t version;
+    };
+    
+    // What a Recorder wrote: the whole document, a delta, or a delta which
+    // could not be completed since the structure of the document changed.
+    // In the last case the output must be dropped and the whole document
+    // written instead.
+    enum class OutputType : uint8_t {WHOLE, DELTA, INVALID};
+    
+    void init ()
+    {
+        m_num_entries = 0;
+        m_epoch = 0;
+        m_version = 0;
+        m_layout_version = 0;
+        m_valid = false;
+    }
+    
+    // Must be called before the first recording, if at all.
+    void setEpoch (uint32_t epoch)
+    {
+        AMBRO_ASSERT(m_version == 0)
+        
+        m_epoch = epoch;
+    }
+    
+    uint32_t getVersion ()
+    {
+        return m_version;
+    }
+    
+    VersionToken getVersionToken ()
+    {
+        return VersionToken{m_epoch, m_version};
+    }
+    
+    // Whether a delta can be made from the given version, which a client
+    // received earlier.
+    bool isDeltaPossible (VersionToken since)
+    {
+        return m_valid && since.epoch == m_epoch && since.version >= m_layout_version && since.version <= m_version;
+    }
+    
+    // Tokens are written as a string "<epoch>.<version>".
+    static void writeVersionToken (JsonBuilder *json, VersionToken token)
+    {
+        char buf[24];
+        snprintf(buf, sizeof(buf), "%" PRIu32 ".%" PRIu32, token.epoch, token.version);
+        json->add(JsonSafeString{buf});
+    }
+    
+    static bool parseVersionToken (MemRef str, VersionToken *out)
+    {
+        size_t dot = 0;
+        while (dot < str.len && str.ptr[dot] != '.') {
+            dot++;
+        }
+        if (dot == str.len) {
+            return false;
+        }
+        return StringParseDecimal(str.subTo(dot), &out->epoch) &&
+               StringParseDecimal(str.subFrom(dot + 1), &out->version);
+    }
+    
+    class Recorder : public BuilderHelpers<Recorder> {
+    public:
+        // If out is given, the document is also written there, only as the
+        // changes since the given version if a delta is possible from it.
+        void start (JsonStatusSnapshot *snapshot, JsonBuilder *out=nullptr, VersionToken const *since=nullptr)
+        {
+            m_snapshot = snapshot;
+            m_old_num_entries = snapshot->m_valid ? snapshot->m_num_entries : 0;
+            m_num_entries = 0;
+            m_new_version = snapshot->m_version + 1;
+            m_pending = false;
+            m_overflow = false;
+            m_changed = false;
+            m_layout_changed = !snapshot->m_valid;
+            m_out = out;
+            m_delta = out && since && snapshot->isDeltaPossible(*since);
+            m_delta_failed = false;
+            m_since = m_delta ? since->version : 0;
+            m_depth = 0;
+            m_force_depth = 0;
+            m_have_member = false;
+        }
+        
+        // Returns false if the document did not fit into the snapshot.
+        bool finish ()
+        {
+            commit_pending();
+            
+            JsonStatusSnapshot *s = m_snapshot;
+            
+            if (m_num_entries != m_old_num_entries) {
+                m_layout_changed = true;
+            }
+            
+            if (m_layout_changed) {
+                for (auto i : LoopRange<size_t>(m_num_entries)) {
+                    s->m_entries[i].version = m_new_version;
+                }
+                s->m_layout_version = m_new_version;
+                m_changed = true;
+            }
+            
+            if (m_changed) {
+                s->m_version = m_new_version;
+            }
+            
+            s->m_num_entries = m_num_entries;
+            s->m_valid = !m_overflow && s->compute_container_versions();
+            
+            if (m_layout_changed || !s->m_valid) {
+                m_delta_failed = true;
+            }
+            
+            return s->m_valid;
+        }
+        
+        // Only meaningful after finish(), if an output was given.
+        OutputType getOutputType ()
+        {
+            return !m_delta ? OutputType::WHOLE : m_delta_failed ? OutputType::INVALID : OutputType::DELTA;
+        }
+        
+        void add (JsonUint32 val)
+        {
+            if (add_value(val.val)) {
+                m_out->add(val);
+            }
+        }
+        
+        void add (JsonDouble val)
+        {
+            uint64_t fingerprint = 0;
+            memcpy(&fingerprint, &val.val, sizeof(val.val));
+            if (add_value(fingerprint)) {
+                m_out->add(val);
+            }
+        }
+        
+        void add (JsonBool val)
+        {
+            if (add_value(val.val)) {
+                m_out->add(val);
+            }
+        }
+        
+        void add (JsonNull val)
+        {
+            if (add_value(0)) {
+                m_out->add(val);
+            }
+        }
+        
+        // Whether a string is a value or a key is only known at the next
+        // token, so strings are always written, and maybe dropped later.
+        void beginString ()
+        {
+            add_token(Kind::VALUE, 0);
+            m_string_hash = StringHashInitial;
+            m_string_length = 0;
+            if (m_out) {
+                m_out->beginString();
+            }
+        }
+        
+        void addStringChar (char ch)
+        {
+            m_string_hash = (m_string_hash ^ (uint8_t)ch) * StringHashPrime;
+            m_string_length++;
+            m_pending_fingerprint = ((uint64_t)m_string_length << 32) | m_string_hash;
+            if (m_out) {
+                m_out->addStringChar(ch);
+            }
+        }
+        
+        void addStringMem (MemRef mem)
+        {
+            for (auto i : LoopRange<size_t>(mem.len)) {
+                addStringChar(mem.ptr[i]);
+            }
+        }
+        
+        void endString ()
+        {
+            if (m_out) {
+                m_out->endString();
+            }
+        }
+        
+        void add (JsonString val)
+        {
+            beginString();
+            addStringMem(val.val);
+            endString();
+        }
+        
+        void add (JsonSafeString val)
+        {
+            beginString();
+            addStringMem(MemRef(val.val));
+            endString();
+        }
+        
+        void add (JsonSafeChar val)
+        {
+            beginString();
+            addStringChar(val.val);
+            endString();
+        }
+        
+        void startArray ()
+        {
+            add_token(Kind::OPEN_ARRAY, 0);
+            if (m_out) {
+                open_level(true);
+                m_out->startArray();
+            }
+        }
+        
+        void endArray ()
+        {
+            add_token(Kind::CLOSE, 0);
+            if (m_out) {
+                m_out->endArray();
+                close_level();
+            }
+        }
+        
+        void startObject ()
+        {
+            add_token(Kind::OPEN_OBJECT, 0);
+            if (m_out) {
+                open_level(false);
+                m_out->startObject();
+            }
+        }
+        
+        void endObject ()
+        {
+            add_token(Kind::CLOSE, 0);
+            if (m_out) {
+                m_out->endObject();
+                close_level();
+            }
+        }
+        
+        void entryValue ()
+        {
+            // The string just added is a key.
+            AMBRO_ASSERT(m_pending || m_overflow)
+            
+            m_pending_kind = Kind::KEY;
+            commit_pending();
+            if (m_out) {
+                m_out->entryValue();
+            }
+        }
+        
+    private:
+        static uint32_t const StringHashInitial = UINT32_C(2166136261);
+        static uint32_t const StringHashPrime = UINT32_C(16777619);
+        
+        // Numbers and booleans are values for sure, so they are compared
+        // right away. Returns whether the value is to be written.
+        bool add_value (uint64_t fingerprint)
+        {
+            add_token(Kind::VALUE, fingerprint);
+            m_value_written = (m_out != nullptr);
+            commit_pending();
+            return m_value_written;
+        }
+        
+        // The token is compared with the snapshot only when the next one
+        // comes, since a string turns out to be a key only at entryValue().
+        void add_token (Kind kind, uint64_t fingerprint)
+        {
+            commit_pending();
+            
+            if (m_out) {
+                m_token_pos = m_out->getPosition();
+            }
+            
+            if (AMBRO_UNLIKELY(m_num_entries == MaxEntries)) {
+                m_overflow = true;
+                return;
+            }
+            
+            m_pending = true;
+            m_pending_kind = kind;
+            m_pending_fingerprint = fingerprint;
+            m_num_entries++;
+        }
+        
+        // A member of an object outside arrays is dropped from a delta when
+        // its value (or every value within it) is not newer than m_since.
+        void end_value (uint32_t version)
+        {
+            if (!tracking()) {
+                return;
+            }
+            
+            if (m_depth > 0 && version > m_levels[m_depth - 1].max_version) {
+                m_levels[m_depth - 1].max_version = version;
+            }
+            
+            if (m_have_member) {
+                m_have_member = false;
+                if (version <= m_since) {
+                    m_out->rollBack(m_member_pos);
+                    m_value_written = false;
+                }
+            }
+        }
+        
+        // Whether the written delta can still turn out right.
+        bool tracking ()
+        {
+            return m_delta && !m_delta_failed;
+        }
+        
+        void open_level (bool is_array)
+        {
+            if (!tracking()) {
+                return;
+            }
+            
+            if (m_depth == MaxDepth) {
+                // The snapshot will not be valid either.
+                m_delta_failed = true;
+                return;
+            }
+            
+            Level *l = &m_levels[m_depth++];
+            l->member_pos = m_member_pos;
+            l->max_version = 0;
+            l->is_member = m_have_member;
+            l->forced = (is_array || m_force_depth > 0);
+            if (l->forced) {
+                m_force_depth++;
+            }
+            m_have_member = false;
+        }
+        
+        void close_level ()
+        {
+            if (!tracking()) {
+                return;
+            }
+            
+            if (m_depth == 0) {
+                // Unbalanced, the snapshot will not be valid either.
+                m_delta_failed = true;
+                return;
+            }
+            
+            Level *l = &m_levels[--m_depth];
+            if (l->forced) {
+                m_force_depth--;
+            }
+            m_have_member = l->is_member;
+            m_member_pos = l->member_pos;
+            end_value(l->max_version);
+        }
+        
+        void commit_pending ()
+        {
+            if (!m_pending) {
+                return;
+            }
+            m_pending = false;
+            
+            size_t index = m_num_entries - 1;
+            Entry *e = &m_snapshot->m_entries[index];
+            bool have_old = index < m_old_num_entries;
+            uint32_t version = m_new_version;
+            
+            if (m_pending_kind == Kind::VALUE) {
+                if (!have_old || e->kind != Kind::VALUE) {
+                    m_layout_changed = true;
+                }
+                else if (e->fingerprint == m_pending_fingerprint) {
+                    version = e->version;
+                }
+                else {
+                    m_changed = true;
+                }
+            } else {
+                if (!have_old || e->kind != m_pending_kind || e->fingerprint != m_pending_fingerprint) {
+                    m_layout_changed = true;
+                }
+            }
+            
+            e->fingerprint = m_pending_fingerprint;
+            e->version = version;
+            e->kind = m_pending_kind;
+            
+            if (tracking()) {
+                if (m_pending_kind == Kind::KEY) {
+                    if (m_force_depth == 0) {
+                        m_member_pos = m_token_pos;
+                        m_have_member = true;
+                    }
+                }
+                else if (m_pending_kind == Kind::VALUE) {
+                    end_value(version);
+                }
+            }
+        }
+        
+        JsonStatusSnapshot *m_snapshot;
+        size_t m_old_num_entries;
+        size_t m_num_entries;
+        uint32_t m_new_version;
+        uint64_t m_pending_fingerprint;
+        uint32_t m_string_hash;
+        uint32_t m_string_length;
+        Kind m_pending_kind;
+        bool m_pending;
+        bool m_overflow;
+        bool m_changed;
+        bool m_layout_changed;
+        JsonBuilder *m_out;
+        uint32_t m_since;
+        JsonBuilder::Position m_token_pos;
+        JsonBuilder::Position m_member_pos;
+        Level m_levels[MaxDepth];
+        int m_depth;
+        int m_force_depth;
+        bool m_delta;
+        bool m_delta_failed;
+        bool m_have_member;
+        bool m_value_written;
+    };
+    
+    class Emitter : public BuilderHelpers<Emitter> {
+    public:
+        void start (JsonStatusSnapshot *snapshot, JsonBuilder *out, VersionToken since)
+        {
+            AMBRO_ASSERT(snapshot->isDeltaPossible(since))
+            
+            m_snapshot = snapshot;
+            m_out = out;
+            m_since = since.version;
+            m_index = 0;
+            m_skip_depth = 0;
+            m_force_depth = 0;
+            m_skip_next = false;
+            m_in_string = false;
+        }
+        
+        template <typename TVal>
+        void add (TVal val)
+        {
+            if (begin_token()) {
+                m_out->add(val);
+            }
+        }
+        
+        void beginString ()
+        {
+            m_in_string = begin_token();
+            if (m_in_string) {
+                m_out->beginString();
+            }
+        }
+        
+        void addStringChar (char ch)
+        {
+            if (m_in_string) {
+                m_out->addStringChar(ch);
+            }
+        }
+        
+        void addStringMem (MemRef mem)
+        {
+            if (m_in_string) {
+                m_out->addStringMem(mem);
+            }
+        }
+        
+        void endString ()
+        {
+            if (m_in_string) {
+                m_out->endString();
+                m_in_string = false;
+            }
+        }
+        
+        void startArray ()
+        {
+            if (begin_token()) {
+                m_out->startArray();
+            }
+        }
+        
+        void endArray ()
+        {
+            if (begin_token()) {
+                m_out->endArray();
+            }
+        }
+        
+        void startObject ()
+        {
+            if (begin_token()) {
+                m_out->startObject();
+            }
+        }
+        
+        void endObject ()
+        {
+            if (begin_token()) {
+                m_out->endObject();
+            }
+        }
+        
+        void entryValue ()
+        {
+            if (m_skip_depth == 0 && !m_skip_next) {
+                m_out->entryValue();
+            }
+        }
+        
+    private:
+        // Returns whether the next token of the document is to be written.
+        bool begin_token ()
+        {
+            JsonStatusSnapshot *s = m_snapshot;
+            
+            size_t index = m_index++;
+            AMBRO_ASSERT(index < s->m_num_entries)
+            Entry *e = &s->m_entries[index];
+            
+            bool is_open = (e->kind == Kind::OPEN_OBJECT || e->kind == Kind::OPEN_ARRAY);
+            
+            if (m_skip_depth > 0) {
+                if (is_open) {
+                    m_skip_depth++;
+                }
+                else if (e->kind == Kind::CLOSE) {
+                    m_skip_depth--;
+                }
+                return false;
+            }
+            
+            if (m_skip_next) {
+                // This is the value of a key which was left out.
+                m_skip_next = false;
+                if (is_open) {
+                    m_skip_depth = 1;
+                }
+                return false;
+            }
+            
+            switch (e->kind) {
+                case Kind::KEY: {
+                    if (m_force_depth == 0 && e->version <= m_since) {
+                        m_skip_next = true;
+                        return false;
+                    }
+                } break;
+                
+                case Kind::OPEN_OBJECT:
+                case Kind::OPEN_ARRAY: {
+                    if (m_force_depth > 0 || e->kind == Kind::OPEN_ARRAY) {
+                        m_force_depth++;
+                    }
+                } break;
+                
+                case Kind::CLOSE: {
+                    if (m_force_depth > 0) {
+                        m_force_depth--;
+                    }
+                } break;
+                
+                default: break;
+            }
+            
+            return true;
+        }
+        
+        JsonStatusSnapshot *m_snapshot;
+        JsonBuilder *m_out;
+        uint32_t m_since;
+        size_t m_index;
+        int m_skip_depth;
+        int m_force_depth;
+        bool m_skip_next;
+        bool m_in_string;
+    };
+    
+private:
+    // Sets the version of each container, and of each key, to the highest
+    // version of the values within. Returns false if the nesting is wrong
+    // or too deep.
+    bool compute_container_versions ()
+    {
+        size_t open_index[MaxDepth];
+        uint32_t max_version[MaxDepth];
+        int depth = 0;
+        
+        for (auto i : LoopRange<size_t>(m_num_entries)) {
+            Entry *e = &m_entries[i];
+            size_t value_index;
+            
+            switch (e->kind) {
+                case Kind::KEY:
+                    continue;
+                
+                case Kind::OPEN_OBJECT:
+                case Kind::OPEN_ARRAY: {
+                    if (depth == MaxDepth) {
+                        return false;
+                    }
+                    open_index[depth] = i;
+                    max_version[depth] = 0;
+                    depth++;
+                } continue;
+                
+                case Kind::CLOSE: {
+                    if (depth == 0) {
+                        return false;
+                    }
+                    depth--;
+                    value_index = open_index[depth];
+                    m_entries[value_index].version = max_version[depth];
+                    e->version = max_version[depth];
+                } break;
+                
+                default: {
+                    value_index = i;
+                } break;
+            }
+            
+            uint32_t version = m_entries[value_index].version;
+            if (value_index > 0 && m_entries[value_index - 1].kind == Kind::KEY) {
+                m_entries[value_index - 1].version = version;
+            }
+            if (depth > 0 && version > max_version[depth - 1]) {
+                max_version[depth - 1] = version;
+            }
+        }
+        
+        return depth == 0;
+    }
+    
+    size_t m_num_entries;
+    uint32_t m_epoch;
+    uint32_t m_version;
+    uint32_t m_layout_version;
+    bool m_valid;
+    Entry m_entries[MaxEntries];
+};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
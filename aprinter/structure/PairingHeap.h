@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMBROLIB_PAIRING_HEAP
+#define AMBROLIB_PAIRING_HEAP
+
+#include <aprinter/base/Assert.h>
+
+#include <aprinter/BeginNamespace.h>
+
+template <class, class, class>
+class PairingHeapWithAccessor;
+
+template <class Entry>
+class PairingHeapNode {
+    template <class, class, class>
+    friend class PairingHeapWithAccessor;
+    Entry *child;
+    Entry *next;
+    // The parent for the first child, otherwise the previous sibling.
+    // Null for the root and equal to the node itself when not in a heap.
+    Entry *prev;
+};
+
+/**
+ * Intrusive min-heap based on the pairing heap. Insertion is constant time,
+ * removal of the minimum or of an arbitrary entry is amortized logarithmic.
+ * 
+ * Compare::lessThan(a, b) defines the order. It only needs to be consistent
+ * among the entries which are in the heap at the same time.
+ */
+template <class Entry, class Accessor, class Compare>
+class PairingHeapWithAccessor {
+public:
+    void init ()
+    {
+        m_root = nullptr;
+    }
+    
+    bool isEmpty () const
+    {
+        return (m_root == nullptr);
+    }
+    
+    Entry * first () const
+    {
+        return m_root;
+    }
+    
+    void insert (Entry *e)
+    {
+        ac(e)->child = nullptr;
+        ac(e)->next = nullptr;
+        ac(e)->prev = nullptr;
+        if (m_root) {
+            set_root(link(m_root, e));
+        } else {
+            m_root = e;
+        }
+    }
+    
+    void remove (Entry *e)
+    {
+        AMBRO_ASSERT(!isRemoved(e))
+        
+        if (e == m_root) {
+            removeFirst();
+            return;
+        }
+        
+        Entry *prev = ac(e)->prev;
+        if (ac(prev)->child == e) {
+            ac(prev)->child = ac(e)->next;
+        } else {
+            ac(prev)->next = ac(e)->next;
+        }
+        if (ac(e)->next) {
+            ac(ac(e)->next)->prev = prev;
+        }
+        
+        Entry *sub = merge_pairs(ac(e)->child);
+        if (sub) {
+            set_root(link(m_root, sub));
+        }
+    }
+    
+    void removeFirst ()
+    {
+        AMBRO_ASSERT(m_root)
+        
+        Entry *root = merge_pairs(ac(m_root)->child);
+        if (root) {
+            set_root(root);
+        } else {
+            m_root = nullptr;
+        }
+    }
+    
+    static void markRemoved (Entry *e)
+    {
+        ac(e)->prev = e;
+    }
+    
+    static bool isRemoved (Entry *e)
+    {
+        return (ac(e)->prev == e);
+    }
+    
+private:
+    static PairingHeapNode<Entry> * ac (Entry *e)
+    {
+        return Accessor::access(e);
+    }
+    
+    void set_root (Entry *root)
+    {
+        ac(root)->next = nullptr;
+        ac(root)->prev = nullptr;
+        m_root = root;
+    }
+    
+    // Makes the greater of the two the first child of the other one, which
+    // is returned. The next and prev pointers of the result are not set.
+    static Entry * link (Entry *a, Entry *b)
+    {
+        if (Compare::lessThan(b, a)) {
+            Entry *temp = a;
+            a = b;
+            b = temp;
+        }
+        ac(b)->next = ac(a)->child;
+        if (ac(a)->child) {
+            ac(ac(a)->child)->prev = b;
+        }
+        ac(b)->prev = a;
+        ac(a)->child = b;
+        return a;
+    }
+    
+    // Merges a list of siblings into a single tree, first pairwise from the
+    // left, then the pairs from the right.
+    static Entry * merge_pairs (Entry *first)
+    {
+        if (!first) {
+            return nullptr;
+        }
+        
+        Entry *pairs = nullptr;
+        while (first) {
+            Entry *a = first;
+            Entry *b = ac(a)->next;
+            if (!b) {
+                ac(a)->next = pairs;
+                pairs = a;
+                break;
+            }
+            first = ac(b)->next;
+            Entry *merged = link(a, b);
+            ac(merged)->next = pairs;
+            pairs = merged;
+        }
+        
+        Entry *result = pairs;
+        pairs = ac(pairs)->next;
+        while (pairs) {
+            Entry *next = ac(pairs)->next;
+            result = link(result, pairs);
+            pairs = next;
+        }
+        return result;
+    }
+    
+    Entry *m_root;
+};
+
+template <class Entry, class Base, PairingHeapNode<Entry> Base::*NodeMember>
+struct PairingHeapAccessor {
+    static PairingHeapNode<Entry> * access (Entry *e)
+    {
+        return &(e->*NodeMember);
+    }
+};
+
+template <class Entry, PairingHeapNode<Entry> Entry::*NodeMember, class Compare>
+class PairingHeap : public PairingHeapWithAccessor<Entry, PairingHeapAccessor<Entry, Entry, NodeMember>, Compare> {};
+
+#include <aprinter/EndNamespace.h>
+
+#endif
@@ -34,8 +34,10 @@
 #include <aprinter/meta/BitsInInt.h>
 #include <aprinter/meta/MinMax.h>
 #include <aprinter/meta/BasicMetaUtils.h>
+#include <aprinter/meta/FuncUtils.h>
 #include <aprinter/meta/ServiceUtils.h>
 #include <aprinter/structure/DoubleEndedList.h>
+#include <aprinter/structure/PairingHeap.h>
 #include <aprinter/base/Object.h>
 #include <aprinter/base/DebugObject.h>
 #include <aprinter/base/Assert.h>
@@ -50,6 +52,22 @@
 template <typename> class BusyEventLoopQueuedEvent;
 template <typename> class BusyEventLoopTimedEvent;
 
+/**
+ * Priority classes of fast events. Normal events are dispatched before Low
+ * events, but a pending Low event gets a turn after at most
+ * BusyEventLoop::MaxNormalBurst Normal events in a row, since some Normal
+ * events (e.g. USB serial receive) trigger themselves on every dispatch.
+ * High priority events are also checked between dispatching other
+ * events, but at most BusyEventLoop::MaxHighBurst of them in a row, so that
+ * a High event which keeps being triggered cannot starve everything else.
+ * Within a class, events are served round-robin.
+ */
+struct BusyEventLoopFastPriority {
+    static int const Low = 0;
+    static int const Normal = 1;
+    static int const High = 2;
+};
+
 template <typename Arg>
 class BusyEventLoop {
     using ParentObject = typename Arg::ParentObject;
@@ -64,6 +82,15 @@ public:
     using QueuedEvent = BusyEventLoopQueuedEvent<BusyEventLoop>;
     using TimedEvent = BusyEventLoopTimedEvent<BusyEventLoop>;
     using FastHandlerType = void (*) (Context);
+    using FastPriority = BusyEventLoopFastPriority;
+    
+    // Maximum number of High priority fast events dispatched before any other
+    // event gets a turn.
+    static int const MaxHighBurst = 4;
+    
+    // Maximum number of Normal priority fast events dispatched in a row
+    // while a Low priority fast event is pending.
+    static int const MaxNormalBurst = 4;
     
 private:
     using TheDebugObject = DebugObject<Context, Object>;
@@ -76,12 +103,17 @@ public:
         o->m_quitting = false;
 #endif
         o->m_event_list.init();
-        Delay::extra(c)->m_fast_event_pos = 0;
+        o->m_timed_heap.init();
+        o->m_prefer_timed = false;
+        o->m_normal_burst = 0;
+        for (int i = 0; i < Delay::Extra::NumPriorities; i++) {
+            Delay::extra(c)->m_fast_event_pos[i] = 0;
+        }
         for (typename Delay::Extra::FastEventSizeType i = 0; i < Delay::Extra::NumFastEvents; i++) {
             Delay::extra(c)->m_fast_events[i].not_triggered = true;
         }
 #ifdef EVENTLOOP_BENCHMARK
-        o->m_bench_time = 0;
+        reset_bench(c);
 #endif
         
         TheDebugObject::init(c);
@@ -92,6 +124,7 @@ public:
         auto *o = Object::self(c);
         TheDebugObject::deinit(c);
         AMBRO_ASSERT(o->m_event_list.isEmpty())
+        AMBRO_ASSERT(o->m_timed_heap.isEmpty())
     }
     
     static void run (Context c)
@@ -100,56 +133,80 @@ public:
         TheDebugObject::access(c);
         
         while (1) {
-            for (typename Delay::Extra::FastEventSizeType i = 0; i < Delay::Extra::NumFastEvents; i++) {
-                Delay::extra(c)->m_fast_event_pos++;
-                if (AMBRO_UNLIKELY(Delay::extra(c)->m_fast_event_pos == Delay::Extra::NumFastEvents)) {
-                    Delay::extra(c)->m_fast_event_pos = 0;
+            // High priority events are dispatched right below.
+            if (o->m_normal_burst < MaxNormalBurst && dispatch_fast_event<FastPriority::Normal>(c)) {
+                o->m_normal_burst++;
+            } else {
+                o->m_normal_burst = 0;
+                if (!dispatch_fast_event<FastPriority::Low>(c) && dispatch_fast_event<FastPriority::Normal>(c)) {
+                    o->m_normal_burst = 1;
                 }
-                cli();
-                if (!Delay::extra(c)->m_fast_events[Delay::extra(c)->m_fast_event_pos].not_triggered) {
-                    Delay::extra(c)->m_fast_events[Delay::extra(c)->m_fast_event_pos].not_triggered = true;
-                    sei();
-                    bench_start_measuring(c);
-                    Delay::extra(c)->m_fast_events[Delay::extra(c)->m_fast_event_pos].handler(c);
-                    c.check();
-                    bench_stop_measuring(c);
-                    break;
-                }
-                sei();
             }
             
+            int high_budget = MaxHighBurst;
         again:;
+            while (high_budget > 0 && dispatch_fast_event<FastPriority::High>(c)) {
+                high_budget--;
+            }
+            
+            // Queued events are dispatched in order of queuing, timed events in
+            // order of their times once they have expired. When both kinds are
+            // ready, they take turns so that neither can starve the other.
             TimeType now = Clock::getTime(c);
-            for (BaseEventStruct *ev = o->m_event_list.first(); ev; ev = o->m_event_list.next(ev)) {
-                AMBRO_ASSERT(!EventList::isRemoved(ev))
-                if (ev->handler_or_hack || TheClockUtils::timeGreaterOrEqual(now, static_cast<TimedEventStruct *>(ev)->time)) {
-                    o->m_event_list.remove(ev);
-                    EventList::markRemoved(ev);
-                    bench_start_measuring(c);
-                    if (ev->handler_or_hack) {
-                        ev->handler_or_hack(c);
-                    } else {
-                        auto handler = EventHandlerType::Make(static_cast<TimedEventStruct *>(ev)->handler_func, ev->handler_or_hack.m_arg);
-                        handler(c);
-                    }
-                    c.check();
-                    bench_stop_measuring(c);
+            BaseEventStruct *ev = o->m_event_list.first();
+            TimedEventStruct *tev = o->m_timed_heap.first();
+            bool timed_ready = tev && TheClockUtils::timeGreaterOrEqual(now, tev->time);
+            bench_scan_done(c, now);
+            
+            EventHandlerType handler;
+            if (timed_ready && (!ev || o->m_prefer_timed)) {
+                o->m_timed_heap.removeFirst();
+                TimedEventHeap::markRemoved(tev);
+                o->m_prefer_timed = false;
+                handler = tev->handler;
+            } else if (ev) {
+                o->m_event_list.removeFirst();
+                EventList::markRemoved(ev);
+                o->m_prefer_timed = true;
+                handler = ev->handler;
+            } else {
+                continue;
+            }
+            
+            bench_start_measuring(c);
+            handler(c);
+            c.check();
+            bench_stop_measuring(c);
 #ifdef AMBROLIB_SUPPORT_QUIT
-                    if (o->m_quitting) {
-                        return;
-                    }
-#endif
-                    goto again;
-                }
+            if (o->m_quitting) {
+                return;
             }
+#endif
+            high_budget = MaxHighBurst;
+            goto again;
         }
     }
     
 #ifdef EVENTLOOP_BENCHMARK
+    struct BenchFastEventStats {
+        // Number of dispatches of the event.
+        uint32_t dispatch_count;
+        // Total and maximum clock ticks from triggering to dispatch.
+        uint32_t latency_time;
+        TimeType max_latency_time;
+    };
+    
+    struct BenchScanStats {
+        // Number of times the loop looked for a ready event.
+        uint32_t scan_count;
+        // Total and maximum clock ticks spent looking for a ready event.
+        uint32_t scan_time;
+        TimeType max_scan_time;
+    };
+    
     static void resetBenchTime (Context c)
     {
-        auto *o = Object::self(c);
-        o->m_bench_time = 0;
+        reset_bench(c);
     }
     
     static TimeType getBenchTime (Context c)
@@ -157,6 +214,31 @@ public:
         auto *o = Object::self(c);
         return o->m_bench_time;
     }
+    
+    static BenchScanStats getBenchScanStats (Context c)
+    {
+        auto *o = Object::self(c);
+        return o->m_bench_scan;
+    }
+    
+    static int getNumFastEvents ()
+    {
+        return Delay::Extra::NumFastEvents;
+    }
+    
+    static int getFastEventPriority (int index)
+    {
+        AMBRO_ASSERT(index >= 0 && index < Delay::Extra::NumFastEvents)
+        
+        return Delay::Extra::get_index_priority(index);
+    }
+    
+    static BenchFastEventStats getBenchFastEventStats (Context c, int index)
+    {
+        AMBRO_ASSERT(index >= 0 && index < Delay::Extra::NumFastEvents)
+        
+        return Delay::extra(c)->m_fast_events[index].bench;
+    }
 #endif
     
 #ifdef AMBROLIB_SUPPORT_QUIT
@@ -167,8 +249,11 @@ public:
     }
 #endif
     
-    template <typename Id>
-    struct FastEventSpec {};
+    template <typename Id, int TPriority = FastPriority::Normal>
+    struct FastEventSpec {
+        static_assert(TPriority >= FastPriority::Low && TPriority <= FastPriority::High, "");
+        static int const Priority = TPriority;
+    };
     
     template <typename EventSpec>
     static void initFastEvent (Context c, FastHandlerType handler)
@@ -193,7 +278,13 @@ public:
         TheDebugObject::access(c);
         
         AMBRO_LOCK_T(InterruptTempLock(), c, lock_c) {
-            Delay::extra(c)->m_fast_events[Delay::Extra::template get_event_index<EventSpec>()].not_triggered = false;
+            auto *ev = &Delay::extra(c)->m_fast_events[Delay::Extra::template get_event_index<EventSpec>()];
+#ifdef EVENTLOOP_BENCHMARK
+            if (ev->not_triggered) {
+                ev->trigger_time = Clock::getTime(lock_c);
+            }
+#endif
+            ev->not_triggered = false;
         }
     }
     
@@ -204,16 +295,28 @@ private:
     using EventHandlerType = Callback<void(Context)>;
     
     struct BaseEventStruct {
-        EventHandlerType handler_or_hack;
+        EventHandlerType handler;
         DoubleEndedListNode<BaseEventStruct> list_node;
     };
     
-    struct TimedEventStruct : public BaseEventStruct {
-        typename EventHandlerType::FuncType handler_func;
+    struct TimedEventStruct {
+        EventHandlerType handler;
+        PairingHeapNode<TimedEventStruct> heap_node;
         TimeType time;
     };
     
+    // Times are compared relative to each other, which is consistent as long as
+    // all pending events are within half of the clock range, as is already
+    // required for deciding whether an event has expired.
+    struct TimedEventCompare {
+        static bool lessThan (TimedEventStruct *a, TimedEventStruct *b)
+        {
+            return !TheClockUtils::timeGreaterOrEqual(a->time, b->time);
+        }
+    };
+    
     using EventList = DoubleEndedList<BaseEventStruct, &BaseEventStruct::list_node>;
+    using TimedEventHeap = PairingHeap<TimedEventStruct, &TimedEventStruct::heap_node, TimedEventCompare>;
     
     struct Delay {
         using Extra = typename ExtraDelay::Type;
@@ -236,15 +339,81 @@ private:
 #endif
     }
     
+    // Dispatches one triggered fast event of the given priority class, if any.
+    template <int Priority>
+    static bool dispatch_fast_event (Context c)
+    {
+        using Extra = typename Delay::Extra;
+        static int const Start = Extra::template class_start<Priority>();
+        static int const Count = Extra::template class_count<Priority>();
+        
+        auto *e = Delay::extra(c);
+        for (int i = 0; i < Count; i++) {
+            e->m_fast_event_pos[Priority]++;
+            if (AMBRO_UNLIKELY(e->m_fast_event_pos[Priority] == Count)) {
+                e->m_fast_event_pos[Priority] = 0;
+            }
+            auto *ev = &e->m_fast_events[Start + e->m_fast_event_pos[Priority]];
+            cli();
+            if (!ev->not_triggered) {
+                ev->not_triggered = true;
+#ifdef EVENTLOOP_BENCHMARK
+                TimeType trigger_time = ev->trigger_time;
+#endif
+                sei();
+#ifdef EVENTLOOP_BENCHMARK
+                TimeType latency = Clock::getTime(c) - trigger_time;
+                ev->bench.dispatch_count++;
+                ev->bench.latency_time += latency;
+                ev->bench.max_latency_time = MaxValue(ev->bench.max_latency_time, latency);
+#endif
+                bench_start_measuring(c);
+                ev->handler(c);
+                c.check();
+                bench_stop_measuring(c);
+                return true;
+            }
+            sei();
+        }
+        return false;
+    }
+    
+    static void bench_scan_done (Context c, TimeType scan_start_time)
+    {
+#ifdef EVENTLOOP_BENCHMARK
+        auto *o = Object::self(c);
+        TimeType scan_time = Clock::getTime(c) - scan_start_time;
+        o->m_bench_scan.scan_count++;
+        o->m_bench_scan.scan_time += scan_time;
+        o->m_bench_scan.max_scan_time = MaxValue(o->m_bench_scan.max_scan_time, scan_time);
+#endif
+    }
+    
+#ifdef EVENTLOOP_BENCHMARK
+    static void reset_bench (Context c)
+    {
+        auto *o = Object::self(c);
+        o->m_bench_time = 0;
+        o->m_bench_scan = BenchScanStats{};
+        for (typename Delay::Extra::FastEventSizeType i = 0; i < Delay::Extra::NumFastEvents; i++) {
+            Delay::extra(c)->m_fast_events[i].bench = BenchFastEventStats{};
+        }
+    }
+#endif
+    
 public:
     struct Object : public ObjBase<BusyEventLoop, ParentObject, MakeTypeList<TheDebugObject>> {
 #ifdef AMBROLIB_SUPPORT_QUIT
         bool m_quitting;
 #endif
         EventList m_event_list;
+        TimedEventHeap m_timed_heap;
+        bool m_prefer_timed;
+        uint8_t m_normal_burst;
 #ifdef EVENTLOOP_BENCHMARK
         TimeType m_bench_time;
         TimeType m_bench_enter_time;
+        BenchScanStats m_bench_scan;
 #endif
     };
 };
@@ -265,23 +434,65 @@ class BusyEventLoopExtra {
     
     friend Loop;
     
-    static const int NumFastEvents = TypeListLength<FastEventList>::Value;
+    using Priority = BusyEventLoopFastPriority;
+    static const int NumPriorities = Priority::High + 1;
+    
+    template <int ThePriority>
+    struct PriorityFilter {
+        template <typename EventSpec>
+        using Match = WrapBool<(EventSpec::Priority == ThePriority)>;
+    };
+    
+    template <int ThePriority>
+    using PriorityEventList = FilterTypeList<FastEventList, TemplateFunc<PriorityFilter<ThePriority>::template Match>>;
+    
+    // The events are stored by priority class, highest first.
+    using OrderedEventList = JoinTypeLists<
+        PriorityEventList<Priority::High>,
+        PriorityEventList<Priority::Normal>,
+        PriorityEventList<Priority::Low>
+    >;
+    
+    static const int NumFastEvents = TypeListLength<OrderedEventList>::Value;
+    static const int NumHigh = TypeListLength<PriorityEventList<Priority::High>>::Value;
+    static const int NumNormal = TypeListLength<PriorityEventList<Priority::Normal>>::Value;
     using FastEventSizeType = ChooseInt<MaxValue(1, BitsInInt<NumFastEvents>::Value), false>;
     
+    template <int ThePriority>
+    static constexpr int class_start ()
+    {
+        return (ThePriority == Priority::High) ? 0 : (ThePriority == Priority::Normal) ? NumHigh : (NumHigh + NumNormal);
+    }
+    
+    template <int ThePriority>
+    static constexpr int class_count ()
+    {
+        return TypeListLength<PriorityEventList<ThePriority>>::Value;
+    }
+    
+    static constexpr int get_index_priority (int index)
+    {
+        return (index < NumHigh) ? Priority::High : (index < NumHigh + NumNormal) ? Priority::Normal : Priority::Low;
+    }
+    
     struct FastEventState {
         bool not_triggered;
         typename Loop::FastHandlerType handler;
+#ifdef EVENTLOOP_BENCHMARK
+        typename Loop::TimeType trigger_time;
+        typename Loop::BenchFastEventStats bench;
+#endif
     };
     
     template <typename EventSpec>
     static constexpr FastEventSizeType get_event_index ()
     {
-        return TypeListIndex<FastEventList, EventSpec>::Value;
+        return TypeListIndex<OrderedEventList, EventSpec>::Value;
     }
     
 public:
     struct Object : public ObjBase<BusyEventLoopExtra, ParentObject, EmptyTypeList> {
-        FastEventSizeType m_fast_event_pos;
+        FastEventSizeType m_fast_event_pos[NumPriorities];
         FastEventState m_fast_events[NumFastEvents];
     };
 };
@@ -307,7 +518,7 @@ public:
     {
         AMBRO_ASSERT(handler)
         
-        this->handler_or_hack = handler;
+        this->handler = handler;
         Loop::EventList::markRemoved(this);
         
         this->debugInit(c);
@@ -395,9 +606,8 @@ public:
     {
         AMBRO_ASSERT(handler)
         
-        this->handler_or_hack = HandlerType::Make(nullptr, handler.m_arg);
-        Loop::EventList::markRemoved(this);
-        this->handler_func = handler.m_func;
+        this->handler = handler;
+        Loop::TimedEventHeap::markRemoved(this);
         
         this->debugInit(c);
     }
@@ -407,8 +617,8 @@ public:
         this->debugDeinit(c);
         auto *lo = Loop::Object::self(c);
         
-        if (!Loop::EventList::isRemoved(this)) {
-            lo->m_event_list.remove(this);
+        if (!Loop::TimedEventHeap::isRemoved(this)) {
+            lo->m_timed_heap.remove(this);
         }
     }
     
@@ -417,9 +627,9 @@ public:
         this->debugAccess(c);
         auto *lo = Loop::Object::self(c);
         
-        if (!Loop::EventList::isRemoved(this)) {
-            lo->m_event_list.remove(this);
-            Loop::EventList::markRemoved(this);
+        if (!Loop::TimedEventHeap::isRemoved(this)) {
+            lo->m_timed_heap.remove(this);
+            Loop::TimedEventHeap::markRemoved(this);
         }
     }
     
@@ -427,17 +637,17 @@ public:
     {
         this->debugAccess(c);
         
-        return !Loop::EventList::isRemoved(this);
+        return !Loop::TimedEventHeap::isRemoved(this);
     }
     
     void appendNowNotAlready (Context c)
     {
         this->debugAccess(c);
         auto *lo = Loop::Object::self(c);
-        AMBRO_ASSERT(Loop::EventList::isRemoved(this))
+        AMBRO_ASSERT(Loop::TimedEventHeap::isRemoved(this))
         
-        lo->m_event_list.append(this);
         this->time = Context::Clock::getTime(c);
+        lo->m_timed_heap.insert(this);
     }
     
     void appendAt (Context c, TimeType time)
@@ -445,11 +655,11 @@ public:
         this->debugAccess(c);
         auto *lo = Loop::Object::self(c);
         
-        if (!Loop::EventList::isRemoved(this)) {
-            lo->m_event_list.remove(this);
+        if (!Loop::TimedEventHeap::isRemoved(this)) {
+            lo->m_timed_heap.remove(this);
         }
-        lo->m_event_list.append(this);
         this->time = time;
+        lo->m_timed_heap.insert(this);
     }
     
     void appendAfter (Context c, TimeType after_time)
@@ -461,20 +671,20 @@ public:
     {
         this->debugAccess(c);
         auto *lo = Loop::Object::self(c);
-        AMBRO_ASSERT(Loop::EventList::isRemoved(this))
+        AMBRO_ASSERT(Loop::TimedEventHeap::isRemoved(this))
         
-        lo->m_event_list.append(this);
         this->time = Context::Clock::getTime(c) + after_time;
+        lo->m_timed_heap.insert(this);
     }
     
     void appendAfterPrevious (Context c, TimeType after_time)
     {
         this->debugAccess(c);
         auto *lo = Loop::Object::self(c);
-        AMBRO_ASSERT(Loop::EventList::isRemoved(this))
+        AMBRO_ASSERT(Loop::TimedEventHeap::isRemoved(this))
         
-        lo->m_event_list.append(this);
         this->time += after_time;
+        lo->m_timed_heap.insert(this);
     }
     
     TimeType getSetTime (Context c)
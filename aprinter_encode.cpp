@@ -0,0 +1,676 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Encoder of text G-code into the binary format read by BinaryGcodeParser
+// (see aprinter/printer/utils/BinaryGcodeFormat.h). G0/G1 moves which only
+// have X, Y, Z, E and F parameters are written as delta moves, with
+// fixed-point positions relative to the previous move and repeated feedrates
+// left out. Other commands use the generic format, as aprinter_encode.py.
+//
+// Build: g++ -std=c++14 -O2 -I. aprinter_encode.cpp -o aprinter_encode
+// Usage: aprinter_encode --input file.gcode --output file.bin [options]
+//   --decimals-xyz N   fixed-point decimals of X/Y/Z (default 3)
+//   --decimals-e N     fixed-point decimals of E (default 5)
+//   --block-moves N    delta moves per block (default 256)
+//   --no-delta         only use the generic format
+//   --verify           decode the result with BinaryGcodeParser and compare
+//                      it with the text parser
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+// The parsers do not lock, but the debug object header needs these.
+static void cli () {}
+static void sei () {}
+
+#include <aprinter/printer/utils/BinaryGcodeFormat.h>
+#include <aprinter/printer/utils/BinaryGcodeParser.h>
+#include <aprinter/printer/utils/GcodeParser.h>
+
+using namespace APrinter;
+
+using Format = BinaryGcodeFormat;
+
+static int const MaxParams = 14;
+
+struct Options {
+    char const *input = nullptr;
+    char const *output = nullptr;
+    int decimals_xyz = 3;
+    int decimals_e = 5;
+    long block_moves = 256;
+    bool delta = true;
+    bool verify = false;
+};
+
+struct EncodeError {
+    std::string msg;
+};
+
+struct Param {
+    char letter;
+    char const *value;
+    size_t value_len;
+};
+
+static void put_u8 (std::string *out, uint8_t x)
+{
+    out->push_back((char)x);
+}
+
+static void put_le (std::string *out, uint64_t x, int bytes)
+{
+    for (int i = 0; i < bytes; i++) {
+        out->push_back((char)(x >> (8 * i)));
+    }
+}
+
+static void put_float (std::string *out, float x)
+{
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    put_le(out, bits, 4);
+}
+
+static bool letter_ok (char ch)
+{
+    return (ch >= 'A' && ch <= 'Z');
+}
+
+// Parses [+]digits as an unsigned integer.
+static bool parse_uint (std::string const &str, uint64_t *out)
+{
+    size_t i = (!str.empty() && str[0] == '+') ? 1 : 0;
+    if (i == str.size()) {
+        return false;
+    }
+    uint64_t value = 0;
+    for (; i < str.size(); i++) {
+        if (str[i] < '0' || str[i] > '9' || value > (UINT64_MAX - (str[i] - '0')) / 10) {
+            return false;
+        }
+        value = 10 * value + (str[i] - '0');
+    }
+    *out = value;
+    return true;
+}
+
+// Parses [+-]digits[.digits] as a fixed-point number with the given number
+// of decimals. Fails if the number has more (nonzero) decimals or does not
+// fit into int32.
+static bool parse_fixed (std::string const &str, int decimals, int32_t *out)
+{
+    size_t i = 0;
+    bool negative = false;
+    if (i < str.size() && (str[i] == '-' || str[i] == '+')) {
+        negative = (str[i] == '-');
+        i++;
+    }
+    int64_t value = 0;
+    bool have_digits = false;
+    int frac_digits = -1;
+    for (; i < str.size(); i++) {
+        char ch = str[i];
+        if (ch == '.' && frac_digits < 0) {
+            frac_digits = 0;
+            continue;
+        }
+        if (ch < '0' || ch > '9') {
+            return false;
+        }
+        have_digits = true;
+        if (frac_digits >= 0) {
+            if (frac_digits == decimals) {
+                if (ch != '0') {
+                    return false;
+                }
+                continue;
+            }
+            frac_digits++;
+        }
+        value = 10 * value + (ch - '0');
+        if (value > INT64_C(0x80000000) * 1000000000) {
+            return false;
+        }
+    }
+    if (!have_digits) {
+        return false;
+    }
+    for (int d = (frac_digits < 0 ? 0 : frac_digits); d < decimals; d++) {
+        value *= 10;
+    }
+    if (negative) {
+        value = -value;
+    }
+    if (value < INT32_MIN || value > INT32_MAX) {
+        return false;
+    }
+    *out = value;
+    return true;
+}
+
+static bool parse_real (std::string const &str, float *out)
+{
+    if (str.empty()) {
+        return false;
+    }
+    char *end;
+    *out = strtof(str.c_str(), &end);
+    return *end == '\0';
+}
+
+class Encoder {
+public:
+    Encoder (Options const &opts)
+    : m_opts(opts)
+    {
+    }
+    
+    void encodeLine (char const *line, size_t len, std::string *out)
+    {
+        size_t comment = 0;
+        while (comment < len && line[comment] != ';') {
+            comment++;
+        }
+        len = comment;
+        
+        std::vector<std::string> words;
+        size_t pos = 0;
+        while (pos < len) {
+            while (pos < len && is_space(line[pos])) {
+                pos++;
+            }
+            size_t start = pos;
+            while (pos < len && !is_space(line[pos])) {
+                pos++;
+            }
+            if (pos > start) {
+                words.push_back(std::string(line + start, pos - start));
+            }
+        }
+        if (words.empty()) {
+            return;
+        }
+        
+        char cmd_letter = words[0][0];
+        if (cmd_letter == 'E') {
+            put_u8(out, Format::CMD_TYPE_EOF << 4);
+            return;
+        }
+        if (!letter_ok(cmd_letter)) {
+            throw EncodeError{"invalid command letter"};
+        }
+        uint64_t cmd_number;
+        if (!parse_uint(words[0].substr(1), &cmd_number) || cmd_number >= 2048) {
+            throw EncodeError{"invalid command number"};
+        }
+        if (words.size() - 1 > MaxParams) {
+            throw EncodeError{"too many parameters"};
+        }
+        for (size_t i = 1; i < words.size(); i++) {
+            if (!letter_ok(words[i][0])) {
+                throw EncodeError{"invalid parameter letter"};
+            }
+        }
+        
+        bool is_move = (cmd_letter == 'G' && (cmd_number == 0 || cmd_number == 1));
+        if (is_move && m_opts.delta && encode_delta_move(cmd_number, words, out)) {
+            return;
+        }
+        encode_generic(cmd_letter, cmd_number, words, out);
+        
+        if (is_move) {
+            update_last_f(words);
+        }
+    }
+    
+    void finish (std::string *out)
+    {
+        put_u8(out, Format::CMD_TYPE_EOF << 4);
+    }
+    
+    long numDeltaMoves () const
+    {
+        return m_num_delta_moves;
+    }
+    
+    long numBlocks () const
+    {
+        return m_block_index;
+    }
+    
+private:
+    static bool is_space (char ch)
+    {
+        return (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n');
+    }
+    
+    int decimals (int axis) const
+    {
+        return (axis == Format::NumDeltaAxes - 1) ? m_opts.decimals_e : m_opts.decimals_xyz;
+    }
+    
+    static int find_axis (char letter)
+    {
+        for (int axis = 0; axis < Format::NumDeltaAxes; axis++) {
+            if (Format::deltaAxisName(axis) == letter) {
+                return axis;
+            }
+        }
+        return -1;
+    }
+    
+    void update_last_f (std::vector<std::string> const &words)
+    {
+        for (size_t i = 1; i < words.size(); i++) {
+            if (words[i][0] == 'R') {
+                // Feedrate is not saved, and we do not track it precisely.
+                m_have_last_f = false;
+                return;
+            }
+        }
+        for (size_t i = 1; i < words.size(); i++) {
+            float f = 0.0f;
+            if (words[i][0] == 'F') {
+                m_have_last_f = parse_real(words[i].substr(1), &f);
+                m_last_f = f;
+            }
+        }
+    }
+    
+    bool encode_delta_move (uint64_t cmd_number, std::vector<std::string> const &words, std::string *out)
+    {
+        bool have_axis[Format::NumDeltaAxes] = {};
+        int32_t values[Format::NumDeltaAxes];
+        bool have_f = false;
+        float f = 0.0f;
+        
+        for (size_t i = 1; i < words.size(); i++) {
+            char letter = words[i][0];
+            std::string value = words[i].substr(1);
+            if (letter == 'F') {
+                if (have_f || !parse_real(value, &f)) {
+                    return false;
+                }
+                have_f = true;
+                continue;
+            }
+            int axis = find_axis(letter);
+            if (axis < 0 || have_axis[axis] || !parse_fixed(value, decimals(axis), &values[axis])) {
+                return false;
+            }
+            have_axis[axis] = true;
+        }
+        
+        int64_t deltas[Format::NumDeltaAxes];
+        uint8_t widths = 0;
+        for (int axis = 0; axis < Format::NumDeltaAxes; axis++) {
+            if (!have_axis[axis]) {
+                continue;
+            }
+            deltas[axis] = (int64_t)values[axis] - m_pos[axis];
+            uint8_t width_code;
+            if (deltas[axis] >= INT8_MIN && deltas[axis] <= INT8_MAX) {
+                width_code = Format::DELTA_WIDTH_8;
+            } else if (deltas[axis] >= INT16_MIN && deltas[axis] <= INT16_MAX) {
+                width_code = Format::DELTA_WIDTH_16;
+            } else if (deltas[axis] >= INT32_MIN && deltas[axis] <= INT32_MAX) {
+                width_code = Format::DELTA_WIDTH_32;
+            } else {
+                return false;
+            }
+            widths |= width_code << (2 * axis);
+        }
+        
+        if (have_f) {
+            if (m_have_last_f && memcmp(&f, &m_last_f, sizeof(f)) == 0) {
+                have_f = false;
+            } else {
+                m_have_last_f = true;
+                m_last_f = f;
+            }
+        }
+        
+        if (m_block_index == 0 || m_moves_in_block >= m_opts.block_moves) {
+            write_block_header(out);
+        }
+        
+        uint8_t cmd_type = (cmd_number == 1) ? Format::CMD_TYPE_G1_DELTA : Format::CMD_TYPE_G0_DELTA;
+        put_u8(out, (cmd_type << 4) | (have_f ? Format::DeltaFlagF : 0));
+        put_u8(out, widths);
+        for (int axis = 0; axis < Format::NumDeltaAxes; axis++) {
+            if (have_axis[axis]) {
+                put_le(out, (uint64_t)deltas[axis], Format::deltaWidthBytes((widths >> (2 * axis)) & 0x3));
+                m_pos[axis] = values[axis];
+            }
+        }
+        if (have_f) {
+            put_float(out, f);
+        }
+        
+        m_moves_in_block++;
+        m_num_delta_moves++;
+        return true;
+    }
+    
+    void write_block_header (std::string *out)
+    {
+        put_u8(out, (Format::CMD_TYPE_BLOCK << 4) | Format::BlockVersion);
+        put_le(out, m_block_index, 4);
+        put_u8(out, m_opts.decimals_xyz | (m_opts.decimals_e << 4));
+        for (int axis = 0; axis < Format::NumDeltaAxes; axis++) {
+            put_le(out, (uint32_t)m_pos[axis], 4);
+        }
+        m_block_index++;
+        m_moves_in_block = 0;
+    }
+    
+    void encode_generic (char cmd_letter, uint64_t cmd_number, std::vector<std::string> const &words, std::string *out)
+    {
+        std::string index;
+        std::string payload;
+        for (size_t i = 1; i < words.size(); i++) {
+            char letter = words[i][0];
+            std::string value = words[i].substr(1);
+            uint8_t type_code;
+            uint64_t integer;
+            float real;
+            if (value.empty()) {
+                type_code = Format::DATA_TYPE_VOID;
+            } else if (parse_uint(value, &integer)) {
+                if (integer <= UINT32_MAX) {
+                    type_code = Format::DATA_TYPE_UINT32;
+                    put_le(&payload, integer, 4);
+                } else {
+                    type_code = Format::DATA_TYPE_UINT64;
+                    put_le(&payload, integer, 8);
+                }
+            } else if (parse_real(value, &real)) {
+                type_code = Format::DATA_TYPE_FLOAT;
+                put_float(&payload, real);
+            } else {
+                throw EncodeError{"invalid command argument"};
+            }
+            put_u8(&index, (type_code << 5) | (letter - 'A'));
+        }
+        
+        uint8_t num_params = words.size() - 1;
+        uint8_t cmd_type = Format::CMD_TYPE_LONG;
+        if (cmd_letter == 'G' && cmd_number == 0) {
+            cmd_type = Format::CMD_TYPE_G0;
+        } else if (cmd_letter == 'G' && cmd_number == 1) {
+            cmd_type = Format::CMD_TYPE_G1;
+        } else if (cmd_letter == 'G' && cmd_number == 92) {
+            cmd_type = Format::CMD_TYPE_G92;
+        }
+        put_u8(out, (cmd_type << 4) | num_params);
+        if (cmd_type == Format::CMD_TYPE_LONG) {
+            put_u8(out, ((cmd_letter - 'A') << 3) | (cmd_number >> 8));
+            put_u8(out, cmd_number & 0xff);
+        }
+        *out += index;
+        *out += payload;
+    }
+    
+    Options m_opts;
+    int32_t m_pos[Format::NumDeltaAxes] = {};
+    bool m_have_last_f = false;
+    float m_last_f = 0.0f;
+    uint32_t m_block_index = 0;
+    long m_moves_in_block = 0;
+    long m_num_delta_moves = 0;
+};
+
+struct VerifyContext {};
+
+using VerifyFpType = float;
+using TextParser = FileGcodeParserService<MaxParams>::Parser<VerifyContext, size_t, VerifyFpType>;
+using BinaryParser = BinaryGcodeParserService<MaxParams>::Parser<VerifyContext, size_t, VerifyFpType>;
+using TheGcodeCommand = GcodeCommand<VerifyContext, VerifyFpType>;
+
+// Gets the next command which is not empty (comment lines, block headers).
+template <typename Parser>
+static bool next_command (Parser *parser, char *buf, size_t len, size_t *pos)
+{
+    VerifyContext c;
+    while (*pos < len) {
+        parser->startCommand(c, buf + *pos, 0);
+        if (!parser->extendCommand(c, len - *pos)) {
+            parser->resetCommand(c);
+            return false;
+        }
+        *pos += parser->getLength(c);
+        if (parser->getNumParts(c) != GCODE_ERROR_NO_PARTS) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool find_part (TheGcodeCommand *cmd, char code, VerifyFpType *value)
+{
+    VerifyContext c;
+    for (int i = 0; i < cmd->getNumParts(c); i++) {
+        auto part = cmd->getPart(c, i);
+        if (cmd->getPartCode(c, part) == code) {
+            *value = cmd->getPartFpValue(c, part);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool verify (std::string text, std::string binary)
+{
+    VerifyContext c;
+    TextParser text_parser;
+    BinaryParser bin_parser;
+    text_parser.init(c);
+    bin_parser.init(c);
+    
+    text.push_back('\n');
+    size_t text_pos = 0;
+    size_t bin_pos = 0;
+    long cmd_index = 0;
+    bool have_last_f = false;
+    VerifyFpType last_f = 0.0f;
+    
+    while (1) {
+        bool have_text = next_command(&text_parser, &text[0], text.size(), &text_pos);
+        bool have_bin = next_command(&bin_parser, &binary[0], binary.size(), &bin_pos);
+        if (!have_text) {
+            if (!have_bin || bin_parser.getNumParts(c) != GCODE_ERROR_EOF) {
+                fprintf(stderr, "verify: missing EOF at the end\n");
+                return false;
+            }
+            return true;
+        }
+        if (!have_bin) {
+            fprintf(stderr, "verify: command %ld: binary data ends early\n", cmd_index);
+            return false;
+        }
+        
+        int text_parts = text_parser.getNumParts(c);
+        int bin_parts = bin_parser.getNumParts(c);
+        if (text_parts < 0 || bin_parts < 0) {
+            if (text_parts != bin_parts) {
+                fprintf(stderr, "verify: command %ld: error %d, expected %d\n", cmd_index, bin_parts, text_parts);
+                return false;
+            }
+            if (text_parts == GCODE_ERROR_EOF) {
+                return true;
+            }
+            cmd_index++;
+            continue;
+        }
+        
+        if (text_parser.getCmdCode(c) != bin_parser.getCmdCode(c) || text_parser.getCmdNumber(c) != bin_parser.getCmdNumber(c)) {
+            fprintf(stderr, "verify: command %ld: different command\n", cmd_index);
+            return false;
+        }
+        
+        bool is_move = (text_parser.getCmdCode(c) == 'G' && text_parser.getCmdNumber(c) <= 1);
+        int matched = 0;
+        for (int i = 0; i < text_parts; i++) {
+            auto part = text_parser.getPart(c, i);
+            char code = text_parser.getPartCode(c, part);
+            VerifyFpType expected = text_parser.getPartFpValue(c, part);
+            VerifyFpType value;
+            if (find_part(&bin_parser, code, &value)) {
+                matched++;
+                if (memcmp(&value, &expected, sizeof(value)) != 0) {
+                    fprintf(stderr, "verify: command %ld: %c is %.9g, expected %.9g\n", cmd_index, code, (double)value, (double)expected);
+                    return false;
+                }
+            } else if (!(is_move && code == 'F' && have_last_f && expected == last_f)) {
+                fprintf(stderr, "verify: command %ld: %c is missing\n", cmd_index, code);
+                return false;
+            }
+            if (is_move && code == 'F') {
+                have_last_f = true;
+                last_f = expected;
+            }
+        }
+        if (matched != bin_parts) {
+            fprintf(stderr, "verify: command %ld: extra parameters\n", cmd_index);
+            return false;
+        }
+        cmd_index++;
+    }
+}
+
+static bool read_file (char const *name, std::string *out)
+{
+    FILE *f = fopen(name, "rb");
+    if (!f) {
+        return false;
+    }
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        out->append(chunk, n);
+    }
+    fclose(f);
+    return true;
+}
+
+static double get_time ()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void usage ()
+{
+    fprintf(stderr, "Usage: aprinter_encode --input FILE --output FILE [--decimals-xyz N] [--decimals-e N] [--block-moves N] [--no-delta] [--verify]\n");
+    exit(2);
+}
+
+int main (int argc, char *argv[])
+{
+    Options opts;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = (i + 1 < argc);
+        if (arg == "--input" && has_value) {
+            opts.input = argv[++i];
+        } else if (arg == "--output" && has_value) {
+            opts.output = argv[++i];
+        } else if (arg == "--decimals-xyz" && has_value) {
+            opts.decimals_xyz = atoi(argv[++i]);
+        } else if (arg == "--decimals-e" && has_value) {
+            opts.decimals_e = atoi(argv[++i]);
+        } else if (arg == "--block-moves" && has_value) {
+            opts.block_moves = atol(argv[++i]);
+        } else if (arg == "--no-delta") {
+            opts.delta = false;
+        } else if (arg == "--verify") {
+            opts.verify = true;
+        } else {
+            usage();
+        }
+    }
+    if (!opts.input || !opts.output ||
+        opts.decimals_xyz < 0 || opts.decimals_xyz > Format::MaxDecimals ||
+        opts.decimals_e < 0 || opts.decimals_e > Format::MaxDecimals || opts.block_moves < 1)
+    {
+        usage();
+    }
+    
+    std::string input;
+    if (!read_file(opts.input, &input)) {
+        fprintf(stderr, "Cannot read %s\n", opts.input);
+        return 1;
+    }
+    
+    double start_time = get_time();
+    
+    Encoder encoder(opts);
+    std::string output;
+    long line_num = 0;
+    size_t pos = 0;
+    while (pos < input.size()) {
+        size_t end = input.find('\n', pos);
+        if (end == std::string::npos) {
+            end = input.size();
+        }
+        line_num++;
+        try {
+            encoder.encodeLine(input.data() + pos, end - pos, &output);
+        } catch (EncodeError const &e) {
+            fprintf(stderr, "line %ld: %s\n", line_num, e.msg.c_str());
+            return 1;
+        }
+        pos = end + 1;
+    }
+    encoder.finish(&output);
+    
+    double elapsed = get_time() - start_time;
+    
+    FILE *f = fopen(opts.output, "wb");
+    if (!f || fwrite(output.data(), 1, output.size(), f) != output.size() || fclose(f) != 0) {
+        fprintf(stderr, "Cannot write %s\n", opts.output);
+        return 1;
+    }
+    
+    fprintf(stderr, "%ld lines, %zu -> %zu bytes (%.2fx), %ld delta moves in %ld blocks, %.0f lines/s\n",
+            line_num, input.size(), output.size(), (double)input.size() / output.size(),
+            encoder.numDeltaMoves(), encoder.numBlocks(), line_num / elapsed);
+    
+    if (opts.verify) {
+        if (!verify(input, output)) {
+            return 1;
+        }
+        fprintf(stderr, "verify: OK\n");
+    }
+    
+    return 0;
+}
@@ -424,6 +424,14 @@ def setup_platform(gen, config, key):
         gen.add_final_init_call(-1, 'platform_init_final();')
         gen.register_singleton_object('lwip_cpu_info', lwip_cpu_info_arm)
     
+    @platform_sel.option('Linux')
+    def option(platform):
+        gen.add_platform_include('aprinter/platform/linux/linux_support.h')
+        gen.add_init_call(-1, 'platform_init();')
+        gen.add_init_call(-3, 'sei();')
+        gen.add_extra_source('aprinter/platform/linux/linux_support.cpp')
+        gen.register_singleton_object('lwip_cpu_info', {'alignment': 'u32_t'})
+    
     config.do_selection(key, platform_sel)
 
 def setup_debug_interface(gen, config, key):
@@ -587,6 +595,15 @@ def Stm32f4ClockDef(x):
     x.TIMER_EXPR = lambda tc: 'Stm32f4ClockTIM{}'.format(tc)
     x.TIMER_ISR = lambda my_clock, tc: 'AMBRO_STM32F4_CLOCK_TC_GLOBAL({}, {}, Context())'.format(tc, my_clock)
 
+def LinuxClockDef(x):
+    x.INCLUDE = 'hal/linux/LinuxClock.h'
+    x.CLOCK_SERVICE = lambda config: TemplateExpr('LinuxClockService', [config.get_int_constant('TimeFreq')])
+    x.TIMER_RE = '\\A([A-Z]{1,4}[0-9]{1,2})\\Z'
+    x.CHANNEL_RE = '\\A([A-Z]{1,4}[0-9]{1,2})_?([A-Z0-9])\\Z'
+    x.INTERRUPT_TIMER_EXPR = lambda it, clearance: 'LinuxClockInterruptTimerService<{}>'.format(clearance)
+    x.INTERRUPT_TIMER_ISR = lambda it, user: 'APRINTER_LINUX_CLOCK_INTERRUPT_TIMER_GLOBAL({}, Context())'.format(user)
+    x.TIMER_EXPR = lambda tc: 'LinuxClockTimer'
+
 def setup_clock(gen, config, key, clock_name, priority, allow_disabled):
     clock_sel = selection.Selection()
     
@@ -616,6 +633,10 @@ def setup_clock(gen, config, key, clock_name, priority, allow_disabled):
     def option(clock):
         return CommonClock(gen, clock, clock_name, priority, Stm32f4ClockDef)
     
+    @clock_sel.option('LinuxClock')
+    def option(clock):
+        return CommonClock(gen, clock, clock_name, priority, LinuxClockDef)
+    
     clock_object = config.do_selection(key, clock_sel)
     if clock_object is not None:
         gen.register_singleton_object(clock_name, clock_object)
@@ -638,8 +659,23 @@ def setup_millisecond_clock(gen, config, key, priority):
     if clock_expr is not None:
         gen.add_global_resource(priority, 'MyMillisecondClock', clock_expr, context_name='MillisecondClock')
 
+class LinuxPinMapper(object):
+    def __init__ (self, gen):
+        self._gen = gen
+        self._pin_names = []
+    
+    def map_pin (self, pin):
+        if pin not in self._pin_names:
+            self._pin_names.append(pin)
+        return 'LinuxPin<{}>'.format(self._pin_names.index(pin))
+    
+    def finalize (self):
+        names = ''.join('"{}", '.format(name) for name in self._pin_names)
+        self._gen.add_global_code(0, 'char const * const linux_pin_names[] = {{{}nullptr}};'.format(names))
+
 def setup_pins (gen, config, key):
     pin_regexes = [IDENTIFIER_REGEX]
+    pin_mapper = [None]
     
     pins_sel = selection.Selection()
     
@@ -667,17 +703,32 @@ def setup_pins (gen, config, key):
         pin_regexes.append('\\AStm32f4Pin<Stm32f4Port[A-Z],[0-9]{1,3}>\\Z')
         return TemplateLiteral('Stm32f4PinsService')
     
+    @pins_sel.option('LinuxPins')
+    def options(pin_config):
+        gen.add_aprinter_include('hal/linux/LinuxPins.h')
+        # Any pin of a real board is accepted and mapped to a simulated pin.
+        pin_regexes.append('\\AAt91SamPin<At91SamPio[A-Z],[0-9]{1,3}>\\Z')
+        pin_regexes.append('\\AMk20Pin<Mk20Port[A-Z],[0-9]{1,3}>\\Z')
+        pin_regexes.append('\\AAvrPin<AvrPort[A-Z],[0-9]{1,3}>\\Z')
+        pin_regexes.append('\\AStm32f4Pin<Stm32f4Port[A-Z],[0-9]{1,3}>\\Z')
+        pin_mapper[0] = LinuxPinMapper(gen)
+        return TemplateLiteral('LinuxPinsService')
+    
     service_expr = config.do_selection(key, pins_sel)
     service_code = 'using PinsService = {};'.format(service_expr.build(indent=0))
     pins_expr = TemplateExpr('PinsService::Pins', ['Context', 'Program'])
     gen.add_global_resource(10, 'Pins', pins_expr, use_instance=True, code_before=service_code, context_name='Pins')
     gen.register_singleton_object('pin_regexes', pin_regexes)
+    gen.register_singleton_object('pin_mapper', pin_mapper[0])
 
 def get_pin (gen, config, key):
     pin = config.get_string(key)
     pin_regexes = gen.get_singleton_object('pin_regexes')
     if not any(re.match(pin_regex, pin) for pin_regex in pin_regexes):
         config.key_path(key).error('Invalid pin value.')
+    pin_mapper = gen.get_singleton_object('pin_mapper')
+    if pin_mapper is not None:
+        pin = pin_mapper.map_pin(pin)
     return pin
 
 def setup_watchdog (gen, config, key, disable_watchdog, user):
@@ -713,6 +764,11 @@ def setup_watchdog (gen, config, key, disable_watchdog, user):
         gen.add_isr('AMBRO_AVR_WATCHDOG_GLOBAL')
         return TemplateExpr('AvrWatchdogService', [wdto])
     
+    @watchdog_sel.option('NullWatchdog')
+    def option(watchdog):
+        gen.add_aprinter_include('hal/generic/NullWatchdog.h')
+        return 'NullWatchdogService'
+    
     @watchdog_sel.option('Stm32f4Watchdog')
     def option(watchdog):
         gen.add_aprinter_include('hal/stm32/Stm32f4Watchdog.h')
@@ -805,6 +861,16 @@ def setup_adc (gen, config, key):
             'pin_func': lambda pin: pin
         }
     
+    @adc_sel.option('LinuxAdc')
+    def option(adc_config):
+        gen.add_aprinter_include('hal/linux/LinuxAdc.h')
+        gen.add_float_constant('AdcValue', adc_config.get_float('Value'))
+        
+        return {
+            'service_expr': TemplateExpr('LinuxAdcService', ['AdcValue']),
+            'pin_func': lambda pin: pin
+        }
+    
     result = config.do_selection(key, adc_sel)
     if result is None:
         return
@@ -865,6 +931,10 @@ def use_input_mode (config, key):
     def option(im_config):
         return im_config.do_enum('PullMode', {'Normal': 'Mk20PinInputModeNormal', 'Pull-up': 'Mk20PinInputModePullUp', 'Pull-down': 'Mk20PinInputModePullDown'})
     
+    @im_sel.option('LinuxPinInputMode')
+    def option(im_config):
+        return im_config.do_enum('PullMode', {'Normal': 'LinuxPinInputModeNormal', 'Pull-up': 'LinuxPinInputModePullUp'})
+    
     return config.do_selection(key, im_sel)
 
 def use_digital_input (gen, config, key):
@@ -945,6 +1015,13 @@ def use_pwm_output (gen, config, key, user, username, hard=False):
                 hard_driver.get_bool('Invert'),
             ])
         
+        @hard_driver_sel.option('LinuxPwm')
+        def option(hard_driver):
+            gen.add_aprinter_include('hal/linux/LinuxPwm.h')
+            return TemplateExpr('LinuxPwmChannelService', [
+                get_pin(gen, hard_driver, 'OutputPin'),
+            ])
+        
         hard_pwm_expr = backend.do_selection('HardPwmDriver', hard_driver_sel)
         
         if hard:
@@ -1118,6 +1195,11 @@ def use_serial(gen, config, key, user):
         gen.add_aprinter_include('hal/stm32/Stm32f4UsbSerial.h')
         return 'Stm32f4UsbSerialService'
     
+    @serial_sel.option('LinuxSerial')
+    def option(serial_service):
+        gen.add_aprinter_include('hal/linux/LinuxSerial.h')
+        return 'LinuxSerialService'
+    
     @serial_sel.option('NullSerial')
     def option(serial_service):
         gen.add_aprinter_include('hal/generic/NullSerial.h')
@@ -1143,6 +1225,11 @@ def use_sdcard(gen, config, key, user):
             use_sdio(gen, sdio_sd, 'SdioService', '{}::GetSdio'.format(user)),
         ])
     
+    @sd_service_sel.option('LinuxSdCard')
+    def option(linux_sd):
+        gen.add_aprinter_include('hal/linux/LinuxSdCard.h')
+        return 'LinuxSdCardService'
+    
     return config.do_selection(key, sd_service_sel)
 
 def use_config_manager(gen, config, key, user):
@@ -1247,11 +1334,15 @@ class NetworkConfigState(object):
         self._num_listeners = 0
         self._num_connections = 0
         self._num_queued_connections = 0
+        self._num_send_refs = 0
     
-    def add_resource_counts(self, listeners=0, connections=0, queued_connections=0):
+    def add_resource_counts(self, listeners=0, connections=0, queued_connections=0, send_refs=0):
         self._num_listeners += listeners
         self._num_connections += connections
-        self._num_queued_connections += queued_connections
+        self._num_send_refs += send_refs
+        # Queued connections of all listeners share one pool, which only needs
+        # to be as large as the largest queue of any single listener.
+        self._num_queued_connections = max(self._num_queued_connections, queued_connections)
 
 def setup_network(gen, config, key):
     network_sel = selection.Selection()
@@ -1306,7 +1397,7 @@ def setup_network(gen, config, key):
             chksum_algorithm = 0
             gen.add_extra_source(cpu_info['checksum_src_file'])
         else:
-            chksum_algorithm = 3
+            chksum_algorithm = 1
         
         network_expr = TemplateExpr('LwipNetworkArg', [
             'Context',
@@ -1323,6 +1414,7 @@ def setup_network(gen, config, key):
             gen.add_define('APRINTER_NUM_TCP_LISTEN', network_state._num_listeners)
             gen.add_define('APRINTER_NUM_TCP_CONN', network_state._num_connections)
             gen.add_define('APRINTER_NUM_TCP_CONN_QUEUED', network_state._num_queued_connections)
+            gen.add_define('APRINTER_NUM_TCP_SEND_REFS', network_state._num_send_refs)
             gen.add_define('APRINTER_TCP_RX_BUF', tcp_rx_buf)
             gen.add_define('APRINTER_TCP_TX_BUF', tcp_tx_buf)
             gen.add_define('APRINTER_MEM_ALIGNMENT', cpu_info['alignment'])
@@ -1346,6 +1438,11 @@ def use_ethernet(gen, config, key, user):
             use_phy(gen, ethernet_config, 'PhyDriver'),
         ])
     
+    @ethernet_sel.option('LinuxTapEthernet')
+    def option(ethernet_config):
+        gen.add_aprinter_include('hal/linux/LinuxTapEthernet.h')
+        return 'LinuxTapEthernetService'
+    
     return config.do_selection(key, ethernet_sel)
 
 def use_mii(gen, config, key, user):
@@ -1383,6 +1480,87 @@ def use_phy(gen, config, key):
     
     return config.do_selection(key, phy_sel)
 
+def get_board_time_freq(clock):
+    clock_type = clock['_compoundName']
+    if clock_type in ('At91Sam3xClock', 'At91Sam3uClock'):
+        f_mck = 84e6 if clock_type == 'At91Sam3xClock' else 96e6
+        return f_mck / {1: 2, 2: 8, 3: 32, 4: 128}[clock['prescaler']]
+    if clock_type == 'Mk20Clock':
+        return 48e6 / 2**clock['prescaler']
+    if clock_type == 'AvrClock':
+        return 16e6 / clock['PrescaleDivide']
+    if clock_type == 'Stm32f4Clock':
+        return 84e6 / (clock['prescaler'] + 1)
+    return 1e6
+
+def convert_board_for_linux_host(config_root_data, cfg_name, tap_network=False):
+    # Rewrite the board of the selected configuration so that it runs as a
+    # Linux process. Steppers, heaters, fans and inputs are kept and use
+    # simulated pins, the SD card is backed by a disk image, while peripherals
+    # which have no simulation (EEPROM, SPI devices) are removed. The network
+    # is removed too, unless tap_network is set, in which case it is kept and
+    # uses a TAP device.
+    if cfg_name is None:
+        cfg_name = config_root_data['selected_config']
+    configs = [cfg for cfg in config_root_data['configurations'] if cfg['name'] == cfg_name]
+    if len(configs) != 1:
+        raise Exception('Configuration {} not found.'.format(cfg_name))
+    boards = [board for board in config_root_data['boards'] if board['name'] == configs[0]['board']]
+    if len(boards) != 1:
+        raise Exception('Board {} not found.'.format(configs[0]['board']))
+    board = boards[0]
+    
+    platform_config = board['platform_config']
+    platform = platform_config['platform']
+    platform_config['board_for_build'] = 'linux'
+    platform_config['output_types'] = {'_compoundName': 'output_types', 'output_elf': True, 'output_bin': False, 'output_hex': False}
+    platform_config['debug_interface'] = {'_compoundName': 'NoDebug'}
+    platform_config['board_helper_includes'] = []
+    platform_config['platform'] = {
+        '_compoundName': 'Linux',
+        'clock': {
+            '_compoundName': 'LinuxClock',
+            'TimeFreq': int(round(get_board_time_freq(platform['clock']))),
+            'primary_timer': platform['clock']['primary_timer'],
+            'avail_oc_units': platform['clock'].get('avail_oc_units', []),
+        },
+        'pins': {'_compoundName': 'LinuxPins', 'input_mode_type': 'LinuxPinInputMode'},
+        'adc': {'_compoundName': 'LinuxAdc', 'Value': 0.955},
+        'watchdog': {'_compoundName': 'NullWatchdog'},
+    }
+    
+    for digital_input in board.get('digital_inputs', []):
+        pull_mode = digital_input['InputMode'].get('PullMode', 'Normal')
+        digital_input['InputMode'] = {'_compoundName': 'LinuxPinInputMode', 'PullMode': pull_mode if pull_mode == 'Pull-up' else 'Normal'}
+    
+    for analog_input in board.get('analog_inputs', []):
+        driver = analog_input['Driver']
+        if driver['_compoundName'] != 'AdcAnalogInput':
+            analog_input['Driver'] = {'_compoundName': 'AdcAnalogInput', 'Pin': driver['SsPin']}
+    
+    for pwm_output in board.get('pwm_outputs', []):
+        backend = pwm_output['Backend']
+        if backend['_compoundName'] == 'HardPwm':
+            backend['HardPwmDriver'] = {'_compoundName': 'LinuxPwm', 'OutputPin': backend['HardPwmDriver']['OutputPin']}
+    
+    for stepper_port in board.get('stepper_ports', []):
+        stepper_port['current'] = {'_compoundName': 'NoCurrent'}
+    
+    for (i, serial) in enumerate(board.get('serial_ports', [])):
+        serial['Service'] = {'_compoundName': 'LinuxSerial' if i == 0 else 'NullSerial'}
+    
+    board['current_config']['current'] = {'_compoundName': 'NoCurrent'}
+    sdcard = board['sdcard_config']['sdcard']
+    if sdcard['_compoundName'] == 'SdCard':
+        sdcard['SdCardService'] = {'_compoundName': 'LinuxSdCard'}
+    network = board['network_config']['network']
+    if tap_network and network['_compoundName'] == 'Network':
+        network['EthernetDriver'] = {'_compoundName': 'LinuxTapEthernet'}
+    else:
+        board['network_config']['network'] = {'_compoundName': 'NoNetwork'}
+    board['runtime_config']['config_manager']['ConfigStore'] = {'_compoundName': 'NoStore'}
+    board['development']['BuildWithClang'] = False
+
 def generate(config_root_data, cfg_name, main_template):
     gen = GenState()
     
@@ -1445,6 +1623,13 @@ def generate(config_root_data, cfg_name, main_template):
                     event_channel_timer_clearance = performance.get_float('EventChannelTimerClearance')
                     optimize_for_size = performance.get_bool('OptimizeForSize')
                     optimize_libc_for_size = performance.get_bool('OptimizeLibcForSize')
+                    
+                    if performance.get_bool('SCurveEnabled'):
+                        scurve_ramp_time = performance.get_float('SCurveRampTime')
+                        if not scurve_ramp_time >= 0.0:
+                            performance.key_path('SCurveRampTime').error('Must be non-negative.')
+                        gen.add_define('MOTIONPLANNER_SCURVE', 1)
+                        gen.add_define('MOTIONPLANNER_SCURVE_RAMP_TIME', repr(scurve_ramp_time))
                 
                 event_channel_timer_expr = use_interrupt_timer(gen, board_data, 'EventChannelTimer', user='{}::GetEventChannelTimer<>'.format(aux_control_module_user), clearance=event_channel_timer_clearance)
                 
@@ -1452,6 +1637,8 @@ def generate(config_root_data, cfg_name, main_template):
                     assertions_enabled = development.get_bool('AssertionsEnabled')
                     event_loop_benchmark_enabled = development.get_bool('EventLoopBenchmarkEnabled')
                     detect_overload_enabled = development.get_bool('DetectOverloadEnabled')
+                    step_trace_enabled = development.get_bool('StepTraceEnabled')
+                    planner_benchmark_enabled = development.get_bool('PlannerBenchmarkEnabled')
                     disable_watchdog = development.get_bool('DisableWatchdog')
                     build_with_clang = development.get_bool('BuildWithClang')
                     verbose_build = development.get_bool('VerboseBuild')
@@ -1468,6 +1655,10 @@ def generate(config_root_data, cfg_name, main_template):
                         basic_test_module.set_expr('BasicTestModuleService')
                     elif detect_overload_enabled:
                         development.key_path('DetectOverloadEnabled').error('BasicTestModule is required for overload detection.')
+                    elif step_trace_enabled:
+                        development.key_path('StepTraceEnabled').error('BasicTestModule is required for step tracing.')
+                    elif planner_benchmark_enabled:
+                        development.key_path('PlannerBenchmarkEnabled').error('BasicTestModule is required for planner timing.')
                     
                     if development.get_bool('EnableStubCommandModule'):
                         gen.add_aprinter_include('printer/modules/StubCommandModule.h')
@@ -1536,13 +1727,25 @@ def generate(config_root_data, cfg_name, main_template):
                             fs_config.key_path('MaxFileNameSize').error('Bad value.')
                         
                         num_cache_entries = fs_config.get_int('NumCacheEntries')
-                        if not (1 <= num_cache_entries <= 64):
+                        if not (1 <= num_cache_entries <= 1024):
                             fs_config.key_path('NumCacheEntries').error('Bad value.')
                         
+                        num_io_units = fs_config.get_int('NumIoUnits')
+                        if not (1 <= num_io_units <= num_cache_entries):
+                            fs_config.key_path('NumIoUnits').error('Bad value.')
+                        
                         max_io_blocks = fs_config.get_int('MaxIoBlocks')
                         if not (1 <= max_io_blocks <= num_cache_entries):
                             fs_config.key_path('MaxIoBlocks').error('Bad value.')
                         
+                        num_lookup_cache_entries = fs_config.get_int('NumLookupCacheEntries')
+                        if not (0 <= num_lookup_cache_entries <= 64):
+                            fs_config.key_path('NumLookupCacheEntries').error('Bad value.')
+                        
+                        write_back_delay = fs_config.get_float('WriteBackDelay')
+                        if not (0.0 <= write_back_delay <= 60.0):
+                            fs_config.key_path('WriteBackDelay').error('Bad value.')
+                        
                         gen.add_aprinter_include('printer/input/SdFatInput.h')
                         gen.add_aprinter_include('fs/FatFs.h')
                         
@@ -1577,11 +1780,13 @@ def generate(config_root_data, cfg_name, main_template):
                             TemplateExpr('FatFsService', [
                                 max_filename_size,
                                 num_cache_entries,
-                                1, # NumIoUnits
+                                num_io_units,
                                 max_io_blocks,
                                 fs_config.get_bool_constant('CaseInsensFileName'),
                                 fs_config.get_bool_constant('FsWritable'),
                                 fs_config.get_bool_constant('EnableReadHinting'),
+                                num_lookup_cache_entries,
+                                gen.add_float_constant('FsWriteBackDelay', write_back_delay),
                             ]),
                             fs_config.get_bool_constant('HaveAccessInterface'),
                         ])
@@ -1627,6 +1832,10 @@ def generate(config_root_data, cfg_name, main_template):
                             if not (1 <= console_max_clients <= 20):
                                 tcpconsole_config.key_path('MaxClients').error('Bad value.')
                             
+                            console_queue_size = tcpconsole_config.get_int('QueueSize')
+                            if not (0 <= console_queue_size <= 50):
+                                tcpconsole_config.key_path('QueueSize').error('Bad value.')
+                            
                             console_max_parts = tcpconsole_config.get_int('MaxParts')
                             if not (1 <= console_max_parts <= 64):
                                 tcpconsole_config.key_path('MaxParts').error('Bad value.')
@@ -1645,11 +1854,13 @@ def generate(config_root_data, cfg_name, main_template):
                                 ]),
                                 console_port,
                                 console_max_clients,
+                                console_queue_size,
+                                gen.add_float_constant('TcpConsoleQueueTimeout', tcpconsole_config.get_float('QueueTimeout')),
                                 console_max_command_size,
                                 gen.add_float_constant('TcpConsoleSendBufTimeout', tcpconsole_config.get_float('SendBufTimeout')),
                             ]))
                             
-                            gen.get_singleton_object('network').add_resource_counts(listeners=1, connections=console_max_clients)
+                            gen.get_singleton_object('network').add_resource_counts(listeners=1, connections=console_max_clients, queued_connections=console_queue_size)
                         
                         network_config.do_selection('tcpconsole', tcpconsole_sel)
                         
@@ -1675,6 +1886,22 @@ def generate(config_root_data, cfg_name, main_template):
                             
                             allow_persistent = webif_config.get_bool('AllowPersistent')
                             
+                            max_status_streams = webif_config.get_int('MaxStatusStreams')
+                            if not (0 <= max_status_streams < webif_max_clients):
+                                webif_config.key_path('MaxStatusStreams').error('Bad value (must be less than MaxClients).')
+                            
+                            status_stream_interval = webif_config.get_float('StatusStreamInterval')
+                            if not (0.05 <= status_stream_interval <= 10.0):
+                                webif_config.key_path('StatusStreamInterval').error('Bad value.')
+                            
+                            status_snapshot_size = webif_config.get_int('StatusSnapshotSize')
+                            if not (16 <= status_snapshot_size <= 4096):
+                                webif_config.key_path('StatusSnapshotSize').error('Bad value.')
+                            
+                            num_send_blocks = webif_config.get_int('NumSendBlocks')
+                            if not (0 <= num_send_blocks <= 16):
+                                webif_config.key_path('NumSendBlocks').error('Bad value.')
+                            
                             gen.add_float_constant('WebInterfaceQueueTimeout', webif_config.get_float('QueueTimeout'))
                             gen.add_float_constant('WebInterfaceInactivityTimeout', webif_config.get_float('InactivityTimeout'))
                             
@@ -1715,9 +1942,13 @@ def generate(config_root_data, cfg_name, main_template):
                                 ]),
                                 webif_config.get_int('MaxGcodeCommandSize'),
                                 gen.add_float_constant('WebInterfaceGcodeSendBufTimeout', webif_config.get_float('GcodeSendBufTimeout')),
+                                gen.add_float_constant('WebInterfaceStatusStreamInterval', status_stream_interval),
+                                max_status_streams,
+                                status_snapshot_size,
+                                num_send_blocks,
                             ]))
                             
-                            gen.get_singleton_object('network').add_resource_counts(listeners=1, connections=webif_max_clients, queued_connections=webif_queue_size)
+                            gen.get_singleton_object('network').add_resource_counts(listeners=1, connections=webif_max_clients, queued_connections=webif_queue_size, send_refs=num_send_blocks)
                             
                         network_config.do_selection('webinterface', webif_sel)
                 
@@ -2391,6 +2622,8 @@ def generate(config_root_data, cfg_name, main_template):
         'assertions_enabled': assertions_enabled,
         'event_loop_benchmark_enabled': event_loop_benchmark_enabled,
         'detect_overload_enabled': detect_overload_enabled,
+        'step_trace_enabled': step_trace_enabled,
+        'planner_benchmark_enabled': planner_benchmark_enabled,
         'build_with_clang': build_with_clang,
         'verbose_build': verbose_build,
         'debug_symbols': debug_symbols,
@@ -2407,6 +2640,10 @@ def main():
     parser.add_argument('--config', help='JSON configuration file to use.')
     parser.add_argument('--cfg-name', help='Build this configuration instead of the one specified in the configuration file.')
     parser.add_argument('--output', default='-', help='File to write the output to (C++ code or Nix expression).')
+    parser.add_argument('--linux-host', action='store_true', help='Build the configuration as a Linux program with simulated hardware.')
+    parser.add_argument('--linux-tap', action='store_true', help='With --linux-host, keep the network and use a TAP device for it.')
+    parser.add_argument('--main-output', help='Also write the generated main source file here.')
+    parser.add_argument('--build-info-output', help='Also write the extra sources, include directories and defines (JSON) here.')
     args = parser.parse_args()
     
     # Determine directories.
@@ -2421,15 +2658,35 @@ def main():
     # Read main template file.
     main_template = file_utils.read_file(os.path.join(src_dir, 'main_template.cpp'))
     
+    # Convert the board for running on the host if requested.
+    if args.linux_host:
+        convert_board_for_linux_host(config_data, args.cfg_name, tap_network=args.linux_tap)
+    
     # Call the generate function.
     result = generate(config_data, args.cfg_name, main_template)
     
+    # Write the main source file if requested.
+    if args.main_output is not None:
+        with file_utils.use_output_file(args.main_output) as output_f:
+            output_f.write(result['main_source'])
+    
+    # Write the build information if requested.
+    if args.build_info_output is not None:
+        build_info = {
+            'extra_sources': result['extra_sources'],
+            'extra_includes': result['extra_includes'],
+            'defines': result['defines'],
+        }
+        with file_utils.use_output_file(args.build_info_output) as output_f:
+            json.dump(build_info, output_f, indent=4)
+    
     # Build the Nix expression.
     nix_expr = (
         'with ((import (builtins.toPath {})) {{}}); aprinterFunc {{\n'
         '    boardName = {}; buildName = "aprinter"; desiredOutputs = {}; optimizeForSize = {};\n'
         '    optimizeLibcForSize = {};\n'
         '    assertionsEnabled = {}; eventLoopBenchmarkEnabled = {}; detectOverloadEnabled = {};\n'
+        '    stepTraceEnabled = {}; plannerBenchmarkEnabled = {};\n'
         '    buildWithClang = {}; verboseBuild = {}; debugSymbols = {}; buildVars = {};\n'
         '    extraSources = {}; extraIncludes = {}; defines = {}; linkerSymbols = {};\n'
         '    mainText = {};\n'
@@ -2443,6 +2700,8 @@ def main():
         nix_utils.convert_bool_for_nix(result['assertions_enabled']),
         nix_utils.convert_bool_for_nix(result['event_loop_benchmark_enabled']),
         nix_utils.convert_bool_for_nix(result['detect_overload_enabled']),
+        nix_utils.convert_bool_for_nix(result['step_trace_enabled']),
+        nix_utils.convert_bool_for_nix(result['planner_benchmark_enabled']),
         nix_utils.convert_bool_for_nix(result['build_with_clang']),
         nix_utils.convert_bool_for_nix(result['verbose_build']),
         nix_utils.convert_bool_for_nix(result['debug_symbols']),
@@ -56,6 +56,9 @@ def input_mode_choice(context, **kwargs):
         ce.Compound('Mk20PinInputMode', attrs=[
             ce.String(key='PullMode', title='Pull mode', enum=['Normal', 'Pull-up', 'Pull-down']),
         ]),
+        ce.Compound('LinuxPinInputMode', attrs=[
+            ce.String(key='PullMode', title='Pull mode', enum=['Normal', 'Pull-up']),
+        ]),
     ], **kwargs)
 
 def i2c_choice(**kwargs):
@@ -297,6 +300,26 @@ def platform_Stm32f4():
         ]),
     ])
 
+def platform_Linux():
+    return ce.Compound('Linux', title='Linux (simulation)', attrs=[
+        ce.Compound('LinuxClock', key='clock', title='Clock', collapsable=True, attrs=[
+            ce.Integer(key='TimeFreq', title='Simulated clock frequency [Hz]'),
+            ce.String(key='primary_timer', title='Primary timer'),
+            ce.Constant(key='avail_oc_units', value=[
+                {
+                    'value': 'TC{}{}'.format(i, j)
+                } for i in range(10) for j in ('A', 'B', 'C')
+            ])
+        ]),
+        ce.Compound('LinuxAdc', key='adc', title='ADC', collapsable=True, attrs=[
+            ce.Float(key='Value', title='Simulated value (fraction of reference)', default=0.955),
+        ]),
+        ce.Compound('NullWatchdog', key='watchdog', title='Watchdog', collapsable=True, attrs=[]),
+        ce.Compound('LinuxPins', key='pins', title='Pins', collapsable=True, attrs=[
+            ce.Constant(key='input_mode_type', value='LinuxPinInputMode'),
+        ]),
+    ])
+
 def hard_pwm_choice(**kwargs):
     return ce.OneOf(title='Hard-PWM driver', choices=[
         ce.Compound('AvrClockPwm', ident='id_pwm_output', attrs=[
@@ -311,6 +334,9 @@ def hard_pwm_choice(**kwargs):
             ce.String(key='Signal', title='Connection type (L/H)'),
             ce.Boolean(key='Invert', title='Output logic', false_title='Normal (On=High)', true_title='Inverted (On=Low)'),
         ]),
+        ce.Compound('LinuxPwm', attrs=[
+            pin_choice(key='OutputPin', title='Output pin'),
+        ]),
     ], **kwargs)
 
 def stepper_homing_params(**kwargs):
@@ -694,6 +720,7 @@ def editor():
                     platform_Avr('ATmega2560'),
                     platform_Avr('ATmega1284p'),
                     platform_Stm32f4(),
+                    platform_Linux(),
                 ]),
                 ce.OneOf(key='debug_interface', title='Debug interface', choices=[
                     ce.Compound('NoDebug', title='None or specified elsewhere', attrs=[]),
@@ -753,6 +780,7 @@ def editor():
                         ce.Boolean(key='DoubleSpeed'),
                     ]),
                     ce.Compound('Stm32f4UsbSerial', title='STM32F4 USB', attrs=[]),
+                    ce.Compound('LinuxSerial', title='Linux stdio/pty', attrs=[]),
                     ce.Compound('NullSerial', title='Null serial driver', attrs=[]),
                 ])
             ])),
@@ -765,10 +793,13 @@ def editor():
                             ce.Compound('Fat32', title='FAT32', attrs=[
                                 ce.Integer(key='MaxFileNameSize', title='Maximum filename size', default=32),
                                 ce.Integer(key='NumCacheEntries', title='Block cache size (in blocks)', default=2),
+                                ce.Integer(key='NumIoUnits', title='Maximum concurrent I/O commands', default=1),
                                 ce.Integer(key='MaxIoBlocks', title='Maximum blocks in single I/O command', default=1),
+                                ce.Integer(key='NumLookupCacheEntries', title='Directory lookup cache size (in entries)', default=0),
                                 ce.Boolean(key='CaseInsensFileName', title='Case-insensitive filename matching', default=True),
                                 ce.Boolean(key='FsWritable', title='Writable filesystem', default=False),
                                 ce.Boolean(key='EnableReadHinting', title='Enable read-ahead hinting', default=False),
+                                ce.Float(key='WriteBackDelay', title='Write-back delay for dirty blocks [s] (0=only on flush)', default=0),
                                 ce.Boolean(key='HaveAccessInterface', title='Enable internal FS access interface', default=False),
                                 ce.Boolean(key='EnableFsTest', title='Enable FS test module', default=False),
                                 ce.OneOf(key='GcodeUpload', title='G-code upload', choices=[
@@ -797,6 +828,7 @@ def editor():
                             ce.Compound('SdioSdCard', title='SDIO', attrs=[
                                 sdio_choice(key='SdioService', title='SDIO driver'),
                             ]),
+                            ce.Compound('LinuxSdCard', title='Linux disk image', attrs=[]),
                         ])
                     ])
                 ]),
@@ -810,6 +842,7 @@ def editor():
                                 mii_choice(key='MiiDriver', title='MII driver'),
                                 phy_choice(key='PhyDriver', title='PHY driver')
                             ]),
+                            ce.Compound('LinuxTapEthernet', title='Linux TAP device', attrs=[]),
                         ]),
                         ce.Boolean(key='LwipAssertions', title='Enable lwIP assertions', default=False),
                         ce.Integer(key='TcpRxBuf', title='TCP receive buffer size [bytes] (for each connection!)', default=5840),
@@ -825,6 +858,8 @@ def editor():
                             ce.Compound('TcpConsole', title='Enabled', attrs=[
                                 ce.Integer(key='Port', title='Console port number', default=23),
                                 ce.Integer(key='MaxClients', title='Maximum number of clients', default=2),
+                                ce.Integer(key='QueueSize', title='Maximum number of queued clients', default=1),
+                                ce.Float(key='QueueTimeout', title='Timeout for queued clients [s]', default=10),
                                 ce.Integer(key='MaxParts', title='Max parts in GCode command', default=16),
                                 ce.Integer(key='MaxCommandSize', title='Maximum command size', default=64),
                                 ce.Float(key='SendBufTimeout', title='Timeout when waiting for send buffer space [s]', default=5.0),
@@ -845,6 +880,10 @@ def editor():
                                 ce.Integer(key='MaxGcodeParts', title='Max parts in g-code command', default=16),
                                 ce.Integer(key='MaxGcodeCommandSize', title='Maximum g-code command size', default=128),
                                 ce.Float(key='GcodeSendBufTimeout', title='Timeout when waiting for send buffer space for g-code commands [s]', default=5.0),
+                                ce.Integer(key='MaxStatusStreams', title='Maximum simultaneous status streams (0=disabled, less than MaxClients)', default=1),
+                                ce.Float(key='StatusStreamInterval', title='Minimum interval between status stream updates [s]', default=0.5),
+                                ce.Integer(key='StatusSnapshotSize', title='Size of status snapshot for delta updates [entries]', default=256),
+                                ce.Integer(key='NumSendBlocks', title='Number of SD blocks sent without copying (0 to disable)', default=4),
                             ]),
                         ]),
                     ])
@@ -864,11 +903,15 @@ def editor():
                 ce.Float(key='EventChannelTimerClearance', title='Event channel timer clearance'),
                 ce.Boolean(key='OptimizeForSize', title='Optimize compilation for program size', default=False),
                 ce.Boolean(key='OptimizeLibcForSize', title='Optimize libc for program size (newlib/ARM only)', default=False),
+                ce.Boolean(key='SCurveEnabled', title='Use S-curve (jerk-limited) acceleration', default=False),
+                ce.Float(key='SCurveRampTime', title='S-curve acceleration ramp time [s]', default=0.02),
             ]),
             ce.Compound('development', key='development', title='Development features', collapsable=True, attrs=[
                 ce.Boolean(key='AssertionsEnabled', title='Enable assertions', default=False),
-                ce.Boolean(key='EventLoopBenchmarkEnabled', title='Enable event-loop execution timing', default=False),
+                ce.Boolean(key='EventLoopBenchmarkEnabled', title='Enable event-loop execution timing (M916, M917, M919, M929)', default=False),
                 ce.Boolean(key='DetectOverloadEnabled', title='Enable interrupt overload detection', default=False),
+                ce.Boolean(key='StepTraceEnabled', title='Enable step timing trace (M923, M924)', default=False),
+                ce.Boolean(key='PlannerBenchmarkEnabled', title='Enable motion planner timing (M927, M928)', default=False),
                 ce.Boolean(key='DisableWatchdog', title='Disable the watchdog timer', default=False),
                 ce.Boolean(key='BuildWithClang', title='Build with the Clang compiler', default=False),
                 ce.Boolean(key='VerboseBuild', title='Verbose build output', default=False),
@@ -30,6 +30,8 @@
 , assertionsEnabled ? false
 , eventLoopBenchmarkEnabled ? false
 , detectOverloadEnabled ? false
+, stepTraceEnabled ? false
+, plannerBenchmarkEnabled ? false
 , buildWithClang ? false
 , verboseBuild ? false
 , debugSymbols ? false
@@ -93,6 +95,8 @@ let
         (stdenv.lib.optionalString assertionsEnabled "-DAMBROLIB_ASSERTIONS")
         (stdenv.lib.optionalString eventLoopBenchmarkEnabled "-DEVENTLOOP_BENCHMARK")
         (stdenv.lib.optionalString detectOverloadEnabled "-DAXISDRIVER_DETECT_OVERLOAD")
+        (stdenv.lib.optionalString stepTraceEnabled "-DAXISDRIVER_STEP_TRACE")
+        (stdenv.lib.optionalString plannerBenchmarkEnabled "-DMOTIONPLANNER_BENCHMARK")
     ];
     
     ccxxldFlags = stdenv.lib.concatStringsSep " " [
@@ -135,4 +135,9 @@ rec {
             USB_MODE = "FS";
         };
     };    
+    
+    linux = {
+        platform = "linux";
+        targetVars = {};
+    };
 }
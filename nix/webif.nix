@@ -70,6 +70,28 @@ stdenv.mkDerivation {
             ${aprinterSource}/webif/reprap.tsx \
             --outDir $out \
             || [[ $? = 2 ]]
+        
+        # Precompress the text assets. The firmware serves file.gz instead of
+        # file to clients which accept gzip; the originals stay for the others.
+        find $out -type f \( -name '*.htm' -o -name '*.css' -o -name '*.js' \) | while read -r file; do
+            gzip -9 -n -c "$file" > "$file.gz"
+            if [[ $(stat -c %s "$file.gz") -ge $(stat -c %s "$file") ]]; then
+                rm "$file.gz"
+            fi
+        done
+        
+        # List all files with their sizes and hashes, for checking an SD card.
+        (
+            cd $out
+            echo '{"files": ['
+            find . -type f | sed 's|^\./||' | LC_ALL=C sort | while read -r file; do
+                size=$(stat -c %s "$file")
+                hash=$(sha256sum "$file" | cut -d ' ' -f 1)
+                echo "  {\"path\": \"$file\", \"size\": $size, \"sha256\": \"$hash\"}"
+            done | sed '$!s/$/,/'
+            echo ']}'
+        ) > manifest.json
+        mv manifest.json $out/
     '';
 }
 
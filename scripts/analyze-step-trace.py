@@ -0,0 +1,164 @@
+# Copyright (c) 2016 Ambroz Bizjak
+# All rights reserved.
+# 
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+# 
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+# DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Analyzes a step timing trace dumped by the M923 command (firmware built
+# with AXISDRIVER_STEP_TRACE). Reads the command output from a file or
+# from standard input and reports, for each axis, the distribution of step
+# lateness (actual step time minus scheduled step time), the number of
+# steps where overload detection tripped, and a histogram of step rates.
+
+from __future__ import print_function
+import sys
+import argparse
+import re
+
+HEADER_RE = re.compile(r'\AStepTrace Freq:([0-9]+) TimeBits:([0-9]+)\Z')
+ENTRY_RE = re.compile(r'\AST A:([0-9]+) N:([0-9]+) S:([0-9]+) T:([0-9]+) F:([0-9]+)\Z')
+
+FLAG_COMMAND_START = 1 << 0
+FLAG_OVERLOAD = 1 << 1
+
+PERCENTILES = [50.0, 90.0, 99.0, 99.9]
+
+class TraceFormatError (Exception):
+    pass
+
+class AxisTrace (object):
+    def __init__ (self, axis):
+        self.axis = axis
+        self.entries = []
+
+def parse_trace (lines):
+    freq = None
+    time_bits = None
+    axes = {}
+    for line_num, line in enumerate(lines, 1):
+        line = line.strip()
+        match = HEADER_RE.match(line)
+        if match:
+            if freq is not None:
+                raise TraceFormatError('line {}: duplicate trace header'.format(line_num))
+            freq = int(match.group(1))
+            time_bits = int(match.group(2))
+            continue
+        match = ENTRY_RE.match(line)
+        if match:
+            if freq is None:
+                raise TraceFormatError('line {}: trace entry before header'.format(line_num))
+            axis, seq, sched, actual, flags = [int(x) for x in match.groups()]
+            axes.setdefault(axis, AxisTrace(axis)).entries.append((seq, sched, actual, flags))
+    if freq is None:
+        raise TraceFormatError('no trace header found')
+    return freq, time_bits, [axes[axis] for axis in sorted(axes)]
+
+def time_diff (a, b, time_bits):
+    mod = 1 << time_bits
+    diff = (a - b) % mod
+    if diff >= mod // 2:
+        diff -= mod
+    return diff
+
+def percentile (sorted_values, pct):
+    index = int(round((pct / 100.0) * (len(sorted_values) - 1)))
+    return sorted_values[index]
+
+def rate_histogram (rates, num_buckets):
+    # Logarithmic buckets (powers of two in steps per second).
+    buckets = {}
+    for rate in rates:
+        bucket = 0
+        while (1 << (bucket + 1)) <= rate:
+            bucket += 1
+        buckets[bucket] = buckets.get(bucket, 0) + 1
+    return sorted(buckets.items())[-num_buckets:]
+
+def analyze_axis (trace, freq, time_bits, args, out):
+    entries = trace.entries
+    us_per_tick = 1e6 / freq
+    
+    lateness = sorted(time_diff(actual, sched, time_bits) for (_, sched, actual, _) in entries)
+    overloads = sum(1 for entry in entries if entry[3] & FLAG_OVERLOAD)
+    command_starts = sum(1 for entry in entries if entry[3] & FLAG_COMMAND_START)
+    
+    print('Axis {}: {} steps, {} command starts, {} overloads'.format(
+        trace.axis, len(entries), command_starts, overloads), file=out)
+    
+    if len(entries) == 0:
+        return
+    
+    print('  lateness (us): min {:.2f}'.format(lateness[0] * us_per_tick), end='', file=out)
+    for pct in PERCENTILES:
+        print(', p{:g} {:.2f}'.format(pct, percentile(lateness, pct) * us_per_tick), end='', file=out)
+    print(', max {:.2f}'.format(lateness[-1] * us_per_tick), file=out)
+    
+    late_threshold = args.late_threshold * 1e-6 * freq
+    num_late = sum(1 for x in lateness if x >= late_threshold)
+    print('  steps later than {:g} us: {}'.format(args.late_threshold, num_late), file=out)
+    
+    # Step rates are derived from the scheduled times of consecutive steps,
+    # skipping gaps where entries were lost or a new move started.
+    rates = []
+    for prev, cur in zip(entries, entries[1:]):
+        if cur[0] != prev[0] + 1 or (cur[3] & FLAG_COMMAND_START):
+            continue
+        interval = time_diff(cur[1], prev[1], time_bits)
+        if interval > 0:
+            rates.append(freq / float(interval))
+    
+    if len(rates) > 0:
+        print('  step rate histogram (steps/s):', file=out)
+        for bucket, count in rate_histogram(rates, args.buckets):
+            print('    {:>8}-{:<8} {}'.format(1 << bucket, (1 << (bucket + 1)) - 1, count), file=out)
+
+def main ():
+    parser = argparse.ArgumentParser(description='Analyze an APrinter step timing trace (M923 output).')
+    parser.add_argument('trace', nargs='?', help='File with the M923 output (default: standard input).')
+    parser.add_argument('--late-threshold', type=float, default=1000.0, help='Lateness in microseconds counted as a late step (default matches overload detection).')
+    parser.add_argument('--buckets', type=int, default=16, help='Maximum number of step rate histogram buckets.')
+    args = parser.parse_args()
+    
+    if args.trace is None:
+        lines = sys.stdin.readlines()
+    else:
+        with open(args.trace, 'r') as f:
+            lines = f.readlines()
+    
+    try:
+        freq, time_bits, traces = parse_trace(lines)
+    except TraceFormatError as e:
+        print('Error: {}'.format(e), file=sys.stderr)
+        return 1
+    
+    print('Clock frequency: {} Hz, time bits: {}'.format(freq, time_bits))
+    
+    all_lateness = []
+    for trace in traces:
+        analyze_axis(trace, freq, time_bits, args, sys.stdout)
+        all_lateness.extend(time_diff(actual, sched, time_bits) for (_, sched, actual, _) in trace.entries)
+    
+    if len(all_lateness) > 0:
+        print('Max interrupt latency over all axes: {:.2f} us'.format(max(all_lateness) * 1e6 / freq))
+    
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
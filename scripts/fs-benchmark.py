@@ -0,0 +1,417 @@
+# Copyright (c) 2016 Ambroz Bizjak
+# All rights reserved.
+# 
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+# 
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+# DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Host benchmark of the SD card filesystem stack (FatFs, BlockCache and
+# BlockAccess). For each requested combination of NumCacheEntries, NumIoUnits
+# and MaxIoBlocks, builds the selected configuration as a Linux host program
+# (generate.py --linux-host) with the SD card backed by a FAT32 disk image
+# (LinuxSdCard) and the FS test module enabled, then measures:
+#   seqread - reading a large file sequentially (M936),
+#   dirlist - listing a directory with many entries (M20),
+#   upload  - writing a large file and flushing it (M935 followed by M22).
+#
+# The image is generated by this script, or can be given with --image. It is
+# used as a RAM disk, so it is never modified. The simulated device latency is
+# set with --cmd-latency and --block-latency. Besides the throughput, the
+# number of device commands and blocks transferred is reported.
+
+from __future__ import print_function
+import sys
+import os
+import argparse
+import copy
+import json
+import re
+import shutil
+import struct
+import subprocess
+import tempfile
+import time
+
+SRC_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+
+STATS_RE = re.compile(r'LinuxSdCard: commands=([0-9]+) read_blocks=([0-9]+) write_blocks=([0-9]+)')
+
+CXXFLAGS = [
+    '-std=c++14', '-O2', '-fno-math-errno', '-fno-trapping-math',
+    '-fno-access-control', '-ftemplate-depth=1024',
+    '-D__STDC_LIMIT_MACROS', '-D__STDC_FORMAT_MACROS', '-D__STDC_CONSTANT_MACROS',
+]
+
+BLOCK_SIZE = 512
+
+SEQ_FILE = 'SEQ.G'
+LIST_DIR = 'LIST'
+UPLOAD_FILE = 'UPLOAD.G'
+
+class Fat32Image (object):
+    # Minimal FAT32 image writer: one partition, files allocated contiguously,
+    # 8.3 names only. Good enough to produce benchmark data for FatFs.
+    
+    def __init__ (self, size_mb, sectors_per_cluster):
+        self.spc = sectors_per_cluster
+        self.cluster_size = self.spc * BLOCK_SIZE
+        self.part_start = 2048
+        total_sectors = size_mb * 2048
+        self.part_sectors = total_sectors - self.part_start
+        self.reserved = 32
+        self.num_fats = 2
+        self.fat_sectors = ((self.part_sectors // self.spc) * 4 + BLOCK_SIZE - 1) // BLOCK_SIZE
+        self.data_start = self.reserved + self.num_fats * self.fat_sectors
+        self.num_clusters = (self.part_sectors - self.data_start) // self.spc
+        if self.num_clusters < 65525:
+            raise Exception('Image too small for FAT32 with this cluster size.')
+        self.data = bytearray(total_sectors * BLOCK_SIZE)
+        self.fat = [0] * (self.num_clusters + 2)
+        self.fat[0] = 0x0FFFFFF8
+        self.fat[1] = 0x0FFFFFFF
+        self.next_cluster = 2
+        # Directory contents by path. Entries are packed file entries or
+        # (name, path) tuples for subdirectories, which get their clusters
+        # when the image is saved.
+        self.dirs = {'': []}
+    
+    def sector_offset (self, sector):
+        return (self.part_start + sector) * BLOCK_SIZE
+    
+    def cluster_offset (self, cluster):
+        return self.sector_offset(self.data_start + (cluster - 2) * self.spc)
+    
+    def alloc_chain (self, num_clusters):
+        clusters = list(range(self.next_cluster, self.next_cluster + num_clusters))
+        self.next_cluster += num_clusters
+        if self.next_cluster > self.num_clusters + 2:
+            raise Exception('Image is full.')
+        for (i, cluster) in enumerate(clusters):
+            self.fat[cluster] = clusters[i + 1] if i + 1 < len(clusters) else 0x0FFFFFFF
+        return clusters
+    
+    @staticmethod
+    def short_name (name):
+        (base, ext) = name.rsplit('.', 1) if '.' in name else (name, '')
+        if not (1 <= len(base) <= 8 and len(ext) <= 3):
+            raise Exception('Not an 8.3 name: {}'.format(name))
+        return (base.upper().ljust(8) + ext.upper().ljust(3)).encode('ascii')
+    
+    @staticmethod
+    def dir_entry (name, attr, first_cluster, size):
+        entry = bytearray(32)
+        entry[0:11] = Fat32Image.short_name(name)
+        entry[11] = attr
+        struct.pack_into('<H', entry, 20, first_cluster >> 16)
+        struct.pack_into('<HI', entry, 26, first_cluster & 0xFFFF, size)
+        return entry
+    
+    def add_file (self, dir_path, name, content):
+        first_cluster = 0
+        if len(content) > 0:
+            clusters = self.alloc_chain((len(content) + self.cluster_size - 1) // self.cluster_size)
+            first_cluster = clusters[0]
+            offset = self.cluster_offset(first_cluster)
+            self.data[offset:offset + len(content)] = content
+        self.dirs[dir_path].append(self.dir_entry(name, 0x20, first_cluster, len(content)))
+    
+    def add_dir (self, dir_path, name):
+        path = name if dir_path == '' else dir_path + '/' + name
+        self.dirs[path] = []
+        self.dirs[dir_path].append((name, path))
+    
+    def write_dir (self, path, parent_cluster):
+        entries = self.dirs[path]
+        num_entries = len(entries) + (0 if path == '' else 2)
+        clusters = self.alloc_chain(max(1, (num_entries * 32 + self.cluster_size - 1) // self.cluster_size))
+        raw = []
+        if path != '':
+            dot = self.dir_entry('X', 0x10, clusters[0], 0)
+            dot[0:11] = b'.          '
+            dotdot = self.dir_entry('X', 0x10, parent_cluster, 0)
+            dotdot[0:11] = b'..         '
+            raw += [dot, dotdot]
+        for entry in entries:
+            if isinstance(entry, tuple):
+                (name, sub_path) = entry
+                sub_cluster = self.write_dir(sub_path, 0 if path == '' else clusters[0])
+                raw.append(self.dir_entry(name, 0x10, sub_cluster, 0))
+            else:
+                raw.append(entry)
+        per_cluster = self.cluster_size // 32
+        for (i, entry) in enumerate(raw):
+            offset = self.cluster_offset(clusters[i // per_cluster]) + (i % per_cluster) * 32
+            self.data[offset:offset + 32] = entry
+        return clusters[0]
+    
+    def save (self, file_name):
+        root_cluster = self.write_dir('', 0)
+        
+        mbr = bytearray(BLOCK_SIZE)
+        mbr[446:462] = struct.pack('<B3sB3sII', 0x00, b'\0\0\0', 0x0C, b'\0\0\0', self.part_start, self.part_sectors)
+        mbr[510:512] = b'\x55\xAA'
+        self.data[0:BLOCK_SIZE] = mbr
+        
+        vbr = bytearray(BLOCK_SIZE)
+        vbr[0:3] = b'\xEB\x58\x90'
+        vbr[3:11] = b'MSWIN4.1'
+        struct.pack_into('<HBHBHHBHHHII', vbr, 11, BLOCK_SIZE, self.spc, self.reserved, self.num_fats, 0, 0, 0xF8, 0, 63, 255, self.part_start, self.part_sectors)
+        struct.pack_into('<IHHIHH', vbr, 36, self.fat_sectors, 0, 0, root_cluster, 1, 6)
+        vbr[64] = 0x80
+        vbr[66] = 0x29
+        struct.pack_into('<I', vbr, 67, 0x12345678)
+        vbr[71:82] = b'NO NAME    '
+        vbr[82:90] = b'FAT32   '
+        vbr[510:512] = b'\x55\xAA'
+        self.data[self.sector_offset(0):self.sector_offset(1)] = vbr
+        self.data[self.sector_offset(6):self.sector_offset(7)] = vbr
+        
+        fsinfo = bytearray(BLOCK_SIZE)
+        struct.pack_into('<I', fsinfo, 0, 0x41615252)
+        struct.pack_into('<III', fsinfo, 484, 0x61417272, 0xFFFFFFFF, 0xFFFFFFFF)
+        struct.pack_into('<I', fsinfo, 508, 0xAA550000)
+        self.data[self.sector_offset(1):self.sector_offset(2)] = fsinfo
+        
+        fat_data = struct.pack('<{}I'.format(len(self.fat)), *self.fat)
+        for i in range(self.num_fats):
+            offset = self.sector_offset(self.reserved + i * self.fat_sectors)
+            self.data[offset:offset + len(fat_data)] = fat_data
+        
+        with open(file_name, 'wb') as f:
+            f.write(self.data)
+
+def make_gcode (size):
+    lines = []
+    total = 0
+    i = 0
+    while total < size:
+        line = 'G1 X{:.3f} Y{:.3f} E{:.5f}\n'.format(100.0 + (i % 400) * 0.1, 100.0 + (i // 400) * 0.1, i * 0.02)
+        lines.append(line)
+        total += len(line)
+        i += 1
+    return ''.join(lines).encode('ascii')[:size]
+
+def make_image (args, file_name):
+    image = Fat32Image(args.image_size, args.cluster_sectors)
+    image.add_file('', SEQ_FILE, make_gcode(args.seq_size * 1024))
+    image.add_dir('', LIST_DIR)
+    for i in range(args.dir_files):
+        image.add_file(LIST_DIR, 'F{:05d}.G'.format(i), b'G28\n')
+    image.save(file_name)
+
+def find_config (config_data, cfg_name):
+    if cfg_name is None:
+        cfg_name = config_data['selected_config']
+    configs = [cfg for cfg in config_data['configurations'] if cfg['name'] == cfg_name]
+    if len(configs) != 1:
+        raise Exception('Configuration {} not found.'.format(cfg_name))
+    boards = [board for board in config_data['boards'] if board['name'] == configs[0]['board']]
+    if len(boards) != 1:
+        raise Exception('Board {} not found.'.format(configs[0]['board']))
+    return cfg_name, configs[0], boards[0]
+
+def build_variant (args, config_data, cfg_name, num_cache_entries, num_io_units, max_io_blocks, work_dir):
+    variant_data = copy.deepcopy(config_data)
+    (_, _, variant_board) = find_config(variant_data, cfg_name)
+    sdcard = variant_board['sdcard_config']['sdcard']
+    if sdcard['_compoundName'] != 'SdCard' or sdcard['FsType']['_compoundName'] != 'Fat32':
+        raise Exception('The board of this configuration has no FAT32 SD card.')
+    fs_config = sdcard['FsType']
+    fs_config['NumCacheEntries'] = num_cache_entries
+    fs_config['NumIoUnits'] = num_io_units
+    fs_config['MaxIoBlocks'] = max_io_blocks
+    fs_config['FsWritable'] = True
+    fs_config['HaveAccessInterface'] = True
+    fs_config['EnableFsTest'] = True
+    if args.read_hinting is not None:
+        fs_config['EnableReadHinting'] = bool(args.read_hinting)
+    
+    name = 'C{}_U{}_B{}'.format(num_cache_entries, num_io_units, max_io_blocks)
+    config_file = os.path.join(work_dir, name + '.json')
+    main_file = os.path.join(work_dir, name + '.cpp')
+    exe_file = os.path.join(work_dir, name)
+    
+    with open(config_file, 'w') as f:
+        json.dump(variant_data, f)
+    
+    subprocess.check_call([args.python, '-B', os.path.join(SRC_DIR, 'config_system', 'generator', 'generate.py'),
+        '--config', config_file, '--cfg-name', cfg_name, '--linux-host',
+        '--main-output', main_file, '--output', os.devnull])
+    
+    subprocess.check_call([args.cxx] + CXXFLAGS + ['-I', SRC_DIR, '-x', 'c++', main_file,
+        os.path.join(SRC_DIR, 'aprinter', 'platform', 'linux', 'linux_support.cpp'),
+        '-o', exe_file, '-lm'])
+    
+    return exe_file
+
+class Firmware (object):
+    def __init__ (self, args, exe_file, image_file, stats_file):
+        env = dict(os.environ)
+        env['APRINTER_LINUX_SPEEDUP'] = '1'
+        env['APRINTER_LINUX_SD_IMAGE'] = image_file
+        env['APRINTER_LINUX_SD_RAMDISK'] = '1'
+        env['APRINTER_LINUX_SD_STATS'] = '1'
+        env['APRINTER_LINUX_SD_CMD_LATENCY'] = str(args.cmd_latency)
+        env['APRINTER_LINUX_SD_BLOCK_LATENCY'] = str(args.block_latency)
+        env.pop('APRINTER_LINUX_SERIAL_PTY', None)
+        self.stats_file = stats_file
+        self.mounted = False
+        with open(stats_file, 'w') as stderr:
+            self.proc = subprocess.Popen([exe_file], stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=stderr, env=env, universal_newlines=True)
+    
+    def command (self, line):
+        # Send a command and wait for its "ok". Returns the other reply lines.
+        self.proc.stdin.write(line + '\n')
+        self.mounted = line.startswith('M21') or (self.mounted and not line.startswith('M22'))
+        self.proc.stdin.flush()
+        reply = []
+        for reply_line in iter(self.proc.stdout.readline, ''):
+            reply_line = reply_line.rstrip('\r\n')
+            if reply_line.startswith('Error:') or reply_line.startswith('//Error:'):
+                raise Exception('{} failed: {}'.format(line, reply_line))
+            if reply_line == 'ok':
+                return reply
+            reply.append(reply_line)
+        raise Exception('Program exited during {}.'.format(line))
+    
+    def finish (self):
+        # Unmount, so that the device statistics are printed.
+        if self.mounted:
+            self.command('M22')
+        self.proc.kill()
+        self.proc.wait()
+        with open(self.stats_file, 'r') as f:
+            matches = STATS_RE.findall(f.read())
+        if len(matches) == 0:
+            raise Exception('Device statistics not found.')
+        return [int(x) for x in matches[-1]]
+
+def run_seqread (fw, args):
+    fw.command('M21')
+    start_time = time.time()
+    fw.command('M936 F{}'.format(SEQ_FILE))
+    elapsed = time.time() - start_time
+    return (elapsed, args.seq_size * 1024, 'bytes')
+
+def run_dirlist (fw, args):
+    fw.command('M21')
+    start_time = time.time()
+    reply = fw.command('M20 D{}'.format(LIST_DIR))
+    elapsed = time.time() - start_time
+    num_entries = len([line for line in reply if line.startswith('f ')])
+    if num_entries != args.dir_files:
+        raise Exception('Listed {} files, expected {}.'.format(num_entries, args.dir_files))
+    return (elapsed, num_entries, 'entries')
+
+def run_upload (fw, args):
+    fw.command('M21 W')
+    start_time = time.time()
+    fw.command('M935 F{} S{}'.format(UPLOAD_FILE, args.upload_size * 1024))
+    fw.command('M22')
+    elapsed = time.time() - start_time
+    return (elapsed, args.upload_size * 1024, 'bytes')
+
+WORKLOADS = [
+    ('seqread', run_seqread),
+    ('dirlist', run_dirlist),
+    ('upload', run_upload),
+]
+
+def report (name, workload, elapsed, amount, unit, stats):
+    (commands, read_blocks, write_blocks) = stats
+    if unit == 'bytes':
+        rate = '{:>8.3f} MB/s'.format(amount / elapsed / 1e6)
+    else:
+        rate = '{:>8.0f} {}/s'.format(amount / elapsed, unit)
+    print('{:<12} {:<8} {}  time {:>7.3f}s  commands {:>6}  read blocks {:>7}  write blocks {:>7}  blocks/command {:>5.1f}'.format(
+        name, workload, rate, elapsed, commands, read_blocks, write_blocks,
+        (read_blocks + write_blocks) / float(max(1, commands))))
+    sys.stdout.flush()
+
+def parse_int_list (text):
+    return [int(x) for x in text.split(',') if x != '']
+
+def main ():
+    parser = argparse.ArgumentParser(description='Benchmark the SD card filesystem stack on the host.')
+    parser.add_argument('--config', default=os.path.join(SRC_DIR, 'config_system', 'gui', 'default_config.json'), help='JSON configuration file.')
+    parser.add_argument('--cfg-name', help='Configuration to benchmark (default: the selected one).')
+    parser.add_argument('--cache-entries', type=parse_int_list, default=[8, 32], help='Comma-separated NumCacheEntries values.')
+    parser.add_argument('--io-units', type=parse_int_list, default=[1, 2], help='Comma-separated NumIoUnits values.')
+    parser.add_argument('--max-io-blocks', type=parse_int_list, default=[1, 8], help='Comma-separated MaxIoBlocks values.')
+    parser.add_argument('--read-hinting', type=int, choices=[0, 1], help='Set EnableReadHinting (default: as configured).')
+    parser.add_argument('--workload', action='append', choices=[w[0] for w in WORKLOADS], help='Workload to run (default: all).')
+    parser.add_argument('--image', help='Use this FAT32 image instead of generating one. It needs the files which the workloads use.')
+    parser.add_argument('--image-size', type=int, default=272, help='Size of the generated image in MiB.')
+    parser.add_argument('--cluster-sectors', type=int, default=8, help='Sectors per cluster of the generated image.')
+    parser.add_argument('--seq-size', type=int, default=4096, help='Size of the file read by seqread in KiB.')
+    parser.add_argument('--dir-files', type=int, default=500, help='Number of files in the directory listed by dirlist.')
+    parser.add_argument('--upload-size', type=int, default=1024, help='Size of the file written by upload in KiB.')
+    parser.add_argument('--cmd-latency', type=float, default=500.0, help='Simulated latency of each device command in microseconds.')
+    parser.add_argument('--block-latency', type=float, default=100.0, help='Simulated transfer time of each block in microseconds.')
+    parser.add_argument('--python', default='python', help='Python interpreter for the generator.')
+    parser.add_argument('--cxx', default=os.environ.get('HOST_CXX', 'g++'), help='Host C++ compiler.')
+    parser.add_argument('--keep', action='store_true', help='Keep the build directory.')
+    args = parser.parse_args()
+    
+    with open(args.config, 'r') as f:
+        config_data = json.load(f)
+    
+    (cfg_name, _, _) = find_config(config_data, args.cfg_name)
+    
+    selected = args.workload if args.workload is not None else [w[0] for w in WORKLOADS]
+    workloads = [w for w in WORKLOADS if w[0] in selected]
+    
+    variants = []
+    for num_cache_entries in args.cache_entries:
+        for num_io_units in args.io_units:
+            for max_io_blocks in args.max_io_blocks:
+                if not (1 <= num_io_units <= num_cache_entries and 1 <= max_io_blocks <= num_cache_entries):
+                    print('Skipping NumCacheEntries={} NumIoUnits={} MaxIoBlocks={} (invalid)'.format(num_cache_entries, num_io_units, max_io_blocks), file=sys.stderr)
+                    continue
+                variants.append((num_cache_entries, num_io_units, max_io_blocks))
+    
+    work_dir = tempfile.mkdtemp(prefix='aprinter-fs-bench-')
+    try:
+        image_file = args.image
+        if image_file is None:
+            image_file = os.path.join(work_dir, 'image.img')
+            make_image(args, image_file)
+        
+        for (num_cache_entries, num_io_units, max_io_blocks) in variants:
+            name = 'C{}/U{}/B{}'.format(num_cache_entries, num_io_units, max_io_blocks)
+            exe_file = build_variant(args, config_data, cfg_name, num_cache_entries, num_io_units, max_io_blocks, work_dir)
+            for (workload, run_func) in workloads:
+                fw = Firmware(args, exe_file, image_file, os.path.join(work_dir, 'stderr.txt'))
+                try:
+                    (elapsed, amount, unit) = run_func(fw, args)
+                    stats = fw.finish()
+                finally:
+                    if fw.proc.poll() is None:
+                        fw.proc.kill()
+                        fw.proc.wait()
+                report(name, workload, elapsed, amount, unit, stats)
+    finally:
+        if args.keep:
+            print('Build directory: {}'.format(work_dir), file=sys.stderr)
+        else:
+            shutil.rmtree(work_dir)
+    
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,283 @@
+# Copyright (c) 2016 Ambroz Bizjak
+# All rights reserved.
+# 
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+# 
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+# DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Throughput benchmark for the MotionPlanner lookahead. For each requested
+# combination of LookaheadBufferSize and LookaheadCommitCount, builds the
+# selected configuration as a Linux host program (generate.py --linux-host)
+# with MOTIONPLANNER_BENCHMARK, feeds it G-code move streams and collects
+# the planner statistics printed by M927.
+#
+# The built-in workloads are synthetic approximations of typical jobs:
+#   curved - dense short segments along circles and spirals (curved surfaces),
+#   tiny   - very short segments with small direction changes (STL exports),
+#   travel - long moves across the bed at high speed.
+# Recorded G-code can be benchmarked as well using --gcode.
+
+from __future__ import print_function
+import sys
+import os
+import argparse
+import copy
+import json
+import math
+import random
+import re
+import shutil
+import subprocess
+import tempfile
+import threading
+import time
+
+SRC_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+
+BENCH_RE = re.compile(r'PlannerBench Freq:([0-9]+) Lookahead:([0-9]+) Commit:([0-9]+) Plans:([0-9]+) Pushed:([0-9]+) Committed:([0-9]+) AvgTime:([0-9.eE+-]+) MaxTime:([0-9]+)')
+
+CXXFLAGS = [
+    '-std=c++14', '-O2', '-fno-math-errno', '-fno-trapping-math',
+    '-fno-access-control', '-ftemplate-depth=1024',
+    '-D__STDC_LIMIT_MACROS', '-D__STDC_FORMAT_MACROS', '-D__STDC_CONSTANT_MACROS',
+    '-DMOTIONPLANNER_BENCHMARK',
+]
+
+def find_config (config_data, cfg_name):
+    if cfg_name is None:
+        cfg_name = config_data['selected_config']
+    configs = [cfg for cfg in config_data['configurations'] if cfg['name'] == cfg_name]
+    if len(configs) != 1:
+        raise Exception('Configuration {} not found.'.format(cfg_name))
+    boards = [board for board in config_data['boards'] if board['name'] == configs[0]['board']]
+    if len(boards) != 1:
+        raise Exception('Board {} not found.'.format(configs[0]['board']))
+    return cfg_name, configs[0], boards[0]
+
+def get_work_area (config):
+    # Center and radius of a circle which fits inside the XY work area.
+    if config['transform']['_compoundName'] != 'NoTransform':
+        return (0.0, 0.0, 30.0, 5.0)
+    limits = dict((stepper['Name'], (stepper['MinPos'], stepper['MaxPos'])) for stepper in config['steppers'])
+    (x_min, x_max) = limits['X']
+    (y_min, y_max) = limits['Y']
+    (z_min, z_max) = limits['Z']
+    radius = min(30.0, 0.4 * min(x_max - x_min, y_max - y_min))
+    return ((x_min + x_max) / 2.0, (y_min + y_max) / 2.0, radius, z_min + 0.3 * (z_max - z_min))
+
+def gen_curved (area, rnd):
+    (cx, cy, radius, z0) = area
+    lines = []
+    e = 0.0
+    for layer in range(5):
+        z = z0 + 0.2 * layer
+        lines.append('G1 Z{:.3f} F1200'.format(z))
+        for ring in range(5):
+            r = radius * (1.0 - 0.15 * ring) * (1.0 + 0.05 * math.sin(layer * 0.7))
+            num_segs = max(8, int(2.0 * math.pi * r / 0.3))
+            for i in range(num_segs + 1):
+                a = 2.0 * math.pi * i / num_segs
+                e += 0.01
+                lines.append('G1 X{:.3f} Y{:.3f} E{:.4f} F3000'.format(cx + r * math.cos(a), cy + r * math.sin(a), e))
+    return lines
+
+def gen_tiny (area, rnd):
+    (cx, cy, radius, z0) = area
+    lines = ['G1 Z{:.3f} F1200'.format(z0)]
+    x = cx
+    y = cy
+    heading = 0.0
+    e = 0.0
+    for i in range(10000):
+        heading += rnd.uniform(-0.3, 0.3)
+        step = rnd.uniform(0.02, 0.08)
+        nx = x + step * math.cos(heading)
+        ny = y + step * math.sin(heading)
+        if math.hypot(nx - cx, ny - cy) > radius:
+            heading += math.pi
+            continue
+        x = nx
+        y = ny
+        e += 0.002
+        lines.append('G1 X{:.4f} Y{:.4f} E{:.4f} F2400'.format(x, y, e))
+    return lines
+
+def gen_travel (area, rnd):
+    (cx, cy, radius, z0) = area
+    lines = ['G1 Z{:.3f} F1200'.format(z0)]
+    for i in range(100):
+        a = rnd.uniform(0.0, 2.0 * math.pi)
+        r = rnd.uniform(0.5, 1.0) * radius
+        lines.append('G0 X{:.3f} Y{:.3f} F12000'.format(cx + r * math.cos(a), cy + r * math.sin(a)))
+    return lines
+
+WORKLOADS = {
+    'curved': gen_curved,
+    'tiny': gen_tiny,
+    'travel': gen_travel,
+}
+
+def build_variant (args, config_data, cfg_name, lookahead, commit, work_dir):
+    variant_data = copy.deepcopy(config_data)
+    (_, _, variant_board) = find_config(variant_data, cfg_name)
+    variant_board['performance']['LookaheadBufferSize'] = lookahead
+    variant_board['performance']['LookaheadCommitCount'] = commit
+    variant_board['development']['PlannerBenchmarkEnabled'] = True
+    
+    name = 'L{}_C{}'.format(lookahead, commit)
+    config_file = os.path.join(work_dir, name + '.json')
+    main_file = os.path.join(work_dir, name + '.cpp')
+    exe_file = os.path.join(work_dir, name)
+    
+    with open(config_file, 'w') as f:
+        json.dump(variant_data, f)
+    
+    subprocess.check_call([args.python, '-B', os.path.join(SRC_DIR, 'config_system', 'generator', 'generate.py'),
+        '--config', config_file, '--cfg-name', cfg_name, '--linux-host',
+        '--main-output', main_file, '--output', os.devnull])
+    
+    subprocess.check_call([args.cxx] + CXXFLAGS + ['-I', SRC_DIR, '-x', 'c++', main_file,
+        os.path.join(SRC_DIR, 'aprinter', 'platform', 'linux', 'linux_support.cpp'),
+        '-o', exe_file, '-lm'])
+    
+    return exe_file
+
+def run_workload (args, exe_file, gcode_lines):
+    env = dict(os.environ)
+    env['APRINTER_LINUX_SPEEDUP'] = str(args.speedup)
+    env.pop('APRINTER_LINUX_SERIAL_PTY', None)
+    
+    proc = subprocess.Popen([exe_file], stdin=subprocess.PIPE, stdout=subprocess.PIPE, env=env, universal_newlines=True)
+    
+    def writer ():
+        try:
+            # Allow extrusion moves since the heaters are not simulated.
+            proc.stdin.write('M302 P1\nM928\n')
+            for line in gcode_lines:
+                proc.stdin.write(line + '\n')
+            proc.stdin.write('M400\nM927\n')
+            proc.stdin.flush()
+        except (IOError, OSError):
+            pass
+    
+    start_time = time.time()
+    writer_thread = threading.Thread(target=writer)
+    writer_thread.daemon = True
+    writer_thread.start()
+    
+    result = None
+    num_errors = 0
+    try:
+        for line in iter(proc.stdout.readline, ''):
+            if line.startswith('Error:'):
+                num_errors += 1
+            match = BENCH_RE.search(line)
+            if match:
+                result = [float(x) for x in match.groups()]
+                break
+    finally:
+        wall_time = time.time() - start_time
+        proc.kill()
+        proc.wait()
+    
+    if result is None:
+        raise Exception('Benchmark output not found (program exited early).')
+    if num_errors > 0:
+        print('Warning: {} commands failed, results may be misleading.'.format(num_errors), file=sys.stderr)
+    
+    return result, wall_time
+
+def report (args, name, workload, result, wall_time):
+    (freq, lookahead, commit, plans, pushed, committed, avg_plan_time, max_plan_time) = result
+    (lookahead, commit, plans, committed) = (int(lookahead), int(commit), int(plans), int(committed))
+    # Convert simulated time units to real nanoseconds.
+    ns_per_tick = 1e9 / (freq * args.speedup)
+    plan_ns = avg_plan_time * plans * ns_per_tick
+    print('{:<8} {:<10} plans {:>7}  committed {:>8}  pushed/plan {:>6.1f}  ns/plan {:>9.0f}  max ns/plan {:>9.0f}  ns/segment {:>7.0f}  planner segments/s {:>10.0f}  wall {:>6.1f}s'.format(
+        name, workload, plans, committed,
+        pushed / float(max(1, plans)),
+        plan_ns / max(1, plans),
+        max_plan_time * ns_per_tick,
+        plan_ns / max(1, committed),
+        committed / (plan_ns * 1e-9) if plan_ns > 0 else float('inf'),
+        wall_time))
+    if args.cpu_freq is not None:
+        print('{:<8} {:<10} cycles/plan {:.0f} (at {:g} MHz)'.format(
+            name, workload, args.cpu_freq * 1e6 * plan_ns * 1e-9 / max(1, plans), args.cpu_freq))
+    sys.stdout.flush()
+
+def parse_int_list (text):
+    return [int(x) for x in text.split(',') if x != '']
+
+def main ():
+    parser = argparse.ArgumentParser(description='Benchmark MotionPlanner lookahead on the host.')
+    parser.add_argument('--config', default=os.path.join(SRC_DIR, 'config_system', 'gui', 'default_config.json'), help='JSON configuration file.')
+    parser.add_argument('--cfg-name', help='Configuration to benchmark (default: the selected one).')
+    parser.add_argument('--lookahead', type=parse_int_list, default=[8, 16, 32, 48], help='Comma-separated LookaheadBufferSize values.')
+    parser.add_argument('--commit', type=parse_int_list, default=None, help='Comma-separated LookaheadCommitCount values (default: a quarter and half of each lookahead size).')
+    parser.add_argument('--workload', action='append', choices=sorted(WORKLOADS.keys()), help='Built-in workload to run (default: all).')
+    parser.add_argument('--gcode', action='append', default=[], help='Also run this G-code file.')
+    parser.add_argument('--speedup', type=float, default=10.0, help='Simulated clock speedup (APRINTER_LINUX_SPEEDUP).')
+    parser.add_argument('--cpu-freq', type=float, help='Also report CPU cycles per plan() at this frequency in MHz.')
+    parser.add_argument('--seed', type=int, default=1, help='Random seed for the workloads.')
+    parser.add_argument('--python', default='python', help='Python interpreter for the generator.')
+    parser.add_argument('--cxx', default=os.environ.get('HOST_CXX', 'g++'), help='Host C++ compiler.')
+    parser.add_argument('--keep', action='store_true', help='Keep the build directory.')
+    args = parser.parse_args()
+    
+    with open(args.config, 'r') as f:
+        config_data = json.load(f)
+    
+    (cfg_name, config, board) = find_config(config_data, args.cfg_name)
+    area = get_work_area(config)
+    segment_buffer_size = board['performance']['StepperSegmentBufferSize']
+    
+    workloads = []
+    for workload in (args.workload if args.workload is not None else sorted(WORKLOADS.keys())):
+        workloads.append((workload, WORKLOADS[workload](area, random.Random(args.seed))))
+    for gcode_file in args.gcode:
+        with open(gcode_file, 'r') as f:
+            workloads.append((os.path.basename(gcode_file), [line.rstrip('\r\n') for line in f]))
+    
+    variants = []
+    for lookahead in args.lookahead:
+        commits = args.commit if args.commit is not None else sorted(set([max(1, lookahead // 4), max(1, lookahead // 2)]))
+        for commit in commits:
+            if not (lookahead >= 2 and 1 <= commit < lookahead and segment_buffer_size - commit >= 6):
+                print('Skipping LookaheadBufferSize={} LookaheadCommitCount={} (invalid for StepperSegmentBufferSize={})'.format(lookahead, commit, segment_buffer_size), file=sys.stderr)
+                continue
+            variants.append((lookahead, commit))
+    
+    work_dir = tempfile.mkdtemp(prefix='aprinter-planner-bench-')
+    try:
+        for (lookahead, commit) in variants:
+            name = 'L{}/C{}'.format(lookahead, commit)
+            exe_file = build_variant(args, config_data, cfg_name, lookahead, commit, work_dir)
+            for (workload, gcode_lines) in workloads:
+                (result, wall_time) = run_workload(args, exe_file, gcode_lines)
+                report(args, name, workload, result, wall_time)
+    finally:
+        if args.keep:
+            print('Build directory: {}'.format(work_dir), file=sys.stderr)
+        else:
+            shutil.rmtree(work_dir)
+    
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,372 @@
+# Copyright (c) 2016 Ambroz Bizjak
+# All rights reserved.
+# 
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+# 
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+# DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Host load test of the web interface HTTP server. Builds the selected
+# configuration as a Linux host program (generate.py --linux-host --linux-tap)
+# with the network on a TAP device (LinuxTapEthernet), then for each requested
+# number of concurrent clients and each mode, has the clients send requests
+# back to back for a while and reports the requests per second and the
+# request latency percentiles. Modes:
+# - close: a new connection for each request (Connection: close).
+# - keepalive: one persistent connection per client, one request at a time.
+# - pipeline: one persistent connection per client, sending --depth requests
+#   at a time before reading the responses. The latency of a request is
+#   measured from sending the batch to receiving its response.
+# 
+# The configuration needs to have the network and the web interface enabled.
+# The TAP device must be set up beforehand (see LinuxTapEthernet.h), and the
+# firmware is given the static address --ip, which must be on the subnet of
+# the host side of the TAP device. Clients beyond MaxClients of the web
+# interface wait in the listener queue (QueueSize), so running more clients
+# than that shows how the server shares its client slots. The number of
+# clients which received any response during a run is reported as served.
+# 
+# Requests go to --path (default /rr_status). Files can be served from an SD
+# card image given with --sd-image, the card is then initialized with M21.
+
+from __future__ import print_function
+import sys
+import os
+import argparse
+import copy
+import json
+import shutil
+import socket
+import subprocess
+import tempfile
+import threading
+import time
+
+SRC_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+
+CXXFLAGS = [
+    '-std=c++14', '-O2', '-fno-math-errno', '-fno-trapping-math',
+    '-fno-access-control', '-ftemplate-depth=1024',
+    '-D__STDC_LIMIT_MACROS', '-D__STDC_FORMAT_MACROS', '-D__STDC_CONSTANT_MACROS',
+]
+
+CFLAGS = ['-std=c99', '-O2']
+
+def find_config (config_data, cfg_name):
+    if cfg_name is None:
+        cfg_name = config_data['selected_config']
+    configs = [cfg for cfg in config_data['configurations'] if cfg['name'] == cfg_name]
+    if len(configs) != 1:
+        raise Exception('Configuration {} not found.'.format(cfg_name))
+    boards = [board for board in config_data['boards'] if board['name'] == configs[0]['board']]
+    if len(boards) != 1:
+        raise Exception('Board {} not found.'.format(configs[0]['board']))
+    return cfg_name, configs[0], boards[0]
+
+def build_firmware (args, config_data, cfg_name, work_dir):
+    build_data = copy.deepcopy(config_data)
+    (_, _, board) = find_config(build_data, cfg_name)
+    network = board['network_config']['network']
+    if network['_compoundName'] != 'Network':
+        raise Exception('The board of this configuration has no network.')
+    network['NetEnabled'] = True
+    network['DhcpEnabled'] = False
+    network['IpAddress'] = args.ip
+    network['IpNetmask'] = args.netmask
+    network['IpGateway'] = args.gateway
+    webif = network['webinterface']
+    if webif['_compoundName'] != 'WebInterface':
+        raise Exception('The board of this configuration has no web interface.')
+    webif['AllowPersistent'] = True
+    if args.max_clients is not None:
+        webif['MaxClients'] = args.max_clients
+        webif['MaxStatusStreams'] = min(webif.get('MaxStatusStreams', 0), args.max_clients - 1)
+    if args.queue_size is not None:
+        webif['QueueSize'] = args.queue_size
+    
+    config_file = os.path.join(work_dir, 'config.json')
+    main_file = os.path.join(work_dir, 'main.cpp')
+    info_file = os.path.join(work_dir, 'build-info.json')
+    exe_file = os.path.join(work_dir, 'aprinter')
+    
+    with open(config_file, 'w') as f:
+        json.dump(build_data, f)
+    
+    subprocess.check_call([args.python, '-B', os.path.join(SRC_DIR, 'config_system', 'generator', 'generate.py'),
+        '--config', config_file, '--cfg-name', cfg_name, '--linux-host', '--linux-tap',
+        '--main-output', main_file, '--build-info-output', info_file, '--output', os.devnull])
+    
+    with open(info_file, 'r') as f:
+        build_info = json.load(f)
+    
+    flags = ['-I', SRC_DIR]
+    flags += ['-I{}'.format(os.path.join(SRC_DIR, inc)) for inc in build_info['extra_includes']]
+    flags += ['-D{}={}'.format(d['name'], d['value']) for d in build_info['defines']]
+    
+    cxx_sources = [main_file]
+    objects = []
+    for source in build_info['extra_sources']:
+        path = os.path.join(SRC_DIR, source)
+        if source.endswith('.c'):
+            obj_file = os.path.join(work_dir, os.path.basename(source)[:-2] + '.o')
+            subprocess.check_call([args.cc] + CFLAGS + flags + ['-c', path, '-o', obj_file])
+            objects.append(obj_file)
+        else:
+            cxx_sources.append(path)
+    
+    subprocess.check_call([args.cxx] + CXXFLAGS + flags + ['-x', 'c++'] + cxx_sources + ['-x', 'none'] + objects + ['-o', exe_file, '-lm'])
+    
+    return exe_file
+
+class Firmware (object):
+    def __init__ (self, args, exe_file):
+        env = dict(os.environ)
+        env['APRINTER_LINUX_TAP'] = args.tap
+        if args.sd_image is not None:
+            env['APRINTER_LINUX_SD_IMAGE'] = args.sd_image
+        env.pop('APRINTER_LINUX_SPEEDUP', None)
+        env.pop('APRINTER_LINUX_SERIAL_PTY', None)
+        self.proc = subprocess.Popen([exe_file], stdin=subprocess.PIPE, stdout=subprocess.PIPE, env=env, universal_newlines=True)
+        # There is no config store on the host, apply the configuration to
+        # bring up the network.
+        self.command('M930')
+        if args.sd_image is not None:
+            self.command('M21')
+    
+    def command (self, line):
+        # Send a command and wait for its "ok". Returns the other reply lines.
+        self.proc.stdin.write(line + '\n')
+        self.proc.stdin.flush()
+        reply = []
+        for reply_line in iter(self.proc.stdout.readline, ''):
+            reply_line = reply_line.rstrip('\r\n')
+            if reply_line.startswith('Error:') or reply_line.startswith('//Error:'):
+                raise Exception('{} failed: {}'.format(line, reply_line))
+            if reply_line == 'ok':
+                return reply
+            reply.append(reply_line)
+        raise Exception('Program exited during {}.'.format(line))
+    
+    def finish (self):
+        self.proc.kill()
+        self.proc.wait()
+
+def make_request (args, close):
+    return 'GET {} HTTP/1.1\r\nHost: {}\r\n{}\r\n'.format(
+        args.path, args.ip, 'Connection: close\r\n' if close else '').encode('ascii')
+
+def read_response (sock_file):
+    # Reads a complete response, returns whether the server will close the connection.
+    status_line = sock_file.readline()
+    if not status_line.startswith(b'HTTP/1.1 200'):
+        raise Exception('Unexpected response: {!r}'.format(status_line))
+    length = None
+    chunked = False
+    close = False
+    while True:
+        line = sock_file.readline()
+        if line in (b'\r\n', b''):
+            break
+        (name, _, value) = line.partition(b':')
+        name = name.strip().lower()
+        value = value.strip().lower()
+        if name == b'content-length':
+            length = int(value)
+        elif name == b'transfer-encoding':
+            chunked = (value == b'chunked')
+        elif name == b'connection':
+            close = (value == b'close')
+    if chunked:
+        while True:
+            size = int(sock_file.readline().split(b';')[0], 16)
+            sock_file.read(size)
+            sock_file.readline()
+            if size == 0:
+                break
+    elif length is not None:
+        if len(sock_file.read(length)) != length:
+            raise Exception('Response body truncated.')
+    else:
+        sock_file.read()
+        close = True
+    return close
+
+class Client (threading.Thread):
+    def __init__ (self, args, mode, stop_event):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.args = args
+        self.mode = mode
+        self.stop_event = stop_event
+        self.measuring = False
+        self.latencies = []
+        self.errors = 0
+        self.sock = None
+    
+    def run (self):
+        while not self.stop_event.is_set():
+            try:
+                self.run_connection()
+            except Exception:
+                if self.stop_event.is_set():
+                    break
+                if self.measuring:
+                    self.errors += 1
+            finally:
+                if self.sock is not None:
+                    self.sock.close()
+                    self.sock = None
+    
+    def run_connection (self):
+        close = (self.mode == 'close')
+        depth = self.args.depth if self.mode == 'pipeline' else 1
+        request = make_request(self.args, close)
+        self.sock = socket.create_connection((self.args.ip, self.args.port), timeout=self.args.timeout)
+        sock_file = self.sock.makefile('rb')
+        while not self.stop_event.is_set():
+            start_time = time.time()
+            self.sock.sendall(request * depth)
+            for i in range(depth):
+                server_close = read_response(sock_file)
+                if self.measuring:
+                    self.latencies.append(time.time() - start_time)
+                if server_close:
+                    # The server closes persistent connections while others are
+                    # queued. Requests after this one were not processed and are
+                    # sent again on the next connection.
+                    return
+            if close:
+                return
+
+def run_mode (args, mode, num_clients):
+    stop_event = threading.Event()
+    clients = [Client(args, mode, stop_event) for i in range(num_clients)]
+    for client in clients:
+        client.start()
+    try:
+        time.sleep(args.warmup)
+        for client in clients:
+            client.measuring = True
+        start_time = time.time()
+        time.sleep(args.duration)
+        for client in clients:
+            client.measuring = False
+        elapsed = time.time() - start_time
+    finally:
+        stop_event.set()
+        for client in clients:
+            # Unblock clients waiting for responses.
+            try:
+                client.sock.shutdown(socket.SHUT_RDWR)
+            except (AttributeError, socket.error):
+                pass
+            client.join(args.timeout)
+    latencies = sorted(latency for client in clients for latency in client.latencies)
+    served = sum(1 for client in clients if len(client.latencies) > 0)
+    errors = sum(client.errors for client in clients)
+    return (elapsed, latencies, served, errors)
+
+def percentile (values, p):
+    if len(values) == 0:
+        return float('nan')
+    return values[min(len(values) - 1, int(p / 100.0 * len(values)))]
+
+def report (mode, num_clients, elapsed, latencies, served, errors):
+    # Clients which got no response at all during the run are counted separately,
+    # they are not in the latencies.
+    print('{:<9} clients {:>3}  served {:>3}  req/s {:>7.1f}  p50 {:>7.2f}ms  p90 {:>7.2f}ms  p99 {:>7.2f}ms  max {:>7.2f}ms  errors {}'.format(
+        mode, num_clients, served, len(latencies) / elapsed,
+        1e3 * percentile(latencies, 50), 1e3 * percentile(latencies, 90), 1e3 * percentile(latencies, 99),
+        1e3 * (latencies[-1] if len(latencies) > 0 else float('nan')), errors))
+    sys.stdout.flush()
+
+def wait_for_server (args):
+    deadline = time.time() + args.timeout
+    while True:
+        try:
+            sock = socket.create_connection((args.ip, args.port), timeout=args.timeout)
+            try:
+                sock.sendall(make_request(args, True))
+                read_response(sock.makefile('rb'))
+            finally:
+                sock.close()
+            return
+        except (socket.error, socket.timeout):
+            if time.time() >= deadline:
+                raise Exception('Web interface at {} not reachable.'.format(args.ip))
+            time.sleep(0.2)
+
+def parse_int_list (text):
+    return [int(x) for x in text.split(',') if x != '']
+
+def main ():
+    parser = argparse.ArgumentParser(description='Load test the web interface HTTP server on the host.')
+    parser.add_argument('--config', default=os.path.join(SRC_DIR, 'config_system', 'gui', 'default_config.json'), help='JSON configuration file.')
+    parser.add_argument('--cfg-name', default='Fisher example', help='Configuration to test. It needs the network and the web interface.')
+    parser.add_argument('--clients', type=parse_int_list, default=[1, 2, 4, 8], help='Comma-separated numbers of concurrent clients.')
+    parser.add_argument('--mode', action='append', choices=['close', 'keepalive', 'pipeline'], help='Mode to run (default: all).')
+    parser.add_argument('--depth', type=int, default=4, help='Number of requests sent at a time in pipeline mode.')
+    parser.add_argument('--path', default='/rr_status', help='Path to request.')
+    parser.add_argument('--sd-image', help='SD card image to serve files from.')
+    parser.add_argument('--max-clients', type=int, help='Set MaxClients of the web interface (default: as configured).')
+    parser.add_argument('--queue-size', type=int, help='Set QueueSize of the web interface (default: as configured).')
+    parser.add_argument('--duration', type=float, default=10.0, help='Measurement time of each run in seconds.')
+    parser.add_argument('--warmup', type=float, default=2.0, help='Time before measuring in each run in seconds.')
+    parser.add_argument('--tap', default='aptap0', help='TAP device to attach to.')
+    parser.add_argument('--ip', default='192.168.64.2', help='Address of the firmware.')
+    parser.add_argument('--netmask', default='255.255.255.0', help='Netmask of the firmware.')
+    parser.add_argument('--gateway', default='192.168.64.1', help='Gateway of the firmware.')
+    parser.add_argument('--port', type=int, help='Web interface port (default: as configured).')
+    parser.add_argument('--timeout', type=float, default=10.0, help='Network timeout in seconds.')
+    parser.add_argument('--python', default='python', help='Python interpreter for the generator.')
+    parser.add_argument('--cc', default=os.environ.get('HOST_CC', 'gcc'), help='Host C compiler.')
+    parser.add_argument('--cxx', default=os.environ.get('HOST_CXX', 'g++'), help='Host C++ compiler.')
+    parser.add_argument('--keep', action='store_true', help='Keep the build directory.')
+    args = parser.parse_args()
+    
+    with open(args.config, 'r') as f:
+        config_data = json.load(f)
+    
+    (cfg_name, _, board) = find_config(config_data, args.cfg_name)
+    webif = board['network_config']['network'].get('webinterface', {})
+    if args.port is None:
+        args.port = webif.get('Port', 80)
+    
+    modes = args.mode if args.mode is not None else ['close', 'keepalive', 'pipeline']
+    
+    work_dir = tempfile.mkdtemp(prefix='aprinter-webif-load-')
+    try:
+        exe_file = build_firmware(args, config_data, cfg_name, work_dir)
+        fw = Firmware(args, exe_file)
+        try:
+            wait_for_server(args)
+            for num_clients in args.clients:
+                for mode in modes:
+                    (elapsed, latencies, served, errors) = run_mode(args, mode, num_clients)
+                    report(mode, num_clients, elapsed, latencies, served, errors)
+        finally:
+            fw.finish()
+    finally:
+        if args.keep:
+            print('Build directory: {}'.format(work_dir), file=sys.stderr)
+        else:
+            shutil.rmtree(work_dir)
+    
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
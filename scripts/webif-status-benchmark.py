@@ -0,0 +1,384 @@
+# Copyright (c) 2016 Ambroz Bizjak
+# All rights reserved.
+# 
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+# 
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+# DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Host benchmark of web interface status delivery, comparing clients which
+# poll /rr_status with clients which receive the /rr_statusstream event
+# stream. Builds the selected configuration as a Linux host program
+# (generate.py --linux-host --linux-tap) with the network on a TAP device
+# (LinuxTapEthernet) and the event loop benchmark enabled. Then, for each
+# requested number of clients and each mode, runs the clients for a while
+# and reports the CPU time which the firmware spent handling events (M917),
+# per client and per status update received. The same is first measured
+# without clients, and this idle load is subtracted from the client runs.
+#
+# The status of an idle printer does not change, so that the stream would
+# only send its periodic refresh. To measure the stream with changing status,
+# the speed factor is toggled (M220) every --change-interval seconds, in all
+# runs including the idle one.
+#
+# The configuration needs to have the network enabled. The TAP device must
+# be set up beforehand (see LinuxTapEthernet.h), and the firmware is given
+# the static address --ip, which must be on the subnet of the host side of
+# the TAP device. Poll clients request the status at the StatusStreamInterval
+# of the configuration, so that all modes deliver updates at the same rate.
+# Delta clients poll like poll clients, but ask only for the changes since
+# the version of the last status they received (/rr_status?since=...).
+
+from __future__ import print_function
+import sys
+import os
+import argparse
+import copy
+import json
+import re
+import shutil
+import socket
+import subprocess
+import tempfile
+import threading
+import time
+
+SRC_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+
+BENCH_FREQ_RE = re.compile(r'EventLoopScan Freq:([0-9]+)')
+
+CXXFLAGS = [
+    '-std=c++14', '-O2', '-fno-math-errno', '-fno-trapping-math',
+    '-fno-access-control', '-ftemplate-depth=1024',
+    '-D__STDC_LIMIT_MACROS', '-D__STDC_FORMAT_MACROS', '-D__STDC_CONSTANT_MACROS',
+    '-DEVENTLOOP_BENCHMARK',
+]
+
+CFLAGS = ['-std=c99', '-O2']
+
+def find_config (config_data, cfg_name):
+    if cfg_name is None:
+        cfg_name = config_data['selected_config']
+    configs = [cfg for cfg in config_data['configurations'] if cfg['name'] == cfg_name]
+    if len(configs) != 1:
+        raise Exception('Configuration {} not found.'.format(cfg_name))
+    boards = [board for board in config_data['boards'] if board['name'] == configs[0]['board']]
+    if len(boards) != 1:
+        raise Exception('Board {} not found.'.format(configs[0]['board']))
+    return cfg_name, configs[0], boards[0]
+
+def build_firmware (args, config_data, cfg_name, max_clients, work_dir):
+    build_data = copy.deepcopy(config_data)
+    (_, _, board) = find_config(build_data, cfg_name)
+    network = board['network_config']['network']
+    if network['_compoundName'] != 'Network':
+        raise Exception('The board of this configuration has no network.')
+    network['NetEnabled'] = True
+    network['DhcpEnabled'] = False
+    network['IpAddress'] = args.ip
+    network['IpNetmask'] = args.netmask
+    network['IpGateway'] = args.gateway
+    webif = network['webinterface']
+    if webif['_compoundName'] != 'WebInterface':
+        raise Exception('The board of this configuration has no web interface.')
+    # One more client slot than status streams, so the warm-up and the poll
+    # clients of the largest run still fit.
+    webif['MaxClients'] = max_clients + 1
+    webif['MaxStatusStreams'] = max_clients
+    if args.json_buffer_size is not None:
+        webif['JsonBufferSize'] = args.json_buffer_size
+    
+    config_file = os.path.join(work_dir, 'config.json')
+    main_file = os.path.join(work_dir, 'main.cpp')
+    info_file = os.path.join(work_dir, 'build-info.json')
+    exe_file = os.path.join(work_dir, 'aprinter')
+    
+    with open(config_file, 'w') as f:
+        json.dump(build_data, f)
+    
+    subprocess.check_call([args.python, '-B', os.path.join(SRC_DIR, 'config_system', 'generator', 'generate.py'),
+        '--config', config_file, '--cfg-name', cfg_name, '--linux-host', '--linux-tap',
+        '--main-output', main_file, '--build-info-output', info_file, '--output', os.devnull])
+    
+    with open(info_file, 'r') as f:
+        build_info = json.load(f)
+    
+    flags = ['-I', SRC_DIR]
+    flags += ['-I{}'.format(os.path.join(SRC_DIR, inc)) for inc in build_info['extra_includes']]
+    flags += ['-D{}={}'.format(d['name'], d['value']) for d in build_info['defines']]
+    
+    cxx_sources = [main_file]
+    objects = []
+    for source in build_info['extra_sources']:
+        path = os.path.join(SRC_DIR, source)
+        if source.endswith('.c'):
+            obj_file = os.path.join(work_dir, os.path.basename(source)[:-2] + '.o')
+            subprocess.check_call([args.cc] + CFLAGS + flags + ['-c', path, '-o', obj_file])
+            objects.append(obj_file)
+        else:
+            cxx_sources.append(path)
+    
+    subprocess.check_call([args.cxx] + CXXFLAGS + flags + ['-x', 'c++'] + cxx_sources + ['-x', 'none'] + objects + ['-o', exe_file, '-lm'])
+    
+    return exe_file
+
+class Firmware (object):
+    def __init__ (self, args, exe_file):
+        env = dict(os.environ)
+        env['APRINTER_LINUX_TAP'] = args.tap
+        env.pop('APRINTER_LINUX_SPEEDUP', None)
+        env.pop('APRINTER_LINUX_SERIAL_PTY', None)
+        self.proc = subprocess.Popen([exe_file], stdin=subprocess.PIPE, stdout=subprocess.PIPE, env=env, universal_newlines=True)
+        # There is no config store on the host, apply the configuration to
+        # bring up the network.
+        self.command('M930')
+        self.bench_freq = int(BENCH_FREQ_RE.search('\n'.join(self.command('M919'))).group(1))
+    
+    def command (self, line):
+        # Send a command and wait for its "ok". Returns the other reply lines.
+        self.proc.stdin.write(line + '\n')
+        self.proc.stdin.flush()
+        reply = []
+        for reply_line in iter(self.proc.stdout.readline, ''):
+            reply_line = reply_line.rstrip('\r\n')
+            if reply_line.startswith('Error:') or reply_line.startswith('//Error:'):
+                raise Exception('{} failed: {}'.format(line, reply_line))
+            if reply_line == 'ok':
+                return reply
+            reply.append(reply_line)
+        raise Exception('Program exited during {}.'.format(line))
+    
+    def bench_time (self):
+        return int(self.command('M917')[-1]) / float(self.bench_freq)
+    
+    def finish (self):
+        self.proc.kill()
+        self.proc.wait()
+
+def http_connect (args, path):
+    sock = socket.create_connection((args.ip, args.port), timeout=args.timeout)
+    sock.sendall('GET {} HTTP/1.1\r\nHost: {}\r\n\r\n'.format(path, args.ip).encode('ascii'))
+    return sock
+
+def read_response_head (sock_file):
+    status_line = sock_file.readline()
+    if not status_line.startswith(b'HTTP/1.1 200'):
+        raise Exception('Unexpected response: {!r}'.format(status_line))
+    while sock_file.readline() not in (b'\r\n', b''):
+        pass
+
+def read_chunk (sock_file):
+    # Returns the data of the next chunk of a chunked body, empty at the end.
+    size = int(sock_file.readline().split(b';')[0], 16)
+    data = sock_file.read(size)
+    sock_file.readline()
+    return data
+
+class Client (threading.Thread):
+    def __init__ (self, args, mode, interval, stop_event):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.args = args
+        self.mode = mode
+        self.interval = interval
+        self.stop_event = stop_event
+        self.updates = 0
+        self.bytes = 0
+        self.error = None
+    
+    def run (self):
+        try:
+            if self.mode in ('poll', 'delta'):
+                self.run_poll()
+            else:
+                self.run_stream()
+        except Exception as e:
+            if not self.stop_event.is_set():
+                self.error = e
+    
+    def run_poll (self):
+        next_time = time.time()
+        version = None
+        while not self.stop_event.is_set():
+            path = '/rr_status'
+            if self.mode == 'delta' and version is not None:
+                path += '?since={}'.format(version)
+            sock = http_connect(self.args, path)
+            try:
+                sock_file = sock.makefile('rb')
+                read_response_head(sock_file)
+                body = b''
+                while True:
+                    data = read_chunk(sock_file)
+                    if len(data) == 0:
+                        break
+                    body += data
+            finally:
+                sock.close()
+            self.bytes += len(body)
+            version = json.loads(body.decode('utf-8')).get('version')
+            self.updates += 1
+            next_time += self.interval
+            self.stop_event.wait(max(0.0, next_time - time.time()))
+    
+    def run_stream (self):
+        sock = http_connect(self.args, '/rr_statusstream')
+        self.sock = sock
+        try:
+            sock_file = sock.makefile('rb')
+            read_response_head(sock_file)
+            while not self.stop_event.is_set():
+                data = read_chunk(sock_file)
+                if len(data) == 0:
+                    raise Exception('Status stream ended.')
+                self.bytes += len(data)
+                self.updates += data.count(b'data: ')
+        finally:
+            sock.close()
+
+def wait_for_server (args):
+    deadline = time.time() + args.timeout
+    while True:
+        try:
+            sock = http_connect(args, '/rr_status')
+            sock.close()
+            return
+        except (socket.error, socket.timeout):
+            if time.time() >= deadline:
+                raise Exception('Web interface at {} not reachable.'.format(args.ip))
+            time.sleep(0.2)
+
+def run_load (fw, args, end_time):
+    # Wait until end_time, toggling the speed factor if requested.
+    toggle = False
+    while True:
+        remaining = end_time - time.time()
+        if remaining <= 0:
+            break
+        if args.change_interval > 0:
+            toggle = not toggle
+            fw.command('M220 S{}'.format(101 if toggle else 100))
+            remaining = min(args.change_interval, end_time - time.time())
+        time.sleep(max(0.0, remaining))
+
+def run_mode (fw, args, mode, num_clients, interval):
+    stop_event = threading.Event()
+    clients = [Client(args, mode, interval, stop_event) for i in range(num_clients)]
+    for client in clients:
+        client.start()
+    try:
+        run_load(fw, args, time.time() + args.warmup)
+        for client in clients:
+            client.updates = 0
+            client.bytes = 0
+        fw.command('M916')
+        start_time = time.time()
+        run_load(fw, args, start_time + args.duration)
+        busy = fw.bench_time()
+        elapsed = time.time() - start_time
+        updates = sum(client.updates for client in clients)
+        num_bytes = sum(client.bytes for client in clients)
+    finally:
+        stop_event.set()
+        for client in clients:
+            if mode == 'stream':
+                # Unblock the reader, the stream does not end by itself.
+                try:
+                    client.sock.shutdown(socket.SHUT_RDWR)
+                except (AttributeError, socket.error):
+                    pass
+            client.join(args.timeout)
+    for client in clients:
+        if client.error is not None:
+            raise Exception('{} client failed: {}'.format(mode, client.error))
+    return (elapsed, busy, updates, num_bytes)
+
+def report (mode, num_clients, elapsed, busy, idle_cpu, updates, num_bytes):
+    cpu = 100.0 * busy / elapsed
+    if num_clients == 0:
+        print('{:<6} clients {:>3}  cpu {:>6.2f}%'.format(mode, num_clients, cpu))
+    else:
+        net_cpu = cpu - idle_cpu
+        print('{:<6} clients {:>3}  cpu {:>6.2f}%  above idle {:>6.2f}%  per client {:>6.3f}%  updates/s {:>7.1f}  per update {:>7.1f}us  KB/s {:>7.1f}'.format(
+            mode, num_clients, cpu, net_cpu, net_cpu / num_clients, updates / elapsed,
+            1e4 * net_cpu * elapsed / max(1, updates), num_bytes / elapsed / 1e3))
+    sys.stdout.flush()
+    return cpu
+
+def parse_int_list (text):
+    return [int(x) for x in text.split(',') if x != '']
+
+def main ():
+    parser = argparse.ArgumentParser(description='Benchmark web interface status polling against the status stream on the host.')
+    parser.add_argument('--config', default=os.path.join(SRC_DIR, 'config_system', 'gui', 'default_config.json'), help='JSON configuration file.')
+    parser.add_argument('--cfg-name', default='Fisher example', help='Configuration to benchmark. It needs the network and the web interface.')
+    parser.add_argument('--clients', type=parse_int_list, default=[1, 2, 4], help='Comma-separated numbers of clients.')
+    parser.add_argument('--mode', action='append', choices=['poll', 'delta', 'stream'], help='Mode to run (default: all).')
+    parser.add_argument('--duration', type=float, default=10.0, help='Measurement time of each run in seconds.')
+    parser.add_argument('--warmup', type=float, default=2.0, help='Time before measuring in each run in seconds.')
+    parser.add_argument('--change-interval', type=float, help='Toggle the speed factor at this interval in seconds, 0 to disable (default: StatusStreamInterval).')
+    parser.add_argument('--json-buffer-size', type=int, help='Set JsonBufferSize (default: as configured).')
+    parser.add_argument('--tap', default='aptap0', help='TAP device to attach to.')
+    parser.add_argument('--ip', default='192.168.64.2', help='Address of the firmware.')
+    parser.add_argument('--netmask', default='255.255.255.0', help='Netmask of the firmware.')
+    parser.add_argument('--gateway', default='192.168.64.1', help='Gateway of the firmware.')
+    parser.add_argument('--port', type=int, help='Web interface port (default: as configured).')
+    parser.add_argument('--timeout', type=float, default=10.0, help='Network timeout in seconds.')
+    parser.add_argument('--python', default='python', help='Python interpreter for the generator.')
+    parser.add_argument('--cc', default=os.environ.get('HOST_CC', 'gcc'), help='Host C compiler.')
+    parser.add_argument('--cxx', default=os.environ.get('HOST_CXX', 'g++'), help='Host C++ compiler.')
+    parser.add_argument('--keep', action='store_true', help='Keep the build directory.')
+    args = parser.parse_args()
+    
+    with open(args.config, 'r') as f:
+        config_data = json.load(f)
+    
+    (cfg_name, _, board) = find_config(config_data, args.cfg_name)
+    webif = board['network_config']['network'].get('webinterface', {})
+    interval = webif.get('StatusStreamInterval', 0.5)
+    if args.port is None:
+        args.port = webif.get('Port', 80)
+    
+    if args.change_interval is None:
+        args.change_interval = interval
+    
+    modes = args.mode if args.mode is not None else ['poll', 'delta', 'stream']
+    
+    work_dir = tempfile.mkdtemp(prefix='aprinter-webif-bench-')
+    try:
+        exe_file = build_firmware(args, config_data, cfg_name, max(args.clients), work_dir)
+        fw = Firmware(args, exe_file)
+        try:
+            wait_for_server(args)
+            (elapsed, busy, _, _) = run_mode(fw, args, 'idle', 0, interval)
+            idle_cpu = report('idle', 0, elapsed, busy, 0.0, 0, 0)
+            for num_clients in args.clients:
+                for mode in modes:
+                    (elapsed, busy, updates, num_bytes) = run_mode(fw, args, mode, num_clients, interval)
+                    report(mode, num_clients, elapsed, busy, idle_cpu, updates, num_bytes)
+        finally:
+            fw.finish()
+    finally:
+        if args.keep:
+            print('Build directory: {}'.format(work_dir), file=sys.stderr)
+        else:
+            shutil.rmtree(work_dir)
+    
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
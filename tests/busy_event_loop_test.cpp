@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#define AMBROLIB_SUPPORT_QUIT
+
+#include <stdint.h>
+#include <stdio.h>
+
+static void cli () {}
+static void sei () {}
+
+#include <aprinter/meta/TypeList.h>
+#include <aprinter/meta/BasicMetaUtils.h>
+#include <aprinter/base/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Assert.h>
+#include <aprinter/base/Callback.h>
+#include <aprinter/system/BusyEventLoop.h>
+
+using namespace APrinter;
+
+// The High event takes this many ticks each time it runs and always
+// triggers itself again, like a stepper refill that is never satisfied.
+static uint32_t const HighEventTicks = 10;
+
+// Gives up on re-triggering the High event after this many runs, so that a
+// starving event loop makes the test fail instead of hang.
+static long const MaxHighRuns = 1000000;
+
+static uint32_t const TimerPeriod = 100;
+static int const NumTimerRuns = 1000;
+
+// The spinning Normal event always triggers itself again, like a USB serial
+// receive handler, and the Low event must still get dispatched this often.
+static long const MaxSpinRuns = 1000000;
+static int const NumLowRuns = 1000;
+
+// The clock advances by one tick on each read, so that the loop makes
+// progress even when there is nothing to do.
+static uint32_t sim_time;
+
+struct TestClock {
+    using TimeType = uint32_t;
+    static constexpr double time_unit = 1e-6;
+    static constexpr double time_freq = 1e6;
+    
+    template <typename ThisContext>
+    static TimeType getTime (ThisContext c)
+    {
+        return sim_time++;
+    }
+};
+
+struct Context;
+struct Program;
+struct MyLoopExtraDelay;
+struct HighEventId;
+struct NormalEventId;
+struct SpinEventId;
+struct LowEventId;
+
+using MyDebugObjectGroup = DebugObjectGroup<Context, Program>;
+
+APRINTER_MAKE_INSTANCE(MyLoop, (BusyEventLoopArg<
+    Context,
+    Program,
+    MyLoopExtraDelay
+>))
+
+struct Context {
+    using DebugGroup = MyDebugObjectGroup;
+    using Clock = TestClock;
+    using EventLoop = MyLoop;
+    
+    void check () const {}
+};
+
+using HighEvent = MyLoop::FastEventSpec<HighEventId, MyLoop::FastPriority::High>;
+using NormalEvent = MyLoop::FastEventSpec<NormalEventId>;
+using SpinEvent = MyLoop::FastEventSpec<SpinEventId>;
+using LowEvent = MyLoop::FastEventSpec<LowEventId, MyLoop::FastPriority::Low>;
+
+using FastEventList = MakeTypeList<HighEvent, NormalEvent, SpinEvent, LowEvent>;
+
+APRINTER_MAKE_INSTANCE(MyLoopExtra, (BusyEventLoopExtraArg<Program, MyLoop, FastEventList>))
+struct MyLoopExtraDelay : public WrapType<MyLoopExtra> {};
+
+// Upper bound on how late the timer may fire: one burst of High events,
+// the Normal event and the clock advancing on every read.
+static uint32_t const MaxLateness = MyLoop::MaxHighBurst * HighEventTicks + 20;
+
+struct Program : public ObjBase<void, void, MakeTypeList<
+    MyDebugObjectGroup,
+    MyLoop,
+    MyLoopExtra
+>> {
+    static Program * self (Context c);
+};
+
+static Program program;
+
+Program * Program::self (Context c)
+{
+    return &program;
+}
+
+static MyLoop::TimedEvent timer;
+static long high_runs;
+static int timer_runs;
+static bool normal_pending;
+static uint32_t max_lateness;
+static MyLoop::QueuedEvent quit_event;
+static long spin_runs;
+static int low_runs;
+static long spin_runs_at_low;
+static long max_spin_runs_between_low;
+
+static void high_event_handler (Context c)
+{
+    MyLoop::resetFastEvent<HighEvent>(c);
+    sim_time += HighEventTicks;
+    high_runs++;
+    if (high_runs < MaxHighRuns) {
+        MyLoop::triggerFastEvent<HighEvent>(c);
+    }
+}
+
+static void normal_event_handler (Context c)
+{
+    MyLoop::resetFastEvent<NormalEvent>(c);
+    normal_pending = false;
+}
+
+static void timer_handler (Context c)
+{
+    uint32_t lateness = sim_time - timer.getSetTime(c);
+    if (lateness > max_lateness) {
+        max_lateness = lateness;
+    }
+    
+    // The Normal event triggered last time must have been dispatched by now.
+    AMBRO_ASSERT_FORCE(!normal_pending)
+    
+    if (++timer_runs == NumTimerRuns) {
+        MyLoop::quit(c);
+        return;
+    }
+    
+    normal_pending = true;
+    MyLoop::triggerFastEvent<NormalEvent>(c);
+    timer.appendAfterPrevious(c, TimerPeriod);
+}
+
+// run() checks for quit() only after queued and timed events, so fast
+// event handlers quit through this.
+static void quit_event_handler (Context c)
+{
+    MyLoop::quit(c);
+}
+
+static void spin_event_handler (Context c)
+{
+    MyLoop::resetFastEvent<SpinEvent>(c);
+    spin_runs++;
+    if (spin_runs < MaxSpinRuns) {
+        MyLoop::triggerFastEvent<SpinEvent>(c);
+    } else {
+        quit_event.appendNowNotAlready(c);
+    }
+}
+
+static void low_event_handler (Context c)
+{
+    MyLoop::resetFastEvent<LowEvent>(c);
+    
+    long between = spin_runs - spin_runs_at_low;
+    if (between > max_spin_runs_between_low) {
+        max_spin_runs_between_low = between;
+    }
+    spin_runs_at_low = spin_runs;
+    
+    if (++low_runs == NumLowRuns) {
+        quit_event.appendNowNotAlready(c);
+        return;
+    }
+    MyLoop::triggerFastEvent<LowEvent>(c);
+}
+
+// A High event which keeps triggering itself must not delay timers by more
+// than one burst.
+static void test_high_burst (Context c)
+{
+    MyLoop::triggerFastEvent<HighEvent>(c);
+    timer.appendAfter(c, TimerPeriod);
+    
+    MyLoop::run(c);
+    
+    printf("High runs: %ld, max timer lateness: %lu\n", high_runs, (unsigned long)max_lateness);
+    AMBRO_ASSERT_FORCE(timer_runs == NumTimerRuns)
+    AMBRO_ASSERT_FORCE(high_runs < MaxHighRuns)
+    AMBRO_ASSERT_FORCE(high_runs >= (long)NumTimerRuns * MyLoop::MaxHighBurst)
+    AMBRO_ASSERT_FORCE(max_lateness <= MaxLateness)
+    
+    MyLoop::resetFastEvent<HighEvent>(c);
+}
+
+// A Normal event which keeps triggering itself must not starve Low events.
+static void test_low_not_starved (Context c)
+{
+    // run() returns after quit(), which stays in effect until cleared.
+    MyLoop::Object::self(c)->m_quitting = false;
+    
+    MyLoop::triggerFastEvent<SpinEvent>(c);
+    MyLoop::triggerFastEvent<LowEvent>(c);
+    
+    MyLoop::run(c);
+    
+    printf("Spin runs: %ld, low runs: %d, max spin runs between low: %ld\n", spin_runs, low_runs, max_spin_runs_between_low);
+    AMBRO_ASSERT_FORCE(low_runs == NumLowRuns)
+    AMBRO_ASSERT_FORCE(spin_runs < MaxSpinRuns)
+    AMBRO_ASSERT_FORCE(max_spin_runs_between_low <= MyLoop::MaxNormalBurst)
+    AMBRO_ASSERT_FORCE(spin_runs >= (long)(NumLowRuns - 1) * MyLoop::MaxNormalBurst)
+    
+    MyLoop::resetFastEvent<SpinEvent>(c);
+}
+
+int main ()
+{
+    Context c;
+    
+    MyDebugObjectGroup::init(c);
+    MyLoop::init(c);
+    MyLoop::initFastEvent<HighEvent>(c, high_event_handler);
+    MyLoop::initFastEvent<NormalEvent>(c, normal_event_handler);
+    MyLoop::initFastEvent<SpinEvent>(c, spin_event_handler);
+    MyLoop::initFastEvent<LowEvent>(c, low_event_handler);
+    timer.init(c, APRINTER_CB_STATFUNC_T(&timer_handler));
+    quit_event.init(c, APRINTER_CB_STATFUNC_T(&quit_event_handler));
+    
+    test_high_burst(c);
+    test_low_not_starved(c);
+    
+    quit_event.deinit(c);
+    timer.deinit(c);
+    MyLoop::deinit(c);
+    MyDebugObjectGroup::deinit(c);
+    
+    printf("OK\n");
+    return 0;
+}
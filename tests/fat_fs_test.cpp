@@ -0,0 +1,645 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define AMBROLIB_SUPPORT_QUIT
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+static void cli () {}
+static void sei () {}
+
+#include <aprinter/meta/TypeList.h>
+#include <aprinter/meta/WrapFunction.h>
+#include <aprinter/meta/BasicMetaUtils.h>
+#include <aprinter/meta/ServiceUtils.h>
+#include <aprinter/base/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Assert.h>
+#include <aprinter/base/Callback.h>
+#include <aprinter/base/BinaryTools.h>
+#include <aprinter/system/BusyEventLoop.h>
+#include <aprinter/hal/linux/LinuxSdCard.h>
+#include <aprinter/fs/BlockAccess.h>
+#include <aprinter/fs/FatFs.h>
+#include <aprinter/fs/BufferedFile.h>
+
+using namespace APrinter;
+
+/*
+ * FAT32 volume without a partition table: one sector per cluster, a
+ * single-cluster root directory at cluster 2 and NumClusters clusters in
+ * all, whose FAT entries are all in the first FAT block.
+ */
+static uint32_t const BlockSize = 512;
+static uint32_t const NumClusters = 120;
+static uint32_t const ReservedBlocks = 32;
+static uint32_t const FatBlocks = 1;
+static uint32_t const FatStart = ReservedBlocks;
+static uint32_t const DataStart = ReservedBlocks + 2 * FatBlocks;
+static uint32_t const TotalBlocks = DataStart + NumClusters;
+static uint32_t const RootCluster = 2;
+static uint32_t const EndOfChain = UINT32_C(0x0FFFFFFF);
+
+// The root directory holds this many entries before the tests create theirs.
+static int const NumInitialRootEntries = 11;
+
+// Needs two long name entries besides the short one.
+static char const LongName[] = "a long file name.txt";
+
+static uint32_t sim_time;
+
+struct TestClock {
+    using TimeType = uint32_t;
+    static constexpr double time_unit = 1e-6;
+    static constexpr double time_freq = 1e6;
+    
+    template <typename ThisContext>
+    static TimeType getTime (ThisContext c)
+    {
+        return sim_time++;
+    }
+};
+
+struct Context;
+struct Program;
+struct MyLoopExtraDelay;
+struct ActivateHandler;
+struct FsInitHandler;
+struct FsWriteMountHandler;
+
+using MyDebugObjectGroup = DebugObjectGroup<Context, Program>;
+
+APRINTER_MAKE_INSTANCE(MyLoop, (BusyEventLoopArg<
+    Context,
+    Program,
+    MyLoopExtraDelay
+>))
+
+struct Context {
+    using DebugGroup = MyDebugObjectGroup;
+    using Clock = TestClock;
+    using EventLoop = MyLoop;
+    
+    void check () const {}
+};
+
+APRINTER_MAKE_INSTANCE(MyLoopExtra, (BusyEventLoopExtraArg<Program, MyLoop, EmptyTypeList>))
+struct MyLoopExtraDelay : public WrapType<MyLoopExtra> {};
+
+APRINTER_MAKE_INSTANCE(MyBlockAccess, (BlockAccessService<LinuxSdCardService>::Access<Context, Program, ActivateHandler>))
+
+using WriteBackDelay = AMBRO_WRAP_DOUBLE(0.0);
+
+APRINTER_MAKE_INSTANCE(MyFs, (FatFsService<
+    64,     // MaxFileNameSize
+    8,      // NumCacheEntries
+    1,      // NumIoUnits
+    8,      // MaxIoBlocks
+    true,   // CaseInsens
+    true,   // Writable
+    true,   // EnableReadHinting
+    8,      // NumLookupCacheEntries
+    WriteBackDelay
+>::Fs<Context, Program, MyBlockAccess, FsInitHandler, FsWriteMountHandler>))
+
+struct Program : public ObjBase<void, void, MakeTypeList<
+    MyDebugObjectGroup,
+    MyLoop,
+    MyLoopExtra,
+    MyBlockAccess,
+    MyFs
+>> {
+    static Program * self (Context c);
+};
+
+static Program program;
+
+Program * Program::self (Context c)
+{
+    return &program;
+}
+
+// Gives BufferedFile access to the file system, which stays mounted.
+struct TestFsAccess {
+    using TheFileSystem = MyFs;
+    
+    class Client {
+    public:
+        using ClientHandler = Callback<void(Context c, bool error)>;
+        
+        void init (Context c, ClientHandler handler)
+        {
+            m_event.init(c, APRINTER_CB_OBJFUNC_T(&Client::event_handler, this));
+            m_handler = handler;
+        }
+        
+        void deinit (Context c)
+        {
+            m_event.deinit(c);
+        }
+        
+        void reset (Context c)
+        {
+            m_event.unset(c);
+        }
+        
+        void requestAccess (Context c, bool writable)
+        {
+            m_event.prependNowNotAlready(c);
+        }
+        
+        MyFs::FsEntry getCurrentDirectory (Context c)
+        {
+            return MyFs::getRootEntry(c);
+        }
+    
+    private:
+        void event_handler (Context c)
+        {
+            m_handler(c, false);
+        }
+        
+        MyLoop::QueuedEvent m_event;
+        ClientHandler m_handler;
+    };
+};
+
+using TheBufferedFile = BufferedFile<Context, TestFsAccess>;
+
+static TheBufferedFile buffered_file;
+
+static bool done;
+static int result_code;
+static size_t result_length;
+
+static void complete (Context c, int code, size_t length=0)
+{
+    done = true;
+    result_code = code;
+    result_length = length;
+    MyLoop::quit(c);
+}
+
+static void activate_handler (Context c, uint8_t error_code)
+{
+    complete(c, error_code);
+}
+struct ActivateHandler : public AMBRO_WFUNC_TD(&activate_handler) {};
+
+static void fs_init_handler (Context c, uint8_t error_code)
+{
+    complete(c, error_code);
+}
+struct FsInitHandler : public AMBRO_WFUNC_TD(&fs_init_handler) {};
+
+static void fs_write_mount_handler (Context c, bool error)
+{
+    complete(c, error);
+}
+struct FsWriteMountHandler : public AMBRO_WFUNC_TD(&fs_write_mount_handler) {};
+
+static void buffered_file_handler (Context c, TheBufferedFile::Error error, size_t read_length)
+{
+    complete(c, (int)error, read_length);
+}
+
+// Runs the event loop until a handler completes, returning its code.
+// run() returns after a handler calls quit(), which stays in effect,
+// so the flag is cleared each time.
+static int wait (Context c)
+{
+    while (!done) {
+        MyLoop::Object::self(c)->m_quitting = false;
+        MyLoop::run(c);
+    }
+    done = false;
+    return result_code;
+}
+
+static int image_fd;
+static uint8_t image_block[BlockSize];
+
+static void read_block (uint32_t block, uint8_t *data)
+{
+    AMBRO_ASSERT_FORCE(pread(image_fd, data, BlockSize, (off_t)block * BlockSize) == (ssize_t)BlockSize)
+}
+
+static void write_block (uint32_t block, uint8_t const *data)
+{
+    AMBRO_ASSERT_FORCE(pwrite(image_fd, data, BlockSize, (off_t)block * BlockSize) == (ssize_t)BlockSize)
+}
+
+static uint32_t read_fat (uint32_t cluster)
+{
+    read_block(FatStart + cluster / (BlockSize / 4), image_block);
+    return ReadBinaryInt<uint32_t, BinaryLittleEndian>((char const *)image_block + (cluster % (BlockSize / 4)) * 4) & UINT32_C(0x0FFFFFFF);
+}
+
+static uint32_t cluster_block (uint32_t cluster)
+{
+    return DataStart + (cluster - 2);
+}
+
+static void make_entry (uint8_t *entry, char const *short_name, uint32_t cluster)
+{
+    memset(entry, 0, 32);
+    memcpy(entry, short_name, 11);
+    entry[0xB] = 0x20;
+    WriteBinaryInt<uint16_t, BinaryLittleEndian>(cluster >> 16, (char *)entry + 0x14);
+    WriteBinaryInt<uint16_t, BinaryLittleEndian>(cluster, (char *)entry + 0x1A);
+}
+
+// Writes a fresh volume. The given clusters are in use, each as a chain of
+// its own, as are all clusters from full_from on.
+static void make_image (uint32_t const *used, int num_used, uint32_t full_from)
+{
+    AMBRO_ASSERT_FORCE(ftruncate(image_fd, 0) == 0)
+    AMBRO_ASSERT_FORCE(ftruncate(image_fd, (off_t)TotalBlocks * BlockSize) == 0)
+    
+    uint8_t block[BlockSize];
+    char *b = (char *)block;
+    
+    memset(block, 0, BlockSize);
+    block[0] = 0xEB; block[1] = 0x58; block[2] = 0x90;
+    WriteBinaryInt<uint16_t, BinaryLittleEndian>(BlockSize, b + 0xB);
+    block[0xD] = 1;
+    WriteBinaryInt<uint16_t, BinaryLittleEndian>(ReservedBlocks, b + 0xE);
+    block[0x10] = 2;
+    block[0x15] = 0xF8;
+    WriteBinaryInt<uint32_t, BinaryLittleEndian>(TotalBlocks, b + 0x20);
+    WriteBinaryInt<uint32_t, BinaryLittleEndian>(FatBlocks, b + 0x24);
+    WriteBinaryInt<uint32_t, BinaryLittleEndian>(RootCluster, b + 0x2C);
+    WriteBinaryInt<uint16_t, BinaryLittleEndian>(1, b + 0x30);
+    block[0x42] = 0x29;
+    block[0x1FE] = 0x55; block[0x1FF] = 0xAA;
+    write_block(0, block);
+    
+    memset(block, 0, BlockSize);
+    WriteBinaryInt<uint32_t, BinaryLittleEndian>(UINT32_C(0x41615252), b + 0x0);
+    WriteBinaryInt<uint32_t, BinaryLittleEndian>(UINT32_C(0x61417272), b + 0x1E4);
+    WriteBinaryInt<uint32_t, BinaryLittleEndian>(UINT32_C(0xFFFFFFFF), b + 0x1E8);
+    WriteBinaryInt<uint32_t, BinaryLittleEndian>(UINT32_C(0xFFFFFFFF), b + 0x1EC);
+    WriteBinaryInt<uint32_t, BinaryLittleEndian>(UINT32_C(0xAA550000), b + 0x1FC);
+    write_block(1, block);
+    
+    memset(block, 0, BlockSize);
+    WriteBinaryInt<uint32_t, BinaryLittleEndian>(UINT32_C(0x0FFFFFF8), b + 0);
+    WriteBinaryInt<uint32_t, BinaryLittleEndian>(EndOfChain, b + 4);
+    WriteBinaryInt<uint32_t, BinaryLittleEndian>(EndOfChain, b + 4 * RootCluster);
+    for (int i = 0; i < num_used; i++) {
+        WriteBinaryInt<uint32_t, BinaryLittleEndian>(EndOfChain, b + 4 * used[i]);
+    }
+    for (uint32_t cluster = full_from; cluster < 2 + NumClusters; cluster++) {
+        WriteBinaryInt<uint32_t, BinaryLittleEndian>(EndOfChain, b + 4 * cluster);
+    }
+    write_block(FatStart, block);
+    write_block(FatStart + FatBlocks, block);
+    
+    // Files which own the used clusters and empty ones after them. The
+    // entries beyond the end of the directory are zero.
+    memset(block, 0, BlockSize);
+    for (int i = 0; i < NumInitialRootEntries; i++) {
+        char name[12];
+        sprintf(name, "FILE%02d  BIN", i);
+        make_entry(block + i * 32, name, (i < num_used) ? used[i] : 0);
+    }
+    write_block(cluster_block(RootCluster), block);
+}
+
+static void mount (Context c)
+{
+    MyBlockAccess::activate(c);
+    AMBRO_ASSERT_FORCE(wait(c) == 0)
+    MyFs::init(c, BlockRange<MyBlockAccess::BlockIndexType>{0, TotalBlocks});
+    AMBRO_ASSERT_FORCE(wait(c) == 0)
+    MyFs::startWriteMount(c);
+    AMBRO_ASSERT_FORCE(wait(c) == 0)
+}
+
+static void unmount (Context c)
+{
+    MyFs::startWriteUnmount(c);
+    AMBRO_ASSERT_FORCE(wait(c) == 0)
+    MyFs::deinit(c);
+    MyBlockAccess::deactivate(c);
+}
+
+static uint8_t data_byte (size_t pos, uint8_t seed)
+{
+    return (uint8_t)(pos * 31 + (pos >> 9) + seed);
+}
+
+// Writes a file of the given length, creating it if needed, and tells
+// the expected size first unless it is zero.
+static void write_file (Context c, char const *name, size_t length, uint32_t expected_size, uint8_t seed)
+{
+    buffered_file.startOpen(c, name, false, TheBufferedFile::OpenMode::OPEN_WRITE);
+    AMBRO_ASSERT_FORCE(wait(c) == (int)TheBufferedFile::Error::NO_ERROR)
+    if (expected_size > 0) {
+        buffered_file.setExpectedSize(c, expected_size);
+    }
+    
+    static char buf[300];
+    size_t pos = 0;
+    while (pos < length) {
+        size_t chunk = MinValue(sizeof(buf), length - pos);
+        for (size_t i = 0; i < chunk; i++) {
+            buf[i] = data_byte(pos + i, seed);
+        }
+        buffered_file.startWriteData(c, buf, chunk);
+        AMBRO_ASSERT_FORCE(wait(c) == (int)TheBufferedFile::Error::NO_ERROR)
+        pos += chunk;
+    }
+    buffered_file.startWriteEof(c);
+    AMBRO_ASSERT_FORCE(wait(c) == (int)TheBufferedFile::Error::NO_ERROR)
+    buffered_file.reset(c);
+}
+
+static void check_file_data (Context c, char const *name, size_t length, uint8_t seed)
+{
+    buffered_file.startOpen(c, name, false, TheBufferedFile::OpenMode::OPEN_READ);
+    AMBRO_ASSERT_FORCE(wait(c) == (int)TheBufferedFile::Error::NO_ERROR)
+    
+    static char buf[300];
+    size_t pos = 0;
+    while (true) {
+        buffered_file.startReadData(c, buf, sizeof(buf));
+        AMBRO_ASSERT_FORCE(wait(c) == (int)TheBufferedFile::Error::NO_ERROR)
+        if (result_length == 0) {
+            break;
+        }
+        for (size_t i = 0; i < result_length; i++) {
+            AMBRO_ASSERT_FORCE((uint8_t)buf[i] == data_byte(pos + i, seed))
+        }
+        pos += result_length;
+    }
+    AMBRO_ASSERT_FORCE(pos == length)
+    buffered_file.reset(c);
+}
+
+// Finds a short entry in a directory block and returns its first cluster.
+static uint32_t find_entry (uint32_t block, char const *short_name, uint32_t *size=nullptr)
+{
+    read_block(block, image_block);
+    for (size_t i = 0; i < BlockSize / 32; i++) {
+        char const *entry = (char const *)image_block + i * 32;
+        if (!memcmp(entry, short_name, 11)) {
+            if (size) {
+                *size = ReadBinaryInt<uint32_t, BinaryLittleEndian>(entry + 0x1C);
+            }
+            return ((uint32_t)ReadBinaryInt<uint16_t, BinaryLittleEndian>(entry + 0x14) << 16) |
+                   ReadBinaryInt<uint16_t, BinaryLittleEndian>(entry + 0x1A);
+        }
+    }
+    AMBRO_ASSERT_FORCE(false)
+    return 0;
+}
+
+// Checks that the chain starting at first_cluster consists of the given runs
+// of adjacent clusters, each given as its first cluster and length.
+static void check_chain (uint32_t first_cluster, uint32_t const (*runs)[2], int num_runs)
+{
+    uint32_t cluster = first_cluster;
+    for (int i = 0; i < num_runs; i++) {
+        AMBRO_ASSERT_FORCE(cluster == runs[i][0])
+        for (uint32_t j = 0; j < runs[i][1]; j++) {
+            uint32_t next = read_fat(cluster);
+            if (j + 1 < runs[i][1]) {
+                AMBRO_ASSERT_FORCE(next == cluster + 1)
+            }
+            cluster = next;
+        }
+    }
+    AMBRO_ASSERT_FORCE(cluster == EndOfChain)
+}
+
+static void check_free (uint32_t from, uint32_t to)
+{
+    for (uint32_t cluster = from; cluster < to; cluster++) {
+        AMBRO_ASSERT_FORCE(read_fat(cluster) == 0)
+    }
+}
+
+// Clusters are handed out in runs from the free space left between used
+// clusters, and extra clusters are released when the file is closed.
+static void test_run_allocation (Context c)
+{
+    // Free space: 3-5, 7-9, 11 and up.
+    static uint32_t const used[] = {6, 10};
+    make_image(used, 2, 2 + NumClusters);
+    mount(c);
+    
+    // The expected size asks for 12 clusters, which come from three gaps.
+    write_file(c, "RUN.BIN", 12 * BlockSize, 12 * BlockSize, 1);
+    
+    // Without an expected size, runs of 1, 2 and 4 clusters are taken and
+    // the last one is not needed.
+    write_file(c, "GROW.BIN", 5 * BlockSize + 100, 0, 2);
+    
+    // More is expected than gets written.
+    write_file(c, "OVER.BIN", 2 * BlockSize, 20 * BlockSize, 3);
+    
+    check_file_data(c, "run.bin", 12 * BlockSize, 1);
+    check_file_data(c, "grow.bin", 5 * BlockSize + 100, 2);
+    check_file_data(c, "over.bin", 2 * BlockSize, 3);
+    
+    unmount(c);
+    
+    uint32_t root_block = cluster_block(RootCluster);
+    uint32_t size;
+    
+    static uint32_t const run_runs[][2] = {{3, 3}, {7, 3}, {11, 6}};
+    check_chain(find_entry(root_block, "RUN     BIN", &size), run_runs, 3);
+    AMBRO_ASSERT_FORCE(size == 12 * BlockSize)
+    
+    static uint32_t const grow_runs[][2] = {{17, 6}};
+    check_chain(find_entry(root_block, "GROW    BIN", &size), grow_runs, 1);
+    AMBRO_ASSERT_FORCE(size == 5 * BlockSize + 100)
+    check_free(23, 24);
+    
+    static uint32_t const over_runs[][2] = {{24, 2}};
+    check_chain(find_entry(root_block, "OVER    BIN", &size), over_runs, 1);
+    AMBRO_ASSERT_FORCE(size == 2 * BlockSize)
+    check_free(26, 2 + NumClusters);
+}
+
+// A long name which does not fit after the end of the directory goes to a
+// new cluster, and the rest of the old block is then marked as deleted.
+static void test_create_extends_dir (Context c)
+{
+    static uint32_t const used[] = {3};
+    make_image(used, 1, 2 + NumClusters);
+    mount(c);
+    
+    // Fill the root directory up to two entries before its end.
+    char name[13];
+    for (int i = NumInitialRootEntries; i < 14; i++) {
+        sprintf(name, "NEW%02d.BIN", i);
+        write_file(c, name, 0, 0, 0);
+    }
+    
+    write_file(c, LongName, 1000, 0, 4);
+    check_file_data(c, "A LONG FILE NAME.TXT", 1000, 4);
+    
+    unmount(c);
+    
+    // The directory got cluster 4, the file 5 and 6.
+    AMBRO_ASSERT_FORCE(read_fat(RootCluster) == 4)
+    AMBRO_ASSERT_FORCE(read_fat(4) == EndOfChain)
+    static uint32_t const file_runs[][2] = {{5, 2}};
+    check_chain(find_entry(cluster_block(4), "ALONGF~1TXT"), file_runs, 1);
+    check_free(7, 2 + NumClusters);
+    
+    read_block(cluster_block(RootCluster), image_block);
+    AMBRO_ASSERT_FORCE(image_block[13 * 32] != 0 && image_block[13 * 32] != 0xE5)
+    AMBRO_ASSERT_FORCE(image_block[14 * 32] == 0xE5)
+    AMBRO_ASSERT_FORCE(image_block[15 * 32] == 0xE5)
+    
+    read_block(cluster_block(4), image_block);
+    AMBRO_ASSERT_FORCE(image_block[0 * 32] == 0x42)
+    AMBRO_ASSERT_FORCE(image_block[1 * 32] == 0x01)
+    AMBRO_ASSERT_FORCE(image_block[3 * 32] == 0)
+    
+    // Once more after remounting.
+    mount(c);
+    check_file_data(c, LongName, 1000, 4);
+    unmount(c);
+}
+
+// When there is no space to extend the directory, creation fails and
+// leaves the directory as it was.
+static void test_create_fails (Context c)
+{
+    make_image(nullptr, 0, 3);
+    
+    // Fill the root directory up to two entries before its end.
+    read_block(cluster_block(RootCluster), image_block);
+    make_entry(image_block + 11 * 32, "EXTRA1  BIN", 0);
+    make_entry(image_block + 12 * 32, "EXTRA2  BIN", 0);
+    make_entry(image_block + 13 * 32, "EXTRA3  BIN", 0);
+    write_block(cluster_block(RootCluster), image_block);
+    
+    uint8_t old_root[BlockSize];
+    uint8_t old_fat[BlockSize];
+    read_block(cluster_block(RootCluster), old_root);
+    read_block(FatStart, old_fat);
+    
+    mount(c);
+    
+    buffered_file.startOpen(c, LongName, false, TheBufferedFile::OpenMode::OPEN_WRITE);
+    AMBRO_ASSERT_FORCE(wait(c) == (int)TheBufferedFile::Error::OTHER_ERROR)
+    buffered_file.reset(c);
+    
+    // An 8.3 name needs no new space and still works.
+    write_file(c, "SHORT.BIN", 0, 0, 0);
+    
+    unmount(c);
+    
+    uint8_t new_root[BlockSize];
+    read_block(cluster_block(RootCluster), new_root);
+    AMBRO_ASSERT_FORCE(!memcmp(new_root, old_root, 14 * 32))
+    AMBRO_ASSERT_FORCE(!memcmp(new_root + 14 * 32, "SHORT   BIN", 11))
+    AMBRO_ASSERT_FORCE(new_root[15 * 32] == 0)
+    read_block(FatStart, image_block);
+    AMBRO_ASSERT_FORCE(!memcmp(image_block, old_fat, BlockSize))
+}
+
+// Counts the cache entries whose hinted reads belong to the given readahead.
+static int count_hint_owner_entries (Context c, void const *owner)
+{
+    int count = 0;
+    for (auto &entry : MyFs::TheBlockCache::Object::self(c)->cache_entries) {
+        if ((void const *)entry.m_hint_owner == owner) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Cache entries remember which readahead hinted them, so closing a file
+// must make them forget it before the next file reuses the same object.
+static void test_readahead_owner (Context c)
+{
+    make_image(nullptr, 0, 2 + NumClusters);
+    mount(c);
+    write_file(c, "READ.BIN", 12 * BlockSize, 12 * BlockSize, 5);
+    unmount(c);
+    
+    mount(c);
+    void const *owner = &buffered_file.m_fs_file.m_readahead;
+    
+    buffered_file.startOpen(c, "READ.BIN", false, TheBufferedFile::OpenMode::OPEN_READ);
+    AMBRO_ASSERT_FORCE(wait(c) == (int)TheBufferedFile::Error::NO_ERROR)
+    static char buf[BlockSize];
+    for (int i = 0; i < 3; i++) {
+        buffered_file.startReadData(c, buf, sizeof(buf));
+        AMBRO_ASSERT_FORCE(wait(c) == (int)TheBufferedFile::Error::NO_ERROR)
+        AMBRO_ASSERT_FORCE(result_length == BlockSize)
+    }
+    AMBRO_ASSERT_FORCE(count_hint_owner_entries(c, owner) > 0)
+    
+    buffered_file.reset(c);
+    AMBRO_ASSERT_FORCE(count_hint_owner_entries(c, owner) == 0)
+    
+    check_file_data(c, "READ.BIN", 12 * BlockSize, 5);
+    AMBRO_ASSERT_FORCE(count_hint_owner_entries(c, owner) == 0)
+    unmount(c);
+}
+
+int main ()
+{
+    Context c;
+    
+    char image_path[] = "/tmp/fat_fs_test_XXXXXX";
+    image_fd = mkstemp(image_path);
+    AMBRO_ASSERT_FORCE(image_fd >= 0)
+    setenv("APRINTER_LINUX_SD_IMAGE", image_path, 1);
+    setenv("APRINTER_LINUX_SD_CMD_LATENCY", "0", 1);
+    setenv("APRINTER_LINUX_SD_BLOCK_LATENCY", "0", 1);
+    
+    MyDebugObjectGroup::init(c);
+    MyLoop::init(c);
+    MyBlockAccess::init(c);
+    buffered_file.init(c, APRINTER_CB_STATFUNC_T(&buffered_file_handler));
+    
+    test_run_allocation(c);
+    test_create_extends_dir(c);
+    test_create_fails(c);
+    test_readahead_owner(c);
+    
+    buffered_file.deinit(c);
+    MyBlockAccess::deinit(c);
+    MyLoop::deinit(c);
+    MyDebugObjectGroup::deinit(c);
+    
+    close(image_fd);
+    unlink(image_path);
+    
+    printf("OK\n");
+    return 0;
+}
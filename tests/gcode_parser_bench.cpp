@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Host benchmark of the text G-code parsers. Parses G-code in memory, the way
+// SdCardModule (file parser) and SerialModule (serial parser, with line
+// numbers and checksums) do, reads the axis and feedrate parameters like the
+// G0/G1 handler and reports lines per second.
+//
+// Usage: gcode_parser_bench [file.gcode [passes]]
+// Without a file, synthetic slicer-like output (perimeters, infill, layer
+// changes and comments) is used. Before measuring, every numeric value is
+// checked against StrToFloat.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+#include <string>
+
+// The parser does not lock, but the debug object header needs these.
+static void cli () {}
+static void sei () {}
+
+#include <aprinter/base/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Assert.h>
+#include <aprinter/printer/utils/GcodeParser.h>
+
+using namespace APrinter;
+
+// The debug object group of the parsers, set up like in the generated main.
+struct BenchContext;
+struct Program;
+
+using MyDebugObjectGroup = DebugObjectGroup<BenchContext, Program>;
+
+struct BenchContext {
+    using DebugGroup = MyDebugObjectGroup;
+};
+
+struct Program : public ObjBase<void, void, MakeTypeList<
+    MyDebugObjectGroup
+>> {
+    static Program * self (BenchContext c);
+};
+
+Program program;
+
+Program * Program::self (BenchContext c) { return &program; }
+
+static std::string make_synthetic_gcode ()
+{
+    std::string out;
+    char line[128];
+    srand(1);
+    double e = 0.0;
+    for (int layer = 0; layer < 40; layer++) {
+        double z = 0.2 + 0.2 * layer;
+        sprintf(line, ";LAYER:%d\nG1 Z%.3f F7800.000\n", layer, z);
+        out += line;
+        for (int seg = 0; seg < 400; seg++) {
+            double x = 100.0 + 40.0 * ((rand() % 100000) / 100000.0);
+            double y = 100.0 + 40.0 * ((rand() % 100000) / 100000.0);
+            e += 0.02 + 0.03 * ((rand() % 1000) / 1000.0);
+            if (seg % 100 == 0) {
+                sprintf(line, "G1 X%.3f Y%.3f F7800.000 ; move to next perimeter\n", x, y);
+            } else if (seg % 50 == 0) {
+                sprintf(line, "G1 F1800\n");
+            } else {
+                sprintf(line, "G1 X%.3f Y%.3f E%.5f\n", x, y, e);
+            }
+            out += line;
+        }
+    }
+    return out;
+}
+
+// Add line numbers and checksums like host software does, skip comments.
+static std::string make_serial_gcode (std::string const &in)
+{
+    std::string out;
+    uint32_t line_number = 1;
+    size_t pos = 0;
+    while (pos < in.size()) {
+        size_t end = in.find('\n', pos);
+        if (end == std::string::npos) {
+            end = in.size();
+        }
+        std::string line = in.substr(pos, end - pos);
+        pos = end + 1;
+        size_t comment = line.find(';');
+        if (comment != std::string::npos) {
+            line.resize(comment);
+        }
+        while (!line.empty() && (line.back() == ' ' || line.back() == '\r')) {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            continue;
+        }
+        char prefix[16];
+        sprintf(prefix, "N%lu ", (unsigned long)line_number++);
+        line = prefix + line;
+        uint8_t checksum = 0;
+        for (char ch : line) {
+            checksum ^= (unsigned char)ch;
+        }
+        char suffix[8];
+        sprintf(suffix, "*%u\n", (unsigned int)checksum);
+        out += line + suffix;
+    }
+    return out;
+}
+
+static double get_time ()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+struct PassResult {
+    size_t lines;
+    size_t errors;
+    size_t mismatches;
+    double sum;
+};
+
+template <typename Parser, typename FpType>
+static PassResult parse_all (Parser *parser, char *buf, size_t len, bool verify)
+{
+    BenchContext c;
+    PassResult res = {};
+    size_t pos = 0;
+    while (pos < len) {
+        parser->startCommand(c, buf + pos, 0);
+        if (!parser->extendCommand(c, len - pos)) {
+            parser->resetCommand(c);
+            break;
+        }
+        res.lines++;
+        pos += parser->getLength(c);
+        auto num_parts = parser->getNumParts(c);
+        if (num_parts < 0) {
+            if (num_parts != GCODE_ERROR_NO_PARTS) {
+                res.errors++;
+            }
+            continue;
+        }
+        res.sum += parser->getCmdNumber(c);
+        
+        // Read the values through the GcodeCommand interface, like the G0/G1
+        // handler which looks for the parameter of each axis. The volatile
+        // hides the parser type from the compiler, as in PrinterMain.
+        GcodeCommand<BenchContext, FpType> * volatile cmd_var = parser;
+        GcodeCommand<BenchContext, FpType> *cmd = cmd_var;
+        for (char const *code = "XYZEF"; *code; code++) {
+            for (decltype(num_parts) i = 0; i < num_parts; i++) {
+                auto part = cmd->getPart(c, i);
+                if (cmd->getPartCode(c, part) == *code) {
+                    res.sum += cmd->getPartFpValue(c, part);
+                }
+            }
+        }
+        
+        if (verify) {
+            for (decltype(num_parts) i = 0; i < num_parts; i++) {
+                auto part = cmd->getPart(c, i);
+                FpType value = cmd->getPartFpValue(c, part);
+                FpType ref = StrToFloat<FpType>(cmd->getPartStringValue(c, part), NULL);
+                if (memcmp(&value, &ref, sizeof(value)) != 0) {
+                    res.mismatches++;
+                    if (res.mismatches <= 10) {
+                        printf("Mismatch: %c%s -> %.17g, expected %.17g\n", cmd->getPartCode(c, part), cmd->getPartStringValue(c, part), (double)value, (double)ref);
+                    }
+                }
+            }
+        }
+    }
+    return res;
+}
+
+template <typename ParserService, typename FpType>
+static bool bench (char const *name, std::string const &input, int passes)
+{
+    using Parser = typename ParserService::template Parser<BenchContext, size_t, FpType>;
+    
+    Parser parser;
+    parser.init(BenchContext());
+    
+    std::vector<char> buf(input.size() + 1);
+    
+    memcpy(buf.data(), input.data(), input.size());
+    PassResult check = parse_all<Parser, FpType>(&parser, buf.data(), input.size(), true);
+    if (check.errors > 0 || check.mismatches > 0) {
+        printf("%s: FAILED errors=%zu mismatches=%zu\n", name, check.errors, check.mismatches);
+        return false;
+    }
+    
+    double best = 0.0;
+    for (int i = 0; i < passes; i++) {
+        memcpy(buf.data(), input.data(), input.size());
+        double start = get_time();
+        PassResult res = parse_all<Parser, FpType>(&parser, buf.data(), input.size(), false);
+        double elapsed = get_time() - start;
+        AMBRO_ASSERT_FORCE(res.lines == check.lines)
+        AMBRO_ASSERT_FORCE(res.sum == check.sum)
+        if (i == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    
+    printf("%s: lines=%zu bytes=%zu lines/s=%.0f ns/line=%.1f\n", name, check.lines, input.size(), check.lines / best, 1e9 * best / check.lines);
+    
+    parser.deinit(BenchContext());
+    return true;
+}
+
+int main (int argc, char *argv[])
+{
+    std::string input;
+    if (argc > 1) {
+        FILE *f = fopen(argv[1], "rb");
+        if (!f) {
+            printf("Cannot open %s\n", argv[1]);
+            return 1;
+        }
+        char chunk[4096];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+            input.append(chunk, n);
+        }
+        fclose(f);
+    } else {
+        input = make_synthetic_gcode();
+    }
+    int passes = (argc > 2) ? atoi(argv[2]) : 20;
+    
+    BenchContext c;
+    MyDebugObjectGroup::init(c);
+    
+    std::string serial_input = make_serial_gcode(input);
+    
+    bool ok = true;
+    ok &= bench<FileGcodeParserService<32>, float>("file/float", input, passes);
+    ok &= bench<FileGcodeParserService<32>, double>("file/double", input, passes);
+    ok &= bench<SerialGcodeParserService<32>, float>("serial/float", serial_input, passes);
+    ok &= bench<SerialGcodeParserService<32>, double>("serial/double", serial_input, passes);
+    
+    MyDebugObjectGroup::deinit(c);
+    
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <aprinter/base/Assert.h>
+#include <aprinter/printer/utils/JsonBuilder.h>
+#include <aprinter/printer/utils/JsonStatusSnapshot.h>
+
+using namespace APrinter;
+
+struct Status {
+    bool active;
+    double pos[2];
+    uint32_t hist[3];
+    char const *state;
+    bool extra;
+};
+
+// Generates a document like get_json_status does.
+template <typename TheJsonBuilder>
+static void get_json_status (Status const *st, TheJsonBuilder *json)
+{
+    json->addSafeKeyVal("active", JsonBool{st->active});
+    json->addKeyObject(JsonSafeString{"axes"});
+    for (int i = 0; i < 2; i++) {
+        json->addKeyObject(JsonSafeChar{(char)('X' + i)});
+        json->addSafeKeyVal("pos", JsonDouble{st->pos[i]});
+        json->endObject();
+    }
+    json->endObject();
+    if (st->extra) {
+        json->addSafeKeyVal("extra", JsonUint32{1});
+    }
+    json->addKeyArray(JsonSafeString{"hist"});
+    for (int i = 0; i < 3; i++) {
+        json->add(JsonUint32{st->hist[i]});
+    }
+    json->endArray();
+    json->addSafeKeyVal("state", JsonString{MemRef(st->state)});
+    json->addKeyObject(JsonSafeString{"empty"});
+    json->endObject();
+}
+
+static uint32_t const Epoch = 1234;
+
+template <size_t MaxEntries>
+struct Tester {
+    using Snapshot = JsonStatusSnapshot<MaxEntries>;
+    using VersionToken = typename Snapshot::VersionToken;
+    using OutputType = typename Snapshot::OutputType;
+    
+    Snapshot snapshot;
+    char buffer[512];
+    OutputType output_type;
+    
+    void init ()
+    {
+        snapshot.init();
+        snapshot.setEpoch(Epoch);
+    }
+    
+    bool record (Status const *st)
+    {
+        typename Snapshot::Recorder recorder;
+        recorder.start(&snapshot);
+        get_json_status(st, &recorder);
+        return recorder.finish();
+    }
+    
+    // Records and writes in one pass, leaving the output type in output_type.
+    char const * record_write (Status const *st, VersionToken const *since)
+    {
+        JsonBuilder json;
+        json.loadBuffer(buffer, sizeof(buffer));
+        json.start();
+        json.startObject();
+        typename Snapshot::Recorder recorder;
+        recorder.start(&snapshot, &json, since);
+        get_json_status(st, &recorder);
+        recorder.finish();
+        output_type = recorder.getOutputType();
+        json.endObject();
+        buffer[json.getLength()] = '\0';
+        return buffer;
+    }
+    
+    char const * emit (Status const *st, uint32_t since)
+    {
+        JsonBuilder json;
+        json.loadBuffer(buffer, sizeof(buffer));
+        json.start();
+        json.startObject();
+        typename Snapshot::Emitter emitter;
+        emitter.start(&snapshot, &json, VersionToken{Epoch, since});
+        get_json_status(st, &emitter);
+        json.endObject();
+        buffer[json.getLength()] = '\0';
+        return buffer;
+    }
+    
+    bool delta_possible (uint32_t since)
+    {
+        return snapshot.isDeltaPossible(VersionToken{Epoch, since});
+    }
+};
+
+using TheTester = Tester<64>;
+
+#define CHECK_EMIT(since, expected) AMBRO_ASSERT_FORCE(strcmp(t.emit(&st, (since)), (expected)) == 0)
+
+// Records the status while writing the delta since the given version, which
+// must be the same as what an Emitter makes after the recording.
+#define CHECK_RECORD_DELTA(since, expected) \
+    { \
+        TheTester::VersionToken token = {Epoch, (since)}; \
+        AMBRO_ASSERT_FORCE(strcmp(t.record_write(&st, &token), (expected)) == 0) \
+        AMBRO_ASSERT_FORCE(t.output_type == TheTester::OutputType::DELTA) \
+        CHECK_EMIT((since), (expected)); \
+    }
+
+static char const WholeStatus[] = "{\"active\":false,\"axes\":{\"X\":{\"pos\":1},\"Y\":{\"pos\":2}},\"hist\":[0,0,0],\"state\":\"a\",\"empty\":{}}";
+
+int main ()
+{
+    TheTester t;
+    t.init();
+    AMBRO_ASSERT_FORCE(!t.delta_possible(0))
+    
+    Status st = {false, {1.0, 2.0}, {0, 0, 0}, "a", false};
+    
+    // The first recording gives version 1, from which nothing changed.
+    AMBRO_ASSERT_FORCE(t.record(&st))
+    AMBRO_ASSERT_FORCE(t.snapshot.getVersion() == 1)
+    AMBRO_ASSERT_FORCE(!t.delta_possible(0))
+    AMBRO_ASSERT_FORCE(!t.delta_possible(2))
+    CHECK_EMIT(1, "{}")
+    
+    // Without changes, the version stays.
+    AMBRO_ASSERT_FORCE(t.record(&st))
+    AMBRO_ASSERT_FORCE(t.snapshot.getVersion() == 1)
+    
+    // Without a version, or with one from another epoch, the whole status
+    // is written while recording.
+    AMBRO_ASSERT_FORCE(strcmp(t.record_write(&st, nullptr), WholeStatus) == 0)
+    AMBRO_ASSERT_FORCE(t.output_type == TheTester::OutputType::WHOLE)
+    TheTester::VersionToken other_epoch = {Epoch + 1, 1};
+    AMBRO_ASSERT_FORCE(!t.snapshot.isDeltaPossible(other_epoch))
+    AMBRO_ASSERT_FORCE(strcmp(t.record_write(&st, &other_epoch), WholeStatus) == 0)
+    AMBRO_ASSERT_FORCE(t.output_type == TheTester::OutputType::WHOLE)
+    AMBRO_ASSERT_FORCE(t.snapshot.getVersion() == 1)
+    
+    // A nested value is written with its parents only.
+    st.pos[1] = 3.5;
+    CHECK_RECORD_DELTA(1, "{\"axes\":{\"Y\":{\"pos\":3.5}}}")
+    AMBRO_ASSERT_FORCE(t.snapshot.getVersion() == 2)
+    CHECK_EMIT(2, "{}")
+    CHECK_RECORD_DELTA(2, "{}")
+    
+    // Arrays are written whole.
+    st.hist[1] = 5;
+    AMBRO_ASSERT_FORCE(t.record(&st))
+    AMBRO_ASSERT_FORCE(t.snapshot.getVersion() == 3)
+    CHECK_EMIT(2, "{\"hist\":[0,5,0]}")
+    CHECK_EMIT(1, "{\"axes\":{\"Y\":{\"pos\":3.5}},\"hist\":[0,5,0]}")
+    CHECK_RECORD_DELTA(1, "{\"axes\":{\"Y\":{\"pos\":3.5}},\"hist\":[0,5,0]}")
+    
+    // Strings are compared by content.
+    char name[2] = {'a', '\0'};
+    st.state = name;
+    AMBRO_ASSERT_FORCE(t.record(&st))
+    AMBRO_ASSERT_FORCE(t.snapshot.getVersion() == 3)
+    name[0] = 'b';
+    st.active = true;
+    CHECK_RECORD_DELTA(3, "{\"active\":true,\"state\":\"b\"}")
+    AMBRO_ASSERT_FORCE(t.snapshot.getVersion() == 4)
+    
+    // A change of structure prevents deltas from before it. A delta which
+    // was being written when it happened has to be replaced.
+    st.extra = true;
+    TheTester::VersionToken before = {Epoch, 4};
+    t.record_write(&st, &before);
+    AMBRO_ASSERT_FORCE(t.output_type == TheTester::OutputType::INVALID)
+    AMBRO_ASSERT_FORCE(t.snapshot.getVersion() == 5)
+    AMBRO_ASSERT_FORCE(!t.delta_possible(4))
+    AMBRO_ASSERT_FORCE(t.delta_possible(5))
+    CHECK_EMIT(5, "{}")
+    st.pos[0] = -1.0;
+    CHECK_RECORD_DELTA(5, "{\"axes\":{\"X\":{\"pos\":-1}}}")
+    
+    // A document which does not fit allows no deltas.
+    Tester<8> small;
+    small.init();
+    AMBRO_ASSERT_FORCE(!small.record(&st))
+    AMBRO_ASSERT_FORCE(!small.delta_possible(small.snapshot.getVersion()))
+    
+    // Version tokens.
+    char token_buf[32];
+    JsonBuilder json;
+    json.loadBuffer(token_buf, sizeof(token_buf));
+    json.start();
+    TheTester::Snapshot::writeVersionToken(&json, t.snapshot.getVersionToken());
+    token_buf[json.getLength()] = '\0';
+    AMBRO_ASSERT_FORCE(strcmp(token_buf, "\"1234.6\"") == 0)
+    TheTester::VersionToken token;
+    AMBRO_ASSERT_FORCE(TheTester::Snapshot::parseVersionToken(MemRef("1234.6"), &token))
+    AMBRO_ASSERT_FORCE(token.epoch == Epoch && token.version == 6)
+    AMBRO_ASSERT_FORCE(!TheTester::Snapshot::parseVersionToken(MemRef("6"), &token))
+    AMBRO_ASSERT_FORCE(!TheTester::Snapshot::parseVersionToken(MemRef("1234."), &token))
+    
+    printf("OK\n");
+    return 0;
+}
@@ -53,8 +53,9 @@ using TheLinearPlanner = LinearPlanner<FpType>;
 
 TheLinearPlanner::SegmentData lp_sd[max_path_len];
 TheLinearPlanner::SegmentState lp_ss[max_path_len];
+TheLinearPlanner::SegmentState lp_ref_ss[max_path_len];
 
-static void test_path (Path path)
+static void init_path (Path path)
 {
     AMBRO_ASSERT_FORCE(path.num_segs <= max_path_len)
     
@@ -66,6 +67,11 @@ static void test_path (Path path)
         TheLinearPlanner::initSegment(&lp_sd[i], prev_max_v, INFINITY, max_v, a_x);
         prev_max_v = max_v;
     }
+}
+
+static void test_path (Path path)
+{
+    init_path(path);
     
     FpType v = 0.0;
     
@@ -92,9 +98,67 @@ static void test_path (Path path)
     }
 }
 
+// Plans the path through a sliding window the way MotionPlanner does, with the
+// backward pass stopping at segments whose push state can no longer change, and
+// checks that the results are identical to doing the full backward pass.
+static void test_path_incremental (Path path, size_t window, size_t commit)
+{
+    init_path(path);
+    
+    size_t start = 0;
+    size_t length = 0;
+    size_t optimal = 0;
+    FpType start_v = 0.0;
+    
+    while (start < path.num_segs) {
+        while (length < window && start + length < path.num_segs) {
+            length++;
+        }
+        
+        FpType v = 0.0;
+        for (size_t j = length; j > 0; j--) {
+            v = TheLinearPlanner::push(&lp_sd[start + j - 1], &lp_ref_ss[start + j - 1], v);
+        }
+        
+        v = 0.0;
+        size_t new_optimal = optimal;
+        for (size_t j = length; j > optimal;) {
+            j--;
+            v = TheLinearPlanner::push(&lp_sd[start + j], &lp_ss[start + j], v);
+            if (new_optimal == optimal && TheLinearPlanner::isStartSpeedFinal(&lp_sd[start + j], v)) {
+                new_optimal = j;
+            }
+        }
+        
+        size_t commit_count = (length < commit) ? length : commit;
+        FpType ref_v = start_v;
+        FpType inc_v = start_v;
+        for (size_t j = 0; j < length; j++) {
+            TheLinearPlanner::SegmentResult ref_result;
+            TheLinearPlanner::SegmentResult inc_result;
+            ref_v = TheLinearPlanner::pull(&lp_sd[start + j], &lp_ref_ss[start + j], ref_v, &ref_result);
+            inc_v = TheLinearPlanner::pull(&lp_sd[start + j], &lp_ss[start + j], inc_v, &inc_result);
+            AMBRO_ASSERT_FORCE(inc_v == ref_v)
+            AMBRO_ASSERT_FORCE(inc_result.const_start == ref_result.const_start)
+            AMBRO_ASSERT_FORCE(inc_result.const_end == ref_result.const_end)
+            AMBRO_ASSERT_FORCE(inc_result.const_v == ref_result.const_v)
+            if (j + 1 == commit_count) {
+                start_v = ref_v;
+            }
+        }
+        
+        start += commit_count;
+        length -= commit_count;
+        optimal = (new_optimal > commit_count) ? (new_optimal - commit_count) : 0;
+    }
+}
+
 int main ()
 {
     for (size_t i = 0; i < num_paths; i++) {
         test_path(paths[i]);
+        test_path_incremental(paths[i], 2, 1);
+        test_path_incremental(paths[i], 8, 3);
+        test_path_incremental(paths[i], 32, 8);
     }
 }
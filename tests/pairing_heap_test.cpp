@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <aprinter/base/Assert.h>
+#include <aprinter/structure/PairingHeap.h>
+
+using namespace APrinter;
+
+static int const NumEntries = 200;
+static int const NumOps = 200000;
+
+struct Entry {
+    PairingHeapNode<Entry> node;
+    uint16_t time;
+};
+
+// Compares times modulo 2^16 like the event loop compares clock times.
+struct EntryCompare {
+    static bool lessThan (Entry *a, Entry *b)
+    {
+        return (int16_t)(uint16_t)(a->time - b->time) < 0;
+    }
+};
+
+using Heap = PairingHeap<Entry, &Entry::node, EntryCompare>;
+
+static Entry entries[NumEntries];
+static Heap heap;
+
+// Finds the minimum among the entries in the heap by brute force.
+static Entry * find_min ()
+{
+    Entry *min = nullptr;
+    for (int i = 0; i < NumEntries; i++) {
+        Entry *e = &entries[i];
+        if (!Heap::isRemoved(e) && (!min || EntryCompare::lessThan(e, min))) {
+            min = e;
+        }
+    }
+    return min;
+}
+
+int main ()
+{
+    heap.init();
+    for (int i = 0; i < NumEntries; i++) {
+        Heap::markRemoved(&entries[i]);
+    }
+    
+    // The current time advances and entries are inserted within a window
+    // after it, so that the times stay comparable across wraparound.
+    uint16_t now = 0;
+    int count = 0;
+    
+    for (int op = 0; op < NumOps; op++) {
+        Entry *e = &entries[rand() % NumEntries];
+        int action = rand() % 3;
+        if (action == 0) {
+            if (!Heap::isRemoved(e)) {
+                heap.remove(e);
+                Heap::markRemoved(e);
+                count--;
+            }
+            e->time = now + (uint16_t)(rand() % 10000);
+            heap.insert(e);
+            count++;
+        } else if (action == 1) {
+            if (!Heap::isRemoved(e)) {
+                heap.remove(e);
+                Heap::markRemoved(e);
+                count--;
+            }
+        } else {
+            Entry *first = heap.first();
+            AMBRO_ASSERT_FORCE(first == nullptr || !EntryCompare::lessThan(find_min(), first))
+            AMBRO_ASSERT_FORCE(first != nullptr || count == 0)
+            if (first) {
+                now = first->time;
+                heap.removeFirst();
+                Heap::markRemoved(first);
+                count--;
+            }
+        }
+        AMBRO_ASSERT_FORCE(heap.isEmpty() == (count == 0))
+    }
+    
+    uint16_t prev_time = now;
+    while (!heap.isEmpty()) {
+        Entry *first = heap.first();
+        AMBRO_ASSERT_FORCE(!EntryCompare::lessThan(first, find_min()))
+        AMBRO_ASSERT_FORCE((int16_t)(uint16_t)(first->time - prev_time) >= 0)
+        prev_time = first->time;
+        heap.removeFirst();
+        Heap::markRemoved(first);
+        count--;
+    }
+    AMBRO_ASSERT_FORCE(count == 0)
+    
+    printf("OK\n");
+    return 0;
+}
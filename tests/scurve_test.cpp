@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+#include <stdio.h>
+
+#include <aprinter/meta/FixedPoint.h>
+#include <aprinter/base/Assert.h>
+#include <aprinter/printer/planning/LinearPlanner.h>
+#include <aprinter/printer/planning/SCurveProfile.h>
+
+using namespace APrinter;
+
+using FpType = double;
+
+static constexpr int RampSteps = 2;
+static constexpr int MaxPieces = 2 * (2 * RampSteps + 1) + 1;
+
+static constexpr FpType PositionEpsilon = 0.00001;
+static constexpr FpType SpeedEpsilon = 0.00001;
+
+// Machine model: the tool is attached through a spring with this natural
+// frequency and damping ratio, and we look at its deviation from the
+// commanded position.
+static constexpr FpType ResonanceFreq = 25.0;
+static constexpr FpType DampingRatio = 0.05;
+static constexpr FpType SettleTime = 0.5;
+static constexpr FpType SimStep = 0.00002;
+
+// Trapezoid acceleration used to define the allowed vibration level.
+static constexpr FpType ReferenceAccel = 1000.0;
+static constexpr FpType MaxSpeed = 200.0;
+// Duration of the S-curve acceleration ramps, matched to the resonance.
+static constexpr FpType RampTime = 1.0 / ResonanceFreq;
+// Largest ramp duration relative to a phase, as MOTIONPLANNER_SCURVE_MAX_RAMP_FRACTION.
+static constexpr FpType MaxRampFraction = 0.25;
+
+using TheLinearPlanner = LinearPlanner<FpType>;
+using TheSCurveProfile = SCurveProfile<FpType, RampSteps>;
+
+struct Piece {
+    FpType duration;
+    FpType accel;
+};
+
+struct Profile {
+    Piece pieces[MaxPieces];
+    int num_pieces;
+    FpType total_time;
+};
+
+static void add_piece (Profile *p, FpType duration, FpType accel)
+{
+    AMBRO_ASSERT_FORCE(p->num_pieces < MaxPieces)
+    p->pieces[p->num_pieces++] = Piece{duration, accel};
+    p->total_time += duration;
+}
+
+// Adds an acceleration phase, either as a single piece or split the same way
+// as MotionPlanner does it when MOTIONPLANNER_SCURVE is defined.
+static void add_phase (Profile *p, FpType duration, FpType accel, bool scurve)
+{
+    if (!scurve) {
+        add_piece(p, duration, accel);
+        return;
+    }
+    
+    FpType ramp_fraction = (duration * MaxRampFraction > RampTime) ? (RampTime / duration) : MaxRampFraction;
+    TheSCurveProfile::Phase phase;
+    TheSCurveProfile::compute(ramp_fraction, &phase);
+    for (int i = 0; i < TheSCurveProfile::NumSubPhases; i++) {
+        FpType ds = phase.time[i + 1] - phase.time[i];
+        FpType a = (ds > 0.0) ? (phase.quad[i] / (ds * ds)) : 0.0;
+        add_piece(p, ds * duration, a * accel);
+    }
+}
+
+// Plans a move from rest to rest with LinearPlanner and turns the result
+// into a list of constant-acceleration pieces. With the S-curve, the move is
+// planned with a lower acceleration such that the peak is at most accel.
+static void plan_move (FpType distance, FpType max_accel, bool scurve, Profile *p)
+{
+    FpType accel = scurve ? (max_accel * (1.0 - MaxRampFraction)) : max_accel;
+    
+    TheLinearPlanner::SegmentData sd;
+    TheLinearPlanner::SegmentState ss;
+    TheLinearPlanner::initSegment(&sd, 0.0, INFINITY, MaxSpeed * MaxSpeed, 2.0 * accel * distance);
+    
+    TheLinearPlanner::push(&sd, &ss, 0.0);
+    TheLinearPlanner::SegmentResult result;
+    FpType end_v = TheLinearPlanner::pull(&sd, &ss, 0.0, &result);
+    AMBRO_ASSERT_FORCE(end_v == 0.0)
+    
+    FpType v_const = sqrt(result.const_v);
+    FpType t_accel = v_const / accel;
+    FpType t_const = (1.0 - result.const_start - result.const_end) * distance / v_const;
+    
+    p->num_pieces = 0;
+    p->total_time = 0.0;
+    add_phase(p, t_accel, accel, scurve);
+    add_piece(p, t_const, 0.0);
+    add_phase(p, t_accel, -accel, scurve);
+    
+    for (int i = 0; i < p->num_pieces; i++) {
+        AMBRO_ASSERT_FORCE(fabs(p->pieces[i].accel) <= max_accel * (1.0 + SpeedEpsilon))
+    }
+}
+
+struct SimState {
+    FpType x;
+    FpType v;
+    FpType y;
+    FpType dy;
+};
+
+// Advances the commanded motion and the tool deviation y by dt under the
+// commanded acceleration a, with y'' = -a - 2*zeta*w*y' - w^2*y.
+static void sim_step (SimState *s, FpType a, FpType dt)
+{
+    FpType w = 2.0 * M_PI * ResonanceFreq;
+    auto f = [&](FpType y, FpType dy) { return -a - 2.0 * DampingRatio * w * dy - w * w * y; };
+    
+    FpType k1y = s->dy;
+    FpType k1d = f(s->y, s->dy);
+    FpType k2y = s->dy + 0.5 * dt * k1d;
+    FpType k2d = f(s->y + 0.5 * dt * k1y, k2y);
+    FpType k3y = s->dy + 0.5 * dt * k2d;
+    FpType k3d = f(s->y + 0.5 * dt * k2y, k3y);
+    FpType k4y = s->dy + dt * k3d;
+    FpType k4d = f(s->y + dt * k3y, k4y);
+    
+    s->y += dt / 6.0 * (k1y + 2.0 * k2y + 2.0 * k3y + k4y);
+    s->dy += dt / 6.0 * (k1d + 2.0 * k2d + 2.0 * k3d + k4d);
+    s->x += s->v * dt + 0.5 * a * dt * dt;
+    s->v += a * dt;
+}
+
+// Runs the profile and returns the largest ringing amplitude seen during the
+// move and while settling after it. The steady deflection caused by the
+// acceleration itself (a/w^2) does not ring and is not counted.
+static FpType simulate (Profile const *p, FpType distance)
+{
+    FpType w = 2.0 * M_PI * ResonanceFreq;
+    SimState s = {0.0, 0.0, 0.0, 0.0};
+    FpType max_dev = 0.0;
+    
+    for (int i = 0; i <= p->num_pieces; i++) {
+        FpType duration = (i < p->num_pieces) ? p->pieces[i].duration : SettleTime;
+        FpType a = (i < p->num_pieces) ? p->pieces[i].accel : 0.0;
+        FpType t = 0.0;
+        while (t < duration) {
+            FpType dt = fmin(SimStep, duration - t);
+            sim_step(&s, a, dt);
+            FpType y_osc = s.y + a / (w * w);
+            max_dev = fmax(max_dev, sqrt(y_osc * y_osc + (s.dy / w) * (s.dy / w)));
+            t += dt;
+        }
+        if (i == p->num_pieces - 1) {
+            AMBRO_ASSERT_FORCE(fabs(s.x - distance) < PositionEpsilon * distance)
+            AMBRO_ASSERT_FORCE(fabs(s.v) < SpeedEpsilon * MaxSpeed)
+        }
+    }
+    
+    return max_dev;
+}
+
+static FpType move_vibration (FpType distance, FpType accel, bool scurve, Profile *p)
+{
+    plan_move(distance, accel, scurve, p);
+    return simulate(p, distance);
+}
+
+// Checks the split itself: the sub-phases must cover the phase, reach the
+// same speed and distance as constant acceleration would, and take the
+// requested time to reach the peak acceleration.
+static void test_split (FpType ramp_fraction)
+{
+    TheSCurveProfile::Phase phase;
+    TheSCurveProfile::compute(ramp_fraction, &phase);
+    
+    FpType u = phase.time[RampSteps];
+    FpType peak = 1.0 / (1.0 - u);
+    
+    FpType v = 0.0;
+    FpType d = 0.0;
+    for (int i = 0; i < TheSCurveProfile::NumSubPhases; i++) {
+        FpType ds = phase.time[i + 1] - phase.time[i];
+        AMBRO_ASSERT_FORCE(ds >= 0.0)
+        AMBRO_ASSERT_FORCE(fabs(phase.dist[i] - d) < PositionEpsilon)
+        FpType a = (ds > 0.0) ? (phase.quad[i] / (ds * ds)) : 0.0;
+        AMBRO_ASSERT_FORCE(a <= peak + SpeedEpsilon)
+        d += 2.0 * v * ds + phase.quad[i];
+        v += a * ds;
+    }
+    AMBRO_ASSERT_FORCE(fabs(v - 1.0) < SpeedEpsilon)
+    AMBRO_ASSERT_FORCE(fabs(d - 1.0) < PositionEpsilon)
+    
+    AMBRO_ASSERT_FORCE(fabs(u - fmin(ramp_fraction, 0.5)) < PositionEpsilon)
+}
+
+using StepFixedType = FixedPoint<11, false, 0>;
+using TimeFixedType = FixedPoint<22, false, 0>;
+
+// Checks the stepper commands that MotionPlanner generates for a phase of x
+// steps in t ticks with acceleration term a: they must add up to the phase,
+// follow the S-curve positions, keep the speed continuous and not exceed
+// the peak acceleration, up to the rounding to whole steps and ticks.
+static void test_commands (FpType ramp_fraction, uint32_t x_bits, uint32_t t_bits, uint32_t a_bits, bool decel)
+{
+    TheSCurveProfile::Phase phase;
+    TheSCurveProfile::compute(ramp_fraction, &phase);
+    
+    StepFixedType x = StepFixedType::importBits(x_bits);
+    TimeFixedType t = TimeFixedType::importBits(t_bits);
+    StepFixedType a = StepFixedType::importBits(a_bits);
+    
+    FpType peak = 1.0 / (1.0 - phase.time[RampSteps]);
+    FpType phase_accel = 2.0 * a_bits / ((FpType)t_bits * t_bits);
+    FpType step_tolerance = 2.0;
+    
+    int num_cmds = 0;
+    FpType x_sum = 0.0;
+    FpType t_sum = 0.0;
+    FpType prev_end_v = (x_bits + (decel ? a_bits : -(FpType)a_bits)) / (FpType)t_bits;
+    FpType prev_t = t_bits;
+    
+    TheSCurveProfile::splitCommand(&phase, x, t, a, decel, [&](auto sub_x, auto sub_t, auto sub_a) {
+        FpType sx = sub_x.bitsValue();
+        FpType st = sub_t.bitsValue();
+        FpType sa = sub_a.bitsValue();
+        AMBRO_ASSERT_FORCE(fabs(sa) <= sx)
+        AMBRO_ASSERT_FORCE((sa <= 0.0) == (decel || sa == 0.0))
+        
+        // The commanded position at the end of this command must match the
+        // continuous phase, which moves as (x - a)*s + a*dist(s) in the
+        // acceleration case, and is time-reversed for deceleration.
+        x_sum += sx;
+        t_sum += st;
+        int k = decel ? (TheSCurveProfile::NumSubPhases - 1 - num_cmds) : (num_cmds + 1);
+        FpType pos = (x_bits - (FpType)a_bits) * phase.time[k] + a_bits * phase.dist[k];
+        FpType expected = decel ? (x_bits - pos) : pos;
+        AMBRO_ASSERT_FORCE(fabs(x_sum - expected) <= step_tolerance)
+        
+        if (st > 0.0) {
+            AMBRO_ASSERT_FORCE(2.0 * fabs(sa) / (st * st) <= peak * phase_accel * 1.05 + 4.0 / (st * st))
+            FpType start_v = (sx - sa) / st;
+            AMBRO_ASSERT_FORCE(fabs(start_v - prev_end_v) <= 0.01 * x_bits / t_bits + 2.0 / st + 2.0 / prev_t)
+            prev_end_v = (sx + sa) / st;
+            prev_t = st;
+        }
+        num_cmds++;
+    });
+    
+    AMBRO_ASSERT_FORCE(num_cmds == TheSCurveProfile::NumSubPhases)
+    AMBRO_ASSERT_FORCE(x_sum == x_bits)
+    AMBRO_ASSERT_FORCE(t_sum == t_bits)
+}
+
+static constexpr FpType ScanStartAccel = 100.0;
+static constexpr FpType ScanEndAccel = 100000.0;
+static constexpr FpType ScanFactor = 1.02;
+
+// Returns the worst vibration of trapezoid moves at accelerations up to
+// ReferenceAccel. This is the vibration level that the machine tolerates.
+static FpType reference_vibration (FpType distance)
+{
+    Profile p;
+    FpType limit = 0.0;
+    for (FpType accel = ScanStartAccel; accel <= ReferenceAccel; accel *= ScanFactor) {
+        limit = fmax(limit, move_vibration(distance, accel, false, &p));
+    }
+    return limit;
+}
+
+// Finds the largest acceleration at which the vibration stays within the
+// limit, scanning upwards so that lucky resonance cancellations at higher
+// accelerations are not picked up.
+static FpType find_max_accel (FpType distance, bool scurve, FpType limit)
+{
+    Profile p;
+    FpType accel = ScanStartAccel;
+    while (accel < ScanEndAccel) {
+        FpType next = accel * ScanFactor;
+        if (move_vibration(distance, next, scurve, &p) > limit) {
+            break;
+        }
+        accel = next;
+    }
+    return accel;
+}
+
+int main ()
+{
+    static FpType const fractions[] = {0.0, 0.01, 0.1, 0.25, 0.4, 0.5, 1.0, 10.0};
+    for (FpType fraction : fractions) {
+        test_split(fraction);
+    }
+    
+    static FpType const cmd_fractions[] = {0.0, 0.05, 0.25};
+    for (FpType fraction : cmd_fractions) {
+        for (int decel = 0; decel < 2; decel++) {
+            test_commands(fraction, 2000, 3000000, 2000, decel);
+            test_commands(fraction, 2000, 3000000, 700, decel);
+            test_commands(fraction, 37, 40000, 37, decel);
+            test_commands(fraction, 1, 5000, 1, decel);
+        }
+    }
+    
+    static FpType const distances[] = {5.0, 20.0, 50.0, 150.0, 400.0};
+    
+    printf("Resonance %g Hz, damping %g, S-curve ramp time %g s\n", ResonanceFreq, DampingRatio, RampTime);
+    printf("%10s %12s %12s %12s %12s %12s %8s\n", "Distance", "Vibration", "TrapAccel", "TrapTime", "SCurveAccel", "SCurveTime", "Gain");
+    
+    for (FpType distance : distances) {
+        Profile p;
+        FpType limit = reference_vibration(distance);
+        
+        FpType trap_accel = find_max_accel(distance, false, limit);
+        plan_move(distance, trap_accel, false, &p);
+        FpType trap_time = p.total_time;
+        
+        FpType scurve_accel = find_max_accel(distance, true, limit);
+        plan_move(distance, scurve_accel, true, &p);
+        FpType scurve_time = p.total_time;
+        
+        printf("%10g %12.5f %12.1f %12.4f %12.1f %12.4f %7.1f%%\n", distance, limit, trap_accel, trap_time,
+               scurve_accel, scurve_time, 100.0 * (trap_time - scurve_time) / trap_time);
+        
+        AMBRO_ASSERT_FORCE(scurve_time <= trap_time)
+    }
+    
+    return 0;
+}
@@ -0,0 +1,628 @@
+/*
+ * Copyright (c) 2016 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+static void cli () {}
+static void sei () {}
+
+#include <aprinter/meta/TypeList.h>
+#include <aprinter/meta/WrapFunction.h>
+#include <aprinter/meta/ServiceUtils.h>
+#include <aprinter/base/Object.h>
+#include <aprinter/base/DebugObject.h>
+#include <aprinter/base/Assert.h>
+#include <aprinter/base/TransferVector.h>
+#include <aprinter/misc/CrcItuT.h>
+#include <aprinter/hal/generic/SpiSdCard.h>
+
+using namespace APrinter;
+
+// The SPI clock runs at 1 MHz, so each byte takes 8 ticks of the 1 MHz clock.
+static uint32_t const TicksPerByte = 8;
+static uint32_t sim_time;
+
+struct TestClock {
+    using TimeType = uint32_t;
+    static constexpr double time_unit = 1e-6;
+    static constexpr double time_freq = 1e6;
+    
+    template <typename ThisContext>
+    static TimeType getTime (ThisContext c)
+    {
+        return sim_time;
+    }
+};
+
+struct TestPins {
+    template <typename Pin, typename ThisContext>
+    static void set (ThisContext c, bool value) {}
+    
+    template <typename Pin, typename ThisContext>
+    static void setOutput (ThisContext c) {}
+};
+
+struct SsPin;
+
+/**
+ * SD card in SPI mode, at the byte level. It holds an SDHC card of
+ * NumCardBlocks blocks and can be told to fail in various ways.
+ */
+struct CardEmulator {
+    static uint32_t const NumCardBlocks = 8192;
+    static int const MaxOut = 1024;
+    static int const HistorySize = 4;
+    
+    enum Mode {IDLE, READ_STREAM, WRITE_WAIT_TOKEN, WRITE_DATA};
+    
+    uint8_t data[NumCardBlocks * 512];
+    
+    // Bytes queued to be sent, then busy bytes (0x00) to be sent.
+    uint8_t out[MaxOut];
+    int out_start;
+    int out_end;
+    uint32_t busy_bytes;
+    
+    Mode mode;
+    bool app_cmd;
+    uint8_t cmd[6];
+    int cmd_len;
+    bool multi;
+    uint32_t block;
+    uint8_t rx[514];
+    int rx_len;
+    
+    // Failure injection.
+    bool fail_read_cmd;
+    bool no_read_token;
+    uint32_t corrupt_read_block;
+    uint32_t reject_write_block;
+    bool reject_preerase;
+    uint32_t write_busy_bytes;
+    uint32_t stop_busy_bytes;
+    
+    // Observations.
+    uint8_t history[HistorySize];
+    int num_commands;
+    uint32_t preerase_count;
+    bool protocol_error;
+    
+    void init ()
+    {
+        for (size_t i = 0; i < sizeof(data); i++) {
+            data[i] = rand();
+        }
+        out_start = 0;
+        out_end = 0;
+        busy_bytes = 0;
+        mode = IDLE;
+        app_cmd = false;
+        cmd_len = 0;
+        fail_read_cmd = false;
+        no_read_token = false;
+        corrupt_read_block = -1;
+        reject_write_block = -1;
+        reject_preerase = false;
+        write_busy_bytes = 100;
+        stop_busy_bytes = 100;
+        num_commands = 0;
+        preerase_count = 0;
+        protocol_error = false;
+    }
+    
+    void push (uint8_t byte)
+    {
+        AMBRO_ASSERT_FORCE(out_end < MaxOut)
+        out[out_end++] = byte;
+    }
+    
+    void respond_r1 (uint8_t r1)
+    {
+        push(0xff);
+        push(r1);
+    }
+    
+    void push_block ()
+    {
+        AMBRO_ASSERT_FORCE(block < NumCardBlocks)
+        uint8_t const *p = data + block * 512;
+        push(0xff);
+        push(0xff);
+        push(0xfe);
+        for (int i = 0; i < 512; i++) {
+            push(p[i]);
+        }
+        uint16_t crc = CrcItuTUpdate(CrcItuTInitial, (char const *)p, 512);
+        if (block == corrupt_read_block) {
+            crc ^= 1;
+        }
+        push(crc >> 8);
+        push(crc);
+        block++;
+    }
+    
+    void execute ()
+    {
+        uint8_t index = cmd[0] & 0x3f;
+        uint32_t arg = ((uint32_t)cmd[1] << 24) | ((uint32_t)cmd[2] << 16) | ((uint32_t)cmd[3] << 8) | cmd[4];
+        bool was_app_cmd = app_cmd;
+        app_cmd = false;
+        
+        for (int i = HistorySize - 1; i > 0; i--) {
+            history[i] = history[i - 1];
+        }
+        history[0] = was_app_cmd ? (0x80 | index) : index;
+        num_commands++;
+        
+        if (mode == READ_STREAM) {
+            // Only CMD12 is allowed while streaming. Its response follows a
+            // stuff byte, and the data being sent is cut off.
+            if (index != 12) {
+                protocol_error = true;
+            }
+            out_start = out_end = 0;
+            push(0x3f);
+            push(0x00);
+            busy_bytes = stop_busy_bytes;
+            mode = IDLE;
+            return;
+        }
+        
+        if (was_app_cmd) {
+            if (index == 41) {
+                respond_r1(0x00);
+            } else if (index == 23) {
+                preerase_count = arg;
+                respond_r1(reject_preerase ? 0x04 : 0x00);
+            } else {
+                respond_r1(0x04);
+            }
+            return;
+        }
+        
+        switch (index) {
+            case 0:
+            case 59:
+                respond_r1(0x01);
+                break;
+            case 8:
+                respond_r1(0x01);
+                push(0x00);
+                push(0x00);
+                push(0x01);
+                push(0xaa);
+                break;
+            case 55:
+                app_cmd = true;
+                respond_r1(0x00);
+                break;
+            case 58:
+                respond_r1(0x00);
+                push(0xc0);
+                push(0x00);
+                push(0x00);
+                push(0x00);
+                break;
+            case 9: {
+                // CSD version 2 with C_SIZE giving NumCardBlocks.
+                respond_r1(0x00);
+                push(0xff);
+                push(0xfe);
+                uint8_t csd[16] = {0x40};
+                uint32_t c_size = NumCardBlocks / 1024 - 1;
+                csd[8] = c_size >> 8;
+                csd[9] = c_size;
+                for (int i = 0; i < 16; i++) {
+                    push(csd[i]);
+                }
+                push(0x00);
+                push(0x00);
+            } break;
+            case 13:
+                respond_r1(0x00);
+                push(0x00);
+                break;
+            case 17:
+            case 18:
+                if (fail_read_cmd || arg >= NumCardBlocks) {
+                    respond_r1(0x40);
+                    break;
+                }
+                respond_r1(0x00);
+                block = arg;
+                multi = (index == 18);
+                if (!no_read_token) {
+                    push_block();
+                }
+                if (multi) {
+                    mode = READ_STREAM;
+                }
+                break;
+            case 24:
+            case 25:
+                respond_r1(0x00);
+                block = arg;
+                multi = (index == 25);
+                mode = WRITE_WAIT_TOKEN;
+                break;
+            default:
+                respond_r1(0x04);
+        }
+    }
+    
+    uint8_t next_out ()
+    {
+        if (out_start == out_end) {
+            out_start = out_end = 0;
+            if (busy_bytes > 0) {
+                busy_bytes--;
+                return 0x00;
+            }
+            if (mode == READ_STREAM && !no_read_token) {
+                push_block();
+            }
+        }
+        if (out_start == out_end) {
+            return 0xff;
+        }
+        return out[out_start++];
+    }
+    
+    uint8_t exchange (uint8_t in)
+    {
+        sim_time += TicksPerByte;
+        
+        // While busy, the host must only clock out 0xff bytes.
+        if (out_start == out_end && busy_bytes > 0) {
+            if (in != 0xff) {
+                protocol_error = true;
+            }
+            return next_out();
+        }
+        
+        if (mode == WRITE_WAIT_TOKEN) {
+            if (in == (multi ? 0xfc : 0xfe)) {
+                mode = WRITE_DATA;
+                rx_len = 0;
+            } else if (multi && in == 0xfd) {
+                push(0xff);
+                busy_bytes = stop_busy_bytes;
+                mode = IDLE;
+            } else if (in != 0xff) {
+                protocol_error = true;
+            }
+            return next_out();
+        }
+        
+        if (mode == WRITE_DATA) {
+            rx[rx_len++] = in;
+            if (rx_len == 514) {
+                uint16_t crc = CrcItuTUpdate(CrcItuTInitial, (char const *)rx, 512);
+                bool ok = (crc == (uint16_t)((rx[512] << 8) | rx[513])) && block != reject_write_block;
+                if (ok) {
+                    memcpy(data + block * 512, rx, 512);
+                }
+                push(ok ? 0x05 : 0x0b);
+                busy_bytes = write_busy_bytes;
+                block++;
+                mode = multi ? WRITE_WAIT_TOKEN : IDLE;
+            }
+            return 0xff;
+        }
+        
+        if (cmd_len > 0 || (in & 0xc0) == 0x40) {
+            uint8_t res = next_out();
+            cmd[cmd_len++] = in;
+            if (cmd_len == 6) {
+                cmd_len = 0;
+                execute();
+            }
+            return res;
+        }
+        
+        if (in != 0xff) {
+            protocol_error = true;
+        }
+        return next_out();
+    }
+};
+
+static CardEmulator card;
+
+// SPI driver which performs the commands right away on the emulated card.
+template <typename Arg>
+class MockSpi {
+    using Context      = typename Arg::Context;
+    using ParentObject = typename Arg::ParentObject;
+    using Handler      = typename Arg::Handler;
+    
+public:
+    struct Object;
+    
+    static void init (Context c)
+    {
+        Object::self(c)->pending = false;
+    }
+    
+    static void deinit (Context c)
+    {
+    }
+    
+    static void cmdReadBuffer (Context c, uint8_t *data, size_t length, uint8_t send_byte)
+    {
+        for (size_t i = 0; i < length; i++) {
+            data[i] = card.exchange(send_byte);
+        }
+        Object::self(c)->pending = true;
+    }
+    
+    static void cmdReadUntilDifferent (Context c, uint8_t target, uint8_t max_extra_length, uint8_t send_byte, uint8_t *data)
+    {
+        int count = 0;
+        do {
+            *data = card.exchange(send_byte);
+        } while (*data == target && count++ < max_extra_length);
+        Object::self(c)->pending = true;
+    }
+    
+    static void cmdWriteBuffer (Context c, uint8_t first_byte, uint8_t const *data, size_t length)
+    {
+        card.exchange(first_byte);
+        for (size_t i = 0; i < length; i++) {
+            card.exchange(data[i]);
+        }
+        Object::self(c)->pending = true;
+    }
+    
+    static void cmdWriteByte (Context c, uint8_t byte, size_t extra_count)
+    {
+        for (size_t i = 0; i <= extra_count; i++) {
+            card.exchange(byte);
+        }
+        Object::self(c)->pending = true;
+    }
+    
+    static bool endReached (Context c)
+    {
+        return true;
+    }
+    
+    static void unsetEvent (Context c)
+    {
+        Object::self(c)->pending = false;
+    }
+    
+    // Calls the handler for as long as there are completed commands.
+    static void dispatch (Context c)
+    {
+        while (Object::self(c)->pending) {
+            Handler::call(c);
+        }
+    }
+    
+public:
+    struct Object : public ObjBase<MockSpi, ParentObject, EmptyTypeList> {
+        bool pending;
+    };
+};
+
+struct MockSpiService {
+    APRINTER_ALIAS_STRUCT_EXT(Spi, (
+        APRINTER_AS_TYPE(Context),
+        APRINTER_AS_TYPE(ParentObject),
+        APRINTER_AS_TYPE(Handler),
+        APRINTER_AS_VALUE(int, CommandBufferBits)
+    ), (
+        APRINTER_DEF_INSTANCE(Spi, MockSpi)
+    ))
+};
+
+struct Context;
+struct Program;
+
+using MyDebugObjectGroup = DebugObjectGroup<Context, Program>;
+
+struct Context {
+    using DebugGroup = MyDebugObjectGroup;
+    using Clock = TestClock;
+    using Pins = TestPins;
+};
+
+static int init_result;
+static int io_result;
+
+static void init_handler (Context c, uint8_t error_code)
+{
+    init_result = error_code;
+}
+struct InitHandler : public AMBRO_WFUNC_TD(&init_handler) {};
+
+static void command_handler (Context c, bool error)
+{
+    io_result = error;
+}
+struct CommandHandler : public AMBRO_WFUNC_TD(&command_handler) {};
+
+APRINTER_MAKE_INSTANCE(MySdCard, (SpiSdCardService<SsPin, MockSpiService>::SdCard<Context, Program, InitHandler, CommandHandler>))
+
+struct Program : public ObjBase<void, void, MakeTypeList<
+    MyDebugObjectGroup,
+    MySdCard
+>> {
+    static Program * self (Context c);
+};
+
+static Program program;
+
+Program * Program::self (Context c)
+{
+    return &program;
+}
+
+using TheSpi = MySdCard::GetSpi;
+using Descriptor = TransferDescriptor<uint8_t>;
+
+static size_t const MaxBlocks = MySdCard::MaxIoBlocks;
+
+static uint8_t buffer[MaxBlocks * 512];
+static Descriptor descriptors[MaxBlocks];
+
+// Transfers num_blocks blocks starting at block through buffer, split into
+// num_descs descriptors of whole blocks, and returns whether it failed.
+static bool transfer (Context c, bool is_write, uint32_t block, size_t num_blocks, int num_descs)
+{
+    size_t pos = 0;
+    for (int i = 0; i < num_descs; i++) {
+        size_t desc_blocks = (i < num_descs - 1) ? 1 : (num_blocks - (num_descs - 1));
+        descriptors[i] = Descriptor{buffer + pos * 512, desc_blocks * 512};
+        pos += desc_blocks;
+    }
+    
+    io_result = -1;
+    MySdCard::startReadOrWrite(c, is_write, block, num_blocks, TransferVector<uint8_t>{descriptors, num_descs});
+    TheSpi::dispatch(c);
+    AMBRO_ASSERT_FORCE(io_result != -1)
+    AMBRO_ASSERT_FORCE(card.mode == CardEmulator::IDLE)
+    AMBRO_ASSERT_FORCE(!card.protocol_error)
+    return io_result;
+}
+
+static bool read_matches (uint32_t block, size_t num_blocks)
+{
+    return !memcmp(buffer, card.data + block * 512, num_blocks * 512);
+}
+
+static void fill_buffer (size_t num_blocks, int seed)
+{
+    for (size_t i = 0; i < num_blocks * 512; i++) {
+        buffer[i] = i * 7 + seed;
+    }
+}
+
+int main ()
+{
+    Context c;
+    card.init();
+    
+    MyDebugObjectGroup::init(c);
+    MySdCard::init(c);
+    init_result = -1;
+    MySdCard::activate(c);
+    TheSpi::dispatch(c);
+    AMBRO_ASSERT_FORCE(init_result == 0)
+    AMBRO_ASSERT_FORCE(MySdCard::getCapacityBlocks(c) == CardEmulator::NumCardBlocks)
+    
+    // Single and multi-block reads, also split across descriptors.
+    AMBRO_ASSERT_FORCE(!transfer(c, false, 5, 1, 1) && read_matches(5, 1))
+    AMBRO_ASSERT_FORCE(!transfer(c, false, 10, 7, 2) && read_matches(10, 7))
+    AMBRO_ASSERT_FORCE(card.history[0] == 12 && card.history[1] == 18)
+    AMBRO_ASSERT_FORCE(!transfer(c, false, 100, MaxBlocks, MySdCard::MaxIoDescriptors) && read_matches(100, MaxBlocks))
+    
+    // The card stays busy after CMD12, which must be waited for and counted
+    // as busy time before the next command.
+    card.stop_busy_bytes = 5000;
+    AMBRO_ASSERT_FORCE(!transfer(c, false, 200, 3, 1) && read_matches(200, 3))
+    AMBRO_ASSERT_FORCE(MySdCard::getBusyTime(c) >= card.stop_busy_bytes * TicksPerByte)
+    card.stop_busy_bytes = 100;
+    AMBRO_ASSERT_FORCE(!transfer(c, false, 300, 1, 1) && read_matches(300, 1))
+    
+    // A CRC error in the middle and at the end of a read fails it, and the
+    // multi-block read is still stopped properly.
+    card.corrupt_read_block = 21;
+    AMBRO_ASSERT_FORCE(transfer(c, false, 20, 4, 1))
+    AMBRO_ASSERT_FORCE(card.history[0] == 12)
+    AMBRO_ASSERT_FORCE(transfer(c, false, 18, 4, 4))
+    AMBRO_ASSERT_FORCE(transfer(c, false, 21, 1, 1))
+    card.corrupt_read_block = -1;
+    AMBRO_ASSERT_FORCE(!transfer(c, false, 20, 4, 1) && read_matches(20, 4))
+    
+    // A read error reported in R1 fails the read before any data.
+    card.fail_read_cmd = true;
+    AMBRO_ASSERT_FORCE(transfer(c, false, 30, 1, 1))
+    AMBRO_ASSERT_FORCE(transfer(c, false, 30, 3, 1))
+    card.fail_read_cmd = false;
+    
+    // Without a data token, a read fails after the token timeout, which
+    // must be much longer than a single poll of the card.
+    card.no_read_token = true;
+    for (size_t num_blocks = 1; num_blocks <= 2; num_blocks++) {
+        uint32_t start_time = sim_time;
+        AMBRO_ASSERT_FORCE(transfer(c, false, 40, num_blocks, 1))
+        uint32_t elapsed = sim_time - start_time;
+        AMBRO_ASSERT_FORCE(elapsed >= 300000 && elapsed < 310000 + card.stop_busy_bytes * TicksPerByte)
+    }
+    card.no_read_token = false;
+    AMBRO_ASSERT_FORCE(!transfer(c, false, 40, 2, 1) && read_matches(40, 2))
+    
+    // Single block write.
+    fill_buffer(1, 1);
+    AMBRO_ASSERT_FORCE(!transfer(c, true, 500, 1, 1) && read_matches(500, 1))
+    AMBRO_ASSERT_FORCE(card.history[0] == 13 && card.history[1] == 24)
+    
+    // Multi-block writes announce the block count with ACMD23 right before
+    // CMD25, and work also if the card does not support it.
+    fill_buffer(16, 2);
+    AMBRO_ASSERT_FORCE(!transfer(c, true, 600, 16, 3) && read_matches(600, 16))
+    AMBRO_ASSERT_FORCE(card.preerase_count == 16)
+    AMBRO_ASSERT_FORCE(card.history[0] == 13 && card.history[1] == 25 && card.history[2] == (0x80 | 23) && card.history[3] == 55)
+    card.reject_preerase = true;
+    fill_buffer(5, 3);
+    AMBRO_ASSERT_FORCE(!transfer(c, true, 700, 5, 1) && read_matches(700, 5))
+    AMBRO_ASSERT_FORCE(card.preerase_count == 5)
+    card.reject_preerase = false;
+    
+    // The card stays busy after the stop token as well.
+    card.stop_busy_bytes = 5000;
+    fill_buffer(2, 4);
+    AMBRO_ASSERT_FORCE(!transfer(c, true, 800, 2, 1) && read_matches(800, 2))
+    AMBRO_ASSERT_FORCE(MySdCard::getBusyTime(c) >= card.stop_busy_bytes * TicksPerByte)
+    card.stop_busy_bytes = 100;
+    
+    // A block rejected in the middle of a write fails it, the rest of the
+    // blocks is not sent, and the write is still stopped properly.
+    card.reject_write_block = 902;
+    fill_buffer(5, 5);
+    memcpy(buffer + 2 * 512, card.data + 902 * 512, 512);
+    AMBRO_ASSERT_FORCE(transfer(c, true, 900, 5, 5))
+    AMBRO_ASSERT_FORCE(read_matches(900, 3))
+    AMBRO_ASSERT_FORCE(memcmp(buffer + 3 * 512, card.data + 903 * 512, 512))
+    fill_buffer(1, 6);
+    AMBRO_ASSERT_FORCE(transfer(c, true, 902, 1, 1))
+    card.reject_write_block = -1;
+    fill_buffer(5, 7);
+    AMBRO_ASSERT_FORCE(!transfer(c, true, 900, 5, 1) && read_matches(900, 5))
+    
+    // Everything written can be read back.
+    AMBRO_ASSERT_FORCE(!transfer(c, false, 900, 5, 1) && read_matches(900, 5))
+    
+    MySdCard::deinit(c);
+    MyDebugObjectGroup::deinit(c);
+    
+    printf("OK, %d commands\n", card.num_commands);
+    return 0;
+}
@@ -1581,8 +1581,16 @@ function makeEcInputProps(ecInputs) {
 
 // Generic status updating
 
-function StatusUpdater(reqPath, refreshInterval, waitingRespTime, handleNewStatus, handleCondition) {
+// If streamPath is given and the browser supports EventSource, the status is
+// received from that event stream instead of being polled from reqPath. If the
+// stream is refused (e.g. no free stream slot), it falls back to polling.
+// If the status has a "version", further polls ask only for the changes since
+// that version, and such a "delta" is merged into the last status.
+function StatusUpdater(reqPath, refreshInterval, waitingRespTime, handleNewStatus, handleCondition, streamPath) {
     this._reqPath = reqPath;
+    this._streamPath = (streamPath && typeof EventSource !== 'undefined') ? streamPath : null;
+    this._eventSource = null;
+    this._status = null;
     this._refreshInterval = refreshInterval;
     this._waitingRespTime = waitingRespTime;
     this._handleNewStatus = handleNewStatus;
@@ -1603,12 +1611,17 @@ StatusUpdater.prototype.setRunning = function(running) {
     if (running) {
         if (!this._running) {
             this._running = true;
-            this.requestUpdate(true);
+            if (this._streamPath !== null) {
+                this._startStream();
+            } else {
+                this.requestUpdate(true);
+            }
         }
     } else {
         if (this._running) {
             this._running = false;
             this._changeCondition('Disabled');
+            this._stopStream();
             this._stopTimer();
             this._stopWaitingTimer();
             this._handleCondition();
@@ -1617,7 +1630,8 @@ StatusUpdater.prototype.setRunning = function(running) {
 };
 
 StatusUpdater.prototype.requestUpdate = function(setWaiting) {
-    if (!this._running) {
+    // While streaming, the server sends any change by itself.
+    if (!this._running || this._eventSource !== null) {
         return;
     }
     if (setWaiting) {
@@ -1631,6 +1645,45 @@ StatusUpdater.prototype.requestUpdate = function(setWaiting) {
     }
 };
 
+StatusUpdater.prototype._startStream = function() {
+    this._changeCondition('WaitingResponse');
+    this._eventSource = new EventSource(this._streamPath);
+    this._eventSource.onmessage = this._streamMessage.bind(this);
+    this._eventSource.onerror = this._streamError.bind(this);
+};
+
+StatusUpdater.prototype._stopStream = function() {
+    if (this._eventSource !== null) {
+        this._eventSource.close();
+        this._eventSource = null;
+    }
+};
+
+StatusUpdater.prototype._streamMessage = function(event) {
+    if (!this._running) {
+        return;
+    }
+    this._changeCondition('Okay');
+    this._handleNewStatus(this._applyStatus(JSON.parse(event.data)));
+};
+
+StatusUpdater.prototype._streamError = function() {
+    if (!this._running) {
+        return;
+    }
+    // The server starts a new stream with the whole status.
+    this._status = null;
+    if (this._eventSource.readyState === EventSource.CLOSED) {
+        // The stream was refused, the browser will not retry. Poll instead.
+        this._stopStream();
+        this._streamPath = null;
+        this.requestUpdate(true);
+    } else {
+        // The connection was lost, the browser is reconnecting.
+        this._changeCondition('Error');
+    }
+};
+
 StatusUpdater.prototype._stopTimer = function() {
     if (this._timerId !== null) {
         clearTimeout(this._timerId);
@@ -1651,8 +1704,14 @@ StatusUpdater.prototype._startRequest = function() {
     this._needsAnotherUpdate = false;
     this._waitingTimerId = setTimeout(this._waitingTimerHandler.bind(this), this._waitingRespTime);
     
+    var data = {};
+    if (this._status !== null && $has(this._status, 'version')) {
+        data['since'] = this._status.version;
+    }
+    
     $.ajax({
         url: this._reqPath,
+        data: data,
         dataType: 'json',
         cache: false,
         success: function(new_status) {
@@ -1679,8 +1738,19 @@ StatusUpdater.prototype._requestCompleted = function(success, new_status) {
         this._timerId = setTimeout(this._timerHandler.bind(this), this._refreshInterval);
     }
     if (success) {
-        this._handleNewStatus(new_status);
+        this._handleNewStatus(this._applyStatus(new_status));
+    } else {
+        this._status = null;
+    }
+};
+
+StatusUpdater.prototype._applyStatus = function(new_status) {
+    if ($has(new_status, 'delta') && this._status !== null) {
+        new_status = applyMergePatch(this._status, new_status);
+        delete new_status.delta;
     }
+    this._status = new_status;
+    return new_status;
 };
 
 StatusUpdater.prototype._timerHandler = function() {
@@ -1705,6 +1775,20 @@ StatusUpdater.prototype._changeCondition = function(condition) {
     }
 }
 
+// Returns a copy of target with the JSON merge patch applied (members
+// removed by null are not supported, the firmware does not send them).
+function applyMergePatch(target, patch) {
+    var result = $.extend({}, target);
+    $.each(patch, function(key, value) {
+        if ($.isPlainObject(value) && $.isPlainObject(result[key])) {
+            result[key] = applyMergePatch(result[key], value);
+        } else {
+            result[key] = value;
+        }
+    });
+    return result;
+}
+
 
 // Gcode execution
 
@@ -2222,7 +2306,7 @@ function handleStatusCondition() {
     wrapper_toppanel.forceUpdate();
 }
 
-var statusUpdater = new StatusUpdater('/rr_status', statusRefreshInterval, statusWaitingRespTime, handleNewStatus, handleStatusCondition);
+var statusUpdater = new StatusUpdater('/rr_status', statusRefreshInterval, statusWaitingRespTime, handleNewStatus, handleStatusCondition, '/rr_statusstream');
 
 function fixupStateObject(state, name) {
     return preprocessObjectForState($has(state, name) ? state[name] : {});